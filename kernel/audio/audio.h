@@ -4,6 +4,7 @@
 #include "process/process.h"
 
 #define AUDIO_DRIVER_BUFFER_SIZE    441
+#define AUDIO_IRQ 38
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,6 +14,7 @@ bool init_audio();
 
 sizedptr audio_request_buffer(uint32_t device);
 void audio_submit_buffer();//TODO: this should be automatic
+void audio_handle_interrupt();
 
 process_t* init_audio_mixer();
 
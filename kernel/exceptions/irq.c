@@ -1,4 +1,5 @@
 #include "irq.h"
+#include "ktimer.h"
 #include "console/kio.h"
 #include "std/memory_access.h"
 #include "process/scheduler.h"
@@ -13,6 +14,7 @@
 #include "networking/interface_manager.h"
 #include "process/syscall.h"
 #include "memory/mmu.h"
+#include "filesystem/disk.h"
 
 #define IRQ_TIMER 30
 #define SLEEP_TIMER 27
@@ -52,6 +54,8 @@ void irq_init() {
 
     gic_enable_irq(IRQ_TIMER, 0x80, 0);
     gic_enable_irq(MSI_OFFSET + INPUT_IRQ, 0x80, 0);
+    gic_enable_irq(MSI_OFFSET + DISK_IRQ, 0x80, 0);
+    gic_enable_irq(MSI_OFFSET + AUDIO_IRQ, 0x80, 0);
 
     for (uint32_t i = 0; i < (uint32_t)MAX_L2_INTERFACES; ++i) {
         gic_enable_irq(MSI_OFFSET + NET_IRQ_BASE + (2*i), 0x80, 0);
@@ -112,13 +116,25 @@ void irq_el1_handler() {
         handle_usb_interrupt();
         if (RPI_BOARD != 3) write32(GICC_BASE + 0x10, irq);
         syscall_depth--;
-        if (scheduler_in_idle()) switch_proc(INTERRUPT);
+        if (scheduler_need_resched()) switch_proc(INTERRUPT);
+        process_restore();
+    } else if (irq == MSI_OFFSET + DISK_IRQ){
+        disk_handle_interrupt();
+        if (RPI_BOARD != 3) write32(GICC_BASE + 0x10, irq);
+        syscall_depth--;
+        if (scheduler_need_resched()) switch_proc(INTERRUPT);
+        process_restore();
+    } else if (irq == MSI_OFFSET + AUDIO_IRQ){
+        audio_handle_interrupt();
+        if (RPI_BOARD != 3) write32(GICC_BASE + 0x10, irq);
+        syscall_depth--;
+        if (scheduler_need_resched()) switch_proc(INTERRUPT);
         process_restore();
     } else if (irq == SLEEP_TIMER){
-        wake_processes();
+        ktimer_interrupt();
         if (RPI_BOARD != 3) write32(GICC_BASE + 0x10, irq);
         syscall_depth--;
-        if (scheduler_in_idle()) switch_proc(INTERRUPT);
+        if (scheduler_need_resched()) switch_proc(INTERRUPT);
         process_restore();
     } else if (irq >= MSI_OFFSET + NET_IRQ_BASE && irq <  MSI_OFFSET + NET_IRQ_BASE + (2*MAX_L2_INTERFACES)){
         uint32_t rel = irq - (MSI_OFFSET + NET_IRQ_BASE);
@@ -128,7 +144,7 @@ void irq_el1_handler() {
         else network_handle_upload_interrupt_nic(nic_id);
         if (RPI_BOARD != 3) write32(GICC_BASE + 0x10, irq);
         syscall_depth--;
-        if (scheduler_in_idle()) switch_proc(INTERRUPT);
+        if (scheduler_need_resched()) switch_proc(INTERRUPT);
         process_restore();
     } else {
         kprintf("[GIC error] Received unknown interrupt %i",irq);
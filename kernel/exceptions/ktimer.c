@@ -0,0 +1,186 @@
+#include "ktimer.h"
+#include "timer.h"
+#include "irq.h"
+
+//Hierarchical wheel. Level n slots span 64^n units of 128us, far timers are moved down a level
+//when their slot comes up, so arm and cancel are O(1) and expiry keeps its exact deadline
+
+typedef struct {
+    ktimer *slots[KTIMER_SLOTS];
+    uint64_t pending;
+} ktimer_level;
+
+static ktimer_level levels[KTIMER_LEVELS];
+static uint64_t wheel_base;
+static bool wheel_started;
+
+static inline uint32_t level_shift(uint32_t level){
+    return level * KTIMER_LEVEL_BITS;
+}
+
+static void wheel_link(ktimer *timer){
+    uint64_t when = timer->expires_us >> KTIMER_SHIFT;
+    if (when < wheel_base) when = wheel_base;
+
+    uint32_t level = 0;
+    while (level < KTIMER_LEVELS - 1 && (when >> level_shift(level)) - (wheel_base >> level_shift(level)) >= KTIMER_SLOTS) level++;
+    uint64_t bucket = when >> level_shift(level);
+    uint64_t limit = (wheel_base >> level_shift(level)) + KTIMER_SLOTS - 1;
+    if (bucket > limit) bucket = limit;
+
+    ktimer_level *l = &levels[level];
+    uint32_t slot = bucket & (KTIMER_SLOTS - 1);
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = 0;
+    timer->next = l->slots[slot];
+    if (timer->next) timer->next->prev = timer;
+    l->slots[slot] = timer;
+    l->pending |= 1ULL << slot;
+    timer->armed = true;
+}
+
+static void wheel_unlink(ktimer *timer){
+    ktimer_level *l = &levels[timer->level];
+    if (timer->prev) timer->prev->next = timer->next;
+    else l->slots[timer->slot] = timer->next;
+    if (timer->next) timer->next->prev = timer->prev;
+    if (!l->slots[timer->slot]) l->pending &= ~(1ULL << timer->slot);
+    timer->next = timer->prev = 0;
+    timer->armed = false;
+}
+
+static ktimer* wheel_take_slot(uint32_t level, uint32_t slot){
+    ktimer *list = levels[level].slots[slot];
+    levels[level].slots[slot] = 0;
+    levels[level].pending &= ~(1ULL << slot);
+    return list;
+}
+
+//First wheel unit at which a slot needs attention, either to run or to cascade down a level
+static uint64_t wheel_next_unit(){
+    uint64_t next = UINT64_MAX;
+    for (uint32_t level = 0; level < KTIMER_LEVELS; level++){
+        uint64_t pending = levels[level].pending;
+        if (!pending) continue;
+        uint64_t pos = wheel_base >> level_shift(level);
+        uint32_t rot = pos & (KTIMER_SLOTS - 1);
+        uint64_t rotated = rot ? (pending >> rot) | (pending << (KTIMER_SLOTS - rot)) : pending;
+        uint64_t unit = (pos + __builtin_ctzll(rotated)) << level_shift(level);
+        if (unit < wheel_base) unit = wheel_base;
+        if (unit < next) next = unit;
+    }
+    return next;
+}
+
+static void wheel_cascade(){
+    for (uint32_t level = 1; level < KTIMER_LEVELS; level++){
+        if (wheel_base & ((1ULL << level_shift(level)) - 1)) break;
+        ktimer *list = wheel_take_slot(level, (wheel_base >> level_shift(level)) & (KTIMER_SLOTS - 1));
+        while (list){
+            ktimer *next = list->next;
+            wheel_link(list);
+            list = next;
+        }
+    }
+}
+
+static void wheel_advance(uint64_t now_us){
+    uint64_t now = now_us >> KTIMER_SHIFT;
+    while (wheel_base <= now){
+        uint64_t next = wheel_next_unit();
+        if (next > now){
+            wheel_base = now + 1;
+            return;
+        }
+        wheel_base = next;
+        wheel_cascade();
+
+        ktimer_level *l0 = &levels[0];
+        uint32_t slot = wheel_base & (KTIMER_SLOTS - 1);
+        for (;;){
+            ktimer *timer = l0->slots[slot];
+            while (timer && timer->expires_us > now_us) timer = timer->next;
+            if (!timer) break;
+            wheel_unlink(timer);
+            timer->fn(timer);
+        }
+        if (levels[0].pending & (1ULL << (wheel_base & (KTIMER_SLOTS - 1)))) return;
+        wheel_base++;
+    }
+}
+
+static uint64_t wheel_deadline(){
+    uint64_t unit = wheel_next_unit();
+    if (unit == UINT64_MAX) return UINT64_MAX;
+    ktimer *slot = levels[0].slots[unit & (KTIMER_SLOTS - 1)];
+    if (!slot || unit - wheel_base >= KTIMER_SLOTS) return unit << KTIMER_SHIFT;
+    uint64_t deadline = UINT64_MAX;
+    for (ktimer *t = slot; t; t = t->next)
+        if (t->expires_us < deadline) deadline = t->expires_us;
+    return deadline > (wheel_base << KTIMER_SHIFT) ? deadline : wheel_base << KTIMER_SHIFT;
+}
+
+static void wheel_program(){
+    uint64_t deadline = wheel_deadline();
+    if (deadline == UINT64_MAX){
+        virtual_timer_disable();
+        return;
+    }
+    //virtual_timer_reset_us caps far deadlines, the early interrupt comes back through here
+    uint64_t now = timer_now_usec();
+    virtual_timer_reset_us(deadline > now ? deadline - now : 1);
+    virtual_timer_enable();
+}
+
+static void wheel_start(){
+    if (wheel_started) return;
+    wheel_base = timer_now_usec() >> KTIMER_SHIFT;
+    wheel_started = true;
+}
+
+void ktimer_init(ktimer *timer, ktimer_fn fn, void *ctx){
+    *timer = (ktimer){ .fn = fn, .ctx = ctx };
+}
+
+void ktimer_arm(ktimer *timer, uint64_t expires_us){
+    if (!timer || !timer->fn) return;
+    irq_flags_t irq = irq_save_disable();
+    wheel_start();
+    if (timer->armed) wheel_unlink(timer);
+    timer->expires_us = expires_us;
+    wheel_link(timer);
+    wheel_program();
+    irq_restore(irq);
+}
+
+void ktimer_arm_in(ktimer *timer, uint64_t delay_us){
+    ktimer_arm(timer, timer_now_usec() + delay_us);
+}
+
+bool ktimer_cancel(ktimer *timer){
+    if (!timer) return false;
+    irq_flags_t irq = irq_save_disable();
+    bool was_armed = timer->armed;
+    if (was_armed){
+        wheel_unlink(timer);
+        wheel_program();
+    }
+    irq_restore(irq);
+    return was_armed;
+}
+
+void ktimer_interrupt(){
+    irq_flags_t irq = irq_save_disable();
+    wheel_start();
+    wheel_advance(timer_now_usec());
+    wheel_program();
+    irq_restore(irq);
+}
+
+uint64_t ktimer_next_deadline_us(){
+    irq_flags_t irq = irq_save_disable();
+    uint64_t deadline = wheel_started ? wheel_deadline() : UINT64_MAX;
+    irq_restore(irq);
+    return deadline;
+}
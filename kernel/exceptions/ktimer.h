@@ -0,0 +1,40 @@
+#pragma once
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KTIMER_SHIFT 7
+#define KTIMER_LEVEL_BITS 6
+#define KTIMER_LEVELS 4
+#define KTIMER_SLOTS (1 << KTIMER_LEVEL_BITS)
+
+typedef struct ktimer ktimer;
+typedef void (*ktimer_fn)(ktimer *timer);
+
+//Embedded in its owner. Callbacks run from the timer interrupt with interrupts disabled and may re-arm
+struct ktimer {
+    ktimer *next;
+    ktimer *prev;
+    uint64_t expires_us;
+    ktimer_fn fn;
+    void *ctx;
+    uint8_t level;
+    uint8_t slot;
+    bool armed;
+};
+
+void ktimer_init(ktimer *timer, ktimer_fn fn, void *ctx);
+void ktimer_arm(ktimer *timer, uint64_t expires_us);
+void ktimer_arm_in(ktimer *timer, uint64_t delay_us);
+bool ktimer_cancel(ktimer *timer);
+
+//Runs expired timers and programs the virtual timer for the next deadline, or turns it off when none is left
+void ktimer_interrupt();
+uint64_t ktimer_next_deadline_us();
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,6 +3,7 @@
 
 #define TIMER_SLEW_MAX_PPM 500
 #define TIMER_FREQ_MAX_PPM 500
+#define TIMER_TVAL_MAX 0x7FFFFFFFULL
 
 static int g_sync = 0;
 
@@ -19,9 +20,17 @@ static inline uint64_t rd_cntfrq_el0(void) {
     return v;
 }
 
-void timer_reset(uint64_t time) {
+//The TVAL registers are signed 32 bit, a longer interval would wrap negative and fire at once.
+//It's capped instead, so far deadlines take an early interrupt that finds nothing due and re-arms
+static uint64_t timer_interval(uint64_t amount, uint64_t per_sec) {
     uint64_t freq = rd_cntfrq_el0();
-    uint64_t interval = (freq * time) / 1000;
+    uint64_t max = (TIMER_TVAL_MAX * per_sec) / freq;
+    if (amount > max) amount = max;
+    return (freq * amount) / per_sec;
+}
+
+void timer_reset(uint64_t time) {
+    uint64_t interval = timer_interval(time, 1000);
     asm volatile ("msr cntp_tval_el0, %0" :: "r"(interval));
 }
 
@@ -56,8 +65,13 @@ void timer_init(uint64_t msecs) {
 }
 
 void virtual_timer_reset(uint64_t smsecs) {
-    uint64_t freq = rd_cntfrq_el0();
-    uint64_t interval = (freq * smsecs) / 1000;
+    uint64_t interval = timer_interval(smsecs, 1000);
+    asm volatile ("msr cntv_tval_el0, %0" :: "r"(interval));
+}
+
+void virtual_timer_reset_us(uint64_t usecs) {
+    uint64_t interval = timer_interval(usecs, 1000000);
+    if (!interval) interval = 1;
     asm volatile ("msr cntv_tval_el0, %0" :: "r"(interval));
 }
 
@@ -71,6 +85,12 @@ void virtual_timer_disable() {
     asm volatile ("msr cntv_ctl_el0, %0" :: "r"(val));
 }
 
+int32_t virtual_timer_remaining_ticks() {
+    uint64_t ticks;
+    asm volatile ("mrs %0, cntv_tval_el0" : "=r"(ticks));
+    return (int32_t)ticks;
+}
+
 uint64_t virtual_timer_remaining_msec() {
     uint64_t ticks;
     uint64_t freq = rd_cntfrq_el0();
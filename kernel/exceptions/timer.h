@@ -12,8 +12,10 @@ void timer_enable();
 void timer_disable();
 
 void virtual_timer_reset(uint64_t smsecs);
+void virtual_timer_reset_us(uint64_t usecs);
 void virtual_timer_enable();
 void virtual_timer_disable();
+int32_t virtual_timer_remaining_ticks();
 uint64_t virtual_timer_remaining_msec();
 
 uint64_t timer_now();
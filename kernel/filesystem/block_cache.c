@@ -0,0 +1,417 @@
+#include "block_cache.h"
+#include "disk.h"
+#include "memory/page_allocator.h"
+#include "exceptions/irq.h"
+#include "process/scheduler.h"
+#include "process/waitqueue.h"
+#include "syscalls/syscalls.h"
+#include "std/memory.h"
+#include "std/string.h"
+#include "math/math.h"
+#include "console/kio.h"
+
+#define BCACHE_NONE -1
+
+typedef struct {
+    uint8_t *data;//Own page, taken on first use and given back by bcache_shrink
+    uint32_t block;
+    int16_t next;
+    bool hashed;
+    bool valid;
+    bool dirty;
+    bool referenced;
+    bool pinned;
+    bool loading;
+    bool stale;
+} bcache_entry;
+
+static bcache_entry entries[BCACHE_BLOCKS];
+static int16_t buckets[BCACHE_BUCKETS];
+static bool bcache_ready;
+static uint16_t clock_hand;
+static volatile bool bcache_busy;
+static wait_queue bcache_waiters;
+static bcache_stats stats;
+
+static uint8_t* entry_data(bcache_entry *e){
+    return e->data;
+}
+
+#define BCACHE_IO_MAX_SECTORS 1024
+
+static bool bcache_disk_io(void *buffer, uint32_t sector, uint32_t count, bool write){
+    while (count){
+        disk_request req = {};
+        req.buffer = buffer;
+        req.sector = sector;
+        req.count = min(count, BCACHE_IO_MAX_SECTORS);
+        req.write = write;
+        if (!disk_submit(&req) || !disk_wait(&req)) return false;
+        if (write) stats.sectors_written += req.count;
+        else stats.sectors_read += req.count;
+        buffer = (uint8_t*)buffer + (req.count * 512);
+        sector += req.count;
+        count -= req.count;
+    }
+    return true;
+}
+
+static bcache_entry* bcache_lookup(uint32_t block){
+    for (int16_t i = buckets[block % BCACHE_BUCKETS]; i != BCACHE_NONE; i = entries[i].next)
+        if (entries[i].block == block) return &entries[i];
+    return 0;
+}
+
+static void bcache_link(bcache_entry *e, uint32_t block){
+    e->block = block;
+    e->next = buckets[block % BCACHE_BUCKETS];
+    buckets[block % BCACHE_BUCKETS] = (int16_t)(e - entries);
+    e->hashed = true;
+    e->valid = false;
+    e->dirty = false;
+}
+
+static void bcache_unlink(bcache_entry *e){
+    if (!e->hashed) return;
+    int16_t *link = &buckets[e->block % BCACHE_BUCKETS];
+    int16_t index = (int16_t)(e - entries);
+    while (*link != BCACHE_NONE){
+        if (*link == index){
+            *link = e->next;
+            break;
+        }
+        link = &entries[*link].next;
+    }
+    e->next = BCACHE_NONE;
+    e->hashed = false;
+    e->valid = false;
+    e->dirty = false;
+}
+
+static bcache_entry* bcache_victim(){
+    for (uint32_t i = 0; i < BCACHE_BLOCKS * 2; i++){
+        bcache_entry *e = &entries[clock_hand];
+        clock_hand = (clock_hand + 1) % BCACHE_BLOCKS;
+        if (e->pinned) continue;
+        if (!e->hashed) return e;
+        if (e->referenced){
+            e->referenced = false;
+            continue;
+        }
+        return e;
+    }
+    return 0;
+}
+
+static bool bcache_flush_entry(bcache_entry *e){
+    if (!e->valid || !e->dirty) return true;
+    e->dirty = false;
+    if (!bcache_disk_io(entry_data(e), e->block * BCACHE_BLOCK_SECTORS, BCACHE_BLOCK_SECTORS, true)){
+        e->dirty = true;
+        return false;
+    }
+    stats.writebacks++;
+    return true;
+}
+
+static bool bcache_try_lock(){
+    irq_flags_t irq = irq_save_disable();
+    bool taken = !bcache_busy;
+    if (taken) bcache_busy = true;
+    irq_restore(irq);
+    return taken;
+}
+
+static bool bcache_idle(void *ctx){
+    (void)ctx;
+    return !bcache_busy;
+}
+
+//Only one context walks the cache at a time. Processes that cannot sleep while another holds it go straight to disk.
+//Interrupts are only masked around bookkeeping, never across disk I/O or sleeps
+static bool bcache_lock(){
+    while (!bcache_try_lock()){
+        if (!scheduler_can_block()) return false;
+        wait_queue_wait(&bcache_waiters, bcache_idle, 0, 0);
+    }
+    return true;
+}
+
+static void bcache_unlock(){
+    bcache_busy = false;
+    wait_queue_wake_one(&bcache_waiters);
+}
+
+static bool bcache_bypass(uint8_t *buffer, uint32_t sector, uint32_t count, bool write, bool contended){
+    if (!bcache_disk_io(buffer, sector, count, write)) return false;
+
+    irq_flags_t irq = irq_save_disable();
+    uint32_t first = sector / BCACHE_BLOCK_SECTORS;
+    uint32_t last = (sector + count - 1) / BCACHE_BLOCK_SECTORS;
+    for (uint32_t block = first; block <= last; block++){
+        bcache_entry *e = bcache_lookup(block);
+        if (!e) continue;
+        if (e->loading && write){
+            e->stale = true;
+            continue;
+        }
+        if (!e->valid) continue;
+        uint32_t start = max(sector, block * BCACHE_BLOCK_SECTORS);
+        uint32_t end = min(sector + count, (block + 1) * BCACHE_BLOCK_SECTORS);
+        uint8_t *cached = entry_data(e) + ((start - (block * BCACHE_BLOCK_SECTORS)) * 512);
+        uint8_t *buf = buffer + ((start - sector) * 512);
+        if (write){
+            memcpy(cached, buf, (end - start) * 512);
+            if (contended) e->dirty = true;
+        } else memcpy(buf, cached, (end - start) * 512);
+    }
+    irq_restore(irq);
+    return true;
+}
+
+//Scans mark only hits as referenced, so the blocks they bring in are the first the clock reclaims
+static bool bcache_chunk(uint8_t *buffer, uint32_t sector, uint32_t count, bool write, bool scan){
+    uint32_t first = sector / BCACHE_BLOCK_SECTORS;
+    uint32_t n = ((sector + count - 1) / BCACHE_BLOCK_SECTORS) - first + 1;
+    bcache_entry *chunk[BCACHE_BATCH];
+    disk_request reqs[BCACHE_BATCH];
+    uint32_t reads = 0;
+    bool ok = true;
+
+    irq_flags_t irq = irq_save_disable();
+    disk_plug();
+    for (uint32_t i = 0; i < n; i++){
+        uint32_t block = first + i;
+        bcache_entry *e = bcache_lookup(block);
+        if (e && e->valid) stats.hits++;
+        else {
+            stats.misses++;
+            if (!e){
+                e = bcache_victim();
+                if (e && e->hashed){
+                    irq_restore(irq);
+                    bool flushed = bcache_flush_entry(e);
+                    irq = irq_save_disable();
+                    if (!flushed){
+                        ok = false;
+                        n = i;
+                        break;
+                    }
+                    stats.evictions++;
+                    bcache_unlink(e);
+                }
+                if (e && !e->data) e->data = (uint8_t*)palloc(BCACHE_BLOCK_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+                if (!e || !e->data){
+                    ok = false;
+                    n = i;
+                    break;
+                }
+                bcache_link(e, block);
+            }
+            bool full = write && sector <= block * BCACHE_BLOCK_SECTORS && sector + count >= (block + 1) * BCACHE_BLOCK_SECTORS;
+            if (!full){
+                disk_request *req = &reqs[reads];
+                memset(req, 0, sizeof(disk_request));
+                req->buffer = entry_data(e);
+                req->sector = block * BCACHE_BLOCK_SECTORS;
+                req->count = BCACHE_BLOCK_SECTORS;
+                req->ctx = e;
+                e->loading = true;
+                e->stale = false;
+                if (disk_submit(req)) reads++;
+                else {
+                    e->loading = false;
+                    bcache_unlink(e);
+                }
+            }
+        }
+        e->pinned = true;
+        if (!scan || e->valid) e->referenced = true;
+        chunk[i] = e;
+    }
+    disk_unplug();
+    irq_restore(irq);
+
+    for (uint32_t i = 0; i < reads; i++){
+        bcache_entry *e = (bcache_entry*)reqs[i].ctx;
+        bool loaded = disk_wait(&reqs[i]);
+        if (loaded) stats.sectors_read += BCACHE_BLOCK_SECTORS;
+        irq = irq_save_disable();
+        while (loaded && e->stale){
+            e->stale = false;
+            irq_restore(irq);
+            loaded = bcache_disk_io(entry_data(e), e->block * BCACHE_BLOCK_SECTORS, BCACHE_BLOCK_SECTORS, false);
+            irq = irq_save_disable();
+        }
+        e->loading = false;
+        if (loaded) e->valid = true;
+        else bcache_unlink(e);
+        irq_restore(irq);
+    }
+
+    irq = irq_save_disable();
+    for (uint32_t i = 0; i < n; i++){
+        bcache_entry *e = chunk[i];
+        e->pinned = false;
+        uint32_t block = first + i;
+        bool full = write && sector <= block * BCACHE_BLOCK_SECTORS && sector + count >= (block + 1) * BCACHE_BLOCK_SECTORS;
+        if (!e->hashed || e->block != block || (!e->valid && !full)){
+            ok = false;
+            continue;
+        }
+        uint32_t start = max(sector, block * BCACHE_BLOCK_SECTORS);
+        uint32_t end = min(sector + count, (block + 1) * BCACHE_BLOCK_SECTORS);
+        uint8_t *cached = entry_data(e) + ((start - (block * BCACHE_BLOCK_SECTORS)) * 512);
+        uint8_t *buf = buffer + ((start - sector) * 512);
+        if (write){
+            memcpy(cached, buf, (end - start) * 512);
+            e->valid = true;
+            e->dirty = true;
+        } else memcpy(buf, cached, (end - start) * 512);
+    }
+    irq_restore(irq);
+    return ok;
+}
+
+static bool bcache_rw(uint8_t *buffer, uint32_t sector, uint32_t count, bool write){
+    if (!buffer || !count) return false;
+    if (!bcache_ready) return bcache_disk_io(buffer, sector, count, write);
+
+    bool ok = true;
+    bool scan = count > (BCACHE_BLOCKS / 2) * BCACHE_BLOCK_SECTORS;
+    if (!bcache_lock()){
+        stats.bypassed++;
+        ok = bcache_bypass(buffer, sector, count, write, true);
+    } else if (scan && write){
+        stats.bypassed++;
+        ok = bcache_bypass(buffer, sector, count, write, false);
+        bcache_unlock();
+    } else {
+        //Large reads are still cached, in batches, without displacing blocks that are in use
+        while (count){
+            uint32_t limit = ((sector / BCACHE_BLOCK_SECTORS) + BCACHE_BATCH) * BCACHE_BLOCK_SECTORS;
+            uint32_t amount = min(count, limit - sector);
+            //A batch that could not get blocks, like when memory is short, goes straight to disk
+            if (!bcache_chunk(buffer, sector, amount, write, scan)){
+                stats.bypassed++;
+                if (!bcache_bypass(buffer, sector, amount, write, false)) ok = false;
+            }
+            buffer += amount * 512;
+            sector += amount;
+            count -= amount;
+        }
+        bcache_unlock();
+    }
+    return ok;
+}
+
+bool bcache_read(void *buffer, uint32_t sector, uint32_t count){
+    return bcache_rw((uint8_t*)buffer, sector, count, false);
+}
+
+bool bcache_write(const void *buffer, uint32_t sector, uint32_t count){
+    return bcache_rw((uint8_t*)buffer, sector, count, true);
+}
+
+bool bcache_sync(){
+    if (!bcache_ready) return true;
+    if (!bcache_lock()) return false;
+
+    irq_flags_t irq = irq_save_disable();
+    int16_t dirty[BCACHE_BLOCKS];
+    uint32_t count = 0;
+    for (int16_t i = 0; i < BCACHE_BLOCKS; i++){
+        if (!entries[i].valid || !entries[i].dirty) continue;
+        uint32_t j = count++;
+        while (j && entries[dirty[j - 1]].block > entries[i].block){
+            dirty[j] = dirty[j - 1];
+            j--;
+        }
+        dirty[j] = i;
+    }
+    irq_restore(irq);
+
+    bool ok = true;
+    disk_request reqs[BCACHE_BATCH];
+    for (uint32_t base = 0; base < count; base += BCACHE_BATCH){
+        uint32_t batch = min(count - base, BCACHE_BATCH);
+        uint32_t submitted = 0;
+        irq = irq_save_disable();
+        disk_plug();
+        for (uint32_t i = 0; i < batch; i++){
+            bcache_entry *e = &entries[dirty[base + i]];
+            disk_request *req = &reqs[submitted];
+            memset(req, 0, sizeof(disk_request));
+            req->buffer = entry_data(e);
+            req->sector = e->block * BCACHE_BLOCK_SECTORS;
+            req->count = BCACHE_BLOCK_SECTORS;
+            req->write = true;
+            req->ctx = e;
+            e->dirty = false;
+            if (disk_submit(req)) submitted++;
+            else {
+                e->dirty = true;
+                ok = false;
+            }
+        }
+        disk_unplug();
+        irq_restore(irq);
+        for (uint32_t i = 0; i < submitted; i++){
+            bcache_entry *e = (bcache_entry*)reqs[i].ctx;
+            if (disk_wait(&reqs[i])){
+                stats.writebacks++;
+                stats.sectors_written += BCACHE_BLOCK_SECTORS;
+            } else {
+                e->dirty = true;
+                ok = false;
+            }
+        }
+    }
+
+    bcache_unlock();
+    return ok;
+}
+
+uint64_t bcache_shrink(uint64_t pages){
+    if (!bcache_ready || !bcache_try_lock()) return 0;
+    uint64_t freed = 0;
+    irq_flags_t irq = irq_save_disable();
+    for (uint32_t i = 0; i < BCACHE_BLOCKS && freed < pages; i++){
+        bcache_entry *e = &entries[clock_hand];
+        clock_hand = (clock_hand + 1) % BCACHE_BLOCKS;
+        if (!e->data || e->pinned || e->loading || (e->valid && e->dirty)) continue;
+        bcache_unlink(e);
+        pfree(e->data, BCACHE_BLOCK_SIZE);
+        e->data = 0;
+        stats.shrunk++;
+        freed++;
+    }
+    irq_restore(irq);
+    bcache_unlock();
+    return freed;
+}
+
+bcache_stats bcache_get_stats(){
+    return stats;
+}
+
+static size_t bcache_proc_stats(char *buf, size_t size){
+    uint32_t used = 0, dirty = 0, resident = 0;
+    for (uint32_t i = 0; i < BCACHE_BLOCKS; i++){
+        if (entries[i].valid) used++;
+        if (entries[i].valid && entries[i].dirty) dirty++;
+        if (entries[i].data) resident++;
+    }
+    return string_format_buf(buf, size, "blocks %u/%u\nresident %u\ndirty %u\nhits %llu\nmisses %llu\nevictions %llu\nwritebacks %llu\nbypassed %llu\nshrunk %llu\nsectors read %llu\nsectors written %llu\n",
+        used, BCACHE_BLOCKS, resident, dirty, stats.hits, stats.misses, stats.evictions, stats.writebacks, stats.bypassed, stats.shrunk, stats.sectors_read, stats.sectors_written);
+}
+
+bool bcache_init(){
+    if (bcache_ready) return true;
+    for (uint32_t i = 0; i < BCACHE_BUCKETS; i++) buckets[i] = BCACHE_NONE;
+    for (uint32_t i = 0; i < BCACHE_BLOCKS; i++) entries[i] = (bcache_entry){ .next = BCACHE_NONE };
+    page_alloc_register_shrinker(bcache_shrink);
+    procfs_register("bcache", bcache_proc_stats);
+    bcache_ready = true;
+    return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "types.h"
+
+#define BCACHE_BLOCK_SECTORS 8
+#define BCACHE_BLOCK_SIZE (BCACHE_BLOCK_SECTORS * 512)
+#define BCACHE_BLOCKS 256
+#define BCACHE_BUCKETS 128
+#define BCACHE_BATCH 32
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+    uint64_t bypassed;
+    uint64_t shrunk;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+} bcache_stats;
+
+bool bcache_init();
+
+//Sector addressed like disk_read/disk_write. Writes stay in memory until bcache_sync or eviction
+bool bcache_read(void *buffer, uint32_t sector, uint32_t count);
+bool bcache_write(const void *buffer, uint32_t sector, uint32_t count);
+bool bcache_sync();
+//Gives back up to pages clean block pages, registered as a page allocator shrinker. Skipped while the cache is in use
+uint64_t bcache_shrink(uint64_t pages);
+
+bcache_stats bcache_get_stats();
+
+#ifdef __cplusplus
+}
+#endif
@@ -7,14 +7,41 @@ extern "C" {
 #include "types.h"
 #include "files/system_module.h"
 
+#define DISK_IRQ 37
+
+typedef struct disk_request disk_request;
+typedef void (*disk_complete_fn)(disk_request *req);
+
+//Owned by the caller until done is set. complete runs with interrupts disabled, possibly from the disk interrupt,
+//so async requests need a direct-map buffer. Other buffers are bounced and need disk_wait from the submitter
+struct disk_request {
+    void *buffer;
+    uint32_t sector;
+    uint32_t count;
+    bool write;
+    volatile bool done;
+    bool ok;
+    disk_complete_fn complete;
+    void *ctx;
+    void *waiter;
+    void *bounce;
+    disk_request *next;
+};
+
 bool init_disk_device();
 void disk_verbose();
 
 void disk_write(const void *buffer, uint32_t sector, uint32_t count);
 void disk_read(void *buffer, uint32_t sector, uint32_t count);
 
+bool disk_submit(disk_request *req);
+bool disk_wait(disk_request *req);
+void disk_plug();
+void disk_unplug();
+void disk_handle_interrupt();
+
 extern system_module disk_module;
 
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
@@ -1,5 +1,5 @@
 #include "fat32.hpp"
-#include "disk.h"
+#include "block_cache.h"
 #include "memory/page_allocator.h"
 #include "console/kio.h"
 #include "std/memory_access.h"
@@ -10,6 +10,10 @@
 #include "exceptions/irq.h"
 #include "files/dir_list.h"
 #include "filesystem/modules/module_loader.h"
+#include "kernel_processes/kprocess_loader.h"
+#include "process/loading/exec_cache.h"
+
+#define FAT32_FLUSH_INTERVAL 2000
 
 #define kprintfv(fmt, ...) \
     ({ \
@@ -18,7 +22,12 @@
         }\
     })
 
+static void fat32_flush_due(ktimer *timer){
+    kevent_signal((kevent*)timer->ctx);
+}
+
 bool FAT32FS::init(uint32_t partition_sector){
+    ktimer_init(&flush_timer, fat32_flush_due, &flush_event);
     fs_page = palloc(0x1000, MEM_PRIV_KERNEL, MEM_DEV | MEM_RW, false);
 
     mbs = (fat32_mbs*)kalloc(fs_page, 512, ALIGN_64B, MEM_PRIV_KERNEL);
@@ -26,7 +35,7 @@ bool FAT32FS::init(uint32_t partition_sector){
 
     partition_first_sector = partition_sector;
     
-    disk_read((void*)mbs, partition_first_sector, 1);
+    bcache_read((void*)mbs, partition_first_sector, 1);
 
     kprintfv("[FAT32] Reading fat32 mbs at %x. %x",partition_first_sector, mbs->jumpboot[0]);
 
@@ -67,7 +76,7 @@ sizedptr FAT32FS::read_cluster(uint32_t cluster_start, uint32_t cluster_size, ui
     size_t size = cluster_count * cluster_size * 512;
     void* buffer = kalloc(fs_page, size, ALIGN_64B, MEM_PRIV_KERNEL);
     if (!buffer) return (sizedptr){0, 0};
-    
+
     uint32_t next_index = root_index;
     for (uint32_t i = 0; i < cluster_count; i++){
         if (next_index < 2 || next_index >= total_fat_entries){
@@ -77,7 +86,7 @@ sizedptr FAT32FS::read_cluster(uint32_t cluster_start, uint32_t cluster_size, ui
 
         uint32_t current_lba = partition_first_sector + data_start_sector + ((next_index - 2) * cluster_size);
         kprintfv("cluster %i = %x (%x)", i, next_index, current_lba * 512);
-        disk_read((void*)((uintptr_t)buffer + (i * cluster_size * 512)), current_lba, cluster_size);
+        bcache_read((void*)((uintptr_t)buffer + (i * cluster_size * 512)), current_lba, cluster_size);
         next_index = fat[next_index] & 0x0FFFFFFF;
         if (next_index >= 0x0FFFFFF8) return (sizedptr){ (uintptr_t)buffer, size };
     }
@@ -85,27 +94,6 @@ sizedptr FAT32FS::read_cluster(uint32_t cluster_start, uint32_t cluster_size, ui
     return (sizedptr){ (uintptr_t)buffer, size };
 }
 
-bool FAT32FS::write_to_disk(u32 root_index, void *buf, size_t size){
-    u32 cluster_size = mbs->sectors_per_cluster;
-
-    u32 new_cluster_count = ceil((float)size/(cluster_size * 512));
-    u32 old_cluster_count = count_FAT(root_index);
-    
-    if (new_cluster_count != old_cluster_count){
-        resize_fat(root_index, new_cluster_count);
-    }
-    
-    uint32_t next_index = root_index;
-    for (uint32_t i = 0; i < new_cluster_count; i++){
-        int32_t current_lba = partition_first_sector + data_start_sector + ((next_index - 2) * cluster_size);
-        disk_write((void*)((uptr)buf + (i * cluster_size * 512)), current_lba, cluster_size);
-        next_index = fat[next_index] & 0x0FFFFFFF;
-        if (next_index >= 0x0FFFFFF8) return true;
-    }
-    
-    return true;
-}
-
 bool FAT32FS::write_section_to_cluster(u32 cluster, u32 offset, void *buf, size_t size){
     u32 sector = partition_first_sector + data_start_sector + ((cluster - 2) * mbs->sectors_per_cluster);
     
@@ -115,14 +103,16 @@ bool FAT32FS::write_section_to_cluster(u32 cluster, u32 offset, void *buf, size_
     u32 sector_count = ceil(((float)offset + size)/512);
     
     void *initial = zalloc(512 * sector_count);
+    if (!initial) return false;
     
-    disk_read(initial, sector, sector_count);
+    bool ok = bcache_read(initial, sector, sector_count);
     
     memcpy((void*)((uptr)initial + offset), buf, size);
     
-    disk_write(initial, sector, sector_count);
+    if (ok) ok = bcache_write(initial, sector, sector_count);
+    release(initial);
     
-    return true;
+    return ok;
 }
 
 void FAT32FS::parse_longnames(f32longname entries[], uint16_t count, char* out){
@@ -291,40 +281,53 @@ sizedptr FAT32FS::list_directory(uint32_t cluster_count, uint32_t root_index) {
     return (sizedptr){(uintptr_t)list_buffer, full_size};
 }
 
-void* file_page;
-
-sizedptr FAT32FS::read_full_file(uint32_t cluster_start, uint32_t cluster_size, uint32_t cluster_count, uint64_t file_size, uint32_t root_index){
-
-    sizedptr buf_ptr = read_cluster(cluster_start, cluster_size, cluster_count, root_index);
-    char *buffer = (char*)buf_ptr.ptr;
-    if (!buffer || !buf_ptr.size) return {0, 0};
-
-    if (!file_page) file_page = page_alloc(PAGE_SIZE);
-    
-    void *file = allocate(file_page, file_size ? file_size : 1, page_alloc);
-    if (!file) {
-        kfree(buffer, buf_ptr.size);
-        return {0, 0};
-    }
-
-    if (file_size) memcpy(file, (void*)buffer, file_size);
-    kfree(buffer, buf_ptr.size);
-    
-    return (sizedptr){(uintptr_t)file,file_size};
-}
-
 void FAT32FS::read_FAT(uint32_t location, uint32_t size, uint8_t count){
     fat = (uint32_t*)kalloc(fs_page, size * 512, ALIGN_64B, MEM_PRIV_KERNEL);
     if (!fat) {
         total_fat_entries = 0;
         return;
     }
-    disk_read((void*)fat, partition_first_sector + location, size);
+    bcache_read((void*)fat, partition_first_sector + location, size);
     total_fat_entries = (size * 512) / 4;
 }
 
-void FAT32FS::write_FAT(u32 location, u32 size, u8 count){
-    disk_write((void*)fat, partition_first_sector + location, size);
+void FAT32FS::mark_dirty(){
+    irq_flags_t irq = irq_save_disable();
+    if (!flush_armed){
+        flush_armed = true;
+        ktimer_arm_in(&flush_timer, FAT32_FLUSH_INTERVAL * 1000);
+    }
+    irq_restore(irq);
+}
+
+void FAT32FS::wait_dirty(){
+    kevent_wait(&flush_event, 0);
+    flush_armed = false;
+}
+
+void FAT32FS::set_FAT(u32 cluster, u32 value){
+    fat[cluster] = value;
+    u32 sector = (cluster * 4) / 512;
+    if (fat_dirty_start == fat_dirty_end){
+        fat_dirty_start = sector;
+        fat_dirty_end = sector + 1;
+        mark_dirty();
+    } else {
+        if (sector < fat_dirty_start) fat_dirty_start = sector;
+        if (sector + 1 > fat_dirty_end) fat_dirty_end = sector + 1;
+    }
+}
+
+bool FAT32FS::flush_FAT(){
+    if (fat_dirty_start == fat_dirty_end) return true;
+    u32 start = fat_dirty_start, end = fat_dirty_end;
+    fat_dirty_start = fat_dirty_end = 0;
+    bool ok = true;
+    for (u8 i = 0; i < mbs->number_of_fats; i++){
+        u32 location = partition_first_sector + mbs->reserved_sectors + (i * mbs->sectors_per_fat);
+        if (!bcache_write((uint8_t*)fat + (start * 512), location + start, end - start)) ok = false;
+    }
+    return ok;
 }
 
 uint32_t FAT32FS::count_FAT(uint32_t first){
@@ -342,6 +345,16 @@ uint32_t FAT32FS::count_FAT(uint32_t first){
     return count;
 }
 
+extern system_module boot_fs_module;
+
+//Executables are cached by their full path, a rewritten one must be read again by the next exec
+static void fat32_drop_exec_image(const module_file *mfile){
+    char path[EXEC_CACHE_PATH_MAX];
+    const char *name = mfile->name.data ? mfile->name.data : "";
+    string_format_buf(path, sizeof(path), *name == '/' ? "/%s%s" : "/%s/%s", boot_fs_module.mount, name);
+    exec_cache_drop(path);
+}
+
 u32 FAT32FS::resolve_cluster_index(u32 start, u32 index){
     if (!fat || start < 2 || start >= total_fat_entries) return 0;
     
@@ -354,46 +367,187 @@ u32 FAT32FS::resolve_cluster_index(u32 start, u32 index){
     return next;
 }
 
-bool FAT32FS::resize_fat(u32 start, u32 count){
-    if (!fat || start < 2 || start >= total_fat_entries) return 0;
-    
-    u32 next = start;
-    for (u32 i = 0; i < count; i++){
-        u32 next_c = fat[next] & 0x0FFFFFFF;
-        if (next_c == 0 || next_c >= 0x0FFFFFF8) {
-            u32 new_cluster = alloc_fat();
-            if (!new_cluster) return false;
-            fat[next] = new_cluster;
-            next_c = new_cluster;
+f32_stream* FAT32FS::create_stream(u32 first_cluster){
+    f32_stream *stream = (f32_stream*)kalloc(fs_page, sizeof(f32_stream), ALIGN_16B, MEM_PRIV_KERNEL);
+    if (!stream) return 0;
+    memset(stream, 0, sizeof(f32_stream));
+    stream->next_cluster = first_cluster;
+    return stream;
+}
+
+void FAT32FS::free_stream(f32_stream *stream){
+    if (!stream) return;
+    if (stream->runs) kfree(stream->runs, stream->run_capacity * sizeof(f32_cluster_run));
+    kfree(stream, sizeof(f32_stream));
+}
+
+bool FAT32FS::map_cluster(f32_stream *stream, u32 index, f32_cluster_run *out){
+    while (stream->mapped <= index){
+        u32 cluster = stream->next_cluster;
+        if (cluster < 2 || cluster >= total_fat_entries) return false;
+        f32_cluster_run *last = stream->run_count ? &stream->runs[stream->run_count - 1] : 0;
+        if (last && last->disk_cluster + last->length == cluster) last->length++;
+        else {
+            if (stream->run_count == stream->run_capacity){
+                u32 capacity = stream->run_capacity ? stream->run_capacity * 2 : 8;
+                f32_cluster_run *runs = (f32_cluster_run*)kalloc(fs_page, capacity * sizeof(f32_cluster_run), ALIGN_16B, MEM_PRIV_KERNEL);
+                if (!runs) return false;
+                if (stream->runs){
+                    memcpy(runs, stream->runs, stream->run_count * sizeof(f32_cluster_run));
+                    kfree(stream->runs, stream->run_capacity * sizeof(f32_cluster_run));
+                }
+                stream->runs = runs;
+                stream->run_capacity = capacity;
+            }
+            stream->runs[stream->run_count++] = (f32_cluster_run){ .file_cluster = stream->mapped, .disk_cluster = cluster, .length = 1 };
         }
-        next = next_c;
+        stream->mapped++;
+        u32 next = fat[cluster] & 0x0FFFFFFF;
+        stream->next_cluster = next >= 0x0FFFFFF8 ? 0 : next;
     }
-    
-    if (fat[next] != 0 && fat[next] < 0x0FFFFFF8) {
+
+    u32 lo = 0, hi = stream->run_count;
+    while (lo < hi){
+        u32 mid = (lo + hi) / 2;
+        f32_cluster_run *run = &stream->runs[mid];
+        if (index < run->file_cluster) hi = mid;
+        else if (index >= run->file_cluster + run->length) lo = mid + 1;
+        else {
+            *out = *run;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FAT32FS::extend_stream(f32_stream *stream){
+    if (stream->next_cluster || !stream->run_count) return false;
+    f32_cluster_run *last = &stream->runs[stream->run_count - 1];
+    u32 tail = last->disk_cluster + last->length - 1;
+    u32 cluster = alloc_fat(tail + 1);
+    if (!cluster) return false;
+    set_FAT(tail, cluster);
+    stream->next_cluster = cluster;
+    return true;
+}
+
+size_t FAT32FS::read_stream(f32_stream *stream, u64 offset, void *buf, size_t size){
+    u32 cluster_bytes = mbs->sectors_per_cluster * 512;
+    uint8_t sector[512];
+    size_t done = 0;
+    while (done < size){
+        u64 pos = offset + done;
+        u32 index = pos / cluster_bytes;
+        f32_cluster_run run;
+        if (!map_cluster(stream, index, &run)) break;
+        u32 run_index = index - run.file_cluster;
+        u64 run_bytes = ((u64)(run.length - run_index) * cluster_bytes) - (pos % cluster_bytes);
+        size_t chunk = min(size - done, run_bytes);
+        u32 lba = partition_first_sector + data_start_sector + ((run.disk_cluster + run_index - 2) * mbs->sectors_per_cluster) + ((pos % cluster_bytes) / 512);
+        u32 head = pos % 512;
+        if (!head && chunk >= 512){
+            chunk -= chunk % 512;
+            if (!bcache_read((uint8_t*)buf + done, lba, chunk / 512)) break;
+        } else {
+            chunk = min(chunk, 512 - head);
+            if (!bcache_read(sector, lba, 1)) break;
+            memcpy((uint8_t*)buf + done, sector + head, chunk);
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+size_t FAT32FS::write_stream(f32_stream *stream, u64 offset, const void *buf, size_t size){
+    u32 cluster_bytes = mbs->sectors_per_cluster * 512;
+    uint8_t sector[512];
+    size_t done = 0;
+    while (done < size){
+        u64 pos = offset + done;
+        u32 index = pos / cluster_bytes;
+        f32_cluster_run run;
+        if (!map_cluster(stream, index, &run)){
+            if (!extend_stream(stream)) break;
+            continue;
+        }
+        u32 run_index = index - run.file_cluster;
+        u64 run_bytes = ((u64)(run.length - run_index) * cluster_bytes) - (pos % cluster_bytes);
+        size_t chunk = min(size - done, run_bytes);
+        u32 lba = partition_first_sector + data_start_sector + ((run.disk_cluster + run_index - 2) * mbs->sectors_per_cluster) + ((pos % cluster_bytes) / 512);
+        u32 head = pos % 512;
+        if (!head && chunk >= 512){
+            chunk -= chunk % 512;
+            if (!bcache_write((const uint8_t*)buf + done, lba, chunk / 512)) break;
+        } else {
+            chunk = min(chunk, 512 - head);
+            if (!bcache_read(sector, lba, 1)) break;
+            memcpy(sector + head, (const uint8_t*)buf + done, chunk);
+            if (!bcache_write(sector, lba, 1)) break;
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+void FAT32FS::shrink_stream(f32_stream *stream, u32 clusters){
+    f32_cluster_run run;
+    if (!clusters || !map_cluster(stream, clusters - 1, &run)) return;
+    u32 tail = run.disk_cluster + (clusters - 1 - run.file_cluster);
+    u32 next = fat[tail] & 0x0FFFFFFF;
+    if (next && next < 0x0FFFFFF8){
+        set_FAT(tail, 0x0FFFFFFF);
         dealloc_fat(next);
-        fat[next] = 0x0FFFFFFF;
     }
-    
-    write_FAT(mbs->reserved_sectors, mbs->sectors_per_fat, mbs->number_of_fats);
-    
+
+    while (stream->run_count && stream->runs[stream->run_count - 1].file_cluster >= clusters) stream->run_count--;
+    if (stream->run_count){
+        f32_cluster_run *last = &stream->runs[stream->run_count - 1];
+        if (last->file_cluster + last->length > clusters) last->length = clusters - last->file_cluster;
+    }
+    stream->mapped = clusters;
+    stream->next_cluster = 0;
+}
+
+bool FAT32FS::flush_stream(f32_stream *stream, u32 file_size){
+    if (!stream->dirty) return true;
+    if (stream->entry_cluster < 2) return false;
+    stream->dirty = false;
+    stream->entry.filesize = file_size;
+    if (!write_section_to_cluster(stream->entry_cluster, stream->entry_offset, &stream->entry, sizeof(f32file_entry))){
+        stream->dirty = true;
+        mark_dirty();
+        return false;
+    }
     return true;
-    
 }
 
 void FAT32FS::dealloc_fat(u32 cluster){
-    if (!fat || cluster < 2 || cluster >= total_fat_entries) return;
-    
-    if (fat[cluster] != 0 && fat[cluster] < 0x0FFFFFF8)
-        dealloc_fat(fat[cluster]);
-    
-    fat[cluster] = 0;
+    while (cluster >= 2 && cluster < total_fat_entries){
+        u32 next = fat[cluster] & 0x0FFFFFFF;
+        set_FAT(cluster, 0);
+        if (cluster < free_hint) free_hint = cluster;
+        if (next == 0 || next >= 0x0FFFFFF8) return;
+        cluster = next;
+    }
+}
+
+u32 FAT32FS::free_clusters(){
+    u32 count = 0;
+    for (u32 i = 2; i < total_fat_entries; i++)
+        if (!(fat[i] & 0x0FFFFFFF)) count++;
+    return count;
 }
 
-u32 FAT32FS::alloc_fat(){
-    for (u32 i = 3; i < total_fat_entries; i++){
+u32 FAT32FS::alloc_fat(u32 hint){
+    if (hint < 3 || hint >= total_fat_entries) hint = free_hint;
+    for (u32 n = 0; n < total_fat_entries; n++){
+        u32 i = hint + n;
+        if (i >= total_fat_entries) i = 3 + (i - total_fat_entries);
+        if (i >= total_fat_entries) break;
         if (!fat[i]){
-            fat[i] = 0x0FFFFFFF;
-            print("Allocated cluster %x (%x)",i,(partition_first_sector + data_start_sector + ((i - 2) * mbs->sectors_per_cluster)) * 512);
+            set_FAT(i, 0x0FFFFFFF);
+            if (i == free_hint) free_hint = i + 1;
+            kprintfv("Allocated cluster %x (%x)",i,(partition_first_sector + data_start_sector + ((i - 2) * mbs->sectors_per_cluster)) * 512);
             return i;
         }
     }
@@ -442,28 +596,23 @@ FS_RESULT FAT32FS::open_file(const char* path, file* descriptor){
     if (!walk_result.found) return FS_RESULT_NOTFOUND; 
     f32file_entry entry = walk_result.entry;
     uint32_t filecluster = (entry.hi_first_cluster << 16) | entry.lo_first_cluster;
-    uint32_t fat_count = count_FAT(filecluster);
-    sizedptr buf_ptr = read_full_file(data_start_sector, mbs->sectors_per_cluster, fat_count, entry.filesize, filecluster);
-    void *buf = (void*)buf_ptr.ptr;
-    if (!buf || !buf_ptr.size) return FS_RESULT_NOTFOUND;
+    if (filecluster < 2 || filecluster >= total_fat_entries || !entry.filesize) return FS_RESULT_NOTFOUND;
+    f32_stream *stream = create_stream(filecluster);
+    if (!stream) return FS_RESULT_DRIVER_ERROR;
+    stream->entry = entry;
+    stream->entry_cluster = walk_result.cluster;
+    stream->entry_offset = walk_result.offset;
     descriptor->id = fid;
-    descriptor->size = buf_ptr.size;
+    descriptor->size = entry.filesize;
     mfile = (module_file*)kalloc(fs_page, sizeof(module_file), ALIGN_64B, MEM_PRIV_KERNEL);
     if (!mfile) {
-        kfree(buf, buf_ptr.size ? buf_ptr.size : 1);
+        free_stream(stream);
         return FS_RESULT_DRIVER_ERROR;
     }
     memset(mfile, 0, sizeof(module_file));
-    mfile->file_size = buf_ptr.size;
+    mfile->file_size = entry.filesize;
     mfile->name = string_from_literal(fullpath);
-    mfile->file_buffer = (buffer){
-        .buffer = buf,
-        .buffer_size = buf_ptr.size,
-        .limit = buf_ptr.size,
-        .options = buffer_can_grow,
-        .cursor = 0,
-        .data_type = 0,
-    };
+    mfile->private_data = stream;
     mfile->ignore_cursor = false;
     mfile->fid = descriptor->id;
     mfile->serial = filecluster;
@@ -472,7 +621,7 @@ FS_RESULT FAT32FS::open_file(const char* path, file* descriptor){
     int ok = chashmap_put(open_files, &fid, sizeof(uint64_t), mfile);
     irq_restore(irq);
     if (ok < 0) {
-        kfree(mfile->file_buffer.buffer, mfile->file_size ? mfile->file_size : 1);
+        free_stream(stream);
         kfree(mfile, sizeof(module_file));
         return FS_RESULT_DRIVER_ERROR;
     }
@@ -491,26 +640,56 @@ size_t FAT32FS::read_file(file *descriptor, void* buf, size_t size){
         return 0;
     }
     if (size > mfile->file_size-descriptor->cursor) size = mfile->file_size-descriptor->cursor;
-    memcpy(buf, (char*)mfile->file_buffer.buffer + descriptor->cursor, size);
     irq_restore(irq);
-    return size;
+    return read_stream((f32_stream*)mfile->private_data, descriptor->cursor, buf, size);
 }
 
 size_t FAT32FS::write_file(file *descriptor, const char* buf, size_t size){
     module_file *mfile  = (module_file*)chashmap_get(open_files, &descriptor->id, sizeof(uint64_t));
     if (!mfile) return 0;
-    if (mfile->read_only) return 0;
-    
-    size_t written = buffer_write_to(&mfile->file_buffer, buf, size, descriptor->cursor);
-    
-    if (written)
-        write_to_disk(mfile->serial, mfile->file_buffer.buffer, mfile->file_buffer.buffer_size);
-    
-    truncate(descriptor, mfile->file_size);
-    
+    if (mfile->read_only || !size) return 0;
+    f32_stream *stream = (f32_stream*)mfile->private_data;
+    if (descriptor->cursor > mfile->file_size) return 0;
+
+    size_t written = write_stream(stream, descriptor->cursor, buf, size);
+    if (written){
+        mark_dirty();
+        fat32_drop_exec_image(mfile);
+    }
+    if (descriptor->cursor + written > mfile->file_size){
+        mfile->file_size = descriptor->cursor + written;
+        stream->dirty = true;
+    }
+    descriptor->size = mfile->file_size;
+
     return written;
 }
 
+bool FAT32FS::sync(){
+    bool ok = true;
+    while (ok){
+        module_file *dirty = 0;
+        irq_flags_t irq = irq_save_disable();
+        for (uint64_t i = 0; i < open_files->capacity && !dirty; i++){
+            for (chashmap_entry_t *e = open_files->buckets[i]; e; e = e->next){
+                module_file *mfile = (module_file*)e->value;
+                if (mfile && ((f32_stream*)mfile->private_data)->dirty){
+                    dirty = mfile;
+                    dirty->references++;
+                    break;
+                }
+            }
+        }
+        irq_restore(irq);
+        if (!dirty) break;
+        if (!flush_stream((f32_stream*)dirty->private_data, dirty->file_size)) ok = false;
+        file descriptor = { .id = dirty->fid };
+        close_file(&descriptor);
+    }
+    if (!flush_FAT()) ok = false;
+    return bcache_sync() && ok;
+}
+
 void FAT32FS::close_file(file* descriptor){
     irq_flags_t irq = irq_save_disable();
     module_file *mfile = (module_file*)chashmap_get(open_files, &descriptor->id, sizeof(uint64_t));
@@ -522,7 +701,13 @@ void FAT32FS::close_file(file* descriptor){
     if (mfile->references == 0){
         chashmap_remove(open_files, &descriptor->id, sizeof(uint64_t), 0);
         irq_restore(irq);
-        buffer_destroy(&mfile->file_buffer);
+        f32_stream *stream = (f32_stream*)mfile->private_data;
+        if (stream->dirty || fat_dirty_start != fat_dirty_end){
+            flush_stream(stream, mfile->file_size);
+            flush_FAT();
+            bcache_sync();
+        }
+        free_stream(stream);
         kfree(mfile, sizeof(module_file));
         return;
     }
@@ -628,22 +813,26 @@ bool FAT32FS::stat(const char *path, fs_stat *out_stat){
 bool FAT32FS::truncate(file *descriptor, size_t size){
     irq_flags_t irq = irq_save_disable();
     module_file *mfile = (module_file*)chashmap_get(open_files, &descriptor->id, sizeof(uint64_t));
-    if (!mfile || !mfile->name.data) {
-        irq_restore(irq);
-        return false;
+    irq_restore(irq);
+    if (!mfile || mfile->read_only || size > UINT32_MAX) return false;
+    f32_stream *stream = (f32_stream*)mfile->private_data;
+    if (size > mfile->file_size){
+        u32 cluster_bytes = mbs->sectors_per_cluster * 512;
+        f32_cluster_run run;
+        u32 last = (size - 1) / cluster_bytes;
+        while (!map_cluster(stream, last, &run))
+            if (!extend_stream(stream)) return false;
+    } else if (size < mfile->file_size){
+        //The first cluster stays so the entry keeps a valid chain
+        u32 cluster_bytes = mbs->sectors_per_cluster * 512;
+        shrink_stream(stream, size ? (size + cluster_bytes - 1) / cluster_bytes : 1);
     }
-    const char* path = mfile->name.data;
-    path = seek_to(path, '/');
-    uint32_t count = count_FAT(mbs->first_cluster_of_root_directory);
-    f32_walk_result result = walk_directory(count, mbs->first_cluster_of_root_directory, path, read_entry_handler);
-    
-    if (!result.found) return false;
-    
-    result.entry.filesize = size & UINT32_MAX;
-    
-    write_section_to_cluster(result.cluster,result.offset, &result.entry, sizeof(f32file_entry));
-    
-    return false;
+    mfile->file_size = size;
+    descriptor->size = size;
+    stream->dirty = true;
+    fat32_drop_exec_image(mfile);
+    if (descriptor->cursor > size) descriptor->cursor = size;
+    return sync();
 }
 
 #include "mbr.h"
@@ -704,6 +893,24 @@ system_module boot_fs_module = (system_module){
     .alias_info = {}
 };
 
+int boot_partition_flush(int argc, char* argv[]){
+    while (true){
+        fs_driver->wait_dirty();
+        fs_driver->sync();
+    }
+    return 0;
+}
+
+extern "C" uint32_t boot_partition_free_clusters(){
+    return fs_driver ? fs_driver->free_clusters() : 0;
+}
+
+extern "C" bool sync_boot_partition(){
+    return fs_driver ? fs_driver->sync() : bcache_sync();
+}
+
 extern "C" bool load_boot_partition(){
-    return load_module(&boot_fs_module);
+    if (!load_module(&boot_fs_module)) return false;
+    create_kernel_process("fat32_flush", boot_partition_flush, 0, 0);
+    return true;
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include "std/string.h"
 #include "fsdriver.hpp"
 #include "data/struct/hashmap.h"
+#include "exceptions/ktimer.h"
+#include "process/waitqueue.h"
 
 typedef struct fat32_mbs {
     uint8_t jumpboot[3];//3
@@ -75,6 +77,24 @@ typedef struct f32longname {
     uint16_t name3[2];
 }__attribute__((packed)) f32longname;
 
+typedef struct {
+    u32 file_cluster;
+    u32 disk_cluster;
+    u32 length;
+} f32_cluster_run;
+
+typedef struct {
+    u32 next_cluster;//Next chain entry to resolve, 0 once the chain ends
+    u32 mapped;
+    f32_cluster_run *runs;
+    u32 run_count;
+    u32 run_capacity;
+    f32file_entry entry;
+    u32 entry_cluster;
+    u32 entry_offset;
+    bool dirty;
+} f32_stream;
+
 class FAT32FS;
 
 typedef struct {
@@ -96,21 +116,35 @@ public:
     void close_file(file* descriptor) override;
     bool stat(const char *path, fs_stat *out_stat) override;
     bool truncate(file *descriptor, size_t size) override;
+    bool sync();
+    u32 free_clusters();
+    //Blocks until something has been dirty for FAT32_FLUSH_INTERVAL
+    void wait_dirty();
 protected:
-    sizedptr read_full_file(uint32_t cluster_start, uint32_t cluster_size, uint32_t cluster_count, uint64_t file_size, uint32_t root_index);
+    //Arms the delayed flush the first time something is dirtied after a sync
+    void mark_dirty();
     void read_FAT(uint32_t location, uint32_t size, uint8_t count);
-    void write_FAT(uint32_t location, uint32_t size, uint8_t count);
+    bool flush_FAT();
+    void set_FAT(u32 cluster, u32 value);
     uint32_t count_FAT(uint32_t first);
     sizedptr list_directory(uint32_t cluster_count, uint32_t root_index);
     f32_walk_result walk_directory(uint32_t cluster_count, uint32_t root_index, const char *seek, f32_entry_handler handler);
     sizedptr read_cluster(uint32_t cluster_start, uint32_t cluster_size, uint32_t cluster_count, uint32_t root_index);
-    bool write_to_disk(u32 cluster_start, void* buf, size_t size);
     
     bool write_section_to_cluster(u32 cluster, u32 offset, void *buf, size_t size);
     u32 resolve_cluster_index(u32 start, u32 index);
+
+    f32_stream* create_stream(u32 first_cluster);
+    void free_stream(f32_stream *stream);
+    bool map_cluster(f32_stream *stream, u32 index, f32_cluster_run *out);
+    size_t read_stream(f32_stream *stream, u64 offset, void *buf, size_t size);
+    size_t write_stream(f32_stream *stream, u64 offset, const void *buf, size_t size);
+    bool extend_stream(f32_stream *stream);
+    //Keeps the first clusters of the chain and returns the rest to the FAT
+    void shrink_stream(f32_stream *stream, u32 clusters);
+    bool flush_stream(f32_stream *stream, u32 file_size);
     
-    bool resize_fat(u32 start, u32 count);
-    u32 alloc_fat();
+    u32 alloc_fat(u32 hint);
     void dealloc_fat(u32 cluster);
     
     fat32_mbs* mbs = 0x0;
@@ -121,6 +155,9 @@ protected:
     uint32_t total_fat_entries = 0;
     uint16_t bytes_per_sector = 0;
     uint32_t partition_first_sector = 0;
+    uint32_t fat_dirty_start = 0;
+    uint32_t fat_dirty_end = 0;
+    uint32_t free_hint = 3;
 
     static f32_walk_result read_entry_handler(FAT32FS *instance, f32file_entry *entry, char *filename, const char *seek);
     static f32_walk_result list_entries_handler(FAT32FS *instance, f32file_entry *entry, char *filename, const char *seek);
@@ -131,4 +168,8 @@ protected:
     bool verbose = false;
 
     hash_map_t *open_files;
+
+    kevent flush_event = {};
+    ktimer flush_timer = {};
+    volatile bool flush_armed = false;
 };
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include "exceptions/irq.h"
 #include "process/scheduler.h"
 #include "pipe.h"
+#include "block_cache.h"
 #include "files/dir_list.h"
 
 uint64_t fd_id = 256;//First byte reserved
@@ -31,6 +32,7 @@ void* open_files_alloc(size_t size){
 
 extern bool load_home();
 extern bool load_boot_partition();
+extern bool sync_boot_partition();
 
 bool init_filesystem(){
     page = palloc(PAGE_SIZE*8, MEM_PRIV_KERNEL, MEM_RW, false);
@@ -40,11 +42,16 @@ bool init_filesystem(){
     const char *path = "disk";
     system_module *disk_mod = get_module(&path);
     if (disk_mod){
+        bcache_init();
         if (!load_boot_partition()) return false;
     }
     return load_home();
 }
 
+bool sync_filesystems(){
+    return sync_boot_partition();
+}
+
 FS_RESULT open_file_global(module_root *root, const char* path, file* descriptor, system_module **mod){
     const char *search_path = path;
     if (*search_path == '/') search_path++;
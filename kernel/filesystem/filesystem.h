@@ -17,6 +17,7 @@ void close_file_global(file *descriptor, system_module *mod);
 void close_file(file *descriptor);
 size_t list_directory_contents(module_root *root, const char *path, void* buf, size_t size, uint64_t *offset);
 bool init_filesystem();
+bool sync_filesystems();
 
 bool get_stat(module_root *root, const char *path, fs_stat *out_stat);
 bool truncate(file *descriptor, size_t size);
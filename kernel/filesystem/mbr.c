@@ -1,7 +1,7 @@
 #include "mbr.h"
 #include "memory/page_allocator.h"
 #include "std/memory_access.h"
-#include "disk.h"
+#include "block_cache.h"
 #include "console/kio.h"
 
 void* mbr_page;
@@ -11,7 +11,7 @@ uint32_t mbr_find_partition(uint8_t partition_type){
 
     mbr *mbr_entry = (mbr*)kalloc(mbr_page, 512, ALIGN_64B, MEM_PRIV_KERNEL);
     
-    disk_read((void*)mbr_entry, 0, 1);
+    bcache_read((void*)mbr_entry, 0, 1);
 
     uint32_t offset = 0;
 
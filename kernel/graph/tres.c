@@ -150,8 +150,8 @@ void resize_window_proc(process_t *proc, u32 width, u32 height){
     if (node && node->data){
         window_frame* frame = (window_frame*)node->data;
         mm_remove_vma(&proc->mm, proc->win_fb_va, proc->win_fb_va + proc->win_fb_size);
-        for (uintptr_t va = proc->win_fb_va; va < proc->win_fb_va + proc->win_fb_size; va += PAGE_SIZE) mmu_unmap_and_get_pa((uint64_t*)proc->mm.ttbr0, va, 0);
-        mmu_flush_asid(proc->mm.asid);
+        mm_unmap_range(&proc->mm, proc->win_fb_va, proc->win_fb_va + proc->win_fb_size, false);
+        mmu_flush_range(proc->mm.asid, proc->win_fb_va, proc->win_fb_va + proc->win_fb_size);
         proc->win_fb_va = 0;
         proc->win_fb_phys = 0;
         proc->win_fb_size = 0;
@@ -205,19 +205,20 @@ void get_window_ctx(draw_ctx* out_ctx){
 
     if (p->win_fb_va && (p->win_fb_size != map_size || p->win_fb_phys != pa)) {
         mm_remove_vma(&p->mm, p->win_fb_va, p->win_fb_va + p->win_fb_size);
-        for (uintptr_t va = p->win_fb_va; va < p->win_fb_va + p->win_fb_size; va += PAGE_SIZE) mmu_unmap_and_get_pa((uint64_t*)p->mm.ttbr0, va, 0);
-        mmu_flush_asid(p->mm.asid);
+        mm_unmap_range(&p->mm, p->win_fb_va, p->win_fb_va + p->win_fb_size, false);
+        mmu_flush_range(p->mm.asid, p->win_fb_va, p->win_fb_va + p->win_fb_size);
         p->win_fb_va = 0;
         p->win_fb_phys = 0;
         p->win_fb_size = 0;
     }
 
     if (!p->win_fb_va) {
-        uintptr_t user_fb = mm_alloc_mmap(&p->mm, fb_size, MEM_RW, VMA_KIND_SPECIAL, 0);
+        //Same offset within a 2MB slot as the backing so the buffer maps with blocks and contiguous runs
+        uintptr_t user_fb = mm_alloc_mmap_aligned(&p->mm, fb_size, GRANULE_2MB, pa & (GRANULE_2MB - 1), MEM_RW, VMA_KIND_SPECIAL, 0);
         if (!user_fb) return;
 
-        for (size_t off = 0; off < map_size; off += PAGE_SIZE) mmu_map_4kb((uint64_t*)p->mm.ttbr0, user_fb + off, pa + off, MAIR_IDX_NORMAL, MEM_RW | MEM_NORM, MEM_PRIV_USER);
-        mmu_flush_asid(p->mm.asid);
+        mmu_map_range((uint64_t*)p->mm.ttbr0, user_fb, pa, map_size, MAIR_IDX_NORMAL, MEM_RW | MEM_NORM, MEM_PRIV_USER);
+        mmu_sync_new_ptes();
 
         p->win_fb_va = user_fb;
         p->win_fb_phys = pa;
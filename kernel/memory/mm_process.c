@@ -1,15 +1,151 @@
 #include "process/process.h"
 #include "memory/mmu.h"
 #include "memory/addr.h"
+#include "memory/slab.h"
 #include "std/memory.h"
 #include "memory/mm_process.h"
+#include "process/loading/exec_cache.h"
+
+static inline uint8_t vma_height(vma *n){
+    return n ? n->height : 0;
+}
+
+static inline void vma_fix_height(vma *n){
+    uint8_t l = vma_height(n->left);
+    uint8_t r = vma_height(n->right);
+    n->height = (l > r ? l : r) + 1;
+}
+
+static vma* vma_rotate_right(vma *n){
+    vma *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    vma_fix_height(n);
+    vma_fix_height(l);
+    return l;
+}
+
+static vma* vma_rotate_left(vma *n){
+    vma *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    vma_fix_height(n);
+    vma_fix_height(r);
+    return r;
+}
+
+static vma* vma_balance(vma *n){
+    vma_fix_height(n);
+    int bf = (int)vma_height(n->left) - (int)vma_height(n->right);
+    if (bf > 1){
+        if (vma_height(n->left->left) < vma_height(n->left->right)) n->left = vma_rotate_left(n->left);
+        return vma_rotate_right(n);
+    }
+    if (bf < -1){
+        if (vma_height(n->right->right) < vma_height(n->right->left)) n->right = vma_rotate_right(n->right);
+        return vma_rotate_left(n);
+    }
+    return n;
+}
+
+static vma* vma_tree_insert(vma *root, vma *n){
+    if (!root) return n;
+    if (n->start < root->start) root->left = vma_tree_insert(root->left, n);
+    else root->right = vma_tree_insert(root->right, n);
+    return vma_balance(root);
+}
+
+static vma* vma_tree_take_min(vma *root, vma **min){
+    if (!root->left){
+        *min = root;
+        return root->right;
+    }
+    root->left = vma_tree_take_min(root->left, min);
+    return vma_balance(root);
+}
+
+static vma* vma_tree_erase(vma *root, vma *n){
+    if (!root) return 0;
+    if (n->start < root->start) root->left = vma_tree_erase(root->left, n);
+    else if (n->start > root->start) root->right = vma_tree_erase(root->right, n);
+    else {
+        vma *l = root->left;
+        vma *r = root->right;
+        if (!r) return l;
+        vma *min = 0;
+        r = vma_tree_take_min(r, &min);
+        min->left = l;
+        min->right = r;
+        return vma_balance(min);
+    }
+    return vma_balance(root);
+}
+
+//Last VMA starting below va
+static vma* vma_predecessor(mm_struct *mm, uaddr_t va){
+    vma *best = 0;
+    vma *m = mm->vma_root;
+    while (m){
+        if (m->start < va){
+            best = m;
+            m = m->right;
+        } else m = m->left;
+    }
+    return best;
+}
+
+//First VMA ending above va, ends are ordered like starts since VMAs don't overlap
+static vma* vma_lower_bound(mm_struct *mm, uaddr_t va){
+    vma *best = 0;
+    vma *m = mm->vma_root;
+    while (m){
+        if (m->end > va){
+            best = m;
+            m = m->left;
+        } else m = m->right;
+    }
+    return best;
+}
+
+static vma* vma_link(mm_struct *mm, uaddr_t start, uaddr_t end, uint8_t prot, uint8_t kind, uint8_t flags){
+    vma *n = (vma*)slab_alloc(sizeof(vma), 8);
+    if (!n) return 0;
+    *n = (vma){ .start = start, .end = end, .prot = prot, .kind = kind, .flags = flags, .height = 1 };
+
+    vma *p = vma_predecessor(mm, start);
+    n->prev = p;
+    n->next = p ? p->next : mm->vma_head;
+    if (n->next) n->next->prev = n;
+    if (p) p->next = n;
+    else mm->vma_head = n;
+
+    mm->vma_root = vma_tree_insert(mm->vma_root, n);
+    mm->vma_count++;
+    return n;
+}
+
+static void vma_unlink(mm_struct *mm, vma *n){
+    if (n->prev) n->prev->next = n->next;
+    else mm->vma_head = n->next;
+    if (n->next) n->next->prev = n->prev;
+
+    mm->vma_root = vma_tree_erase(mm->vma_root, n);
+    mm->vma_count--;
+    slab_free(n);
+}
+
+static inline bool vma_mergeable(const vma *m, uint8_t prot, uint8_t kind, uint8_t flags){
+    if (m->prot != prot || m->kind != kind || m->flags != flags) return false;
+    return !(flags & (VMA_FLAG_USERALLOC | VMA_FLAG_HEAP | VMA_FLAG_FILE));
+}
 
 vma* mm_find_vma(mm_struct *mm, uaddr_t va){
     if (!mm) return 0;
-    for (uint16_t i = 0; i < mm->vma_count; i++){
-        vma *m = &mm->vmas[i];
-        if (va < m->start) return 0;
-        if (va < m->end) return m;
+    vma *m = mm->vma_root;
+    while (m){
+        if (va < m->start) m = m->left;
+        else if (va >= m->end) m = m->right;
+        else return m;
     }
     return 0;
 }
@@ -19,40 +155,30 @@ bool mm_add_vma(mm_struct *mm, uaddr_t start, uaddr_t end, uint8_t prot, uint8_t
     start &= ~(PAGE_SIZE - 1);
     end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     if (start >= end) return false;
-    if (mm->vma_count >= MAX_VMAS) return false;
-
-    uint16_t ins = 0;
-    while (ins < mm->vma_count && mm->vmas[ins].start < start) ins++;
-
-    if (ins > 0 && start < mm->vmas[ins - 1].end) return false;
-    if (ins < mm->vma_count && end > mm->vmas[ins].start) return false;
 
-    for (uint16_t i = mm->vma_count; i > ins; i--) mm->vmas[i] = mm->vmas[i - 1];
+    vma *prev = vma_predecessor(mm, start);
+    vma *next = prev ? prev->next : mm->vma_head;
+    if (prev && start < prev->end) return false;
+    if (next && end > next->start) return false;
 
-    mm->vmas[ins] = (vma){start, end, prot, kind, flags};
-    mm->vma_count++;
+    bool merge_prev = prev && prev->end == start && vma_mergeable(prev, prot, kind, flags);
+    bool merge_next = next && next->start == end && vma_mergeable(next, prot, kind, flags);
 
-    if (ins > 0) {
-        vma *a = &mm->vmas[ins - 1];
-        vma *b = &mm->vmas[ins];
-        if (a->end == b->start && a->prot == b->prot && a->kind == b->kind && a->flags == b->flags && !(a->flags & VMA_FLAG_USERALLOC) && !(b->flags & VMA_FLAG_USERALLOC)) {
-            a->end = b->end;
-            for (uint16_t i = ins; i + 1 < mm->vma_count; i++) mm->vmas[i] = mm->vmas[i + 1];
-            mm->vma_count--;
-            ins--;
-        }
+    if (merge_prev && merge_next){
+        prev->end = next->end;
+        vma_unlink(mm, next);
+        return true;
     }
-
-    if (ins + 1 < mm->vma_count) {
-        vma *a = &mm->vmas[ins];
-        vma *b = &mm->vmas[ins + 1];
-        if (a->end == b->start && a->prot == b->prot && a->kind == b->kind && a->flags == b->flags && !(a->flags & VMA_FLAG_USERALLOC) && !(b->flags & VMA_FLAG_USERALLOC)) {
-            a->end = b->end;
-            for (uint16_t i = ins + 1; i + 1 < mm->vma_count; i++)mm->vmas[i] = mm->vmas[i + 1];
-            mm->vma_count--;
-        }
+    if (merge_prev){
+        prev->end = end;
+        return true;
     }
-    return true;
+    //Lowering the start keeps the node between the same neighbours, so the tree stays ordered
+    if (merge_next){
+        next->start = start;
+        return true;
+    }
+    return vma_link(mm, start, end, prot, kind, flags) != 0;
 }
 
 bool mm_remove_vma(mm_struct *mm, uaddr_t start, uaddr_t end) {
@@ -61,105 +187,563 @@ bool mm_remove_vma(mm_struct *mm, uaddr_t start, uaddr_t end) {
     end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     if (start >= end) return false;
 
-    for (uint16_t i = 0; i < mm->vma_count; i++) {
-        vma *m = &mm->vmas[i];
-        if (end <= m->start) return false;
-        if (start >= m->end) continue;
-
-        bool track_free = m->kind != VMA_KIND_STACK;
-        uaddr_t free_start = 0;
-        uaddr_t free_end = 0;
-
-        if (start <= m->start && end >= m->end) {
-            free_start = m->start;
-            free_end = m->end;
-            for (uint16_t j = i; j + 1 < mm->vma_count; j++) mm->vmas[j] = mm->vmas[j + 1];
-            mm->vma_count--;
-        } else if (start <= m->start) {
-            free_start = m->start;
-            free_end = end;
-            m->start = end;
-        } else if (end >= m->end) {
-            free_start = start;
-            free_end = m->end;
-            m->end = start;
-        } else {
-            if (mm->vma_count >= MAX_VMAS) return false;
-            free_start = start;
-            free_end = end;
-            for (uint16_t j = mm->vma_count; j > i + 1; j--) mm->vmas[j] = mm->vmas[j-1];
-            mm->vmas[i + 1] = (vma){end, m->end, m->prot, m->kind, m->flags};
-            m->end = start;
-            mm->vma_count++;
+    vma *m = vma_lower_bound(mm, start);
+    if (!m || m->start >= end) return false;
+
+    uint64_t freed = 0;
+    //Splitting needs a node, take it before touching anything so failure leaves the tree intact
+    if (start > m->start && end < m->end){
+        uaddr_t tail_end = m->end;
+        m->end = start;
+        vma *tail = vma_link(mm, end, tail_end, m->prot, m->kind, m->flags);
+        if (!tail){
+            m->end = tail_end;
+            return false;
         }
-
-        if (!track_free) return true;
-
-        free_start &= ~(PAGE_SIZE - 1);
-        free_end = (free_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-        if (free_start >= free_end) return true;
-
-        uint16_t ins = 0;
-        while (ins < mm->mmap_free_count && mm->mmap_free[ins].start < free_start) ins++;
-
-        if (ins > 0 && mm->mmap_free[ins - 1].end >= free_start) {
-            if (mm->mmap_free[ins - 1].end < free_end) mm->mmap_free[ins - 1].end = free_end;
-            ins--;
-        } else {
-            if (mm->mmap_free_count >= MAX_VMAS) return true;
-            for (uint16_t j = mm->mmap_free_count; j > ins; j--) mm->mmap_free[j] = mm->mmap_free[j - 1];
-            mm->mmap_free[ins] = (mm_free_range){free_start, free_end};
-            mm->mmap_free_count++;
+        tail->file_off = m->file_off + (end - m->start);
+        tail->file_end = m->file_end;
+        if (m->start >= mm->mmap_cursor && end <= mm->mmap_top) freed = end - start;
+    } else {
+        while (m && m->start < end){
+            vma *next = m->next;
+            uaddr_t lo = start > m->start ? start : m->start;
+            uaddr_t hi = end < m->end ? end : m->end;
+            if (m->start >= mm->mmap_cursor && hi <= mm->mmap_top) freed += hi - lo;
+            if (start <= m->start && end >= m->end) vma_unlink(mm, m);
+            else if (start <= m->start) {
+                m->file_off += end - m->start;
+                m->start = end;
+            } else m->end = start;
+            m = next;
         }
+    }
+    mm->mmap_hole_bytes += freed;
+
+    //Nothing is mapped between the cursor and the lowest mapping still present, so that span stops being a hole
+    if (start <= mm->mmap_cursor && end > mm->mmap_cursor){
+        vma *low = vma_lower_bound(mm, mm->mmap_cursor);
+        uaddr_t up = low && low->start <= mm->mmap_top ? low->start : mm->mmap_top;
+        uint64_t span = up - mm->mmap_cursor;
+        mm->mmap_hole_bytes = mm->mmap_hole_bytes > span ? mm->mmap_hole_bytes - span : 0;
+        mm->mmap_cursor = up;
+    }
+    return true;
+}
 
-        while (ins + 1 < mm->mmap_free_count && mm->mmap_free[ins].end >= mm->mmap_free[ins + 1].start) {
-            if (mm->mmap_free[ins].end < mm->mmap_free[ins + 1].end) mm->mmap_free[ins].end = mm->mmap_free[ins + 1].end;
-            for (uint16_t j = ins + 1; j + 1 < mm->mmap_free_count; j++) mm->mmap_free[j] = mm->mmap_free[j + 1];
-            mm->mmap_free_count--;
-        }
+bool mm_add_file_vma(mm_struct *mm, uaddr_t start, uaddr_t end, uint8_t prot, uint64_t file_off, uaddr_t file_end){
+    if (!mm || !mm->exec) return false;
+    if ((start | file_off) & (PAGE_SIZE - 1)) return false;
+    end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (start >= end) return false;
+    if (file_end > start && file_off + (file_end - start) > mm->exec->size) return false;
 
-        while (mm->mmap_free_count) {
-            mm_free_range *top = &mm->mmap_free[mm->mmap_free_count - 1];
-            if (top->end != mm->mmap_cursor) break;
-            mm->mmap_cursor = top->start;
-            mm->mmap_free_count--;
-        }
+    vma *prev = vma_predecessor(mm, start);
+    vma *next = prev ? prev->next : mm->vma_head;
+    if (prev && start < prev->end) return false;
+    if (next && end > next->start) return false;
 
-        return true;
-    }
-    return false;
+    vma *m = vma_link(mm, start, end, prot, VMA_KIND_ELF, VMA_FLAG_FILE | VMA_FLAG_DEMAND);
+    if (!m) return false;
+    m->file_off = file_off;
+    m->file_end = file_end;
+    return true;
 }
 
-uaddr_t mm_alloc_mmap(mm_struct *mm, size_t size, uint8_t prot, uint8_t kind, uint8_t flags) {
+//Highest address at or below x that sits at phase within an align sized slot
+static inline uaddr_t mm_align_down_phase(uaddr_t x, size_t align, uaddr_t phase){
+    if (x < phase) return 0;
+    return ((x - phase) & ~(uaddr_t)(align - 1)) + phase;
+}
+
+uaddr_t mm_alloc_mmap_aligned(mm_struct *mm, size_t size, size_t align, uaddr_t phase, uint8_t prot, uint8_t kind, uint8_t flags) {
     if (!mm) return 0;
     if (!size) return 0;
+    if (!mm->mmap_cursor) return 0;
     size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-
-    for (uint16_t i = 0; i < mm->mmap_free_count; i++) {
-        mm_free_range *r = &mm->mmap_free[i];
-        size_t span = r->end - r->start;
-        if(span < size) continue;
-        uaddr_t base = (r->end - size) & ~(PAGE_SIZE - 1);
-        if (base < r->start) continue;
+    if (align < PAGE_SIZE) align = PAGE_SIZE;
+    phase &= (align - 1) & ~(uaddr_t)(PAGE_SIZE - 1);
+
+    //Reuse holes left between live mappings before pushing the cursor down, skipped while they can't fit
+    vma *m = mm->mmap_hole_bytes >= size ? vma_lower_bound(mm, mm->mmap_cursor) : 0;
+    for (; m && m->end < mm->mmap_top; m = m->next) {
+        uaddr_t hole_end = m->next && m->next->start < mm->mmap_top ? m->next->start : mm->mmap_top;
+        if (hole_end - m->end < size) continue;
+        uaddr_t base = mm_align_down_phase(hole_end - size, align, phase);
+        if (base < m->end) continue;
         if (!mm_add_vma(mm, base, base + size, prot, kind, flags)) return 0;
-        if (base == r->start && base + size == r->end) {
-            for (uint16_t j = i; j + 1 < mm->mmap_free_count; j++) mm->mmap_free[j] = mm->mmap_free[j + 1];
-            mm->mmap_free_count--;
-        } else if (base == r->start) r->start += size;
-        else r->end = base;
+        mm->mmap_hole_bytes = mm->mmap_hole_bytes > size ? mm->mmap_hole_bytes - size : 0;
         return base;
     }
 
-    uaddr_t heap_guard = mm->mmap_bottom + (MM_GAP_PAGES * PAGE_SIZE);
-    if (!mm->mmap_cursor) return 0;
-    uaddr_t base = (mm->mmap_cursor - size) & ~(PAGE_SIZE - 1);
-    if (base < heap_guard) return 0;
+    uaddr_t floor = (mm->heap.end ? mm->heap.end : mm->mmap_bottom) + (MM_GAP_PAGES * PAGE_SIZE);
+    if (mm->mmap_cursor < size) return 0;
+    uaddr_t base = mm_align_down_phase(mm->mmap_cursor - size, align, phase);
+    if (base < floor) return 0;
     if (base + size > mm->mmap_top) return 0;
     if (!mm_add_vma(mm, base, base + size, prot, kind, flags)) return 0;
+    mm->mmap_hole_bytes += mm->mmap_cursor - (base + size);
     mm->mmap_cursor = base;
     return base;
 }
 
+uaddr_t mm_alloc_mmap(mm_struct *mm, size_t size, uint8_t prot, uint8_t kind, uint8_t flags) {
+    //Anonymous mappings big enough for a large page start on its boundary so faults can back them with one
+    size_t align = PAGE_SIZE;
+    if (kind == VMA_KIND_ANON) {
+        if (size >= GRANULE_2MB) align = GRANULE_2MB;
+        else if (size >= GRANULE_64KB) align = GRANULE_64KB;
+    }
+    return mm_alloc_mmap_aligned(mm, size, align, 0, prot, kind, flags);
+}
+
+uint64_t mm_unmap_range(mm_struct *mm, uaddr_t start, uaddr_t end, bool free_pages){
+    if (!mm || !mm->ttbr0) return 0;
+    uint64_t *root = (uint64_t*)mm->ttbr0;
+    uint64_t pages = 0;
+
+    for (uaddr_t va = start; va < end;) {
+        uint64_t pa = 0;
+        if (!(va & (GRANULE_2MB - 1)) && end - va >= GRANULE_2MB && mmu_unmap_2mb_and_get_pa(root, va, &pa)) {
+            if (free_pages) pfree((void*)dmap_pa_to_kva((paddr_t)pa), GRANULE_2MB);
+            pages += GRANULE_2MB / PAGE_SIZE;
+            va += GRANULE_2MB;
+            continue;
+        }
+        //A block only partly covered by the range is split into pages here. Executable cache pages are shared and stay
+        if (mmu_unmap_and_get_pa(root, va, &pa)) {
+            if (free_pages && !exec_image_owns(mm->exec, (paddr_t)pa)) pfree((void*)dmap_pa_to_kva((paddr_t)pa), PAGE_SIZE);
+            pages++;
+        }
+        va += PAGE_SIZE;
+    }
+    return pages;
+}
+
+static inline size_t mm_heap_meta_size(uint32_t pages){
+    return count_pages(pages * sizeof(mm_heap_page), PAGE_SIZE) * PAGE_SIZE;
+}
+
+//The arena is one VMA that grows up from mmap_bottom towards the mmap cursor
+static bool mm_heap_grow(mm_struct *mm){
+    mm_heap *h = &mm->heap;
+    if (!h->start) h->start = mm->mmap_bottom;
+    if (!h->start) return false;
+
+    vma *arena = h->end ? mm_find_vma(mm, h->start) : 0;
+    vma *above = arena ? arena->next : vma_lower_bound(mm, h->start);
+    uaddr_t limit = above ? above->start : mm->mmap_top;
+    if (mm->mmap_cursor && mm->mmap_cursor < limit) limit = mm->mmap_cursor;
+
+    uint32_t new_cap = h->page_cap + MM_HEAP_GROW_PAGES;
+    uaddr_t new_end = h->start + (uaddr_t)new_cap * PAGE_SIZE;
+    if (limit < MM_GAP_PAGES * PAGE_SIZE || new_end > limit - MM_GAP_PAGES * PAGE_SIZE) return false;
+
+    mm_heap_page *pages = (mm_heap_page*)palloc(mm_heap_meta_size(new_cap), MEM_PRIV_KERNEL, MEM_RW, true);
+    if (!pages) return false;
+
+    if (arena) arena->end = new_end;
+    else if (!mm_add_vma(mm, h->start, new_end, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_ZERO | VMA_FLAG_HEAP)){
+        pfree(pages, mm_heap_meta_size(new_cap));
+        return false;
+    }
+
+    memset(pages, 0, mm_heap_meta_size(new_cap));
+    if (h->pages){
+        memcpy(pages, h->pages, h->page_cap * sizeof(mm_heap_page));
+        pfree(h->pages, mm_heap_meta_size(h->page_cap));
+    }
+    h->pages = pages;
+    h->page_cap = new_cap;
+    h->end = new_end;
+    return true;
+}
+
+static void mm_heap_list_push(mm_heap *h, uint32_t *head, uint32_t idx){
+    mm_heap_page *p = &h->pages[idx - 1];
+    p->prev = 0;
+    p->next = *head;
+    if (*head) h->pages[*head - 1].prev = idx;
+    *head = idx;
+}
+
+static void mm_heap_list_remove(mm_heap *h, uint32_t *head, uint32_t idx){
+    mm_heap_page *p = &h->pages[idx - 1];
+    if (p->prev) h->pages[p->prev - 1].next = p->next;
+    else *head = p->next;
+    if (p->next) h->pages[p->next - 1].prev = p->prev;
+    p->prev = 0;
+    p->next = 0;
+}
+
+static uint32_t mm_heap_take_page(mm_struct *mm){
+    mm_heap *h = &mm->heap;
+    if (h->free_head){
+        uint32_t idx = h->free_head;
+        mm_heap_list_remove(h, &h->free_head, idx);
+        return idx;
+    }
+    if (h->page_top >= h->page_cap && !mm_heap_grow(mm)) return 0;
+    return ++h->page_top;
+}
+
+uaddr_t mm_heap_alloc(mm_struct *mm, size_t size){
+    if (!mm || !size || size > MM_HEAP_MAX_OBJ) return 0;
+
+    uint8_t cls = 0;
+    while (((size_t)MM_HEAP_MIN_OBJ << cls) < size) cls++;
+    uint32_t obj = MM_HEAP_MIN_OBJ << cls;
+    uint32_t cap = PAGE_SIZE / obj;
+
+    mm_heap *h = &mm->heap;
+    uint32_t idx = h->partial[cls];
+    if (!idx){
+        if (mm->rss_anon_pages >= mm->cap_anon_pages) return 0;
+        idx = mm_heap_take_page(mm);
+        if (!idx) return 0;
+        mm_heap_page *fresh = &h->pages[idx - 1];
+        fresh->cls = cls + 1;
+        fresh->used = 0;
+        fresh->bits[0] = 0;
+        fresh->bits[1] = 0;
+        mm_heap_list_push(h, &h->partial[cls], idx);
+    }
+
+    mm_heap_page *p = &h->pages[idx - 1];
+    uint32_t slot = 0;
+    if (~p->bits[0]) slot = __builtin_ctzll(~p->bits[0]);
+    else slot = 64 + __builtin_ctzll(~p->bits[1]);
+    if (slot >= cap) return 0;
+
+    p->bits[slot >> 6] |= 1ull << (slot & 63);
+    p->used++;
+    if (p->used == cap) mm_heap_list_remove(h, &h->partial[cls], idx);
+    h->objects++;
+
+    return h->start + (uaddr_t)(idx - 1) * PAGE_SIZE + (uaddr_t)slot * obj;
+}
+
+//Freed objects are zeroed so every allocation hands out zeroed memory, empty pages go back to the allocator
+bool mm_heap_free(mm_struct *mm, uaddr_t va){
+    if (!mm) return false;
+    mm_heap *h = &mm->heap;
+    if (!h->end || va < h->start || va >= h->end) return false;
+
+    uint32_t idx = (uint32_t)((va - h->start) / PAGE_SIZE) + 1;
+    if (idx > h->page_top) return true;
+    mm_heap_page *p = &h->pages[idx - 1];
+    if (!p->cls) return true;
+
+    uint8_t cls = p->cls - 1;
+    uint32_t obj = MM_HEAP_MIN_OBJ << cls;
+    uint32_t cap = PAGE_SIZE / obj;
+    uaddr_t off = va & (PAGE_SIZE - 1);
+    if (off % obj) return true;
+    uint32_t slot = (uint32_t)(off / obj);
+    if (!(p->bits[slot >> 6] & (1ull << (slot & 63)))) return true;
+
+    p->bits[slot >> 6] &= ~(1ull << (slot & 63));
+    p->used--;
+    h->objects--;
+
+    uaddr_t page_va = va & ~(PAGE_SIZE - 1);
+    if (!p->used){
+        mm_heap_list_remove(h, &h->partial[cls], idx);
+        p->cls = 0;
+        mm_heap_list_push(h, &h->free_head, idx);
+
+        uint64_t pa = 0;
+        if (mm->ttbr0 && mmu_unmap_and_get_pa((uint64_t*)mm->ttbr0, page_va, &pa)){
+            pfree((void*)dmap_pa_to_kva((paddr_t)pa), PAGE_SIZE);
+            if (mm->rss_anon_pages) mm->rss_anon_pages--;
+            mmu_flush_va(mm->asid, page_va);
+        }
+        return true;
+    }
+
+    if (p->used == cap - 1) mm_heap_list_push(h, &h->partial[cls], idx);
+
+    int st = 0;
+    if (mm->ttbr0) mm_break_cow(mm, page_va);
+    uintptr_t pa = mm->ttbr0 ? mmu_translate((uint64_t*)mm->ttbr0, va, &st) : 0;
+    if (pa && st == 0) memset((void*)dmap_pa_to_kva((paddr_t)pa), 0, obj);
+    return true;
+}
+
+void mm_release(mm_struct *mm){
+    if (!mm) return;
+    vma *m = mm->vma_head;
+    while (m){
+        vma *next = m->next;
+        slab_free(m);
+        m = next;
+    }
+    mm->vma_root = 0;
+    mm->vma_head = 0;
+    mm->vma_count = 0;
+
+    if (mm->heap.pages) pfree(mm->heap.pages, mm_heap_meta_size(mm->heap.page_cap));
+    memset(&mm->heap, 0, sizeof(mm->heap));
+}
+
+//Executable cache pages belong to the image, everything else gains a reference for the second mapping
+static void mm_clone_share(paddr_t pa, uint64_t size, void *ctx){
+    mm_struct *mm = (mm_struct*)ctx;
+    for (uint64_t off = 0; off < size; off += PAGE_SIZE)
+        if (!exec_image_owns(mm->exec, pa + off)) page_ref_get(pa + off);
+}
+
+bool mm_clone(mm_struct *dst, mm_struct *src){
+    if (!dst || !src || !dst->ttbr0 || !src->ttbr0 || dst->vma_head) return false;
+
+    dst->mmap_bottom = src->mmap_bottom;
+    dst->mmap_top = src->mmap_top;
+    dst->mmap_cursor = src->mmap_cursor;
+    dst->mmap_hole_bytes = src->mmap_hole_bytes;
+    dst->stack_top = src->stack_top;
+    dst->stack_limit = src->stack_limit;
+    dst->stack_commit = src->stack_commit;
+    dst->rss_stack_pages = src->rss_stack_pages;
+    dst->rss_anon_pages = src->rss_anon_pages;
+    dst->cap_stack_pages = src->cap_stack_pages;
+    dst->cap_anon_pages = src->cap_anon_pages;
+
+    dst->heap = src->heap;
+    dst->heap.pages = 0;
+    if (src->heap.pages) {
+        size_t meta = mm_heap_meta_size(src->heap.page_cap);
+        dst->heap.pages = (mm_heap_page*)palloc(meta, MEM_PRIV_KERNEL, MEM_RW, true);
+        if (!dst->heap.pages) {
+            memset(&dst->heap, 0, sizeof(dst->heap));
+            return false;
+        }
+        memcpy(dst->heap.pages, src->heap.pages, meta);
+    }
+
+    exec_cache_ref(src->exec);
+    dst->exec = src->exec;
+
+    //Each VMA is linked before its pages are shared, so a partial clone still tears down cleanly
+    for (vma *m = src->vma_head; m; m = m->next) {
+        vma *n = vma_link(dst, m->start, m->end, m->prot, m->kind, m->flags);
+        if (!n) return false;
+        //Device mappings like a window framebuffer stay with src, removing the VMA keeps the mmap holes right
+        if (m->kind == VMA_KIND_SPECIAL && !(m->flags & VMA_FLAG_NOFREE)) {
+            mm_remove_vma(dst, m->start, m->end);
+            continue;
+        }
+        n->file_off = m->file_off;
+        n->file_end = m->file_end;
+        //The shared return page isn't owned by anyone and is mapped as it is
+        bool owned = !(m->flags & VMA_FLAG_NOFREE);
+        mmu_share_range((uint64_t*)dst->ttbr0, (uint64_t*)src->ttbr0, m->start, m->end, owned, owned ? mm_clone_share : 0, dst);
+    }
+    return true;
+}
+
+static paddr_t mm_fault_alloc_page(vma *m){
+    paddr_t phys = palloc_inner(PAGE_SIZE, MEM_PRIV_USER, MEM_RW, true, false);
+    if (!phys) return 0;
+    if (m->kind != VMA_KIND_ANON || (m->flags & VMA_FLAG_ZERO)) memset((void*)dmap_pa_to_kva(phys), 0, PAGE_SIZE);
+    return phys;
+}
+
+static bool mm_fault_map_one(mm_struct *mm, vma *m, uintptr_t va){
+    if (m->kind == VMA_KIND_ANON && mm->rss_anon_pages >= mm->cap_anon_pages) return false;
+    paddr_t phys = mm_fault_alloc_page(m);
+    if (!phys) return false;
+    mmu_map_4kb((uint64_t*)mm->ttbr0, va, phys, MAIR_IDX_NORMAL, m->prot | MEM_NORM, MEM_PRIV_USER);
+    if (m->kind == VMA_KIND_ANON) mm->rss_anon_pages++;
+    return true;
+}
+
+uint32_t mm_fault_around_pages = MM_FAULT_AROUND_PAGES;
+bool mm_large_pages = true;
+
+static inline bool mm_vma_covers(vma *m, uaddr_t start, uint64_t size){
+    return start >= m->start && start + size <= m->end;
+}
+
+//The heap arena frees single pages all the time, so it stays on 4KB mappings
+static inline bool mm_vma_large_ok(vma *m){
+    return mm_large_pages && m->kind == VMA_KIND_ANON && !(m->flags & VMA_FLAG_HEAP);
+}
+
+//Backs an untouched aligned 2MB or 64KB window of the VMA with a single mapping, 0 when neither fits
+static uint64_t mm_fault_large(mm_struct *mm, vma *m, uintptr_t va_page){
+    if (!mm_vma_large_ok(m)) return 0;
+
+    static const uint64_t sizes[] = { GRANULE_2MB, GRANULE_64KB };
+    for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint64_t size = sizes[i];
+        uint64_t pages = size / PAGE_SIZE;
+        uintptr_t base = va_page & ~(size - 1);
+        if (!mm_vma_covers(m, base, size)) continue;
+        if (mm->rss_anon_pages + pages > mm->cap_anon_pages) continue;
+        if (mmu_populated((uint64_t*)mm->ttbr0, base, size, 0)) continue;
+
+        paddr_t phys = palloc_inner(size, MEM_PRIV_USER, MEM_RW, true, false);
+        if (!phys) continue;
+        if (phys & (size - 1)) {
+            pfree((void*)dmap_pa_to_kva(phys), size);
+            continue;
+        }
+        if (m->flags & VMA_FLAG_ZERO) memset((void*)dmap_pa_to_kva(phys), 0, size);
+
+        if (size == GRANULE_2MB) mmu_map_2mb((uint64_t*)mm->ttbr0, base, phys, MAIR_IDX_NORMAL, m->prot | MEM_NORM, MEM_PRIV_USER);
+        else if (!mmu_map_64kb((uint64_t*)mm->ttbr0, base, phys, MAIR_IDX_NORMAL, m->prot | MEM_NORM, MEM_PRIV_USER)) {
+            pfree((void*)dmap_pa_to_kva(phys), size);
+            continue;
+        }
+        mm->rss_anon_pages += pages;
+        mm->fault_stats.large_maps++;
+        return pages;
+    }
+    return 0;
+}
+
+//Once a window is fully populated with pages, fold it into a contiguous run or copy it into a 2MB block
+static void mm_try_promote(mm_struct *mm, vma *m, uintptr_t va_page){
+    if (!mm_vma_large_ok(m)) return;
+    uint64_t *root = (uint64_t*)mm->ttbr0;
+    if (mmu_try_contig_64kb(root, va_page)) mm->fault_stats.promotions++;
+
+    uintptr_t base = va_page & ~(GRANULE_2MB - 1);
+    if (!mm_vma_covers(m, base, GRANULE_2MB)) return;
+    bool block = false;
+    if (mmu_populated(root, base, GRANULE_2MB, &block) != PAGE_TABLE_ENTRIES || block) return;
+
+    paddr_t huge = palloc_inner(GRANULE_2MB, MEM_PRIV_USER, MEM_RW, true, false);
+    if (!huge) return;
+    paddr_t *old = (paddr_t*)palloc(PAGE_TABLE_ENTRIES * sizeof(paddr_t), MEM_PRIV_KERNEL, MEM_RW, true);
+    if (!old || (huge & (GRANULE_2MB - 1))) {
+        if (old) pfree(old, PAGE_TABLE_ENTRIES * sizeof(paddr_t));
+        pfree((void*)dmap_pa_to_kva(huge), GRANULE_2MB);
+        return;
+    }
+
+    for (uint32_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+        int st = 0;
+        old[i] = mmu_translate(root, base + (i * PAGE_SIZE), &st) & ~(uintptr_t)(PAGE_SIZE - 1);
+        memcpy((void*)dmap_pa_to_kva(huge + (i * PAGE_SIZE)), (void*)dmap_pa_to_kva(old[i]), PAGE_SIZE);
+    }
+
+    if (mmu_collapse_2mb(root, mm->asid, base, huge, MAIR_IDX_NORMAL, m->prot | MEM_NORM, MEM_PRIV_USER)) {
+        for (uint32_t i = 0; i < PAGE_TABLE_ENTRIES; i++) pfree((void*)dmap_pa_to_kva(old[i]), PAGE_SIZE);
+        mm->fault_stats.promotions++;
+    } else pfree((void*)dmap_pa_to_kva(huge), GRANULE_2MB);
+    pfree(old, PAGE_TABLE_ENTRIES * sizeof(paddr_t));
+}
+
+//Maps the faulting page, then whatever is still empty in the aligned window around it
+static uint64_t mm_fault_around(mm_struct *mm, vma *m, uintptr_t va_page){
+    if (!mm_fault_map_one(mm, m, va_page)) return 0;
+    if (mm_fault_around_pages <= 1) return 1;
+
+    uintptr_t window = (uintptr_t)mm_fault_around_pages * PAGE_SIZE;
+    uintptr_t start = va_page - (va_page % window);
+    uintptr_t end = start + window;
+    if (start < m->start) start = m->start;
+    if (end > m->end) end = m->end;
+
+    uint64_t mapped = 1;
+    for (uintptr_t va = start; va < end; va += PAGE_SIZE) {
+        if (va == va_page) continue;
+        int st = 0;
+        mmu_translate((uint64_t*)mm->ttbr0, va, &st);
+        if (st == 0) continue;
+        if (!mm_fault_map_one(mm, m, va)) break;
+        mapped++;
+    }
+    return mapped;
+}
+
+static inline bool mm_file_page_whole(vma *m, uintptr_t va){
+    return va + PAGE_SIZE <= m->file_end;
+}
+
+//Private copy of a file page, the bytes past the end of the file data read as zero
+static paddr_t mm_file_copy_page(mm_struct *mm, vma *m, uintptr_t va){
+    paddr_t phys = palloc_inner(PAGE_SIZE, MEM_PRIV_USER, MEM_RW, true, false);
+    if (!phys) return 0;
+    uint8_t *dst = (uint8_t*)dmap_pa_to_kva(phys);
+    uint64_t have = va < m->file_end ? m->file_end - va : 0;
+    if (have > PAGE_SIZE) have = PAGE_SIZE;
+    if (have) memcpy(dst, (void*)dmap_pa_to_kva(mm->exec->phys + m->file_off + (va - m->start)), have);
+    if (have < PAGE_SIZE) memset(dst + have, 0, PAGE_SIZE - have);
+    return phys;
+}
+
+//Whole file pages map straight from the executable cache, read only even in writable segments until written.
+//Those cost nothing to map, so reads take the rest of the fault-around window with them
+static uint64_t mm_fault_file(mm_struct *mm, vma *m, uintptr_t va_page, bool is_write){
+    if (!mm->exec) return 0;
+    uint64_t *root = (uint64_t*)mm->ttbr0;
+
+    if (!mm_file_page_whole(m, va_page) || (is_write && (m->prot & MEM_RW))) {
+        paddr_t phys = mm_file_copy_page(mm, m, va_page);
+        if (!phys) return 0;
+        mmu_map_4kb(root, va_page, phys, MAIR_IDX_NORMAL, m->prot | MEM_NORM, MEM_PRIV_USER);
+        return 1;
+    }
+
+    uintptr_t window = (uintptr_t)(mm_fault_around_pages ? mm_fault_around_pages : 1) * PAGE_SIZE;
+    uintptr_t start = va_page - (va_page % window);
+    uintptr_t end = start + window;
+    if (start < m->start) start = m->start;
+    if (end > m->end) end = m->end;
+
+    uint64_t mapped = 0;
+    for (uintptr_t va = start; va < end; va += PAGE_SIZE) {
+        if (!mm_file_page_whole(m, va)) break;
+        if (va != va_page) {
+            int st = 0;
+            mmu_translate(root, va, &st);
+            if (st == 0) continue;
+        }
+        paddr_t pa = mm->exec->phys + m->file_off + (va - m->start);
+        mmu_map_4kb(root, va, pa, MAIR_IDX_NORMAL, (m->prot & ~MEM_RW) | MEM_NORM, MEM_PRIV_USER);
+        mapped++;
+    }
+    mm->fault_stats.file_pages += mapped;
+    return mapped;
+}
+
+//Pages of writable VMAs can be mapped read only while shared with the executable cache or with a cloned
+//address space. Shared ones get a private copy, a page nobody else maps any more is just made writable again
+bool mm_break_cow(mm_struct *mm, uaddr_t va){
+    if (!mm || !mm->ttbr0) return false;
+    uintptr_t va_page = va & ~(PAGE_SIZE - 1);
+    uint64_t *root = (uint64_t*)mm->ttbr0;
+    uint64_t pte = mmu_leaf_entry(root, va_page);
+    if (!pte || !(pte & PTE_AP_RO)) return false;
+    vma *m = mm_find_vma(mm, va_page);
+    if (!m || !(m->prot & MEM_RW) || (m->flags & VMA_FLAG_NOFREE) || m->kind == VMA_KIND_SPECIAL) return false;
+
+    int st = 0;
+    paddr_t pa = (paddr_t)mmu_translate(root, va_page, &st) & ~(paddr_t)(PAGE_SIZE - 1);
+    if (st != 0) return false;
+
+    paddr_t phys = pa;
+    if (exec_image_owns(mm->exec, pa)) {
+        if (!(m->flags & VMA_FLAG_FILE)) return false;
+        phys = mm_file_copy_page(mm, m, va_page);
+    } else if (page_ref_count(pa) > 1) {
+        phys = palloc_inner(PAGE_SIZE, MEM_PRIV_USER, MEM_RW, true, false);
+        if (phys) memcpy((void*)dmap_pa_to_kva(phys), (void*)dmap_pa_to_kva(pa), PAGE_SIZE);
+    }
+    if (!phys) return false;
+
+    mmu_unmap_and_get_pa(root, va_page, 0);
+    mmu_flush_va(mm->asid, va_page);
+    mmu_map_4kb(root, va_page, phys, MAIR_IDX_NORMAL, m->prot | MEM_NORM, MEM_PRIV_USER);
+    mmu_sync_new_ptes();
+    if (phys != pa) {
+        if (!exec_image_owns(mm->exec, pa)) pfree((void*)dmap_pa_to_kva(pa), PAGE_SIZE);
+        mm->fault_stats.cow_copies++;
+    }
+    return true;
+}
+
 bool mm_try_handle_page_fault(process_t *proc, uintptr_t far, uint64_t esr) {
     if (!proc || !proc->mm.ttbr0) return false;
 
@@ -171,13 +755,19 @@ bool mm_try_handle_page_fault(process_t *proc, uintptr_t far, uint64_t esr) {
     bool is_write = false;
     if (!is_exec) is_write = ((iss >> 6) & 1) != 0;
 
+    //Entries with AF clear are never cached, publishing the updated entry is enough
     if (ifsc >= 0x9 && ifsc <= 0xB) {
         if (!mmu_set_access_flag((uint64_t*)proc->mm.ttbr0, far)) return false;
-        mmu_flush_asid(proc->mm.asid);
+        mmu_sync_new_ptes();
+        proc->mm.fault_stats.access_faults++;
         return true;
     }
 
-    if (ifsc >= 0xD && ifsc <= 0xF) return false;
+    if (ifsc >= 0xD && ifsc <= 0xF) {
+        if (!is_write || !mm_break_cow(&proc->mm, far)) return false;
+        proc->mm.fault_stats.faults++;
+        return true;
+    }
     if (ifsc < 0x4 || ifsc > 0x7) return false;
 
     uintptr_t va_page = far & ~(PAGE_SIZE-1);
@@ -204,28 +794,33 @@ bool mm_try_handle_page_fault(process_t *proc, uintptr_t far, uint64_t esr) {
                     pfree((void*)dmap_pa_to_kva((paddr_t)pa), PAGE_SIZE);
                     if (proc->mm.rss_stack_pages) proc->mm.rss_stack_pages--;
                 }
+                mmu_flush_range(proc->mm.asid, page + PAGE_SIZE, proc->mm.stack_commit);
                 return false;
             }
             memset((void*)dmap_pa_to_kva(phys), 0, PAGE_SIZE);
             mmu_map_4kb((uint64_t*)proc->mm.ttbr0, page, phys, MAIR_IDX_NORMAL, m->prot | MEM_NORM, MEM_PRIV_USER);
             proc->mm.rss_stack_pages++;
+            proc->mm.fault_stats.pages++;
             if (page == 0) break;
         }
         proc->mm.stack_commit = grow_to;
-        mmu_flush_asid(proc->mm.asid);
+        mmu_sync_new_ptes();
+        proc->mm.fault_stats.faults++;
         return true;
     }
 
-    if (m->kind == VMA_KIND_ANON && proc->mm.rss_anon_pages >= proc->mm.cap_anon_pages) return false;
-
-    paddr_t phys = palloc_inner(PAGE_SIZE, MEM_PRIV_USER, MEM_RW, true, false);
-    if (!phys) return false;
-
-    if (m->kind != VMA_KIND_ANON || (m->flags & VMA_FLAG_ZERO)) memset((void*)dmap_pa_to_kva(phys), 0, PAGE_SIZE);
-    mmu_map_4kb((uint64_t*)proc->mm.ttbr0, va_page, phys, MAIR_IDX_NORMAL, m->prot | MEM_NORM, MEM_PRIV_USER);
-    mmu_flush_asid(proc->mm.asid);
-
-    if (m->kind == VMA_KIND_ANON) proc->mm.rss_anon_pages++;
-
+    uint64_t mapped = 0;
+    if (m->kind == VMA_KIND_ANON) {
+        mapped = mm_fault_large(&proc->mm, m, va_page);
+        if (!mapped) mapped = mm_fault_around(&proc->mm, m, va_page);
+        if (mapped) mm_try_promote(&proc->mm, m, va_page);
+    } else if (m->flags & VMA_FLAG_FILE) mapped = mm_fault_file(&proc->mm, m, va_page, is_write);
+    else mapped = mm_fault_map_one(&proc->mm, m, va_page) ? 1 : 0;
+    if (!mapped) return false;
+
+    mmu_sync_new_ptes();
+    proc->mm.fault_stats.faults++;
+    proc->mm.fault_stats.pages += mapped;
+    proc->mm.fault_stats.around_pages += mapped - 1;
     return true;
 }
@@ -4,44 +4,94 @@
 #include "memory/page_allocator.h"
 
 typedef struct process process_t;
+struct exec_image;
 
 #define VMA_FLAG_DEMAND 1
 #define VMA_FLAG_USERALLOC 2
 #define VMA_FLAG_ZERO 4
 #define VMA_FLAG_NOFREE 8
+#define VMA_FLAG_HEAP 16
+//Backed by the process executable image, see mm_add_file_vma
+#define VMA_FLAG_FILE 32
 #define VMA_KIND_ELF 1
 #define VMA_KIND_STACK 2
 #define VMA_KIND_ANON 3
 #define VMA_KIND_SPECIAL 4
 
-#define MAX_VMAS 128
 #define MM_GAP_PAGES 16
 
+//Small user allocations are carved from one heap arena instead of getting a VMA each
+#define MM_HEAP_MIN_OBJ 32
+#define MM_HEAP_MAX_OBJ 2048
+#define MM_HEAP_CLASSES 7
+#define MM_HEAP_GROW_PAGES 64
+
+//Anonymous faults map this many pages of the VMA around the faulting one
+#define MM_FAULT_AROUND_PAGES 16
+
+typedef struct mm_fault_stats {
+    uint64_t faults;
+    uint64_t access_faults;
+    uint64_t pages;
+    uint64_t around_pages;
+    uint64_t large_maps;
+    uint64_t promotions;
+    uint64_t file_pages;
+    uint64_t cow_copies;
+} mm_fault_stats;
+
+//VMAs never overlap, so a tree ordered by start answers point lookups like an interval tree
 typedef struct vma {
     uaddr_t start;
     uaddr_t end;
     uint8_t prot;
     uint8_t kind;
     uint8_t flags;
+    uint8_t height;
+    //File backed VMAs only: image offset of start, and where the file data ends and zero fill begins
+    uint64_t file_off;
+    uaddr_t file_end;
+    struct vma *left;
+    struct vma *right;
+    struct vma *prev;
+    struct vma *next;
 } vma;
 
-typedef struct mm_free_range {
+//Page indexes in the lists are stored plus one so zero can mean none
+typedef struct mm_heap_page {
+    uint8_t cls;
+    uint8_t pad;
+    uint16_t used;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t pad2;
+    uint64_t bits[2];
+} mm_heap_page;
+
+typedef struct mm_heap {
     uaddr_t start;
     uaddr_t end;
-} mm_free_range;
+    mm_heap_page *pages;
+    uint32_t page_cap;
+    uint32_t page_top;
+    uint32_t free_head;
+    uint32_t partial[MM_HEAP_CLASSES];
+    uint64_t objects;
+} mm_heap;
 
 typedef struct mm_struct {
     uintptr_t *ttbr0;
     paddr_t ttbr0_phys;
     uint16_t asid;
     uint32_t asid_gen;
-    vma vmas[MAX_VMAS];
-    uint16_t vma_count;
-    mm_free_range mmap_free[MAX_VMAS];
-    uint16_t mmap_free_count;
+    vma *vma_root;
+    vma *vma_head;
+    uint32_t vma_count;
+    mm_heap heap;
     uaddr_t mmap_bottom;
     uaddr_t mmap_top;
     uaddr_t mmap_cursor;
+    uint64_t mmap_hole_bytes;
     uaddr_t stack_top;
     uaddr_t stack_limit;
     uaddr_t stack_commit;
@@ -49,10 +99,31 @@ typedef struct mm_struct {
     uint64_t rss_anon_pages;
     uint64_t cap_stack_pages;
     uint64_t cap_anon_pages;
+    mm_fault_stats fault_stats;
+    struct exec_image *exec;
 } mm_struct;
 
 vma* mm_find_vma(mm_struct *mm, uaddr_t va);
 bool mm_add_vma(mm_struct *mm, uaddr_t start, uaddr_t end, uint8_t prot, uint8_t kind, uint8_t flags);
 bool mm_remove_vma(mm_struct *mm, uaddr_t start, uaddr_t end);
+//Maps [start, end) of mm->exec lazily: file_off is the image offset of start, past file_end pages read as zero
+bool mm_add_file_vma(mm_struct *mm, uaddr_t start, uaddr_t end, uint8_t prot, uint64_t file_off, uaddr_t file_end);
 uaddr_t mm_alloc_mmap(mm_struct *mm, size_t size, uint8_t prot, uint8_t kind, uint8_t flags);
-bool mm_try_handle_page_fault(process_t *proc, uintptr_t far, uint64_t esr);
\ No newline at end of file
+//Places the mapping so that base % align == phase, letting it share large page alignment with its physical backing
+uaddr_t mm_alloc_mmap_aligned(mm_struct *mm, size_t size, size_t align, uaddr_t phase, uint8_t prot, uint8_t kind, uint8_t flags);
+//Unmaps [start, end) and returns how many 4KB pages were mapped there. The caller invalidates the TLB
+uint64_t mm_unmap_range(mm_struct *mm, uaddr_t start, uaddr_t end, bool free_pages);
+uaddr_t mm_heap_alloc(mm_struct *mm, size_t size);
+bool mm_heap_free(mm_struct *mm, uaddr_t va);
+//Drops the VMA tree and heap bookkeeping, the pages must already be unmapped
+void mm_release(mm_struct *mm);
+//Builds the empty dst as a copy of src sharing every private page copy on write, dst holds its own exec reference.
+//On failure dst keeps what was cloned so far for the caller to tear down. The caller invalidates src's TLB
+bool mm_clone(mm_struct *dst, mm_struct *src);
+//Makes the page at va privately writable if it is still shared copy on write, false when there was nothing to do.
+//Kernel writes through the direct map don't fault, so they call this first
+bool mm_break_cow(mm_struct *mm, uaddr_t va);
+bool mm_try_handle_page_fault(process_t *proc, uintptr_t far, uint64_t esr);
+
+extern uint32_t mm_fault_around_pages;
+extern bool mm_large_pages;
\ No newline at end of file
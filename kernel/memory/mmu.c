@@ -107,6 +107,84 @@ void mmu_enable_verbose(){
         }\
     })
 
+static mmu_large_stats large_stats;
+
+static inline void mmu_count_large(uint64_t entry, bool block, int64_t delta) {
+    bool user = (entry & PTE_NG) != 0;
+    if (block) {
+        if (user) large_stats.user_2mb += delta;
+        else large_stats.kernel_2mb += delta;
+    } else {
+        if (user) large_stats.user_64kb += delta;
+        else large_stats.kernel_64kb += delta;
+    }
+}
+
+void mmu_get_large_stats(mmu_large_stats *out) {
+    if (out) *out = large_stats;
+}
+
+//By VA for every ASID, used where the walker doesn't know which address space it is in
+static inline void mmu_tlbi_va_all_asids(uint64_t va) {
+    uint64_t v = (va >> 12) & 0xFFFFFFFFFFFULL;
+    asm volatile("tlbi vaae1is, %0":: "r"(v) : "memory");
+}
+
+//Replaces a 2MB block with an equivalent page table. User blocks go invalid and get invalidated first
+static uint64_t* mmu_split_block(uint64_t *l2, uint64_t l2_index, uint64_t va) {
+    uint64_t old = l2[l2_index];
+    if ((old & 0b11) != PD_BLOCK){
+        kprintf("[MMU error] split expected block va=%llx l2=%llu e=%llx", (uint64_t)va, (uint64_t)l2_index, (uint64_t)old);
+        panic("mmu_split not a block", va);
+    }
+
+    uint64_t base = (old & PTE_ADDR_MASK) & ~(GRANULE_2MB - 1);
+    uint64_t *l3 = mmu_alloc();
+    uint64_t attr = (old & ~PTE_ADDR_MASK) & ~0b11;
+
+    for (uint64_t i = 0; i < PAGE_TABLE_ENTRIES; i++){
+        uint64_t p = base + (i * GRANULE_4KB);
+        l3[i] = (p & PTE_ADDR_MASK) | attr | PD_TABLE;
+    }
+
+    if (old & PTE_NG) {
+        l2[l2_index] = 0;
+        asm volatile("dsb ishst" ::: "memory");
+        mmu_tlbi_va_all_asids(va & ~(GRANULE_2MB - 1));
+        asm volatile("dsb ish\n\tisb" ::: "memory");
+    }
+
+    l2[l2_index] = (pt_va_to_pa(l3) & PTE_ADDR_MASK) | PD_TABLE;
+    mmu_count_large(old, true, -1);
+    large_stats.splits++;
+    return l3;
+}
+
+//Drops the contiguous hint from the run holding idx so one of its entries can change on its own
+static void mmu_break_contig(uint64_t *l3, uint64_t idx, uint64_t va) {
+    if (!(l3[idx] & PTE_CONT)) return;
+    uint64_t first = idx & ~(uint64_t)(MMU_CONT_ENTRIES - 1);
+    uint64_t base = (va & ~(GRANULE_64KB - 1));
+    uint64_t entry = l3[idx];
+
+    if (entry & PTE_NG) {
+        uint64_t saved[MMU_CONT_ENTRIES];
+        for (uint64_t i = 0; i < MMU_CONT_ENTRIES; i++) {
+            saved[i] = l3[first + i];
+            l3[first + i] = 0;
+        }
+        asm volatile("dsb ishst" ::: "memory");
+        for (uint64_t i = 0; i < MMU_CONT_ENTRIES; i++) mmu_tlbi_va_all_asids(base + (i * GRANULE_4KB));
+        asm volatile("dsb ish\n\tisb" ::: "memory");
+        for (uint64_t i = 0; i < MMU_CONT_ENTRIES; i++) l3[first + i] = saved[i] & ~PTE_CONT;
+    } else {
+        for (uint64_t i = 0; i < MMU_CONT_ENTRIES; i++) l3[first + i] &= ~PTE_CONT;
+    }
+
+    mmu_count_large(entry, false, -1);
+    large_stats.splits++;
+}
+
 void mmu_map_2mb(uint64_t *table, uint64_t va, uint64_t pa, uint64_t attr_index, uint8_t mem_attr, uint8_t level) {
     uint64_t l0_index = (va >> 39) & 0x1FF;
     uint64_t l1_index = (va >> 30) & 0x1FF;
@@ -128,6 +206,7 @@ void mmu_map_2mb(uint64_t *table, uint64_t va, uint64_t pa, uint64_t attr_index,
 
     if ((old & 1) == 0){
         l2[l2_index] = want;
+        mmu_count_large(want, true, 1);
         return;
     }
 
@@ -212,25 +291,7 @@ void mmu_map_4kb(uint64_t *table, uint64_t va, uint64_t pa, uint64_t attr_index,
 
         if (expected == pa &&old_attr == want_attr) return;
 
-        {
-            uint64_t old = l2[l2_index];
-            if ((old & 0b11) != PD_BLOCK){
-                kprintf("[MMU error] split expected block va=%llx l2=%llu e=%llx", (uint64_t)va, (uint64_t)l2_index, (uint64_t)old);
-                panic("mmu_split not a block", va);
-            }
-
-            uint64_t base2 = (old & PTE_ADDR_MASK) & ~(GRANULE_2MB - 1);
-            uint64_t* l3 = mmu_alloc();
-            uint64_t attr = (old & ~PTE_ADDR_MASK) & ~0b11;
-
-            for (uint64_t i = 0; i < PAGE_TABLE_ENTRIES; i++){
-                uint64_t p = base2 + (i * GRANULE_4KB);
-                l3[i] = (p & PTE_ADDR_MASK) | attr | PD_TABLE;
-            }
-
-            l2[l2_index] = (pt_va_to_pa(l3) & PTE_ADDR_MASK) | PD_TABLE;
-        }
-
+        mmu_split_block(l2, l2_index, va);
         l2_val = l2[l2_index];
     }
 
@@ -251,9 +312,14 @@ void mmu_map_4kb(uint64_t *table, uint64_t va, uint64_t pa, uint64_t attr_index,
         }
 
         if ((old & PTE_ADDR_MASK) == (want & PTE_ADDR_MASK)){
-            uint64_t diff = (old ^ want) & ~(PTE_ADDR_MASK | PTE_AF);
+            uint64_t diff = (old ^ want) & ~(PTE_ADDR_MASK | PTE_AF | PTE_CONT);
             if (diff == 0) return;
 
+            if (old & PTE_CONT) {
+                mmu_break_contig(l3, l3_index, va);
+                old = l3[l3_index];
+            }
+
             uint64_t rs = get_user_ram_start();
             uint64_t re = get_user_ram_end();
 
@@ -296,6 +362,235 @@ void mmu_map_4kb(uint64_t *table, uint64_t va, uint64_t pa, uint64_t attr_index,
     l3[l3_index] = want;
 }
 
+//Last level table for va, allocating the intermediate levels. Null when a block already covers it
+static uint64_t* mmu_walk_l3(uint64_t *table, uint64_t va, bool alloc) {
+    uint64_t l0_index = (va >> 39) & 0x1FF;
+    uint64_t l1_index = (va >> 30) & 0x1FF;
+    uint64_t l2_index = (va >> 21) & 0x1FF;
+
+    uint64_t *l1 = 0;
+    uint64_t *l2 = 0;
+    if (alloc) {
+        l1 = walk_or_alloc(table, l0_index, 0, va);
+        l2 = walk_or_alloc(l1, l1_index, 1, va);
+    } else {
+        uint64_t e0 = table[l0_index];
+        if ((e0 & 0b11) != PD_TABLE) return 0;
+        l1 = (uint64_t*)pt_pa_to_va(e0 & PTE_ADDR_MASK);
+        uint64_t e1 = l1[l1_index];
+        if ((e1 & 0b11) != PD_TABLE) return 0;
+        l2 = (uint64_t*)pt_pa_to_va(e1 & PTE_ADDR_MASK);
+    }
+
+    uint64_t e2 = l2[l2_index];
+    if (!(e2 & 1)) {
+        if (!alloc) return 0;
+        uint64_t *l3 = mmu_alloc();
+        l2[l2_index] = (pt_va_to_pa(l3) & PTE_ADDR_MASK) | PD_TABLE;
+        return l3;
+    }
+    if ((e2 & 0b11) != PD_TABLE) return 0;
+    return (uint64_t*)pt_pa_to_va(e2 & PTE_ADDR_MASK);
+}
+
+//Level 2 slot for va, or null when the tables above it are missing
+static uint64_t* mmu_walk_l2_slot(uint64_t *table, uint64_t va) {
+    uint64_t e0 = table[(va >> 39) & 0x1FF];
+    if ((e0 & 0b11) != PD_TABLE) return 0;
+    uint64_t *l1 = (uint64_t*)pt_pa_to_va(e0 & PTE_ADDR_MASK);
+    uint64_t e1 = l1[(va >> 30) & 0x1FF];
+    if ((e1 & 0b11) != PD_TABLE) return 0;
+    uint64_t *l2 = (uint64_t*)pt_pa_to_va(e1 & PTE_ADDR_MASK);
+    return &l2[(va >> 21) & 0x1FF];
+}
+
+//Maps 16 empty entries as one contiguous run, false leaves the table untouched so the caller can map 4KB pages
+bool mmu_map_64kb(uint64_t *table, uint64_t va, uint64_t pa, uint64_t attr_index, uint8_t mem_attributes, uint8_t level) {
+    if (!table) panic("mmu_map_64kb null root", va);
+    if ((va | pa) & (GRANULE_64KB - 1)) return false;
+
+    uint64_t *l3 = mmu_walk_l3(table, va, true);
+    if (!l3) return false;
+
+    uint64_t first = (va >> 12) & 0x1FF;
+    for (uint64_t i = 0; i < MMU_CONT_ENTRIES; i++)
+        if (l3[first + i] & 1) return false;
+
+    kprintfv("[MMU] Mapping 64kb memory %llx for EL%i = %llx", (uint64_t)va, (int)level, (uint64_t)pa);
+    uint64_t want = make_pte(pa, attr_index, mem_attributes, level, PD_TABLE) | PTE_CONT;
+    for (uint64_t i = 0; i < MMU_CONT_ENTRIES; i++) l3[first + i] = want + (i * GRANULE_4KB);
+    mmu_count_large(want, false, 1);
+    return true;
+}
+
+//Physically contiguous range with the largest granule the alignment of both addresses allows
+void mmu_map_range(uint64_t *table, uint64_t va, uint64_t pa, uint64_t size, uint64_t attr_index, uint8_t mem_attributes, uint8_t level) {
+    uint64_t end = va + size;
+    while (va < end) {
+        uint64_t left = end - va;
+        if (!((va | pa) & (GRANULE_2MB - 1)) && left >= GRANULE_2MB) {
+            uint64_t *slot = mmu_walk_l2_slot(table, va);
+            if (!slot || !(*slot & 1)) {
+                mmu_map_2mb(table, va, pa, attr_index, mem_attributes, level);
+                va += GRANULE_2MB;
+                pa += GRANULE_2MB;
+                continue;
+            }
+        }
+        if (!((va | pa) & (GRANULE_64KB - 1)) && left >= GRANULE_64KB && mmu_map_64kb(table, va, pa, attr_index, mem_attributes, level)) {
+            va += GRANULE_64KB;
+            pa += GRANULE_64KB;
+            continue;
+        }
+        mmu_map_4kb(table, va, pa, attr_index, mem_attributes, level);
+        va += GRANULE_4KB;
+        pa += GRANULE_4KB;
+    }
+}
+
+//Valid 4KB entries in the aligned 2MB or 64KB window holding va, a block counts as fully populated
+uint32_t mmu_populated(uint64_t *table, uint64_t va, uint64_t size, bool *is_block) {
+    if (is_block) *is_block = false;
+    if (!table) return 0;
+    va &= ~(size - 1);
+
+    uint64_t *slot = mmu_walk_l2_slot(table, va);
+    if (!slot || !(*slot & 1)) return 0;
+    if ((*slot & 0b11) == PD_BLOCK) {
+        if (is_block) *is_block = true;
+        return (uint32_t)(size / GRANULE_4KB);
+    }
+
+    uint64_t *l3 = (uint64_t*)pt_pa_to_va(*slot & PTE_ADDR_MASK);
+    uint64_t first = (va >> 12) & 0x1FF;
+    uint32_t count = 0;
+    for (uint64_t i = 0; i < size / GRANULE_4KB; i++)
+        if (l3[first + i] & 1) count++;
+    return count;
+}
+
+//Swaps a page table for a block at pa, the caller has copied the pages and frees them afterwards
+bool mmu_collapse_2mb(uint64_t *table, uint16_t asid, uint64_t va, uint64_t pa, uint64_t attr_index, uint8_t mem_attributes, uint8_t level) {
+    if (!table || ((va | pa) & (GRANULE_2MB - 1))) return false;
+    uint64_t *slot = mmu_walk_l2_slot(table, va);
+    if (!slot || (*slot & 0b11) != PD_TABLE) return false;
+
+    uint64_t *l3 = (uint64_t*)pt_pa_to_va(*slot & PTE_ADDR_MASK);
+    for (uint64_t i = 0; i < PAGE_TABLE_ENTRIES; i += MMU_CONT_ENTRIES)
+        if (l3[i] & PTE_CONT) mmu_count_large(l3[i], false, -1);
+
+    *slot = 0;
+    mmu_flush_asid(asid);
+    uint64_t want = make_pte(pa, attr_index, mem_attributes, level, PD_BLOCK);
+    *slot = want;
+    mmu_sync_new_ptes();
+
+    temp_free(l3, GRANULE_4KB);
+    mmu_count_large(want, true, 1);
+    large_stats.promotions++;
+    return true;
+}
+
+//Sets the contiguous hint on a full run of 16 entries that already map one aligned 64KB physical range
+bool mmu_try_contig_64kb(uint64_t *table, uint64_t va) {
+    if (!table) return false;
+    va &= ~(GRANULE_64KB - 1);
+    uint64_t *l3 = mmu_walk_l3(table, va, false);
+    if (!l3) return false;
+
+    uint64_t first = (va >> 12) & 0x1FF;
+    uint64_t e0 = l3[first];
+    if ((e0 & 0b11) != PD_TABLE || (e0 & PTE_CONT)) return false;
+    if ((e0 & PTE_ADDR_MASK) & (GRANULE_64KB - 1)) return false;
+    for (uint64_t i = 1; i < MMU_CONT_ENTRIES; i++)
+        if (l3[first + i] != e0 + (i * GRANULE_4KB)) return false;
+
+    for (uint64_t i = 0; i < MMU_CONT_ENTRIES; i++) l3[first + i] = 0;
+    asm volatile("dsb ishst" ::: "memory");
+    for (uint64_t i = 0; i < MMU_CONT_ENTRIES; i++) mmu_tlbi_va_all_asids(va + (i * GRANULE_4KB));
+    asm volatile("dsb ish\n\tisb" ::: "memory");
+    for (uint64_t i = 0; i < MMU_CONT_ENTRIES; i++) l3[first + i] = (e0 + (i * GRANULE_4KB)) | PTE_CONT;
+
+    mmu_count_large(e0, false, 1);
+    large_stats.promotions++;
+    return true;
+}
+
+//Drops a whole block mapping at a 2MB aligned va, false when va isn't mapped by a block
+bool mmu_unmap_2mb_and_get_pa(uint64_t *table, uint64_t va, uint64_t *pa) {
+    if (!table || (va & (GRANULE_2MB - 1))) return false;
+    uint64_t *slot = mmu_walk_l2_slot(table, va);
+    if (!slot || (*slot & 0b11) != PD_BLOCK) return false;
+
+    uint64_t old = *slot;
+    if (pa) *pa = (old & PTE_ADDR_MASK) & ~(GRANULE_2MB - 1);
+    *slot = 0;
+    mmu_count_large(old, true, -1);
+    return true;
+}
+
+uint64_t mmu_leaf_entry(uint64_t *table, uint64_t va) {
+    if (!table) return 0;
+    uint64_t *slot = mmu_walk_l2_slot(table, va);
+    if (!slot || !(*slot & 1)) return 0;
+    if ((*slot & 0b11) == PD_BLOCK) return *slot;
+    uint64_t *l3 = (uint64_t*)pt_pa_to_va(*slot & PTE_ADDR_MASK);
+    uint64_t e = l3[(va >> 12) & 0x1FF];
+    return (e & 1) ? e : 0;
+}
+
+//Copies the entries mapping [start, end) of src into the same, still empty, range of dst. With cow both sides
+//lose write access so whichever writes first faults and takes its own copy. Blocks and contiguous runs are
+//copied whole, share is told about every page or block now mapped twice. The caller invalidates src's TLB
+uint64_t mmu_share_range(uint64_t *dst, uint64_t *src, uint64_t start, uint64_t end, bool cow, mmu_share_fn share, void *ctx) {
+    if (!dst || !src) return 0;
+    uint64_t pages = 0;
+
+    for (uint64_t va = start & ~(GRANULE_4KB - 1); va < end;) {
+        uint64_t next = (va & ~(GRANULE_2MB - 1)) + GRANULE_2MB;
+        uint64_t *slot = mmu_walk_l2_slot(src, va);
+        if (!slot || !(*slot & 1)) {
+            va = next;
+            continue;
+        }
+
+        if ((*slot & 0b11) == PD_BLOCK) {
+            if (!(va & (GRANULE_2MB - 1)) && next <= end) {
+                if (cow) *slot |= PTE_AP_RO;
+                uint64_t *l1 = walk_or_alloc(dst, (va >> 39) & 0x1FF, 0, va);
+                uint64_t *l2 = walk_or_alloc(l1, (va >> 30) & 0x1FF, 1, va);
+                l2[(va >> 21) & 0x1FF] = *slot;
+                mmu_count_large(*slot, true, 1);
+                if (share) share((*slot & PTE_ADDR_MASK) & ~(GRANULE_2MB - 1), GRANULE_2MB, ctx);
+                pages += GRANULE_2MB / GRANULE_4KB;
+                va = next;
+                continue;
+            }
+            //Only part of the block is in range, that part is shared as pages
+            uint64_t *l2 = slot - ((va >> 21) & 0x1FF);
+            mmu_split_block(l2, (va >> 21) & 0x1FF, va);
+        }
+
+        uint64_t *l3 = (uint64_t*)pt_pa_to_va(*slot & PTE_ADDR_MASK);
+        uint64_t *dst_l3 = mmu_walk_l3(dst, va, true);
+        if (!dst_l3) panic("mmu_share_range block in destination", va);
+        uint64_t stop = next < end ? next : end;
+        for (; va < stop; va += GRANULE_4KB) {
+            uint64_t i = (va >> 12) & 0x1FF;
+            uint64_t e = l3[i];
+            if (!(e & 1)) continue;
+            if (cow) e |= PTE_AP_RO;
+            l3[i] = e;
+            dst_l3[i] = e;
+            if ((e & PTE_CONT) && !(i % MMU_CONT_ENTRIES)) mmu_count_large(e, false, 1);
+            if (share) share(e & PTE_ADDR_MASK, GRANULE_4KB, ctx);
+            pages++;
+        }
+        va = stop;
+    }
+    return pages;
+}
+
 static inline void mmu_flush_all() {
     asm volatile (
         "dsb ishst\n"        // Ensure all memory accesses complete
@@ -344,23 +639,7 @@ void mmu_unmap_table(uint64_t *table, uint64_t va, uint64_t pa){
     if (!(e2 & 1)) return;
 
     if ((e2 & 0b11) == PD_BLOCK) {
-        uint64_t old = l2[l2_index];
-        if ((old & 0b11) != PD_BLOCK){
-            kprintf("[MMU error] split expected block va=%llx l2=%llu e=%llx", (uint64_t)va, (uint64_t)l2_index, (uint64_t)old);
-            panic("mmu_split not a block", va);
-        }
-
-        uint64_t base = (old & PTE_ADDR_MASK) & ~(GRANULE_2MB - 1);
-        uint64_t *l3 = mmu_alloc();
-        uint64_t attr = (old & ~PTE_ADDR_MASK) & ~0b11;
-
-        for (uint64_t i = 0; i < PAGE_TABLE_ENTRIES; i++){
-            uint64_t p = base + (i * GRANULE_4KB);
-            l3[i] = (p & PTE_ADDR_MASK) | attr | PD_TABLE;
-        }
-
-        l2[l2_index] = (pt_va_to_pa(l3) & PTE_ADDR_MASK) | PD_TABLE;
-
+        mmu_split_block(l2, l2_index, va);
         e2 = l2[l2_index];
         if (!(e2 & 1)) panic("mmu_unmap split vanished", va);
     }
@@ -381,6 +660,7 @@ void mmu_unmap_table(uint64_t *table, uint64_t va, uint64_t pa){
         panic("mmu_unmap pa mismatch", va);
     }
 
+    mmu_break_contig(l3, l3_index, va);
     l3[l3_index] = 0;
 }
 
@@ -475,6 +755,9 @@ void mmu_init() {
             //mmu_map_2mb((uint64_t*)kernel_ttbr0, pa, pa, MAIR_IDX_NORMAL, MEM_RW | MEM_NORM, MEM_PRIV_KERNEL);
             mmu_map_2mb((uint64_t*)kernel_ttbr1, pa | HIGH_VA, pa, MAIR_IDX_NORMAL, MEM_RW | MEM_NORM, MEM_PRIV_KERNEL);
             pa += GRANULE_2MB;
+        } else if ((!(pa & (GRANULE_64KB - 1))) && (ram_end - pa) >= GRANULE_64KB && !(mmio_skip_end && pa + GRANULE_64KB > mmio_skip_start && pa < mmio_skip_end)
+            && mmu_map_64kb((uint64_t*)kernel_ttbr1, pa | HIGH_VA, pa, MAIR_IDX_NORMAL, MEM_RW | MEM_NORM, MEM_PRIV_KERNEL)){
+            pa += GRANULE_64KB;
         } else {
             //mmu_map_4kb((uint64_t*)kernel_ttbr0, pa, pa, MAIR_IDX_NORMAL, MEM_RW | MEM_NORM, MEM_PRIV_KERNEL);
             mmu_map_4kb((uint64_t*)kernel_ttbr1, pa | HIGH_VA, pa, MAIR_IDX_NORMAL, MEM_RW | MEM_NORM, MEM_PRIV_KERNEL);
@@ -573,8 +856,14 @@ void mmu_free_ttbr(uintptr_t *ttbr){
 
         uintptr_t e = f->table[f->i++];
         if (!(e & 1)) continue;
-        if (f->level == 3) continue;
-        if (f->level == 2 && ((e & 0b11) == PD_BLOCK)) continue;
+        if (f->level == 3) {
+            if ((e & PTE_CONT) && ((f->i - 1) % MMU_CONT_ENTRIES) == 0) mmu_count_large(e, false, -1);
+            continue;
+        }
+        if (f->level == 2 && ((e & 0b11) == PD_BLOCK)) {
+            mmu_count_large(e, true, -1);
+            continue;
+        }
         if ((e & 0b11) != PD_TABLE) continue;
 
         uintptr_t *child = (uintptr_t*)pt_pa_to_va(e & PTE_ADDR_MASK);
@@ -823,6 +1112,42 @@ void mmu_flush_asid(uint16_t asid) {
     asm volatile("dsb ish\n\tisb" ::: "memory");
 }
 
+//TLBI operands carry VA[55:12] in the low bits and the ASID in [63:48]
+static inline uint64_t mmu_tlbi_va_operand(uint16_t asid, uint64_t va) {
+    return ((uint64_t)(asid & asid_mask) << asid_shift) | ((va >> 12) & 0xFFFFFFFFFFFULL);
+}
+
+void mmu_flush_va(uint16_t asid, uint64_t va) {
+    uint64_t v = mmu_tlbi_va_operand(asid, va);
+    asm volatile("dsb ishst" ::: "memory");
+    asm volatile("tlbi vae1is, %0":: "r"(v) : "memory");
+    asm volatile("dsb ish\n\tisb" ::: "memory");
+}
+
+//Past a handful of pages one ASID wide invalidate is cheaper than walking the range
+#define MMU_FLUSH_RANGE_MAX_PAGES 64
+
+void mmu_flush_range(uint16_t asid, uint64_t start, uint64_t end) {
+    start &= ~(GRANULE_4KB - 1);
+    if (end <= start) return;
+    if ((end - start) / GRANULE_4KB > MMU_FLUSH_RANGE_MAX_PAGES) {
+        mmu_flush_asid(asid);
+        return;
+    }
+
+    asm volatile("dsb ishst" ::: "memory");
+    for (uint64_t va = start; va < end; va += GRANULE_4KB) {
+        uint64_t v = mmu_tlbi_va_operand(asid, va);
+        asm volatile("tlbi vae1is, %0":: "r"(v) : "memory");
+    }
+    asm volatile("dsb ish\n\tisb" ::: "memory");
+}
+
+//Invalid entries are never held in the TLB, so filling one only needs the store visible to the walker
+void mmu_sync_new_ptes() {
+    asm volatile("dsb ishst\n\tisb" ::: "memory");
+}
+
 void mmu_asid_ensure(mm_struct *mm) {
     if (!mm) return;
     if (!asid_max) return;
@@ -911,6 +1236,7 @@ bool mmu_unmap_and_get_pa(uint64_t *table, uint64_t va, uint64_t *pa) {
     if (!(l4_val & 1)) return false;
 
     if (pa) *pa = l4_val & PTE_ADDR_MASK;
+    mmu_break_contig(l3, l3_index, va);
     l3[l3_index] = 0;
     if (table == (uint64_t*)kernel_ttbr0 || table == (uint64_t*)kernel_ttbr1) return true;
 
@@ -5,6 +5,7 @@
 typedef struct mm_struct mm_struct;
 
 #define GRANULE_4KB 0x1000
+#define GRANULE_64KB 0x10000
 #define GRANULE_2MB 0x200000
 
 #define MMU_MAP_EXEC 0x01
@@ -14,6 +15,9 @@ typedef struct mm_struct mm_struct;
 #define PTE_UXN (1ULL << 54)
 #define PTE_AF (1ULL << 10)
 #define PTE_NG (1ULL << 11)
+#define PTE_CONT (1ULL << 52)
+//AP[2], read only at every exception level
+#define PTE_AP_RO (1ULL << 7)
 #define PTE_SH_SHIFT 8
 #define PTE_AP_SHIFT 6
 #define PTE_ATTR_SHIFT 2
@@ -22,6 +26,19 @@ typedef struct mm_struct mm_struct;
 #define PD_TABLE 0b11
 #define PD_BLOCK 0b01
 
+//16 aligned 4KB entries with the contiguous hint share one TLB entry
+#define MMU_CONT_ENTRIES 16
+
+//Live large mappings, user ones are the nG entries
+typedef struct mmu_large_stats {
+    uint64_t kernel_2mb;
+    uint64_t kernel_64kb;
+    uint64_t user_2mb;
+    uint64_t user_64kb;
+    uint64_t promotions;
+    uint64_t splits;
+} mmu_large_stats;
+
 uint64_t* mmu_alloc();
 void mmu_init();
 #ifdef __cplusplus
@@ -42,6 +59,18 @@ void register_device_memory_dmap(kaddr_t va);
 void register_device_memory_2mb(kaddr_t va, paddr_t pa);
 void register_proc_memory(uint64_t va, paddr_t pa, uint8_t attributes, uint8_t level);
 void mmu_map_4kb(uint64_t *table, uint64_t va, uint64_t pa, uint64_t attr_index, uint8_t mem_attributes, uint8_t level);
+void mmu_map_2mb(uint64_t *table, uint64_t va, uint64_t pa, uint64_t attr_index, uint8_t mem_attr, uint8_t level);
+bool mmu_map_64kb(uint64_t *table, uint64_t va, uint64_t pa, uint64_t attr_index, uint8_t mem_attributes, uint8_t level);
+void mmu_map_range(uint64_t *table, uint64_t va, uint64_t pa, uint64_t size, uint64_t attr_index, uint8_t mem_attributes, uint8_t level);
+uint32_t mmu_populated(uint64_t *table, uint64_t va, uint64_t size, bool *is_block);
+bool mmu_collapse_2mb(uint64_t *table, uint16_t asid, uint64_t va, uint64_t pa, uint64_t attr_index, uint8_t mem_attributes, uint8_t level);
+bool mmu_try_contig_64kb(uint64_t *table, uint64_t va);
+bool mmu_unmap_2mb_and_get_pa(uint64_t *table, uint64_t va, uint64_t *pa);
+//Block or page descriptor mapping va, 0 when nothing does
+uint64_t mmu_leaf_entry(uint64_t *table, uint64_t va);
+typedef void (*mmu_share_fn)(paddr_t pa, uint64_t size, void *ctx);
+uint64_t mmu_share_range(uint64_t *dst, uint64_t *src, uint64_t start, uint64_t end, bool cow, mmu_share_fn share, void *ctx);
+void mmu_get_large_stats(mmu_large_stats *out);
 void mmu_unmap_table(uint64_t *table, uint64_t va, uint64_t pa);
 void debug_mmu_address(uint64_t va);
 void mmu_enable_verbose();
@@ -49,6 +78,9 @@ void mmu_swap_ttbr(mm_struct *mm);
 void mmu_ttbr0_disable_user();
 void mmu_ttbr0_enable_user();
 void mmu_flush_asid(uint16_t asid);
+void mmu_flush_va(uint16_t asid, uint64_t va);
+void mmu_flush_range(uint16_t asid, uint64_t start, uint64_t end);
+void mmu_sync_new_ptes();
 void mmu_asid_ensure(mm_struct *mm);
 void mmu_asid_release(mm_struct *mm);
 bool mmu_unmap_and_get_pa(uint64_t *table, uint64_t va, uint64_t *pa);
@@ -8,6 +8,10 @@
 #include "sysregs.h"
 #include "memory/addr.h"
 #include "exceptions/exception_handler.h"
+#include "memory/slab.h"
+#include "exceptions/irq.h"
+#include "process/scheduler.h"
+#include "std/string.h"
 
 #define PD_TABLE 0b11
 #define PD_BLOCK 0b01
@@ -27,24 +31,36 @@ typedef struct {
     uint32_t alloc_size;
 } alloc_tag;
 
-typedef struct {
+typedef struct big_alloc_entry {
     uint64_t phys_base;
     uint64_t size;
     uint64_t owner_phys;
+    struct big_alloc_entry *next;
+    struct big_alloc_entry *owner_next;
+    struct big_alloc_entry *owner_prev;
 } big_alloc_entry;
 
-#define BIG_ALLOC_ENTRIES ((PAGE_SIZE - 16) / sizeof(big_alloc_entry))
-
-typedef struct big_alloc_page {
-    struct big_alloc_page* next;
-    uint32_t count;
-    uint32_t pad;
-    big_alloc_entry entries[BIG_ALLOC_ENTRIES];
-} big_alloc_page;
+#define BIG_ALLOC_BUCKETS 512
 
 
 uintptr_t *mem_bitmap;
-static big_alloc_page* big_alloc_meta = 0;
+//One bit per bitmap word: full_map when the word has no free page, empty_map when it has no used page.
+//The top maps summarize 64 summary bits each, so searches skip 4096 pages per bit
+static uint64_t *full_map;
+static uint64_t *empty_map;
+static uint64_t *full_top;
+static uint64_t *empty_top;
+static uint64_t bitmap_words = 0;
+static uint64_t summary_words = 0;
+static uint64_t top_words = 0;
+//Extra mappings of each page besides its owner, pages shared copy on write across address spaces.
+//Like the bitmap, they are only changed with interrupts disabled
+static uint16_t *page_refs;
+static uint64_t page_shared_pages = 0;
+static uint64_t ram_first_page = 0;
+static big_alloc_entry* big_alloc_by_base[BIG_ALLOC_BUCKETS];
+static big_alloc_entry* big_alloc_by_owner[BIG_ALLOC_BUCKETS];
+static big_alloc_entry* big_alloc_free_entries = 0;
 
 static uint64_t alloc_min_page = 0;
 static uint64_t alloc_max_page = 0;
@@ -54,8 +70,13 @@ static uint64_t bitmap_page_count = 0;
 static bool page_alloc_verbose = false;
 static bool page_alloc_high_va = false;
 
+#define PAGE_SHRINKERS_MAX 8
+static page_shrink_fn page_shrinkers[PAGE_SHRINKERS_MAX];
+static uint32_t page_shrinker_count = 0;
+
 extern uintptr_t heap_end;
 static void page_alloc_init();
+static void bitmap_layout();
 
 void page_alloc_enable_verbose(){
     page_alloc_verbose = true;
@@ -69,6 +90,7 @@ void page_alloc_enable_high_va(){
     if (page_alloc_high_va) return;
     mem_bitmap = (uintptr_t*)PHYS_TO_VIRT((uintptr_t)mem_bitmap);
     page_alloc_high_va = true;
+    bitmap_layout();
 }
 
 #define kprintfv(fmt, ...) \
@@ -88,6 +110,86 @@ static inline uint64_t lowmask64(uint64_t bits) {
     return (1ull << bits) - 1ull;
 }
 
+static void bitmap_layout(){
+    full_map = (uint64_t*)mem_bitmap + bitmap_words;
+    empty_map = full_map + summary_words;
+    full_top = empty_map + summary_words;
+    empty_top = full_top + top_words;
+    page_refs = (uint16_t*)(empty_top + top_words);
+}
+
+static void bitmap_sync(uint64_t word){
+    uint64_t v = mem_bitmap[word];
+    uint64_t g = word / 64;
+    uint64_t b = 1ULL << (word % 64);
+    if (v == UINT64_MAX) full_map[g] |= b;
+    else full_map[g] &= ~b;
+    if (!v) empty_map[g] |= b;
+    else empty_map[g] &= ~b;
+
+    uint64_t t = g / 64;
+    uint64_t tb = 1ULL << (g % 64);
+    if (full_map[g] == UINT64_MAX) full_top[t] |= tb;
+    else full_top[t] &= ~tb;
+    if (empty_map[g]) empty_top[t] |= tb;
+    else empty_top[t] &= ~tb;
+}
+
+static void bitmap_set_range(uint64_t page, uint64_t count, bool used){
+    while (count){
+        uint64_t word = page / 64;
+        uint64_t bit = page % 64;
+        uint64_t n = min(count, 64 - bit);
+        uint64_t mask = lowmask64(n) << bit;
+        if (used) mem_bitmap[word] |= mask;
+        else mem_bitmap[word] &= ~mask;
+        bitmap_sync(word);
+        page += n;
+        count -= n;
+    }
+}
+
+//First word in [from, end) that has a free page, or that is entirely free when need_empty is set
+static uint64_t bitmap_next_word(uint64_t from, uint64_t end, bool need_empty){
+    while (from < end){
+        uint64_t g = from / 64;
+        uint64_t bits = (need_empty ? empty_map[g] : ~full_map[g]) & ~lowmask64(from % 64);
+        if (bits){
+            uint64_t word = (g * 64) + __builtin_ctzll(bits);
+            return word < end ? word : end;
+        }
+        g++;
+        while (g * 64 < end){
+            uint64_t t = g / 64;
+            uint64_t tbits = (need_empty ? empty_top[t] : ~full_top[t]) & ~lowmask64(g % 64);
+            if (tbits){
+                g = (t * 64) + __builtin_ctzll(tbits);
+                break;
+            }
+            g = (t + 1) * 64;
+        }
+        from = g * 64;
+    }
+    return end;
+}
+
+//First free run of count pages in the word starting on a multiple of align
+static int64_t bitmap_word_run(uint64_t v, uint64_t count, uint64_t align){
+    uint64_t bit = 0;
+    while (bit + count <= 64){
+        uint64_t rest = v >> bit;
+        if (rest & 1){
+            bit += __builtin_ctzll(~rest);
+            continue;
+        }
+        uint64_t run = rest ? __builtin_ctzll(rest) : 64 - bit;
+        uint64_t start = (bit + align - 1) & ~(align - 1);
+        if (start + count <= bit + run) return start;
+        bit += run;
+    }
+    return -1;
+}
+
 void pfree(void* ptr, uint64_t size) {
     if (!ptr || !size) return;
     if (!alloc_max_page) page_alloc_init();
@@ -99,15 +201,100 @@ void pfree(void* ptr, uint64_t size) {
     addr /= PAGE_SIZE;
     if (addr < alloc_min_page || addr + pages > alloc_max_page) panic("pfree out of range", (uintptr_t)ptr);
 
-    for (uint64_t i = 0; i < pages; i++){
-        uint64_t index = addr + i;
-        uint64_t table_index = index/64;
-        uint64_t table_offset = index % 64;
-        mem_bitmap[table_index] &= ~(1ULL << table_offset);
-    }
+    irq_flags_t irq = irq_save_disable();
+    if (page_shared_pages) {
+        //A page some other address space still maps loses one reference and stays allocated
+        uint64_t run = addr;
+        for (uint64_t p = addr; p < addr + pages; p++) {
+            uint16_t *ref = &page_refs[p - ram_first_page];
+            if (!*ref) continue;
+            if (!--*ref) page_shared_pages--;
+            bitmap_set_range(run, p - run, false);
+            run = p + 1;
+        }
+        bitmap_set_range(run, addr + pages - run, false);
+    } else bitmap_set_range(addr, pages, false);
 
     if (addr < alloc_hint_page) alloc_hint_page = addr;
     if (alloc_hint_page < alloc_min_page) alloc_hint_page = alloc_min_page;
+    irq_restore(irq);
+}
+
+static inline uint32_t big_alloc_hash(uint64_t phys){
+    return (uint32_t)(((phys >> 12) * 0x9E3779B97F4A7C15ULL) >> 55) % BIG_ALLOC_BUCKETS;
+}
+
+static void big_alloc_insert(uint64_t phys_base, uint64_t size, uint64_t owner_phys){
+    if (!big_alloc_free_entries){
+        paddr_t meta_phys = palloc_inner(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, true, true);
+        if (!meta_phys) panic("kalloc no metadata page", size);
+        big_alloc_entry *meta = (big_alloc_entry*)dmap_pa_to_kva(meta_phys);
+        for (uint32_t i = 0; i < PAGE_SIZE / sizeof(big_alloc_entry); i++){
+            meta[i].next = big_alloc_free_entries;
+            big_alloc_free_entries = &meta[i];
+        }
+    }
+    big_alloc_entry *e = big_alloc_free_entries;
+    big_alloc_free_entries = e->next;
+
+    e->phys_base = phys_base;
+    e->size = size;
+    e->owner_phys = owner_phys;
+    uint32_t b = big_alloc_hash(phys_base);
+    e->next = big_alloc_by_base[b];
+    big_alloc_by_base[b] = e;
+    uint32_t o = big_alloc_hash(owner_phys);
+    e->owner_prev = 0;
+    e->owner_next = big_alloc_by_owner[o];
+    if (e->owner_next) e->owner_next->owner_prev = e;
+    big_alloc_by_owner[o] = e;
+}
+
+static void big_alloc_remove(big_alloc_entry *e){
+    big_alloc_entry **slot = &big_alloc_by_base[big_alloc_hash(e->phys_base)];
+    while (*slot && *slot != e) slot = &(*slot)->next;
+    if (*slot) *slot = e->next;
+    if (e->owner_prev) e->owner_prev->owner_next = e->owner_next;
+    else big_alloc_by_owner[big_alloc_hash(e->owner_phys)] = e->owner_next;
+    if (e->owner_next) e->owner_next->owner_prev = e->owner_prev;
+    e->next = big_alloc_free_entries;
+    big_alloc_free_entries = e;
+}
+
+static big_alloc_entry* big_alloc_find(uint64_t phys_base){
+    for (big_alloc_entry *e = big_alloc_by_base[big_alloc_hash(phys_base)]; e; e = e->next)
+        if (e->phys_base == phys_base) return e;
+    return 0;
+}
+
+uint32_t kalloc_census(kalloc_owner_usage *out, uint32_t max){
+    if (!out || !max) return 0;
+    uint32_t count = 0;
+    irq_flags_t irq = irq_save_disable();
+    for (uint32_t b = 0; b < BIG_ALLOC_BUCKETS; b++){
+        for (big_alloc_entry *e = big_alloc_by_owner[b]; e; e = e->owner_next){
+            uint32_t i = 0;
+            while (i < count && out[i].owner != e->owner_phys) i++;
+            if (i == count){
+                if (count == max){
+                    if (out[count - 1].bytes >= e->size) continue;
+                    i = count - 1;
+                } else count++;
+                out[i] = (kalloc_owner_usage){ .owner = e->owner_phys };
+            }
+            out[i].allocations++;
+            out[i].bytes += e->size;
+            if (e->size > out[i].largest) out[i].largest = e->size;
+            while (i && out[i].bytes > out[i - 1].bytes){
+                kalloc_owner_usage tmp = out[i];
+                out[i] = out[i - 1];
+                out[i - 1] = tmp;
+                i--;
+            }
+        }
+    }
+    irq_restore(irq);
+    return count;
 }
 
 void free_managed_page(void* ptr){
@@ -117,23 +304,16 @@ void free_managed_page(void* ptr){
     if ((owner_phys & HIGH_VA) == HIGH_VA) owner_phys = VIRT_TO_PHYS(owner_phys);
     owner_phys &= ~0xFFFULL;
 
-    big_alloc_page* mp = big_alloc_meta;
-    while (mp){
-        for (uint32_t i = 0; i < mp->count;){
-            if (mp->entries[i].owner_phys != owner_phys){
-                i++;
-                continue;
-            } 
-
-            uint64_t phys_base = mp->entries[i].phys_base;
-            uint64_t size = mp->entries[i].size;
-
-            mp->count--;
-            mp->entries[i] = mp->entries[mp->count];
-
+    big_alloc_entry *e = big_alloc_by_owner[big_alloc_hash(owner_phys)];
+    while (e){
+        big_alloc_entry *next = e->owner_next;
+        if (e->owner_phys == owner_phys){
+            uint64_t phys_base = e->phys_base;
+            uint64_t size = e->size;
+            big_alloc_remove(e);
             pfree(PHYS_TO_VIRT_P((void*)phys_base), size);
         }
-        mp = mp->next;
+        e = next;
     }
 
     mem_page *info = (mem_page*)ptr;
@@ -149,7 +329,12 @@ static void page_alloc_init(){
     uint64_t end_page = ram_end / PAGE_SIZE;
 
     uint64_t words = (end_page + 63) /64;
-    uint64_t bytes = words * sizeof(uint64_t);
+    bitmap_words = words;
+    summary_words = (words + 63) / 64;
+    top_words = (summary_words + 63) / 64;
+    ram_first_page = start_page;
+    uint64_t ref_words = ((end_page - start_page) * sizeof(uint16_t) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    uint64_t bytes = (words + (summary_words * 2) + (top_words * 2) + ref_words) * sizeof(uint64_t);
     bitmap_page_count = count_pages(bytes, PAGE_SIZE);
 
     uint64_t sctlr = 0;
@@ -162,11 +347,14 @@ static void page_alloc_init(){
         page_alloc_high_va = false;
     }
     memset(mem_bitmap, 0, bitmap_page_count * PAGE_SIZE);
+    bitmap_layout();
 
     if (end_page & 63) {
         uint64_t tail = end_page & 63;
         mem_bitmap[words - 1] |= ~lowmask64(tail);
     }
+    if (words & 63) full_map[summary_words - 1] |= ~lowmask64(words & 63);
+    for (uint64_t i = 0; i < words; i++) bitmap_sync(i);
 
     alloc_min_page = start_page + bitmap_page_count;
     alloc_max_page = end_page;
@@ -174,6 +362,7 @@ static void page_alloc_init(){
 
     heap_end = alloc_min_page * PAGE_SIZE;
     mark_used(ram_start, bitmap_page_count);
+    procfs_register("pages", page_alloc_proc_stats);
 }
 
 void setup_page(uintptr_t address, uint8_t attributes){
@@ -185,13 +374,34 @@ void setup_page(uintptr_t address, uint8_t attributes){
     new_info->attributes = attributes;
 }
 
-paddr_t palloc_inner(uint64_t size, uint8_t level, uint8_t attributes, bool full, bool map) {
-    if (!alloc_max_page) page_alloc_init();
-    if (!page_alloc_high_va) page_alloc_enable_high_va();
-    uint64_t page_count = count_pages(size,PAGE_SIZE);
+static void palloc_map_pages(uint64_t first_page, uint64_t page_count, uint8_t level, uint8_t attributes, bool full){
+    mem_page* prev_page = 0;
+    for (uint64_t p = 0; p < page_count; p++){
+        uintptr_t address = (first_page + p) * PAGE_SIZE;
+        if ((attributes & MEM_DEV) != 0 && level == MEM_PRIV_KERNEL)
+            register_device_memory(address, address);
+        else if (level != MEM_PRIV_USER)
+            register_proc_memory(address, address, attributes, level);
+        if (!full){
+            setup_page(address, attributes);
+
+            mem_page* curr = (mem_page*)PHYS_TO_VIRT(address);
+            if (prev_page) prev_page->next = curr;
+            prev_page = curr;
+
+            memset((void*)PHYS_TO_VIRT(address + sizeof(mem_page)), 0, PAGE_SIZE - sizeof(mem_page));
+        } else {
+            memset((void*)PHYS_TO_VIRT(address), 0, PAGE_SIZE);
+        }
+    }
+}
+
+//Finds a free run for page_count pages, interrupts must be disabled
+static bool palloc_find_run(uint64_t size, uint64_t page_count, uint64_t *first_page){
     uint64_t reg_min = alloc_min_page / 64;
     uint64_t reg_end = (alloc_max_page + 63) / 64;
     uint64_t reg_hint = alloc_hint_page / 64;
+    bool found = false;
 
     if (page_count > 64){
         kprintfv("[page_alloc] Large allocation > 64p");
@@ -201,121 +411,92 @@ paddr_t palloc_inner(uint64_t size, uint8_t level, uint8_t attributes, bool full
         uint64_t align_regs = 1;
         if (size >= GRANULE_2MB && (size & (GRANULE_2MB - 1)) == 0) align_regs = GRANULE_2MB / (PAGE_SIZE * 64);
 
-        for (int pass = 0; pass < 2; pass++) {
-        uint64_t i0 = pass == 0 ? reg_hint : reg_min;
-        uint64_t i1 = pass == 0 ? reg_end : reg_hint;
-        for (uint64_t i = i0; i + reg_count <= i1; i++) {
-            if (align_regs > 1 && (i % align_regs) != 0) continue;
-            bool found = true;
-            for (uint64_t j = 0; j < reg_count; j++){
-                if (fractional && j == reg_count-1)
-                    found &= (mem_bitmap[i + j] & lowmask64(fractional)) == 0;
-                else
-                    found &= mem_bitmap[i + j] == 0;
-                
-                if (!found) break;
-            }
-            if (found){
-                for (uint64_t j = 0; j < reg_count; j++){
-                    if (fractional && j == reg_count-1)
-                        mem_bitmap[i+j] |= lowmask64(fractional);
-                    else
-                        mem_bitmap[i+j] = UINT64_MAX;
+        for (int pass = 0; pass < 2 && !found; pass++) {
+            uint64_t i0 = pass == 0 ? reg_hint : reg_min;
+            uint64_t i1 = pass == 0 ? reg_end : reg_hint;
+            uint64_t i = bitmap_next_word(i0, i1, true);
+            while (i + reg_count <= i1) {
+                if (i % align_regs){
+                    i = bitmap_next_word(i + align_regs - (i % align_regs), i1, true);
+                    continue;
                 }
-
-                alloc_hint_page = (i * 64) + page_count;
-                if (alloc_hint_page < alloc_min_page) alloc_hint_page = alloc_min_page;
-                mem_page* prev_page = 0;
-                for (uint32_t p = 0; p < page_count; p++){
-                    uintptr_t address = ((i * 64) + p) * PAGE_SIZE;
-                    if (map){
-                        if ((attributes & MEM_DEV) != 0 && level == MEM_PRIV_KERNEL)
-                            register_device_memory(address, address);
-                        else if (level != MEM_PRIV_USER)
-                            register_proc_memory(address, address, attributes, level);
-                        if (!full){
-                            setup_page(address, attributes);
-
-                            mem_page* curr = (mem_page*)PHYS_TO_VIRT(address);
-                            if (prev_page) prev_page->next = curr;
-                            prev_page = curr;
-
-                            memset((void*)PHYS_TO_VIRT(address +sizeof(mem_page)), 0, PAGE_SIZE - sizeof(mem_page));
-                        } else {
-                            memset((void*)PHYS_TO_VIRT(address), 0, PAGE_SIZE);
-                        }
-                    }
+                uint64_t j = 0;
+                for (; j < reg_count; j++){
+                    if (fractional && j == reg_count-1){
+                        if (mem_bitmap[i + j] & lowmask64(fractional)) break;
+                    } else if (mem_bitmap[i + j]) break;
                 }
-                kprintfv("[page_alloc] Final address %x", (i * 64 * PAGE_SIZE));
-                return (paddr_t)(i * 64 * PAGE_SIZE);
+                if (j == reg_count){
+                    *first_page = i * 64;
+                    found = true;
+                    break;
+                }
+                i = bitmap_next_word(i + j + 1, i1, true);
             }
         }
+    } else {
+        bool need_empty = page_count == 64;
+        //64KB requests are naturally aligned so they can be mapped as one contiguous run
+        uint64_t align_pages = size == GRANULE_64KB ? GRANULE_64KB / PAGE_SIZE : 1;
+        for (int pass = 0; pass < 2 && !found; pass++) {
+            uint64_t i0 = pass == 0 ? reg_hint : reg_min;
+            uint64_t i1 = pass == 0 ? reg_end : reg_hint;
+            for (uint64_t i = bitmap_next_word(i0, i1, need_empty); i < i1; i = bitmap_next_word(i + 1, i1, need_empty)) {
+                int64_t bit = bitmap_word_run(mem_bitmap[i], page_count, align_pages);
+                if (bit < 0) continue;
+                *first_page = (i * 64) + bit;
+                found = true;
+                break;
+            }
         }
-        return 0;
     }
 
-    for (int pass = 0; pass < 2; pass++) {
-        uint64_t i0 = pass == 0 ? reg_hint : reg_min;
-        uint64_t i1 = pass == 0 ? reg_end : reg_hint;
+    return found;
+}
 
-        for (uint64_t i = i0; i < i1; i++) {
-            if (mem_bitmap[i] == UINT64_MAX) continue;
+//Asks the registered caches to give pages back, returns how many they freed
+static uint64_t palloc_shrink(uint64_t pages){
+    uint64_t freed = 0;
+    for (uint32_t i = 0; i < page_shrinker_count && freed < pages; i++)
+        freed += page_shrinkers[i](pages - freed);
+    return freed;
+}
 
-            uint64_t inv = ~mem_bitmap[i];
-            uint64_t bit = __builtin_ctzll(inv);
-            if (bit > (64 - page_count)){ 
-                continue;
-            }
-            while (bit < 64) {
-                bool found = true;
-                for (uint64_t b = bit; b < bit + page_count; b++){
-                    if ((mem_bitmap[i] >> b) & 1ull){
-                        bit = b + 1;
-                        found = false;
-                        break;
-                    }
-                }
-                if (found) break;
-            }
-            if (bit >= 64) continue;
-            uintptr_t first_address = 0;
-            mem_page* prev_page = 0;
-
-            for (uint64_t j = 0; j < page_count; j++){
-                mem_bitmap[i] |= (1ULL << (bit + j));
-                uint64_t page_index = (i * 64) + (bit + j);
-                uintptr_t address = page_index * PAGE_SIZE;
-                if (!first_address) first_address = address;
-
-                if (map){
-                    if ((attributes & MEM_DEV) != 0 && level == MEM_PRIV_KERNEL)
-                        register_device_memory(address, address);
-                    else if (level != MEM_PRIV_USER)
-                        register_proc_memory(address, address, attributes, level);
-
-                    if (!full) {
-                        setup_page(address, attributes);
-                        mem_page* curr = (mem_page*)PHYS_TO_VIRT(address);
-                        if (prev_page) prev_page->next = curr;
-                        prev_page = curr;
-
-                        memset((void*)PHYS_TO_VIRT(address + sizeof(mem_page)), 0, PAGE_SIZE - sizeof(mem_page));
-                    } else {
-                        memset((void*)PHYS_TO_VIRT(address), 0, PAGE_SIZE);
-                    }
-                }
-            }
+void page_alloc_register_shrinker(page_shrink_fn fn){
+    irq_flags_t irq = irq_save_disable();
+    if (fn && page_shrinker_count < PAGE_SHRINKERS_MAX) page_shrinkers[page_shrinker_count++] = fn;
+    irq_restore(irq);
+}
 
-            alloc_hint_page = (first_address / PAGE_SIZE) + page_count;
-            if (alloc_hint_page < alloc_min_page) alloc_hint_page = alloc_min_page;
+paddr_t palloc_inner(uint64_t size, uint8_t level, uint8_t attributes, bool full, bool map) {
+    if (!alloc_max_page) page_alloc_init();
+    if (!page_alloc_high_va) page_alloc_enable_high_va();
+    uint64_t page_count = count_pages(size,PAGE_SIZE);
+    uint64_t first_page = 0;
+    irq_flags_t irq = irq_save_disable();
+    bool found = palloc_find_run(size, page_count, &first_page);
+    if (!found){
+        irq_restore(irq);
+        bool shrunk = palloc_shrink(page_count) != 0;
+        irq = irq_save_disable();
+        if (shrunk) found = palloc_find_run(size, page_count, &first_page);
+    }
 
-            kprintfv("[page_alloc] Final address %x", first_address);
-            return (paddr_t)first_address;
-        } 
+    if (!found){
+        irq_restore(irq);
+        uart_puts("[page_alloc error] Could not allocate");
+        return 0;
     }
 
-    uart_puts("[page_alloc error] Could not allocate");
-    return 0;
+    bitmap_set_range(first_page, page_count, true);
+    alloc_hint_page = first_page + page_count;
+    if (alloc_hint_page < alloc_min_page) alloc_hint_page = alloc_min_page;
+    irq_restore(irq);
+
+    if (map) palloc_map_pages(first_page, page_count, level, attributes, full);
+
+    kprintfv("[page_alloc] Final address %x", first_page * PAGE_SIZE);
+    return (paddr_t)(first_page * PAGE_SIZE);
 }
 
 void* palloc(uint64_t size, uint8_t level, uint8_t attributes, bool full){
@@ -324,6 +505,62 @@ void* palloc(uint64_t size, uint8_t level, uint8_t attributes, bool full){
     return (void*)dmap_pa_to_kva(phys);
 }
 
+static void report_free_run(page_alloc_report *out, uint64_t start, uint64_t length){
+    if (!length) return;
+    out->free_pages += length;
+    if (length > out->largest_free_run) out->largest_free_run = length;
+    uint64_t end = start + length;
+    while (start < end){
+        uint64_t order = start ? __builtin_ctzll(start) : PAGE_ORDERS - 1;
+        while (order && (1ULL << order) > end - start) order--;
+        if (order >= PAGE_ORDERS) order = PAGE_ORDERS - 1;
+        out->free_blocks[order]++;
+        start += 1ULL << order;
+    }
+}
+
+void page_alloc_get_report(page_alloc_report *out){
+    if (!out) return;
+    memset(out, 0, sizeof(page_alloc_report));
+    if (!mem_bitmap || !alloc_max_page) return;
+    out->total_pages = alloc_max_page - alloc_min_page;
+    uint64_t run_start = 0, run = 0;
+    for (uint64_t page = alloc_min_page; page < alloc_max_page;){
+        uint64_t v = mem_bitmap[page / 64];
+        if (!(page % 64) && page + 64 <= alloc_max_page && (v == 0 || v == UINT64_MAX)){
+            if (v){
+                report_free_run(out, run_start, run);
+                run = 0;
+            } else {
+                if (!run) run_start = page;
+                run += 64;
+            }
+            page += 64;
+            continue;
+        }
+        if ((v >> (page % 64)) & 1){
+            report_free_run(out, run_start, run);
+            run = 0;
+        } else {
+            if (!run) run_start = page;
+            run++;
+        }
+        page++;
+    }
+    report_free_run(out, run_start, run);
+}
+
+static size_t page_alloc_proc_stats(char *buf, size_t size){
+    page_alloc_report report;
+    page_alloc_get_report(&report);
+    uint64_t frag = report.free_pages ? 100 - ((report.largest_free_run * 100) / report.free_pages) : 0;
+    size_t len = string_format_buf(buf, size, "pages %llu\nfree %llu\nshared %llu\nlargest free run %llu\nfragmentation %llu%%\nfree blocks by order:", report.total_pages, report.free_pages, page_shared_pages, report.largest_free_run, frag);
+    for (uint32_t i = 0; i < PAGE_ORDERS && len < size; i++)
+        len += string_format_buf(buf + len, size - len, " %llu", report.free_blocks[i]);
+    if (len < size) len += string_format_buf(buf + len, size - len, "\n");
+    return len;
+}
+
 bool page_used(uintptr_t ptr){
     if (!page_alloc_high_va) page_alloc_enable_high_va();
     if (!mem_bitmap || !alloc_max_page) return false;
@@ -334,6 +571,32 @@ bool page_used(uintptr_t ptr){
     return (mem_bitmap[table_index] >> table_offset) & 1;
 }
 
+static uint16_t* page_ref_slot(paddr_t pa){
+    if (!page_refs || !alloc_max_page) return 0;
+    uint64_t page = pa / PAGE_SIZE;
+    if (page < alloc_min_page || page >= alloc_max_page) return 0;
+    return &page_refs[page - ram_first_page];
+}
+
+void page_ref_get(paddr_t pa){
+    uint16_t *ref = page_ref_slot(pa);
+    if (!ref) panic("page_ref_get out of range", pa);
+    irq_flags_t irq = irq_save_disable();
+    if (*ref == UINT16_MAX) panic("page_ref_get overflow", pa);
+    if (!(*ref)++) page_shared_pages++;
+    irq_restore(irq);
+}
+
+uint32_t page_ref_count(paddr_t pa){
+    uint16_t *ref = page_ref_slot(pa);
+    if (!ref) return 1;
+    return (uint32_t)*ref + 1;
+}
+
+uint64_t page_shared_count(){
+    return page_shared_pages;
+}
+
 void mark_used(uintptr_t address, size_t pages)
 {
     if (!page_alloc_high_va) page_alloc_enable_high_va();
@@ -346,13 +609,9 @@ void mark_used(uintptr_t address, size_t pages)
     if (pages == 0) return;
 
     uint64_t page_index = address / PAGE_SIZE;
-    for (size_t j = 0; j < pages; j++) {
-        uint64_t idx = page_index + j;
-        uint64_t i = idx / 64;
-        uint64_t bit  = idx % 64;
-
-        mem_bitmap[i] |= (1ULL << bit);
-    }
+    if (page_index >= bitmap_words * 64) return;
+    if (page_index + pages > bitmap_words * 64) pages = (bitmap_words * 64) - page_index;
+    bitmap_set_range(page_index, pages, true);
 }
 void* kalloc_inner(void *page, size_t size, uint16_t alignment, uint8_t level, uintptr_t page_va, uintptr_t *next_va, uintptr_t *ttbr){
     if (!page) return 0;
@@ -396,22 +655,7 @@ void* kalloc_inner(void *page, size_t size, uint16_t alignment, uint8_t level, u
 
         uintptr_t phys_base = VIRT_TO_PHYS((uintptr_t)ptr);
 
-        big_alloc_page* mp = big_alloc_meta;
-        while (mp && mp->count >= BIG_ALLOC_ENTRIES)
-            mp = mp->next;
-
-        if (!mp) {
-            paddr_t meta_phys =palloc_inner(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, true, true);
-            if (!meta_phys) panic("kalloc no metadata page", alloc_size);
-            mp = (big_alloc_page*)dmap_pa_to_kva(meta_phys);
-            mp->next = big_alloc_meta;
-            big_alloc_meta = mp;
-        }
-
-        mp->entries[mp->count].phys_base = phys_base;
-        mp->entries[mp->count].size = alloc_size;
-        mp->entries[mp->count].owner_phys = owner_phys;
-        mp->count++;
+        big_alloc_insert(phys_base, alloc_size, owner_phys);
 
         if (page_va && next_va && ttbr){
             uintptr_t va = *next_va;
@@ -567,6 +811,13 @@ void release_page_index(page_index *index){
 }
 
 void* kalloc(void *page, size_t size, uint16_t alignment, uint8_t level){
+    if (page && level == MEM_PRIV_KERNEL && page_alloc_high_va && size <= SLAB_MAX_SIZE && alignment && alignment <= SLAB_MAX_SIZE && !(alignment & (alignment - 1))){
+        mem_page *info = (mem_page*)PHYS_TO_VIRT_P(page);
+        if (!(info->attributes & MEM_DEV)){
+            void *obj = slab_alloc(size, alignment);
+            if (obj) return obj;
+        }
+    }
     void* ptr = kalloc_inner(page, size, alignment, level, 0, 0, 0);
     if (level == MEM_PRIV_KERNEL && ptr) ptr = PHYS_TO_VIRT_P(ptr);
     return ptr;
@@ -576,6 +827,11 @@ void kfree(void* ptr, size_t size) {
     if(!ptr) return;
     kprintfv("[page_alloc_free] Freeing block at %x size %x",(uintptr_t)ptr, size);
 
+    if (slab_owns(ptr)){
+        slab_free(ptr);
+        return;
+    }
+
     uintptr_t va = (uintptr_t)ptr;
     uintptr_t phys = 0;
 
@@ -643,29 +899,18 @@ void kfree(void* ptr, size_t size) {
         panic("kfree untracked pointer", va);
     }
 
-    big_alloc_page* mp = big_alloc_meta;
-    while(mp) {
-        for(uint32_t i = 0; i < mp->count; i++)  {
-            if(mp->entries[i].phys_base != phys_base) continue;
+    big_alloc_entry *e = big_alloc_find(phys_base);
+    if(e) {
+        uint64_t big_size = e->size;
+        big_alloc_remove(e);
 
-            if(mp->entries[i].phys_base != phys) {
-                kprintf("[kfree] non base big ptr=%llx phys=%llx base=%llx", (uint64_t)va, (uint64_t)phys, (uint64_t)phys_base);
-                panic("kfree non base big pointer", va);
-            }
-
-            uint64_t big_size = mp->entries[i].size;
-            mp->count--;
-            mp->entries[i] = mp->entries[mp->count];
-
-            if(!mem_bitmap) {
-                kprintf("[kfree] bitmap not init ptr=%llx phys=%llx", (uint64_t)va, (uint64_t)phys);
-                panic("kfree bitmap not init", va);
-            }
-
-            pfree(PHYS_TO_VIRT_P((void*)phys_base), big_size);
-            return;
+        if(!mem_bitmap) {
+            kprintf("[kfree] bitmap not init ptr=%llx phys=%llx", (uint64_t)va, (uint64_t)phys);
+            panic("kfree bitmap not init", va);
         }
-        mp = mp->next;
+
+        pfree(PHYS_TO_VIRT_P((void*)phys_base), big_size);
+        return;
     }
 
     kprintf("[kfree] page pointer not tracked ptr=%llx phys=%llx size=%llx", (uint64_t)va, (uint64_t)phys, (uint64_t)size);
@@ -14,6 +14,22 @@
 #define MEM_DEV     (1 << 2)
 #define MEM_NORM    (0 << 2)
 
+#define PAGE_ORDERS 11
+
+typedef struct {
+    uint64_t total_pages;
+    uint64_t free_pages;
+    uint64_t largest_free_run;
+    uint64_t free_blocks[PAGE_ORDERS];
+} page_alloc_report;
+
+typedef struct {
+    uintptr_t owner;
+    uint64_t allocations;
+    uint64_t bytes;
+    uint64_t largest;
+} kalloc_owner_usage;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -27,15 +43,32 @@ void setup_page(uintptr_t address, uint8_t attributes);
 paddr_t palloc_inner(uint64_t size, uint8_t level, uint8_t attributes, bool full, bool map);
 void* palloc(uint64_t size, uint8_t level, uint8_t attributes, bool full);
 void free_managed_page(void* ptr);
+//Drops a reference from pages shared with page_ref_get, only pages nobody else maps are freed
 void pfree(void* ptr, uint64_t size);
 void mark_used(uintptr_t address, size_t pages);
 
+//Returns pages a cache freed when asked for up to the given count
+typedef uint64_t (*page_shrink_fn)(uint64_t pages);
+//Shrinkers run when an allocation finds no free run, from whatever context allocated, so they must not sleep or allocate
+void page_alloc_register_shrinker(page_shrink_fn fn);
+
 bool page_used(uintptr_t ptr);
 
+//Another mapping of an allocated page, pfree then releases one reference at a time
+void page_ref_get(paddr_t pa);
+//Mappings of pa including its owner, 1 for pages that aren't shared or aren't from the allocator
+uint32_t page_ref_count(paddr_t pa);
+uint64_t page_shared_count();
+
+//Free memory split into naturally aligned power of two blocks, as a buddy allocator would see it
+void page_alloc_get_report(page_alloc_report *out);
+
 //DEADLINE: 01/03/2026 - malloc syscall will be removed and kalloc will remain as a kernel-only allocator, but allocate is still preferred
 void* kalloc_inner(void *page, size_t size, uint16_t alignment, uint8_t level, uintptr_t page_va, uintptr_t *next_va, uintptr_t *ttbr);
 void* kalloc(void *page, size_t size, uint16_t alignment, uint8_t level);
 void kfree(void* ptr, size_t size);
+//Page-sized kalloc allocations grouped by owner page, largest owners first
+uint32_t kalloc_census(kalloc_owner_usage *out, uint32_t max);
 
 uint64_t count_pages(uint64_t i1,uint64_t i2);
 
@@ -0,0 +1,272 @@
+#include "slab.h"
+#include "page_allocator.h"
+#include "exceptions/irq.h"
+#include "exceptions/exception_handler.h"
+#include "process/scheduler.h"
+#include "std/memory.h"
+#include "std/string.h"
+#include "sysregs.h"
+
+#define SLAB_MAGIC 0x51AB51AB0BCEC0DEULL
+#define SLAB_LINK(obj) (*(void**)((uint8_t*)(obj) + 8))
+
+//Small classes keep this at the start of their page. From SLAB_OFFSLAB_MIN up it is a separate object
+//found through slab_offslab, so the whole page holds objects
+typedef struct slab_page {
+    uint64_t magic;
+    uintptr_t self;
+    struct slab_page *prev;
+    struct slab_page *next;
+    void *free;
+    uint8_t *base;
+    struct slab_page *hash_next;
+    uint16_t in_use;
+    uint16_t capacity;
+    uint8_t class_index;
+} slab_page;
+
+typedef struct {
+    uint32_t first_offset;
+    uint16_t capacity;
+    slab_page *partial;
+    slab_page *empty;
+    slab_stats stats;
+} slab_cache;
+
+static slab_cache caches[SLAB_CLASSES];
+static bool slab_ready;
+
+static slab_page **slab_offslab;
+static uint64_t slab_offslab_buckets;
+static uint64_t slab_offslab_count;
+
+static void* slab_take(int index);
+static void slab_put(slab_page *s, void *ptr);
+
+static size_t slab_proc_stats(char *buf, size_t size){
+    size_t len = string_format_buf(buf, size, "size slabs objects in_use allocs frees\n");
+    for (uint32_t i = 0; i < SLAB_CLASSES && len < size; i++){
+        slab_stats *s = &caches[i].stats;
+        len += string_format_buf(buf + len, size - len, "%u %u %llu %llu %llu %llu\n", s->object_size, s->slabs, s->objects, s->in_use, s->allocs, s->frees);
+    }
+    return len;
+}
+
+static void slab_init(){
+    for (uint32_t i = 0; i < SLAB_CLASSES; i++){
+        uint32_t size = SLAB_MIN_SIZE << i;
+        caches[i].first_offset = size >= SLAB_OFFSLAB_MIN ? 0 : (sizeof(slab_page) + size - 1) & ~(size - 1);
+        caches[i].capacity = (PAGE_SIZE - caches[i].first_offset) / size;
+        caches[i].stats.object_size = size;
+        caches[i].stats.capacity = caches[i].capacity;
+    }
+    slab_ready = true;
+    procfs_register("slabs", slab_proc_stats);
+}
+
+static int slab_class(size_t size){
+    if (size < SLAB_MIN_SIZE) size = SLAB_MIN_SIZE;
+    int index = 0;
+    while ((SLAB_MIN_SIZE << index) < size) index++;
+    return index < SLAB_CLASSES ? index : -1;
+}
+
+static void slab_unlink(slab_cache *cache, slab_page *s){
+    if (s->prev) s->prev->next = s->next;
+    else cache->partial = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->prev = s->next = 0;
+}
+
+static void slab_push(slab_cache *cache, slab_page *s){
+    s->prev = 0;
+    s->next = cache->partial;
+    if (cache->partial) cache->partial->prev = s;
+    cache->partial = s;
+}
+
+static inline uint64_t slab_offslab_bucket(uintptr_t page, uint64_t buckets){
+    return (page / PAGE_SIZE) & (buckets - 1);
+}
+
+//Grows the off-slab table once it holds two descriptors per bucket. Caller holds irqs off
+static bool slab_offslab_grow(){
+    uint64_t buckets = slab_offslab_buckets ? slab_offslab_buckets * 2 : PAGE_SIZE / sizeof(slab_page*);
+    slab_page **table = (slab_page**)palloc(buckets * sizeof(slab_page*), MEM_PRIV_KERNEL, MEM_RW, true);
+    if (!table) return slab_offslab_buckets != 0;
+    memset(table, 0, buckets * sizeof(slab_page*));
+    for (uint64_t i = 0; i < slab_offslab_buckets; i++){
+        slab_page *s = slab_offslab[i];
+        while (s){
+            slab_page *next = s->hash_next;
+            uint64_t b = slab_offslab_bucket((uintptr_t)s->base, buckets);
+            s->hash_next = table[b];
+            table[b] = s;
+            s = next;
+        }
+    }
+    if (slab_offslab) pfree(slab_offslab, slab_offslab_buckets * sizeof(slab_page*));
+    slab_offslab = table;
+    slab_offslab_buckets = buckets;
+    return true;
+}
+
+static slab_page* slab_offslab_find(uintptr_t page){
+    if (!slab_offslab) return 0;
+    for (slab_page *s = slab_offslab[slab_offslab_bucket(page, slab_offslab_buckets)]; s; s = s->hash_next)
+        if ((uintptr_t)s->base == page) return s;
+    return 0;
+}
+
+static void slab_offslab_remove(slab_page *s){
+    slab_page **link = &slab_offslab[slab_offslab_bucket((uintptr_t)s->base, slab_offslab_buckets)];
+    while (*link && *link != s) link = &(*link)->hash_next;
+    if (*link) *link = s->hash_next;
+    s->hash_next = 0;
+    slab_offslab_count--;
+}
+
+//The descriptor of the slab holding va, caller holds irqs off
+static slab_page* slab_lookup(uintptr_t va){
+    uintptr_t page = va & ~((uintptr_t)PAGE_SIZE - 1);
+    slab_page *s = slab_offslab_find(page);
+    if (s) return s;
+    if (!(va & (PAGE_SIZE - 1))) return 0;
+    s = (slab_page*)page;
+    return page_used(page) && s->magic == SLAB_MAGIC && s->self == page ? s : 0;
+}
+
+static slab_page* slab_new(uint8_t class_index){
+    slab_cache *cache = &caches[class_index];
+    bool offslab = cache->stats.object_size >= SLAB_OFFSLAB_MIN;
+    if (offslab && slab_offslab_count >= slab_offslab_buckets * 2 && !slab_offslab_grow()) return 0;
+    uint8_t *page = (uint8_t*)palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+    if (!page) return 0;
+    slab_page *s = (slab_page*)page;
+    if (offslab){
+        s = (slab_page*)slab_take(slab_class(sizeof(slab_page)));
+        if (!s){
+            pfree(page, PAGE_SIZE);
+            return 0;
+        }
+        memset(s, 0, sizeof(slab_page));
+    }
+    uint32_t size = cache->stats.object_size;
+    s->magic = SLAB_MAGIC;
+    s->self = (uintptr_t)s;
+    s->base = page + cache->first_offset;
+    s->capacity = cache->capacity;
+    s->class_index = class_index;
+    if (offslab){
+        uint64_t b = slab_offslab_bucket((uintptr_t)page, slab_offslab_buckets);
+        s->hash_next = slab_offslab[b];
+        slab_offslab[b] = s;
+        slab_offslab_count++;
+    }
+    uint8_t *obj = s->base + ((s->capacity - 1) * size);
+    for (uint16_t i = 0; i < s->capacity; i++, obj -= size){
+        SLAB_LINK(obj) = s->free;
+        s->free = obj;
+    }
+    cache->stats.slabs++;
+    cache->stats.objects += s->capacity;
+    return s;
+}
+
+static void slab_release(slab_cache *cache, slab_page *s){
+    cache->stats.slabs--;
+    cache->stats.objects -= s->capacity;
+    uint8_t *page = (uint8_t*)((uintptr_t)s->base & ~((uintptr_t)PAGE_SIZE - 1));
+    if (cache->stats.object_size >= SLAB_OFFSLAB_MIN){
+        slab_offslab_remove(s);
+        pfree(page, PAGE_SIZE);
+        s->magic = 0;
+        slab_page *desc = slab_lookup((uintptr_t)s);
+        if (desc) slab_put(desc, s);
+        return;
+    }
+    s->magic = 0;
+    pfree(page, PAGE_SIZE);
+}
+
+//Caller holds irqs off, the object is not cleared
+static void* slab_take(int index){
+    if (!slab_ready) slab_init();
+    slab_cache *cache = &caches[index];
+    slab_page *s = cache->partial;
+    if (!s){
+        s = cache->empty;
+        cache->empty = 0;
+        if (!s) s = slab_new(index);
+        if (!s) return 0;
+        slab_push(cache, s);
+    }
+    void *obj = s->free;
+    s->free = SLAB_LINK(obj);
+    s->in_use++;
+    if (!s->free) slab_unlink(cache, s);
+    cache->stats.in_use++;
+    cache->stats.allocs++;
+    return obj;
+}
+
+//Caller holds irqs off
+static void slab_put(slab_page *s, void *ptr){
+    slab_cache *cache = &caches[s->class_index];
+    if (!s->in_use) panic("slab double free", (uintptr_t)ptr);
+    if (!s->free) slab_push(cache, s);
+    SLAB_LINK(ptr) = s->free;
+    s->free = ptr;
+    s->in_use--;
+    cache->stats.in_use--;
+    cache->stats.frees++;
+    if (!s->in_use){
+        slab_unlink(cache, s);
+        if (cache->empty) slab_release(cache, s);
+        else cache->empty = s;
+    }
+}
+
+void* slab_alloc(size_t size, uint16_t alignment){
+    if (!size) return 0;
+    int index = slab_class(size > alignment ? size : alignment);
+    if (index < 0) return 0;
+
+    irq_flags_t irq = irq_save_disable();
+    void *obj = slab_take(index);
+    irq_restore(irq);
+
+    if (obj) memset(obj, 0, caches[index].stats.object_size);
+    return obj;
+}
+
+bool slab_owns(void *ptr){
+    uintptr_t va = (uintptr_t)ptr;
+    if ((va & HIGH_VA) != HIGH_VA) return false;
+    irq_flags_t irq = irq_save_disable();
+    bool owned = slab_lookup(va) != 0;
+    irq_restore(irq);
+    return owned;
+}
+
+void slab_free(void *ptr){
+    uintptr_t va = (uintptr_t)ptr;
+    irq_flags_t irq = irq_save_disable();
+    slab_page *s = slab_lookup(va);
+    if (!s) panic("slab free of foreign pointer", va);
+    uint32_t size = caches[s->class_index].stats.object_size;
+    if (va < (uintptr_t)s->base || (va - (uintptr_t)s->base) % size) panic("slab free of misaligned pointer", va);
+
+    memset32(ptr, 0xDEADBEEF, size);
+    slab_put(s, ptr);
+    irq_restore(irq);
+}
+
+bool slab_get_stats(uint32_t class_index, slab_stats *out){
+    if (class_index >= SLAB_CLASSES || !out) return false;
+    irq_flags_t irq = irq_save_disable();
+    if (!slab_ready) slab_init();
+    *out = caches[class_index].stats;
+    irq_restore(irq);
+    return true;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE 2048
+#define SLAB_CLASSES 8
+//Classes from this size up keep their slab descriptor outside the page, so a page holds PAGE_SIZE/size objects
+#define SLAB_OFFSLAB_MIN 512
+
+typedef struct {
+    uint32_t object_size;
+    uint32_t capacity;//Objects per slab
+    uint32_t slabs;
+    uint64_t objects;
+    uint64_t in_use;
+    uint64_t allocs;
+    uint64_t frees;
+} slab_stats;
+
+//Objects are naturally aligned to their size class, so any alignment up to SLAB_MAX_SIZE is honored
+void* slab_alloc(size_t size, uint16_t alignment);
+bool slab_owns(void *ptr);
+void slab_free(void *ptr);
+bool slab_get_stats(uint32_t class_index, slab_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,18 @@
+#pragma once
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Drops roughly permille/1000 of the frames sent through loopback, 0 disables it
+void loopback_set_loss_permille(uint32_t permille);
+uint32_t loopback_get_loss_permille();
+
+//Holds every frame for delay_ms before it can be received, emulating a long path. 0 disables it
+void loopback_set_delay_ms(uint32_t delay_ms);
+uint32_t loopback_get_delay_ms();
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,6 +1,28 @@
 #include "loopback_driver.hpp"
+#include "loopback.h"
 #include "std/memory.h"
 #include "memory/page_allocator.h"
+#include "exceptions/timer.h"
+
+static uint32_t loss_permille;
+static uint32_t loss_state = 0x2545F491u;
+static uint32_t delay_ms;
+
+extern "C" void loopback_set_loss_permille(uint32_t permille){
+    loss_permille = permille > 1000 ? 1000 : permille;
+}
+
+extern "C" uint32_t loopback_get_loss_permille(){ return loss_permille; }
+
+extern "C" void loopback_set_delay_ms(uint32_t ms){ delay_ms = ms; }
+
+extern "C" uint32_t loopback_get_delay_ms(){ return delay_ms; }
+
+static bool loss_drop(){
+    if (!loss_permille) return false;
+    loss_state = loss_state * 1664525u + 1013904223u;
+    return ((loss_state >> 8) % 1000) < loss_permille;
+}
 
 LoopbackDriver::LoopbackDriver(){
     memory_page = 0;
@@ -31,20 +53,28 @@ sizedptr LoopbackDriver::allocate_packet(size_t size){
 
 sizedptr LoopbackDriver::handle_receive_packet(){
     if (rx_head == rx_tail) return (sizedptr){0,0};
+    if (rx_due_us[rx_head] > timer_now_usec()) return (sizedptr){0,0};
     sizedptr p = rxq[rx_head];
     rx_head = (uint16_t)((rx_head + 1) & 255);
     return p;
 }
 
+uint64_t LoopbackDriver::next_rx_due_us() const{
+    if (rx_head == rx_tail) return 0;
+    return rx_due_us[rx_head] ? rx_due_us[rx_head] : 1;
+}
+
 void LoopbackDriver::handle_sent_packet(){}
 
 void LoopbackDriver::enable_verbose(){ verbose = true; }
 
 bool LoopbackDriver::send_packet(sizedptr packet){
     if (!packet.ptr || !packet.size) return false;
+    if (loss_drop()) return false;
     uint16_t next = (uint16_t)((rx_tail + 1) & 255);
     if (next == rx_head)return false;
     rxq[rx_tail] = packet;
+    rx_due_us[rx_tail] = delay_ms ? timer_now_usec() + (uint64_t)delay_ms * 1000 : 0;
     rx_tail = next;
     return true;
 }
@@ -20,10 +20,12 @@ public:
     const char* hw_ifname() const override;
     uint32_t get_speed_mbps() const override;
     uint8_t get_duplex() const override;
+    uint64_t next_rx_due_us() const override;
 
 private:
     void* memory_page;
     sizedptr rxq[256];
+    uint64_t rx_due_us[256];
     uint16_t rx_head;
     uint16_t rx_tail;
     bool verbose;
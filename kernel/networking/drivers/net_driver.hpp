@@ -1,6 +1,8 @@
 #pragma once
 #include "types.h"
 #include "net/network_types.h"
+#include "networking/netpkt.h"
+#include "memory/page_allocator.h"
 
 class NetDriver {
 public:
@@ -19,4 +21,21 @@ public:
     virtual uint32_t get_speed_mbps() const = 0;
     virtual uint8_t get_duplex() const = 0;
     virtual bool sync_multicast(const uint8_t* macs, uint32_t count) {(void)macs; (void)count; return true; }
+    //Drivers without an RX interrupt say when their next queued frame can be received, 0 when none is queued
+    virtual uint64_t next_rx_due_us() const { return 0; }
+
+    //The stack keeps views of received frames, drivers that can give up their RX buffers override this to skip the copy
+    virtual netpkt_t* receive_netpkt() {
+        sizedptr raw = handle_receive_packet();
+        if (!raw.ptr || !raw.size) return nullptr;
+        netpkt_t* p = netpkt_wrap(raw.ptr, (uint32_t)raw.size, 0, (uint32_t)raw.size, free_frame, nullptr);
+        if (!p) kfree((void*)raw.ptr, raw.size);
+        return p;
+    }
+
+protected:
+    static void free_frame(void* ctx, uintptr_t base, uint32_t alloc_size) {
+        (void)ctx;
+        kfree((void*)base, alloc_size);
+    }
 };
\ No newline at end of file
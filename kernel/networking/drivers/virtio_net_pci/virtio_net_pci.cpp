@@ -42,6 +42,13 @@ typedef struct __attribute__((packed)) virtio_net_ctrl_ack_t {
 
 #define VIRTIO_NET_CTRL_MAC_TABLE_SET 0
 
+//Completions can be reaped from the TX interrupt, where kfree isn't safe, so finished requests are only unlinked there and freed on the next send
+static void virtio_net_tx_complete(virtio_request *req){
+    virtio_net_tx_req_t *tx = (virtio_net_tx_req_t*)req->ctx;
+    if (!tx || !tx->done_list) return;
+    tx->next = *tx->done_list;
+    *tx->done_list = tx;
+}
 
 bool virtio_net_ctrl_send(virtio_device* dev, uint8_t cls, uint8_t cmd, const void* payload, uint32_t payload_len) {
     if (!dev) return false;
@@ -287,10 +294,19 @@ sizedptr VirtioNetDriver::allocate_packet(size_t size){
     return (sizedptr){(uintptr_t)kalloc(vnp_net_dev.memory_page, total, ALIGN_64B, MEM_PRIV_KERNEL), total};
 }
 
-sizedptr VirtioNetDriver::handle_receive_packet(){
-    uint32_t desc_index = 0;
-    uint32_t total_len = 0;
-    uint16_t num_buffers = 1;
+//Gives the chain back to the device, called with interrupts disabled
+void VirtioNetDriver::rx_repost(uint16_t desc_index){
+    uint16_t aidx = rx_avail->idx;
+    rx_avail->ring[aidx % rx_qsz] = desc_index;
+    asm volatile ("dmb ishst" ::: "memory");
+    rx_avail->idx = (uint16_t)(aidx + 1);
+    asm volatile ("dmb ishst" ::: "memory");
+    select_queue(&vnp_net_dev, RECEIVE_QUEUE);
+    virtio_notify(&vnp_net_dev);
+}
+
+bool VirtioNetDriver::rx_next(uint16_t* desc_index, uint32_t* total_len, uint16_t* num_buffers){
+    *num_buffers = 1;
 
     disable_interrupt();
     select_queue(&vnp_net_dev, RECEIVE_QUEUE);
@@ -300,72 +316,60 @@ sizedptr VirtioNetDriver::handle_receive_packet(){
     uint16_t qsz = rx_qsz;
     if (!qsz || !used || !desc || !avail) {
         enable_interrupt();
-        return (sizedptr){0,0};
+        return false;
     }
     asm volatile ("dmb ishld" ::: "memory");
 
     uint16_t new_idx = used->idx;
     if (new_idx == last_used_receive_idx) {
         enable_interrupt();
-        return (sizedptr){0,0};
+        return false;
     }
 
     uint16_t used_ring_index = (uint16_t)(last_used_receive_idx % qsz);
     volatile virtq_used_elem* e = &used->ring[used_ring_index];
     last_used_receive_idx++;
-    desc_index = e->id;
-    total_len = e->len;
-
-    if (desc_index >= qsz || total_len <= (uint32_t)header_size){
-        uint16_t aidx = avail->idx;
-        avail->ring[aidx % qsz] = (uint16_t)(desc_index % qsz);
-        asm volatile ("dmb ishst" ::: "memory");
-        avail->idx = (uint16_t)(aidx + 1);
-        asm volatile ("dmb ishst" ::: "memory");
-        select_queue(&vnp_net_dev, RECEIVE_QUEUE);
-        virtio_notify(&vnp_net_dev);
+    uint32_t di = e->id;
+    *total_len = e->len;
+
+    if (di >= qsz || *total_len <= (uint32_t)header_size){
+        rx_repost((uint16_t)(di % qsz));
         enable_interrupt();
-        return (sizedptr){0,0};
+        return false;
     }
 
-    volatile uint8_t* first_buf = (volatile uint8_t*)PHYS_TO_VIRT_P((void*)(uintptr_t)desc[desc_index].addr);
     if (mrg_rxbuf) {
+        volatile uint8_t* first_buf = (volatile uint8_t*)PHYS_TO_VIRT_P((void*)(uintptr_t)desc[di].addr);
         virtio_net_hdr_mrg_rxbuf_t* h = (virtio_net_hdr_mrg_rxbuf_t*)(uintptr_t)first_buf;
-        num_buffers = h->num_buffers;
-        if (num_buffers == 0) num_buffers = 1;
-        if (num_buffers > RX_CHAIN_SEGS) {
-            uint16_t aidx = avail->idx;
-            avail->ring[aidx % qsz] = (uint16_t)desc_index;
-            asm volatile ("dmb ishst" ::: "memory");
-            avail->idx = (uint16_t)(aidx + 1);
-            asm volatile ("dmb ishst" ::: "memory");
-            select_queue(&vnp_net_dev, RECEIVE_QUEUE);
-            virtio_notify(&vnp_net_dev);
+        *num_buffers = h->num_buffers;
+        if (*num_buffers == 0) *num_buffers = 1;
+        if (*num_buffers > RX_CHAIN_SEGS) {
+            rx_repost((uint16_t)di);
             enable_interrupt();
-            return (sizedptr){0,0};
+            return false;
         }
     }
 
     enable_interrupt();
+    *desc_index = (uint16_t)di;
+    return true;
+}
+
+sizedptr VirtioNetDriver::rx_copy(uint16_t desc_index, uint32_t total_len, uint16_t num_buffers){
+    volatile virtq_desc* desc = rx_desc;
 
     uint32_t payload_len = total_len - (uint32_t)header_size;
     void* out_buf = kalloc(vnp_net_dev.memory_page, payload_len, ALIGN_64B, MEM_PRIV_KERNEL);
     if (!out_buf){
         disable_interrupt();
-        uint16_t aidx = avail->idx;
-        avail->ring[aidx % qsz] = (uint16_t)desc_index;
-        asm volatile ("dmb ishst" ::: "memory");
-        avail->idx = (uint16_t)(aidx + 1);
-        asm volatile ("dmb ishst" ::: "memory");
-        select_queue(&vnp_net_dev, RECEIVE_QUEUE);
-        virtio_notify(&vnp_net_dev);
+        rx_repost(desc_index);
         enable_interrupt();
         return (sizedptr){0,0};
     }
 
     uint32_t written = 0;
     uint32_t remaining = payload_len;
-    uint16_t di = (uint16_t)desc_index;
+    uint16_t di = desc_index;
     for (uint16_t bi = 0; bi < num_buffers && remaining; bi++) {
         volatile uint8_t* buf = (volatile uint8_t*)PHYS_TO_VIRT_P((void*)(uintptr_t)desc[di].addr);
         uint32_t cap = desc[di].len;
@@ -385,13 +389,7 @@ sizedptr VirtioNetDriver::handle_receive_packet(){
     }
 
     disable_interrupt();
-    uint16_t aidx = avail->idx;
-    avail->ring[aidx % qsz] = (uint16_t)desc_index;
-    asm volatile ("dmb ishst" ::: "memory");
-    avail->idx = (uint16_t)(aidx + 1);
-    asm volatile ("dmb ishst" ::: "memory");
-    select_queue(&vnp_net_dev, RECEIVE_QUEUE);
-    virtio_notify(&vnp_net_dev);
+    rx_repost(desc_index);
     enable_interrupt();
 
     if (remaining != 0) {
@@ -402,29 +400,94 @@ sizedptr VirtioNetDriver::handle_receive_packet(){
     return (sizedptr){ (uintptr_t)out_buf, payload_len };
 }
 
+sizedptr VirtioNetDriver::handle_receive_packet(){
+    uint16_t desc_index = 0;
+    uint32_t total_len = 0;
+    uint16_t num_buffers = 1;
+
+    if (!rx_next(&desc_index, &total_len, &num_buffers)) return (sizedptr){0,0};
+    return rx_copy(desc_index, total_len, num_buffers);
+}
+
+static void virtio_net_rx_page_free(void* ctx, uintptr_t base, uint32_t alloc_size){
+    (void)ctx;
+    pfree((void*)base, alloc_size);
+}
+
+//A frame that fits the head buffer leaves with that page and a fresh page takes its slot in the chain
+netpkt_t* VirtioNetDriver::receive_netpkt(){
+    uint16_t desc_index = 0;
+    uint32_t total_len = 0;
+    uint16_t num_buffers = 1;
+
+    if (!rx_next(&desc_index, &total_len, &num_buffers)) return nullptr;
+
+    if (num_buffers == 1 && total_len <= rx_desc[desc_index].len) {
+        void* fresh = palloc(RX_BUF_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+        if (fresh) {
+            uintptr_t page = (uintptr_t)PHYS_TO_VIRT_P((void*)(uintptr_t)rx_desc[desc_index].addr);
+            netpkt_t* p = netpkt_wrap(page, RX_BUF_SIZE, header_size, total_len - header_size, virtio_net_rx_page_free, nullptr);
+            if (p) {
+                disable_interrupt();
+                rx_desc[desc_index].addr = VIRT_TO_PHYS((uintptr_t)fresh);
+                rx_repost(desc_index);
+                enable_interrupt();
+                return p;
+            }
+            pfree(fresh, RX_BUF_SIZE);
+        }
+    }
+
+    sizedptr raw = rx_copy(desc_index, total_len, num_buffers);
+    if (!raw.ptr) return nullptr;
+    netpkt_t* p = netpkt_wrap(raw.ptr, raw.size, 0, raw.size, free_frame, nullptr);
+    if (!p) kfree((void*)raw.ptr, raw.size);
+    return p;
+}
+
 void VirtioNetDriver::handle_sent_packet(){
     if (TRANSMIT_QUEUE >= vnp_net_dev.num_queues) return;
     if (!vnp_net_dev.queues[TRANSMIT_QUEUE].device) return;
-    last_used_sent_idx = vnp_net_dev.queues[TRANSMIT_QUEUE].device->idx;
+    virtio_reap(&vnp_net_dev, TRANSMIT_QUEUE);
+    last_used_sent_idx = vnp_net_dev.queues[TRANSMIT_QUEUE].last_used_idx;
+}
+
+void VirtioNetDriver::release_sent_packets(){
+    virtio_net_tx_req_t *tx = tx_done;
+    tx_done = nullptr;
+    while (tx) {
+        virtio_net_tx_req_t *next = tx->next;
+        kfree((void*)tx->packet.ptr, tx->packet.size);
+        kfree(tx, sizeof(virtio_net_tx_req_t));
+        tx = next;
+    }
 }
 
 bool VirtioNetDriver::send_packet(sizedptr packet){
     if (!packet.ptr || !packet.size) return false;
 
     disable_interrupt();
-    select_queue(&vnp_net_dev, TRANSMIT_QUEUE);
+    handle_sent_packet();
+    release_sent_packets();
+
+    virtio_net_tx_req_t *tx = (virtio_net_tx_req_t*)kalloc(vnp_net_dev.memory_page, sizeof(virtio_net_tx_req_t), ALIGN_16B, MEM_PRIV_KERNEL);
+    if (!tx) {
+        enable_interrupt();
+        return false;
+    }
+    tx->packet = packet;
+    tx->done_list = &tx_done;
+    tx->req.complete = virtio_net_tx_complete;
+    tx->req.ctx = tx;
 
     if ((size_t)header_size <= packet.size) memset((void*)packet.ptr, 0, (size_t)header_size);
     if (mrg_rxbuf) ((virtio_net_hdr_mrg_rxbuf_t*)packet.ptr)->num_buffers = 0;
-    virtio_buf b;
-    b.addr = packet.ptr;
-    b.len = (uint32_t)packet.size;
-    b.flags = 0;
-    bool ok = virtio_send_nd(&vnp_net_dev, &b, 1);
+    virtio_buf b = VBUF(packet.ptr, packet.size, 0);
+    bool ok = virtio_submit(&vnp_net_dev, TRANSMIT_QUEUE, &b, 1, &tx->req);
+    if (!ok) kfree(tx, sizeof(virtio_net_tx_req_t));
     enable_interrupt();
 
     kprintfv("[virtio-net] tx queued len=%u",(unsigned)packet.size);
-    if (ok) kfree((void*)packet.ptr, packet.size);
     return ok;
 }
 
@@ -51,6 +51,13 @@ typedef struct __attribute__((packed)) virtio_net_config {
     uint32_t supported_hash_types;
 } virtio_net_config;
 
+typedef struct virtio_net_tx_req_t {
+    virtio_request req;
+    sizedptr packet;
+    struct virtio_net_tx_req_t **done_list;
+    struct virtio_net_tx_req_t *next;
+} virtio_net_tx_req_t;
+
 class VirtioNetDriver : public NetDriver {
 public:
     VirtioNetDriver();
@@ -69,11 +76,18 @@ public:
 
     sizedptr allocate_packet(size_t size) override;
     sizedptr handle_receive_packet() override;
+    netpkt_t* receive_netpkt() override;
     void handle_sent_packet() override;
     bool send_packet(sizedptr packet) override;
 
 private:
+    void release_sent_packets();
+    bool rx_next(uint16_t* desc_index, uint32_t* total_len, uint16_t* num_buffers);
+    sizedptr rx_copy(uint16_t desc_index, uint32_t total_len, uint16_t num_buffers);
+    void rx_repost(uint16_t desc_index);
+
     virtio_device vnp_net_dev = {};
+    virtio_net_tx_req_t* tx_done = nullptr;
 
     volatile virtq_desc* rx_desc = nullptr;
     volatile virtq_avail* rx_avail = nullptr;
@@ -1,5 +1,6 @@
 #include "interface_manager.h"
 #include "std/memory.h"
+#include "std/string.h"
 #include "networking/link_layer/arp.h"
 #include "networking/link_layer/ndp.h"
 #include "networking/internet_layer/ipv4_route.h"
@@ -39,6 +40,39 @@ typedef struct {
 static v4_slot_t g_v4[V4_POOL_SIZE];
 static v6_slot_t g_v6[V6_POOL_SIZE];
 
+#define PORT_VIEW_BATCH 32
+
+//Pages through the bindings so the view isn't capped by a fixed array, procfs grows buf until it all fits
+static size_t port_view_append(char *buf, size_t size, size_t len, port_manager_t *pm, uint8_t l3_id){
+    port_binding_t b[PORT_VIEW_BATCH];
+    uint32_t skip = 0;
+    while (len < size){
+        uint32_t got = port_list_bindings(pm, skip, b, PORT_VIEW_BATCH);
+        for (uint32_t i = 0; i < got && len < size; i++)
+            len += string_format_buf(buf + len, size - len, "%u %s %u %x\n", b[i].pid, b[i].proto == PROTO_TCP ? "tcp" : "udp", b[i].port, l3_id);
+        if (got < PORT_VIEW_BATCH) break;
+        skip += got;
+    }
+    return len;
+}
+
+static size_t ifmgr_port_view(char *buf, size_t size){
+    size_t len = string_format_buf(buf, size, "pid proto port l3\n");
+    for (int i = 0; i < V4_POOL_SIZE && len < size; i++)
+        if (g_v4[i].used && g_v4[i].node.port_manager)
+            len = port_view_append(buf, size, len, g_v4[i].node.port_manager, g_v4[i].node.l3_id);
+    for (int i = 0; i < V6_POOL_SIZE && len < size; i++)
+        if (g_v6[i].used && g_v6[i].node.port_manager)
+            len = port_view_append(buf, size, len, g_v6[i].node.port_manager, g_v6[i].node.l3_id);
+    return len;
+}
+
+static void ifmgr_register_port_view(){
+    static bool registered = false;
+    if (registered) return;
+    registered = procfs_register("ports", ifmgr_port_view);
+}
+
 static inline int l2_slot_from_ifindex(uint8_t ifindex){
     if (!ifindex) return -1;
     int s = (int)ifindex - 1;
@@ -160,6 +194,7 @@ bool l2_interface_set_up(uint8_t ifindex, bool up) {
     l2_interface_t* itf = l2_interface_find_by_index(ifindex);
     if (!itf) return false;
     itf->is_up = up;
+    if (up) ndp_kick();
     return true;
 }
 
@@ -389,6 +424,7 @@ uint8_t l3_ipv4_add_to_interface(uint8_t ifindex, uint32_t ip, uint32_t mask, ui
         return 0;
     }
     port_manager_init(n->port_manager);
+    ifmgr_register_port_view();
 
     if (n->mode != IPV4_CFG_DISABLED && n->ip && l2->kind != NET_IFK_LOCALHOST) (void)l2_ipv4_mcast_join(ifindex, IPV4_MCAST_ALL_HOSTS);
 
@@ -468,6 +504,7 @@ bool l3_ipv4_remove_from_interface(uint8_t l3_id){
     if (g < 0) return false;
 
     if (n->port_manager) {
+        port_manager_destroy(n->port_manager);
         kfree(n->port_manager, sizeof(port_manager_t));
         n->port_manager = NULL;
     }
@@ -641,6 +678,7 @@ uint8_t l3_ipv6_add_to_interface(uint8_t ifindex, const uint8_t ip[16], uint8_t
         return 0;
     }
     port_manager_init(n->port_manager);
+    ifmgr_register_port_view();
     if (cfg == IPV6_CFG_DHCPV6){
         uint8_t m[16];
         ipv6_make_multicast(2, IPV6_MCAST_DHCPV6_SERVERS, NULL, m);
@@ -663,6 +701,7 @@ uint8_t l3_ipv6_add_to_interface(uint8_t ifindex, const uint8_t ip[16], uint8_t
         }
     }
 
+    if (n->dad_requested) ndp_kick();
     return n->l3_id;
 }
 
@@ -807,6 +846,7 @@ bool l3_ipv6_update(uint8_t l3_id, const uint8_t ip[16], uint8_t prefix_len, con
         }
     }
 
+    if (n->dad_requested) ndp_kick();
     return true;
 }
 
@@ -832,6 +872,7 @@ bool l3_ipv6_remove_from_interface(uint8_t l3_id){
     if (g < 0) return false;
 
     if (n->port_manager) {
+        port_manager_destroy(n->port_manager);
         kfree(n->port_manager, sizeof(port_manager_t));
         n->port_manager = NULL;
     }
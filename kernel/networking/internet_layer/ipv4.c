@@ -262,6 +262,7 @@ void ipv4_send_packet(uint32_t dst_ip, uint8_t proto, netpkt_t* pkt, const ipv4_
     }
 
     uint8_t dst_mac[6];
+    bool resolve = false;
     bool is_dbcast = false;
     l2_interface_t* l2 = l2_interface_find_by_index(ifx);
     if (l2) {
@@ -277,12 +278,8 @@ void ipv4_send_packet(uint32_t dst_ip, uint8_t proto, netpkt_t* pkt, const ipv4_
     } else if (ipv4_is_multicast(dst_ip)) {
         ipv4_mcast_to_mac(dst_ip, dst_mac);
     } else {
-        if (l2 && l2->kind == NET_IFK_LOCALHOST) {
-            memset(dst_mac, 0, 6);
-        } else if (!arp_resolve_on(ifx, nh, dst_mac, 1000)) {
-            netpkt_unref(pkt);
-            return;
-        }
+        if (l2 && l2->kind == NET_IFK_LOCALHOST) memset(dst_mac, 0, 6);
+        else resolve = true;
     }
 
     uint16_t mtu = 1500;
@@ -325,7 +322,8 @@ void ipv4_send_packet(uint32_t dst_ip, uint8_t proto, netpkt_t* pkt, const ipv4_
     ip->dst_ip = bswap32(dst_ip);
     ip->header_checksum = checksum16((const uint16_t*)ip, hdr_len / 2);
 
-    eth_send_frame_on(ifx, ETHERTYPE_IPV4, dst_mac, pkt);
+    if (resolve) arp_output(ifx, nh, ETHERTYPE_IPV4, pkt);
+    else eth_send_frame_on(ifx, ETHERTYPE_IPV4, dst_mac, pkt);
 }
 
 void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
@@ -399,7 +397,7 @@ void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
             uint8_t l3id = cand[i]->l3_id;
             switch (proto) {
                 case 2: igmp_input((uint8_t)ifindex, src, dst, (const void*)l4, l4_len); break;
-                case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
+                case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
                 case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
                 default: break;
             }
@@ -413,7 +411,7 @@ void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
             uint8_t l3id = cand[0]->l3_id;
             switch (proto) {
                 case 1: icmp_input(l4, l4_len, src, dst); break;
-                case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
+                case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
                 case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
                 default: break;
             }
@@ -423,7 +421,7 @@ void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
                 uint8_t l3id = cand[i]->l3_id;
                 switch (proto) {
                     case 1: icmp_input(l4, l4_len, src, dst); break;
-                    case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
+                    case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
                     case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
                     default: break;
                 }
@@ -443,7 +441,7 @@ void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
     if (match_count == 1) {
         switch (proto) {
             case 1: icmp_input(l4, l4_len, src, dst); break;
-            case 6: tcp_input(IP_VER4, &src, &dst, match_l3id, l4, l4_len); break;
+            case 6: tcp_input(IP_VER4, &src, &dst, match_l3id, l4, l4_len, pkt); break;
             case 17: udp_input(IP_VER4, &src, &dst, match_l3id, l4, l4_len); break;
             default: break;
         }
@@ -455,7 +453,7 @@ void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
                 uint8_t l3id = cand[i]->l3_id;
                 switch (proto) {
                     case 1: icmp_input(l4, l4_len, src, dst); break;
-                    case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
+                    case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
                     case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
                     default: break;
                 }
@@ -477,7 +475,7 @@ void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
                 uint8_t l3id = v4->l3_id;
                 switch (proto) {
                     case 1: icmp_input(l4, l4_len, src, dst); break;
-                    case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
+                    case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
                     case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
                     default: break;
                 }
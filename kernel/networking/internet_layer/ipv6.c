@@ -395,13 +395,11 @@ void ipv6_send_packet(const uint8_t dst[16], uint8_t next_header, netpkt_t* pkt,
     }
 
     uint8_t dst_mac[6];
+    bool via_ndp = false;
     l2_interface_t* l2 = l2_interface_find_by_index(ifx);
     if (ipv6_is_multicast(dst)) ipv6_multicast_mac(dst, dst_mac);
     else if (l2 && l2->kind == NET_IFK_LOCALHOST) memset(dst_mac, 0, 6);
-    else if (!ndp_resolve_on(ifx, nh, dst_mac, 200)) {
-        netpkt_unref(pkt);
-        return;
-    }
+    else via_ndp = true;
 
     uint16_t mtu = 1500;
 
@@ -431,7 +429,8 @@ void ipv6_send_packet(const uint8_t dst[16], uint8_t next_header, netpkt_t* pkt,
         memcpy(ip6->src, src, 16);
         memcpy(ip6->dst, dst, 16);
 
-        eth_send_frame_on(ifx, ETHERTYPE_IPV6, dst_mac, pkt);
+        if (via_ndp) ndp_output(ifx, nh, pkt);
+        else eth_send_frame_on(ifx, ETHERTYPE_IPV6, dst_mac, pkt);
         return;
     }
 
@@ -497,7 +496,8 @@ void ipv6_send_packet(const uint8_t dst[16], uint8_t next_header, netpkt_t* pkt,
 
         memcpy((uint8_t*)(fh + 1), data + off, chunk);
 
-        eth_send_frame_on(ifx, ETHERTYPE_IPV6, dst_mac, fpkt);
+        if (via_ndp) ndp_output(ifx, nh, fpkt);
+        else eth_send_frame_on(ifx, ETHERTYPE_IPV6, dst_mac, fpkt);
 
         off += chunk;
     }
@@ -848,7 +848,7 @@ void ipv6_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
                 l3_ipv6_interface_t* v6 = cand[i];
                 if (!ipv6_is_linklocal(v6->ip) && ipv6_is_linklocal(ip6->dst)) continue;
                 if (inner_nh == 17) udp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, payload_ptr, payload_size);
-                else if (inner_nh == 6) tcp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, payload_ptr, payload_size);
+                else if (inner_nh == 6) tcp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, payload_ptr, payload_size, NULL);
             }
 
             reass_free(s);
@@ -865,7 +865,7 @@ void ipv6_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
         }
 
         if (match_count >= 1) {
-            if (inner_nh == 6) tcp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, payload_ptr, payload_size);
+            if (inner_nh == 6) tcp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, payload_ptr, payload_size, NULL);
             else if (inner_nh == 17) udp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, payload_ptr, payload_size);
         }
 
@@ -911,7 +911,7 @@ void ipv6_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
                 udp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, l4, l4_len);
                 break;
             case 6:
-                tcp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, l4, l4_len);
+                tcp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, l4, l4_len, pkt);
                 break;
             default:
                 break;
@@ -932,7 +932,7 @@ void ipv6_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
     if (match_count >= 1) {
         switch (ip6->next_header) {
         case 6:
-            tcp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, l4, l4_len);
+            tcp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, l4, l4_len, pkt);
             break;
         case 17:
             udp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, l4, l4_len);
@@ -8,101 +8,248 @@
 #include "networking/internet_layer/ipv4.h"
 #include "syscalls/syscalls.h"
 #include "networking/internet_layer/ipv4_utils.h"
+#include "exceptions/irq.h"
+#include "exceptions/ktimer.h"
+#include "exceptions/timer.h"
+#include "process/waitqueue.h"
+
+#define ARP_HASH_BUCKETS 32
+#define ARP_NONE -1
+#define ARP_TTL_MS 180000
+#define ARP_REACHABLE_MS 30000
+#define ARP_RETRANS_MS 1000
+#define ARP_MAX_PROBES 3
+
+typedef struct {
+    netpkt_t* pkt;
+    uint16_t ethertype;
+} arp_pending_t;
 
 typedef struct arp_table {
     arp_entry_t entries[ARP_TABLE_MAX];
+    int16_t next[ARP_TABLE_MAX];
+    int16_t buckets[ARP_HASH_BUCKETS];
+    int16_t free_head;
+    arp_pending_t pending[ARP_TABLE_MAX][ARP_PENDING_MAX];
+    uint8_t pending_count[ARP_TABLE_MAX];
     uint8_t init;
 } arp_table_t;
 
 static uint16_t g_arp_pid = 0xFFFF;
+static kevent g_arp_event;
+static ktimer g_arp_timer;
+static uint64_t g_arp_timer_due_ms;
+static uint64_t g_arp_last_tick_ms;
+
+static void arp_timer_fired(ktimer* timer){
+    g_arp_timer_due_ms = 0;
+    kevent_signal((kevent*)timer->ctx);
+}
+
+//Wakes the daemon in delay_ms unless it is already due sooner
+static void arp_timer_schedule(uint32_t delay_ms){
+    irq_flags_t irq = irq_save_disable();
+    uint64_t due = timer_now_msec() + delay_ms;
+    if (!g_arp_timer.fn) ktimer_init(&g_arp_timer, arp_timer_fired, &g_arp_event);
+    if (!g_arp_timer_due_ms || due < g_arp_timer_due_ms){
+        g_arp_timer_due_ms = due;
+        ktimer_arm(&g_arp_timer, due * 1000);
+    }
+    irq_restore(irq);
+}
+
+//Entry timers count down from the last tick, so one started in between is stretched by the time already elapsed
+static inline uint32_t arp_from_last_tick(uint32_t ms){
+    if (!g_arp_last_tick_ms) return ms;
+    return ms + (uint32_t)(timer_now_msec() - g_arp_last_tick_ms);
+}
 
 static inline arp_table_t* l2_arp(uint8_t ifindex){
     l2_interface_t* l2 = l2_interface_find_by_index(ifindex);
     return l2 ? (arp_table_t*)l2->arp_table : 0;
 }
 
+static inline uint32_t arp_hash(uint32_t ip){
+    return (ip * 2654435761u) >> 27;
+}
+
+static inline bool arp_has_mac(const arp_entry_t* e){
+    return e->state == ARP_STATE_REACHABLE || e->state == ARP_STATE_STALE || e->state == ARP_STATE_PROBE;
+}
+
 arp_table_t* arp_table_create(void){
     arp_table_t* t = (arp_table_t*)malloc(sizeof(arp_table_t));
     if (!t) return 0;
     memset(t, 0, sizeof(*t));
+    for (int i=0;i<ARP_HASH_BUCKETS;i++) t->buckets[i] = ARP_NONE;
+    for (int i=0;i<ARP_TABLE_MAX;i++) t->next[i] = i + 1 < ARP_TABLE_MAX ? i + 1 : ARP_NONE;
+    t->free_head = 0;
     t->init = 1;
     arp_table_init_static_defaults(t);
     return t;
 }
 
-void arp_table_destroy(arp_table_t* t){
-    if (t) free_sized(t, sizeof(*t));
+static int arp_find_slot(arp_table_t* t, uint32_t ip){
+    if (!t) return -1;
+    for (int16_t i = t->buckets[arp_hash(ip)]; i != ARP_NONE; i = t->next[i])
+        if (t->entries[i].ip == ip) return i;
+    return -1;
 }
 
-void arp_table_init_static_defaults(arp_table_t* t){
+static void arp_drop_pending(arp_table_t* t, int idx){
+    for (uint8_t i=0;i<t->pending_count[idx];i++) netpkt_unref(t->pending[idx][i].pkt);
+    t->pending_count[idx] = 0;
+}
+
+static void arp_release_slot(arp_table_t* t, int idx){
+    int16_t* link = &t->buckets[arp_hash(t->entries[idx].ip)];
+    while (*link != ARP_NONE && *link != idx) link = &t->next[*link];
+    if (*link == idx) *link = t->next[idx];
+    arp_drop_pending(t, idx);
+    memset(&t->entries[idx], 0, sizeof(arp_entry_t));
+    t->next[idx] = t->free_head;
+    t->free_head = (int16_t)idx;
+}
+
+static int arp_acquire_slot(arp_table_t* t, uint32_t ip){
+    int idx = arp_find_slot(t, ip);
+    if (idx >= 0) return idx;
+    if (t->free_head == ARP_NONE){
+        int victim = -1;
+        for (int i=0;i<ARP_TABLE_MAX;i++){
+            arp_entry_t* e = &t->entries[i];
+            if (e->static_entry || e->state == ARP_STATE_INCOMPLETE) continue;
+            if (victim < 0 || e->ttl_ms < t->entries[victim].ttl_ms) victim = i;
+        }
+        if (victim < 0) return -1;
+        arp_release_slot(t, victim);
+    }
+    idx = t->free_head;
+    t->free_head = t->next[idx];
+    memset(&t->entries[idx], 0, sizeof(arp_entry_t));
+    t->entries[idx].ip = ip;
+    uint32_t b = arp_hash(ip);
+    t->next[idx] = t->buckets[b];
+    t->buckets[b] = (int16_t)idx;
+    return idx;
+}
+
+void arp_table_destroy(arp_table_t* t){
     if (!t) return;
-    t->entries[0].ip = 0xFFFFFFFFu;
-    t->entries[0].mac[0] = 0xFF;
-    t->entries[0].mac[1] = 0xFF;
-    t->entries[0].mac[2] = 0xFF;
-    t->entries[0].mac[3] = 0xFF;
-    t->entries[0].mac[4] = 0xFF;
-    t->entries[0].mac[5] = 0xFF;
-    t->entries[0].ttl_ms = 0;
-    t->entries[0].static_entry = 1;
+    for (int i=0;i<ARP_TABLE_MAX;i++) arp_drop_pending(t, i);
+    free_sized(t, sizeof(*t));
 }
 
-static int arp_find_slot(arp_table_t* t, uint32_t ip){
-    if (!t) return -1;
-    for (int i=0;i<ARP_TABLE_MAX;i++) if (t->entries[i].ip == ip) return i;
-    return -1;
+void arp_table_init_static_defaults(arp_table_t* t){
+    if (!t) return;
+    int idx = arp_acquire_slot(t, 0xFFFFFFFFu);
+    if (idx < 0) return;
+    memset(t->entries[idx].mac, 0xFF, 6);
+    t->entries[idx].ttl_ms = 0;
+    t->entries[idx].static_entry = 1;
+    t->entries[idx].state = ARP_STATE_REACHABLE;
 }
 
-static int arp_find_free(arp_table_t* t){
-    if (!t) return -1;
-    for (int i=0;i<ARP_TABLE_MAX;i++) if (t->entries[i].ip == 0) return i;
-    return -1;
+static void arp_flush_pending(uint8_t ifindex, arp_pending_t* list, uint8_t count, const uint8_t mac[6]){
+    for (uint8_t i=0;i<count;i++) (void)eth_send_frame_on(ifindex, list[i].ethertype, mac, list[i].pkt);
 }
 
 void arp_table_put_for_l2(uint8_t ifindex, uint32_t ip, const uint8_t mac[6], uint32_t ttl_ms, bool is_static){
     arp_table_t* t = l2_arp(ifindex);
     if (!t) return;
-    int idx = arp_find_slot(t, ip);
-    if (idx < 0) idx = arp_find_free(t);
-    if (idx < 0) idx = 0;
-    t->entries[idx].ip = ip;
-    memcpy(t->entries[idx].mac, mac, 6);
-    t->entries[idx].ttl_ms = is_static ? 0 : ttl_ms;
-    t->entries[idx].static_entry = is_static ? 1 : 0;
+    arp_pending_t pending[ARP_PENDING_MAX];
+    uint8_t pending_count = 0;
+
+    irq_flags_t irq = irq_save_disable();
+    int idx = arp_acquire_slot(t, ip);
+    if (idx < 0){
+        irq_restore(irq);
+        return;
+    }
+    arp_entry_t* e = &t->entries[idx];
+    memcpy(e->mac, mac, 6);
+    e->ttl_ms = is_static ? 0 : arp_from_last_tick(ttl_ms);
+    e->static_entry = is_static ? 1 : 0;
+    e->state = ARP_STATE_REACHABLE;
+    e->timer_ms = arp_from_last_tick(ARP_REACHABLE_MS);
+    e->probes_sent = 0;
+    pending_count = t->pending_count[idx];
+    memcpy(pending, t->pending[idx], pending_count * sizeof(arp_pending_t));
+    t->pending_count[idx] = 0;
+    irq_restore(irq);
+
+    if (!is_static) arp_timer_schedule(ARP_REACHABLE_MS);
+    arp_flush_pending(ifindex, pending, pending_count, mac);
 }
 
 bool arp_table_get_for_l2(uint8_t ifindex, uint32_t ip, uint8_t mac_out[6]){
     arp_table_t* t = l2_arp(ifindex);
     if (!t) return false;
-    for (int i=0;i<ARP_TABLE_MAX;i++){
-        if (t->entries[i].ip == ip){
-            memcpy(mac_out, t->entries[i].mac, 6);
-            return true;
-        }
-    }
-    return false;
+    int idx = arp_find_slot(t, ip);
+    if (idx < 0 || !arp_has_mac(&t->entries[idx])) return false;
+    memcpy(mac_out, t->entries[idx].mac, 6);
+    return true;
 }
 
-void arp_table_tick_for_l2(uint8_t ifindex, uint32_t ms){
+uint32_t arp_table_tick_for_l2(uint8_t ifindex, uint32_t ms){
     arp_table_t* t = l2_arp(ifindex);
-    if (!t) return;
+    if (!t) return 0;
+    uint32_t next = 0;
+    uint32_t probes[ARP_TABLE_MAX];
+    uint32_t probe_count = 0;
+
+    irq_flags_t irq = irq_save_disable();
     for (int i=0;i<ARP_TABLE_MAX;i++){
-        if (t->entries[i].ip == 0 || t->entries[i].static_entry) continue;
-        if (t->entries[i].ttl_ms <= ms){
-            memset(&t->entries[i], 0, sizeof(arp_entry_t));
-        } else {
-            t->entries[i].ttl_ms -= ms;
+        arp_entry_t* e = &t->entries[i];
+        if (e->state == ARP_STATE_UNUSED || e->static_entry) continue;
+        if (e->ttl_ms <= ms){
+            arp_release_slot(t, i);
+            continue;
+        }
+        e->ttl_ms -= ms;
+        e->timer_ms = e->timer_ms > ms ? e->timer_ms - ms : 0;
+        if (e->timer_ms) continue;
+
+        switch (e->state){
+        case ARP_STATE_REACHABLE:
+            e->state = ARP_STATE_STALE;
+            break;
+        case ARP_STATE_INCOMPLETE:
+        case ARP_STATE_PROBE:
+            if (e->probes_sent >= ARP_MAX_PROBES){
+                arp_release_slot(t, i);
+                break;
+            }
+            e->probes_sent++;
+            e->timer_ms = ARP_RETRANS_MS;
+            probes[probe_count++] = e->ip;
+            break;
+        default:
+            break;
         }
     }
+    for (int i=0;i<ARP_TABLE_MAX;i++){
+        arp_entry_t* e = &t->entries[i];
+        if (e->state == ARP_STATE_UNUSED || e->static_entry) continue;
+        if (!next || e->ttl_ms < next) next = e->ttl_ms;
+        if (e->timer_ms && e->timer_ms < next) next = e->timer_ms;
+    }
+    irq_restore(irq);
+
+    for (uint32_t i=0;i<probe_count;i++) arp_send_request_on(ifindex, probes[i]);
+    return next;
 }
 
-void arp_tick_all(uint32_t ms){
+uint32_t arp_tick_all(uint32_t ms){
+    uint32_t next = 0;
     for (uint8_t i=1;i<=MAX_L2_INTERFACES;i++){
         l2_interface_t* l2 = l2_interface_find_by_index(i);
         if (!l2) continue;
         if (!l2->arp_table) continue;
-        arp_table_tick_for_l2(i, ms);
+        uint32_t due = arp_table_tick_for_l2(i, ms);
+        if (due && (!next || due < next)) next = due;
     }
+    return next;
 }
 
 static uint32_t pick_spa_for_l2(uint8_t ifindex, uint32_t target_ip){
@@ -127,22 +274,65 @@ static uint32_t pick_spa_for_l2(uint8_t ifindex, uint32_t target_ip){
     return 0;
 }
 
-bool arp_resolve_on(uint8_t ifindex, uint32_t ip, uint8_t mac_out[6], uint32_t timeout_ms){
+bool arp_output(uint8_t ifindex, uint32_t ip, uint16_t ethertype, netpkt_t* pkt){
+    if (!pkt) return false;
+    uint8_t mac[6];
     if (ip == 0xFFFFFFFFu){
-        memset(mac_out, 0xFF, 6);
-        return true;
-    }
-    if (arp_table_get_for_l2(ifindex, ip, mac_out)) return true;
-    arp_send_request_on(ifindex, ip);
-    uint32_t waited = 0;
-    const uint32_t POLL_MS = 100;
-    while (waited < timeout_ms) {
-        arp_table_tick_for_l2(ifindex, POLL_MS);
-        if (arp_table_get_for_l2(ifindex, ip, mac_out)) return true;
-        msleep(POLL_MS);
-        waited += POLL_MS;
+        memset(mac, 0xFF, 6);
+        return eth_send_frame_on(ifindex, ethertype, mac, pkt);
     }
-    return false;
+    arp_table_t* t = l2_arp(ifindex);
+    if (!t){
+        netpkt_unref(pkt);
+        return false;
+    }
+
+    irq_flags_t irq = irq_save_disable();
+    int idx = arp_find_slot(t, ip);
+    if (idx >= 0 && arp_has_mac(&t->entries[idx])){
+        arp_entry_t* e = &t->entries[idx];
+        bool probe = e->state == ARP_STATE_STALE;
+        if (probe){
+            e->state = ARP_STATE_PROBE;
+            e->probes_sent = 1;
+            e->timer_ms = arp_from_last_tick(ARP_RETRANS_MS);
+        }
+        memcpy(mac, e->mac, 6);
+        irq_restore(irq);
+        if (probe){
+            arp_timer_schedule(ARP_RETRANS_MS);
+            arp_send_request_on(ifindex, ip);
+        }
+        return eth_send_frame_on(ifindex, ethertype, mac, pkt);
+    }
+
+    bool request = idx < 0;
+    if (request){
+        idx = arp_acquire_slot(t, ip);
+        if (idx < 0){
+            irq_restore(irq);
+            netpkt_unref(pkt);
+            return false;
+        }
+        arp_entry_t* e = &t->entries[idx];
+        e->state = ARP_STATE_INCOMPLETE;
+        e->ttl_ms = arp_from_last_tick(ARP_RETRANS_MS * (ARP_MAX_PROBES + 1));
+        e->timer_ms = arp_from_last_tick(ARP_RETRANS_MS);
+        e->probes_sent = 1;
+    }
+    if (t->pending_count[idx] == ARP_PENDING_MAX){
+        netpkt_unref(t->pending[idx][0].pkt);
+        for (int i=1;i<ARP_PENDING_MAX;i++) t->pending[idx][i - 1] = t->pending[idx][i];
+        t->pending_count[idx]--;
+    }
+    t->pending[idx][t->pending_count[idx]++] = (arp_pending_t){ .pkt = pkt, .ethertype = ethertype };
+    irq_restore(irq);
+
+    if (request){
+        arp_timer_schedule(ARP_RETRANS_MS);
+        arp_send_request_on(ifindex, ip);
+    }
+    return true;
 }
 
 void arp_send_request_on(uint8_t ifindex, uint32_t target_ip){
@@ -218,7 +408,7 @@ void arp_input(uint16_t ifindex, netpkt_t* pkt) {
     uint32_t sender_ip = bswap32(hdr->sender_ip);
     uint32_t target_ip = bswap32(hdr->target_ip);
 
-    arp_table_put_for_l2((uint8_t)ifindex, sender_ip, hdr->sender_mac, 180000, false);
+    arp_table_put_for_l2((uint8_t)ifindex, sender_ip, hdr->sender_mac, ARP_TTL_MS, false);
 
     if (op == ARP_OPCODE_REQUEST) {
         char tbuf[16], abuf[16];
@@ -241,9 +431,13 @@ uint16_t arp_get_pid(void){ return g_arp_pid; }
 int arp_daemon_entry(int argc, char* argv[]){
     (void)argc; (void)argv;
     arp_set_pid(get_current_proc_pid());
-    const uint32_t tick_ms = 10000;
+    g_arp_last_tick_ms = timer_now_msec();
+    //Sleeps until the earliest entry timer, or until arp_output or a new entry arms one
     while (1){
-        arp_tick_all(tick_ms);
-        msleep(tick_ms);
+        uint64_t now = timer_now_msec();
+        uint32_t next = arp_tick_all((uint32_t)(now - g_arp_last_tick_ms));
+        g_arp_last_tick_ms = now;
+        if (next) arp_timer_schedule(next);
+        kevent_wait(&g_arp_event, 0);
     }
 }
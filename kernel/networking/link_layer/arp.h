@@ -23,11 +23,24 @@ typedef struct __attribute__((packed)) arp_hdr_t {
     uint32_t target_ip;
 } arp_hdr_t;
 
+#define ARP_PENDING_MAX 8
+
+typedef enum {
+    ARP_STATE_UNUSED = 0,
+    ARP_STATE_INCOMPLETE = 1,
+    ARP_STATE_REACHABLE = 2,
+    ARP_STATE_STALE = 3,
+    ARP_STATE_PROBE = 4
+} arp_state_t;
+
 typedef struct arp_entry {
     uint32_t ip;
     uint8_t  mac[6];
     uint32_t ttl_ms;
     uint8_t  static_entry;//1 static, 0 dynamic
+    uint8_t  state;
+    uint8_t  probes_sent;
+    uint32_t timer_ms;
 } arp_entry_t;
 
 typedef struct arp_table arp_table_t;
@@ -38,10 +51,12 @@ void arp_table_init_static_defaults(arp_table_t* t);
 
 void arp_table_put_for_l2(uint8_t ifindex, uint32_t ip, const uint8_t mac[6], uint32_t ttl_ms, bool is_static);
 bool arp_table_get_for_l2(uint8_t ifindex, uint32_t ip, uint8_t mac_out[6]);
-void arp_table_tick_for_l2(uint8_t ifindex, uint32_t ms);
-void arp_tick_all(uint32_t ms);
+//Age entries by ms and return the time until the next entry timer runs out, 0 when none is running
+uint32_t arp_table_tick_for_l2(uint8_t ifindex, uint32_t ms);
+uint32_t arp_tick_all(uint32_t ms);
 
-bool arp_resolve_on(uint8_t ifindex, uint32_t ip, uint8_t mac_out[6], uint32_t timeout_ms);
+//Sends pkt to ip on ifindex, queueing it until the neighbor answers if its address is not known yet
+bool arp_output(uint8_t ifindex, uint32_t ip, uint16_t ethertype, netpkt_t* pkt);
 void arp_send_request_on(uint8_t ifindex, uint32_t target_ip);
 
 void arp_input(uint16_t ifindex, netpkt_t* pkt);
@@ -10,9 +10,25 @@
 #include "networking/network.h"
 #include "process/scheduler.h"
 #include "math/rng.h"
+#include "networking/netpkt.h"
+#include "networking/link_layer/eth.h"
+#include "exceptions/irq.h"
+#include "exceptions/ktimer.h"
+#include "exceptions/timer.h"
+#include "process/waitqueue.h"
+
+#define NDP_HASH_BUCKETS 32
+#define NDP_NONE -1
+#define NDP_DELAY_FIRST_PROBE_MS 5000
+#define NDP_DAD_INTERVAL_MS 1000
+#define NDP_RS_INTERVAL_MS 4000
 
 typedef struct {
     ndp_entry_t entries[NDP_TABLE_MAX];
+    int16_t next[NDP_TABLE_MAX];
+    int16_t buckets[NDP_HASH_BUCKETS];
+    netpkt_t* pending[NDP_TABLE_MAX][NDP_PENDING_MAX];
+    uint8_t pending_count[NDP_TABLE_MAX];
     uint8_t init;
 } ndp_table_impl_t;
 
@@ -20,6 +36,10 @@ static uint32_t g_ndp_reachable_time_ms = 30000;
 static uint32_t g_ndp_retrans_timer_ms = 1000;
 static uint8_t g_ndp_max_probes = 3;
 static volatile uint16_t g_ndp_pid = 0xFFFF;
+static kevent g_ndp_event;
+static ktimer g_ndp_timer;
+static uint64_t g_ndp_timer_due_ms;
+static uint64_t g_ndp_last_tick_ms;
 
 static rng_t g_rng;
 
@@ -71,6 +91,37 @@ typedef struct __attribute__((packed)) {
 static uint8_t g_rs_tries[MAX_L2_INTERFACES];
 static uint32_t g_rs_timer_ms[MAX_L2_INTERFACES];
 
+static void ndp_timer_fired(ktimer* timer) {
+    g_ndp_timer_due_ms = 0;
+    kevent_signal((kevent*)timer->ctx);
+}
+
+//Wakes the daemon in delay_ms unless it is already due sooner
+static void ndp_timer_schedule(uint32_t delay_ms) {
+    irq_flags_t irq = irq_save_disable();
+    uint64_t due = timer_now_msec() + delay_ms;
+    if (!g_ndp_timer.fn) ktimer_init(&g_ndp_timer, ndp_timer_fired, &g_ndp_event);
+    if (!g_ndp_timer_due_ms || due < g_ndp_timer_due_ms) {
+        g_ndp_timer_due_ms = due;
+        ktimer_arm(&g_ndp_timer, due * 1000);
+    }
+    irq_restore(irq);
+}
+
+//Entry timers count down from the last tick, so one started in between is stretched by the time already elapsed
+static inline uint32_t ndp_from_last_tick(uint32_t ms) {
+    if (!g_ndp_last_tick_ms) return ms;
+    return ms + (uint32_t)(timer_now_msec() - g_ndp_last_tick_ms);
+}
+
+static inline void ndp_due_min(uint32_t* next, uint32_t ms) {
+    if (ms && (!*next || ms < *next)) *next = ms;
+}
+
+void ndp_kick(void) {
+    kevent_signal(&g_ndp_event);
+}
+
 static void make_random_iid(uint8_t out_iid[8]) {
     uint64_t x = 0;
 
@@ -128,26 +179,32 @@ static void handle_dad_failed(l3_ipv6_interface_t* v6) {
     (void)ndp_request_dad_on(v6->l2 ? v6->l2->ifindex : 0, new_ip);
 }
 
-static void handle_lifetimes(uint32_t now_ms, l3_ipv6_interface_t* v6) {
-    if (!v6) return;
-    if (ipv6_is_placeholder_gua(v6->ip)) return;
-    if (ipv6_is_unspecified(v6->ip)) return;
-    if (ipv6_is_linklocal(v6->ip)) return;
-    if (!v6->ra_last_update_ms) return;
+//Returns the time until the next lifetime of v6 runs out, 0 when none will
+static uint32_t handle_lifetimes(uint32_t now_ms, l3_ipv6_interface_t* v6) {
+    if (!v6) return 0;
+    if (ipv6_is_placeholder_gua(v6->ip)) return 0;
+    if (ipv6_is_unspecified(v6->ip)) return 0;
+    if (ipv6_is_linklocal(v6->ip)) return 0;
+    if (!v6->ra_last_update_ms) return 0;
 
     uint32_t elapsed_ms = now_ms >= v6->ra_last_update_ms ? now_ms - v6->ra_last_update_ms : 0;
+    uint32_t next = 0;
 
     if (v6->preferred_lifetime && v6->preferred_lifetime != 0xFFFFFFFFu) {
         uint64_t pref_ms = (uint64_t)v6->preferred_lifetime * 1000ull;
         if ((uint64_t)elapsed_ms >= pref_ms) v6->preferred_lifetime = 0;
+        else if (pref_ms - elapsed_ms < 0xFFFFFFFFull) next = (uint32_t)(pref_ms - elapsed_ms);
     }
 
-    if (v6->valid_lifetime == 0xFFFFFFFFu) return;
+    if (v6->valid_lifetime == 0xFFFFFFFFu) return next;
 
     uint64_t valid_ms = (uint64_t)v6->valid_lifetime * 1000ull;
     if ((uint64_t)elapsed_ms >= valid_ms) {
         if (!l3_ipv6_remove_from_interface(v6->l3_id)) (void)l3_ipv6_set_enabled(v6->l3_id, false);
+        return 0;
     }
+    if (valid_ms - elapsed_ms < 0xFFFFFFFFull) ndp_due_min(&next, (uint32_t)(valid_ms - elapsed_ms));
+    return next;
 }
 
 static void apply_ra_policy(uint32_t now_ms, l2_interface_t* l2) {
@@ -322,6 +379,7 @@ ndp_table_t* ndp_table_create(void) {
     if (!t) return 0;
 
     memset(t, 0, sizeof(*t));
+    for (int i = 0; i < NDP_HASH_BUCKETS; i++) t->buckets[i] = NDP_NONE;
     t->init = 1;
 
     return (ndp_table_t*)t;
@@ -329,6 +387,9 @@ ndp_table_t* ndp_table_create(void) {
 
 void ndp_table_destroy(ndp_table_t* t) {
     if (!t) return;
+    ndp_table_impl_t* impl = (ndp_table_impl_t*)t;
+    for (int i = 0; i < NDP_TABLE_MAX; i++)
+        for (uint8_t j = 0; j < impl->pending_count[i]; j++) netpkt_unref(impl->pending[i][j]);
     free_sized(t, sizeof(ndp_table_impl_t));
 }
 
@@ -339,67 +400,97 @@ static ndp_table_impl_t* l2_ndp(uint8_t ifindex) {
     return (ndp_table_impl_t*)l2->nd_table;
 }
 
-static int ndp_find_slot(ndp_table_impl_t* t, const uint8_t ip[16]) {
-    if (!t) return -1;
-
-    for (int i = 0; i < NDP_TABLE_MAX; i++) {
-        if (!t->entries[i].ttl_ms) continue;
-        if (memcmp(t->entries[i].ip, ip, 16) == 0) return i;
-    }
+static inline uint32_t ndp_hash(const uint8_t ip[16]) {
+    uint32_t h = 2166136261u;
+    for (int i = 8; i < 16; i++) h = (h ^ ip[i]) * 16777619u;
+    return h % NDP_HASH_BUCKETS;
+}
 
-    return -1;
+static inline bool ndp_has_mac(const ndp_entry_t* e) {
+    return e->ttl_ms && e->state != NDP_STATE_UNUSED && e->state != NDP_STATE_INCOMPLETE;
 }
 
-static int ndp_find_free(ndp_table_impl_t* t) {
+static int ndp_find_slot(ndp_table_impl_t* t, const uint8_t ip[16]) {
     if (!t) return -1;
 
-    for (int i = 0; i < NDP_TABLE_MAX; i++) if (t->entries[i].ttl_ms == 0 && t->entries[i].state == NDP_STATE_UNUSED) return i;
+    for (int16_t i = t->buckets[ndp_hash(ip)]; i != NDP_NONE; i = t->next[i])
+        if (memcmp(t->entries[i].ip, ip, 16) == 0) return i;
 
     return -1;
 }
 
-static void ndp_entry_clear(ndp_entry_t* e) {
+static void ndp_entry_release(ndp_table_impl_t* t, int idx) {
+    ndp_entry_t* e = &t->entries[idx];
+    if (e->ttl_ms || e->state != NDP_STATE_UNUSED) {
+        int16_t* link = &t->buckets[ndp_hash(e->ip)];
+        while (*link != NDP_NONE && *link != idx) link = &t->next[*link];
+        if (*link == idx) *link = t->next[idx];
+    }
+    for (uint8_t j = 0; j < t->pending_count[idx]; j++) netpkt_unref(t->pending[idx][j]);
+    t->pending_count[idx] = 0;
     memset(e, 0, sizeof(*e));
     e->state = NDP_STATE_UNUSED;
 }
 
-void ndp_table_put_for_l2(uint8_t ifindex, const uint8_t ip[16], const uint8_t mac[6], uint32_t ttl_ms, bool router) {
-    ndp_table_impl_t* t = l2_ndp(ifindex);
-    if (!t) return;
-
+//Returns the entry for ip, taking a free or evicted slot if needed. New slots keep ttl_ms 0 and NDP_STATE_UNUSED
+static int ndp_acquire_slot(ndp_table_impl_t* t, const uint8_t ip[16]) {
     int idx = ndp_find_slot(t, ip);
-    if (idx < 0) idx = ndp_find_free(t);
+    if (idx >= 0) return idx;
 
-    if (idx < 0) {
-        uint32_t best_ttl = 0xFFFFFFFFu;
-        int best_i = -1;
+    uint32_t best_ttl = 0xFFFFFFFFu;
+    int best_i = -1;
 
-        for (int i = 0; i < NDP_TABLE_MAX; i++) {
-            ndp_entry_t* e = &t->entries[i];
-            if (e->state == NDP_STATE_UNUSED || e->ttl_ms == 0) {
-                best_i = i;
-                break;
-            }
+    for (int i = 0; i < NDP_TABLE_MAX; i++) {
+        ndp_entry_t* e = &t->entries[i];
+        if (e->state == NDP_STATE_UNUSED && e->ttl_ms == 0) {
+            best_i = i;
+            break;
+        }
 
-            if (e->is_router && e->router_lifetime_ms) continue;
+        if (e->is_router && e->router_lifetime_ms) continue;
 
-            if (e->ttl_ms < best_ttl) {
-                best_ttl = e->ttl_ms;
-                best_i = i;
-            }
+        if (e->ttl_ms < best_ttl) {
+            best_ttl = e->ttl_ms;
+            best_i = i;
         }
-
-        if (best_i < 0) best_i = 0;
-        idx = best_i;
     }
 
+    if (best_i < 0) best_i = 0;
+    ndp_entry_release(t, best_i);
+
+    memcpy(t->entries[best_i].ip, ip, 16);
+    uint32_t b = ndp_hash(ip);
+    t->next[best_i] = t->buckets[b];
+    t->buckets[b] = (int16_t)best_i;
+    return best_i;
+}
+
+static void ndp_flush_pending(uint8_t ifindex, ndp_table_impl_t* t, int idx) {
+    if (!t->pending_count[idx] || !ndp_has_mac(&t->entries[idx])) return;
+
+    netpkt_t* pending[NDP_PENDING_MAX];
+    uint8_t mac[6];
+    irq_flags_t irq = irq_save_disable();
+    uint8_t count = t->pending_count[idx];
+    memcpy(pending, t->pending[idx], count * sizeof(netpkt_t*));
+    t->pending_count[idx] = 0;
+    memcpy(mac, t->entries[idx].mac, 6);
+    irq_restore(irq);
+
+    for (uint8_t i = 0; i < count; i++) eth_send_frame_on(ifindex, ETHERTYPE_IPV6, mac, pending[i]);
+}
+
+void ndp_table_put_for_l2(uint8_t ifindex, const uint8_t ip[16], const uint8_t mac[6], uint32_t ttl_ms, bool router) {
+    ndp_table_impl_t* t = l2_ndp(ifindex);
+    if (!t) return;
+
+    int idx = ndp_acquire_slot(t, ip);
     ndp_entry_t* e = &t->entries[idx];
-    memcpy(e->ip, ip, 16);
 
     if (mac) {
         memcpy(e->mac, mac, 6);
         e->state = NDP_STATE_REACHABLE;
-        e->timer_ms = g_ndp_reachable_time_ms;
+        e->timer_ms = ndp_from_last_tick(g_ndp_reachable_time_ms);
     }
 
     if (ttl_ms == 0) {
@@ -407,28 +498,24 @@ void ndp_table_put_for_l2(uint8_t ifindex, const uint8_t ip[16], const uint8_t m
         if (ttl_ms == 0) ttl_ms = 1;
     }
 
-    e->ttl_ms = ttl_ms;
+    e->ttl_ms = ndp_from_last_tick(ttl_ms);
     e->is_router = router ? 1 : 0;
-    e->router_lifetime_ms = router ? ttl_ms : 0;
+    e->router_lifetime_ms = router ? e->ttl_ms : 0;
     e->probes_sent = 0;
+
+    ndp_timer_schedule(mac && g_ndp_reachable_time_ms < ttl_ms ? g_ndp_reachable_time_ms : ttl_ms);
+    ndp_flush_pending(ifindex, t, idx);
 }
 
 static bool ndp_table_get_for_l2(uint8_t ifindex, const uint8_t ip[16], uint8_t mac_out[6]) {
     ndp_table_impl_t* t = l2_ndp(ifindex);
     if (!t) return false;
 
-    for (int i = 0; i < NDP_TABLE_MAX; i++) {
-        ndp_entry_t* e = &t->entries[i];
-        if (!e->ttl_ms) continue;
-        if (e->state == NDP_STATE_UNUSED) continue;
-        if (e->state == NDP_STATE_INCOMPLETE) continue;
-        if (memcmp(e->ip, ip, 16) != 0) continue;
-
-        memcpy(mac_out, e->mac, 6);
-        return true;
-    }
+    int idx = ndp_find_slot(t, ip);
+    if (idx < 0 || !ndp_has_mac(&t->entries[idx])) return false;
 
-    return false;
+    memcpy(mac_out, t->entries[idx].mac, 6);
+    return true;
 }
 
 static bool ndp_send_na_on(uint8_t ifindex, const uint8_t dst_ip[16], const uint8_t src_ip[16], const uint8_t target_ip[16], const uint8_t dst_mac_in[6], const uint8_t my_mac[6], uint8_t solicited) {
@@ -554,44 +641,49 @@ static void ndp_send_rs_on(uint8_t ifindex) {
     free_sized((void*)buf, plen);
 }
 
-static void ndp_send_probe(uint8_t ifindex, ndp_entry_t* e) {
-    uint8_t src_ip[16] = {0};
+static void ndp_pick_source(uint8_t ifindex, uint8_t src_ip[16]) {
+    memset(src_ip, 0, 16);
     l2_interface_t* l2 = l2_interface_find_by_index(ifindex);
+    if (!l2) return;
 
-    if (l2) {
-        for (int i = 0; i < MAX_IPV6_PER_INTERFACE; i++) {
-            l3_ipv6_interface_t* v6 = l2->l3_v6[i];
-            if (!v6) continue;
-            if (v6->cfg == IPV6_CFG_DISABLE) continue;
-            if (v6->dad_state!= IPV6_DAD_OK) continue;
-
-            if (ipv6_is_linklocal(v6->ip)) {
-                memcpy(src_ip, v6->ip, 16);
-                break;
-            }
+    for (int i = 0; i < MAX_IPV6_PER_INTERFACE; i++) {
+        l3_ipv6_interface_t* v6 = l2->l3_v6[i];
+        if (!v6) continue;
+        if (v6->cfg == IPV6_CFG_DISABLE) continue;
+        if (v6->dad_state != IPV6_DAD_OK) continue;
 
-            if (ipv6_is_unspecified(src_ip) && !ipv6_is_unspecified(v6->ip))
-                memcpy(src_ip, v6->ip, 16);
+        if (ipv6_is_linklocal(v6->ip)) {
+            memcpy(src_ip, v6->ip, 16);
+            break;
         }
+
+        if (ipv6_is_unspecified(src_ip) && !ipv6_is_unspecified(v6->ip))
+            memcpy(src_ip, v6->ip, 16);
     }
+}
 
+static void ndp_send_probe(uint8_t ifindex, const ndp_entry_t* e) {
+    uint8_t src_ip[16];
+    ndp_pick_source(ifindex, src_ip);
     ndp_send_ns_on(ifindex, e->ip, src_ip);
 }
 
-static void ndp_table_tick_for_l2(uint8_t ifindex, uint32_t ms) {
+//Returns the time until the next entry timer runs out, 0 when none is running
+static uint32_t ndp_table_tick_for_l2(uint8_t ifindex, uint32_t ms) {
     ndp_table_impl_t* t = l2_ndp(ifindex);
-    if (!t) return;
+    if (!t) return 0;
+    uint32_t next = 0;
 
     for (int i = 0; i < NDP_TABLE_MAX; i++) {
         ndp_entry_t* e =&t->entries[i];
 
         if (!e->ttl_ms) {
-            if (e->state != NDP_STATE_UNUSED) ndp_entry_clear(e);
+            if (e->state != NDP_STATE_UNUSED) ndp_entry_release(t, i);
             continue;
         }
 
         if (e->ttl_ms <= ms) {
-            ndp_entry_clear(e);
+            ndp_entry_release(t, i);
             continue;
         }
 
@@ -619,7 +711,7 @@ static void ndp_table_tick_for_l2(uint8_t ifindex, uint32_t ms) {
                     e->timer_ms = g_ndp_retrans_timer_ms;
                     ndp_send_probe(ifindex, e);
                 } else {
-                    ndp_entry_clear(e);
+                    ndp_entry_release(t, i);
                 }
             }
             break;
@@ -643,99 +735,93 @@ static void ndp_table_tick_for_l2(uint8_t ifindex, uint32_t ms) {
                     e->probes_sent++;
                     e->timer_ms = g_ndp_retrans_timer_ms;
                     ndp_send_probe(ifindex, e);
-                } else ndp_entry_clear(e);
+                } else ndp_entry_release(t, i);
             }
             break;
 
         default:
             break;
         }
+
+        if (!e->ttl_ms) continue;
+        ndp_due_min(&next, e->ttl_ms);
+        ndp_due_min(&next, e->timer_ms);
+        ndp_due_min(&next, e->router_lifetime_ms);
     }
+    return next;
 }
 
-static void ndp_tick_all(uint32_t ms) {
+static uint32_t ndp_tick_all(uint32_t ms) {
     uint8_t n = l2_interface_count();
+    uint32_t next = 0;
 
     for (uint8_t i = 0; i < n; i++) {
         l2_interface_t* l2 = l2_interface_at(i);
         if (!l2) continue;
         if (!l2->is_up) continue;
 
-        ndp_table_tick_for_l2(l2->ifindex, ms);
+        ndp_due_min(&next, ndp_table_tick_for_l2(l2->ifindex, ms));
     }
+    return next;
 }
 
-bool ndp_resolve_on(uint16_t ifindex, const uint8_t next_hop[16], uint8_t out_mac[6], uint32_t timeout_ms) {
+bool ndp_output(uint16_t ifindex, const uint8_t next_hop[16], netpkt_t* pkt) {
+    if (!pkt) return false;
+
+    uint8_t mac[6];
     if (ipv6_is_multicast(next_hop)) {
-        ipv6_multicast_mac(next_hop, out_mac);
-        return true;
+        ipv6_multicast_mac(next_hop, mac);
+        return eth_send_frame_on(ifindex, ETHERTYPE_IPV6, mac, pkt);
     }
 
-    if (ndp_table_get_for_l2((uint8_t)ifindex, next_hop, out_mac)) return true;
-
     ndp_table_impl_t* t = l2_ndp((uint8_t)ifindex);
-    if (t) {
-        int idx = ndp_find_slot(t, next_hop);
-        if (idx >= 0) {
-            ndp_entry_t* e = &t->entries[idx];
-            if (e->ttl_ms && e->is_router && e->state != NDP_STATE_UNUSED && e->state != NDP_STATE_INCOMPLETE) {
-                memcpy(out_mac, e->mac, 6);
-                return true;
-            }
-        }
+    if (!t) {
+        netpkt_unref(pkt);
+        return false;
     }
 
-    uint8_t src_ip[16] = {0};
-    l2_interface_t* l2 = l2_interface_find_by_index((uint8_t)ifindex);
-
-    if (l2) {
-        for (int i = 0; i < MAX_IPV6_PER_INTERFACE; i++) {
-            l3_ipv6_interface_t* v6 = l2->l3_v6[i];
-            if (!v6) continue;
-            if (v6->cfg == IPV6_CFG_DISABLE) continue;
-            if (v6->dad_state != IPV6_DAD_OK) continue;
-
-            if (ipv6_is_linklocal(v6->ip)) {
-                memcpy(src_ip, v6->ip, 16);
-                break;
-            }
-
-            if (ipv6_is_unspecified(src_ip) && !ipv6_is_unspecified(v6->ip))
-                memcpy(src_ip, v6->ip, 16);
+    irq_flags_t irq = irq_save_disable();
+    int idx = ndp_find_slot(t, next_hop);
+    if (idx >= 0 && ndp_has_mac(&t->entries[idx])) {
+        ndp_entry_t* e = &t->entries[idx];
+        bool delay = e->state == NDP_STATE_STALE;
+        if (delay) {
+            e->state = NDP_STATE_DELAY;
+            e->timer_ms = ndp_from_last_tick(NDP_DELAY_FIRST_PROBE_MS);
         }
+        memcpy(mac, e->mac, 6);
+        irq_restore(irq);
+        if (delay) ndp_timer_schedule(NDP_DELAY_FIRST_PROBE_MS);
+        return eth_send_frame_on(ifindex, ETHERTYPE_IPV6, mac, pkt);
     }
 
-    t = l2_ndp((uint8_t)ifindex);
-    if (t) {
-        int idx = ndp_find_slot(t, next_hop);
-        if (idx < 0) idx = ndp_find_free(t);
-
-        if (idx >= 0) {
-            ndp_entry_t* e = &t->entries[idx];
-            memcpy(e->ip, next_hop, 16);
-            memset(e->mac, 0, 6);
-            e->ttl_ms = g_ndp_reachable_time_ms * 4;
-            e->is_router = 0;
-            e->router_lifetime_ms = 0;
-            e->state = NDP_STATE_INCOMPLETE;
-            e->timer_ms = g_ndp_retrans_timer_ms;
-            e->probes_sent = 0;
-        }
+    bool solicit = idx < 0 || t->entries[idx].state != NDP_STATE_INCOMPLETE;
+    if (solicit) {
+        idx = ndp_acquire_slot(t, next_hop);
+        ndp_entry_t* e = &t->entries[idx];
+        memset(e->mac, 0, 6);
+        e->ttl_ms = ndp_from_last_tick(g_ndp_reachable_time_ms * 4);
+        e->is_router = 0;
+        e->router_lifetime_ms = 0;
+        e->state = NDP_STATE_INCOMPLETE;
+        e->timer_ms = ndp_from_last_tick(g_ndp_retrans_timer_ms);
+        e->probes_sent = 0;
     }
-
-    ndp_send_ns_on((uint8_t)ifindex, next_hop, src_ip);
-
-    uint32_t waited = 0;
-    const uint32_t poll = 50;
-
-    while (waited < timeout_ms) {
-        ndp_table_tick_for_l2((uint8_t)ifindex, poll);
-        if (ndp_table_get_for_l2((uint8_t)ifindex, next_hop, out_mac)) return true;
-        msleep(poll);
-        waited += poll;
+    if (t->pending_count[idx] == NDP_PENDING_MAX) {
+        netpkt_unref(t->pending[idx][0]);
+        for (int i = 1; i < NDP_PENDING_MAX; i++) t->pending[idx][i - 1] = t->pending[idx][i];
+        t->pending_count[idx]--;
     }
-
-    return false;
+    t->pending[idx][t->pending_count[idx]++] = pkt;
+    irq_restore(irq);
+
+    if (solicit) {
+        ndp_timer_schedule(g_ndp_retrans_timer_ms);
+        uint8_t src_ip[16];
+        ndp_pick_source((uint8_t)ifindex, src_ip);
+        ndp_send_ns_on((uint8_t)ifindex, next_hop, src_ip);
+    }
+    return true;
 }
 
 bool ndp_request_dad_on(uint8_t ifindex, const uint8_t ip[16]) {
@@ -761,6 +847,7 @@ bool ndp_request_dad_on(uint8_t ifindex, const uint8_t ip[16]) {
         ipv6_make_multicast(2, IPV6_MCAST_SOLICITED_NODE, v6->ip, sn);
         (void)l2_ipv6_mcast_join(ifindex, sn);
 
+        ndp_kick();
         return true;
     }
 
@@ -803,6 +890,7 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
                 self->dad_timer_ms = 0;
                 self->dad_probes_sent = 0;
                 self->dad_requested = 0;
+                ndp_kick();
             }
             return;
         }
@@ -853,6 +941,7 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
                     v6->dad_requested = 0;
                     v6->dad_timer_ms = 0;
                     v6->dad_probes_sent = 0;
+                    ndp_kick();
                     return;
                 }
             }
@@ -868,32 +957,7 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
         ndp_table_impl_t* t = l2_ndp((uint8_t)ifindex);
         if (!t) return;
 
-        int idx = ndp_find_slot(t, na->target);
-        if (idx < 0) idx = ndp_find_free(t);
-
-        if (idx < 0) {
-            uint32_t best_ttl = 0xFFFFFFFFu;
-            int best_i = -1;
-
-            for (int i = 0; i < NDP_TABLE_MAX; i++) {
-                ndp_entry_t* e = &t->entries[i];
-                if (e->state == NDP_STATE_UNUSED || e->ttl_ms == 0) {
-                    best_i = i;
-                    break;
-                }
-
-                if (e->is_router && e->router_lifetime_ms) continue;
-
-                if (e->ttl_ms < best_ttl) {
-                    best_ttl = e->ttl_ms;
-                    best_i = i;
-                }
-            }
-
-            if (best_i < 0) best_i = 0;
-            idx = best_i;
-        }
-
+        int idx = ndp_acquire_slot(t, na->target);
         ndp_entry_t* e = &t->entries[idx];
 
         uint8_t old_mac[6];
@@ -902,14 +966,14 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
         if (e->ttl_ms == 0 && e->state == NDP_STATE_UNUSED) {
             memcpy(e->ip, na->target, 16);
             memcpy(e->mac, src_mac, 6);
-            e->ttl_ms = g_ndp_reachable_time_ms * 4;
+            e->ttl_ms = ndp_from_last_tick(g_ndp_reachable_time_ms * 4);
             e->probes_sent = 0;
             e->is_router = router ? 1 : 0;
             e->router_lifetime_ms = e->is_router ? e->ttl_ms : 0;
 
             if (solicited) {
                 e->state = NDP_STATE_REACHABLE;
-                e->timer_ms = g_ndp_reachable_time_ms;
+                e->timer_ms = ndp_from_last_tick(g_ndp_reachable_time_ms);
             } else {
                 e->state = NDP_STATE_STALE;
                 e->timer_ms = 0;
@@ -919,11 +983,11 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
 
             if (e->state == NDP_STATE_INCOMPLETE) {
                 memcpy(e->mac, src_mac, 6);
-                e->ttl_ms = g_ndp_reachable_time_ms * 4;
+                e->ttl_ms = ndp_from_last_tick(g_ndp_reachable_time_ms * 4);
 
                 if (solicited) {
                     e->state = NDP_STATE_REACHABLE;
-                    e->timer_ms = g_ndp_reachable_time_ms;
+                    e->timer_ms = ndp_from_last_tick(g_ndp_reachable_time_ms);
                 } else {
                     e->state = NDP_STATE_STALE;
                     e->timer_ms = 0;
@@ -932,16 +996,16 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
                 if (!mac_changed) {
                     if (solicited) {
                         e->state = NDP_STATE_REACHABLE;
-                        e->timer_ms = g_ndp_reachable_time_ms;
+                        e->timer_ms = ndp_from_last_tick(g_ndp_reachable_time_ms);
                     }
                 } else {
                     if (override) {
                         memcpy(e->mac, src_mac, 6);
-                        e->ttl_ms = g_ndp_reachable_time_ms * 4;
+                        e->ttl_ms = ndp_from_last_tick(g_ndp_reachable_time_ms * 4);
 
                         if (solicited) {
                             e->state = NDP_STATE_REACHABLE;
-                            e->timer_ms = g_ndp_reachable_time_ms;
+                            e->timer_ms = ndp_from_last_tick(g_ndp_reachable_time_ms);
                         } else {
                             e->state = NDP_STATE_STALE;
                             e->timer_ms = 0;
@@ -959,6 +1023,8 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
         }
 
         e->probes_sent = 0;
+        ndp_timer_schedule(g_ndp_reachable_time_ms);
+        ndp_flush_pending((uint8_t)ifindex, t, idx);
         return;
     }
 
@@ -1091,6 +1157,7 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
             opt_len -= opt_size;
         }
 
+        ndp_kick();
         return;
     }
 }
@@ -1104,10 +1171,14 @@ int ndp_daemon_entry(int argc, char* argv[]) {
     asm volatile ("mrs %0, cntvct_el0" : "=r"(virt_timer));
     rng_seed(&g_rng, virt_timer);
 
-    const uint32_t tick_ms = 1000;
+    g_ndp_last_tick_ms = timer_now_msec();
 
+    //Sleeps until the earliest neighbor, DAD, solicitation or lifetime timer, or until ndp_kick reports a change
     while (1) {
-        ndp_tick_all(tick_ms);
+        uint64_t now = timer_now_msec();
+        uint32_t elapsed_ms = (uint32_t)(now - g_ndp_last_tick_ms);
+        g_ndp_last_tick_ms = now;
+        uint32_t next = ndp_tick_all(elapsed_ms);
 
         uint32_t now_ms = get_time();
         uint8_t n = l2_interface_count();
@@ -1157,7 +1228,7 @@ int ndp_daemon_entry(int argc, char* argv[]) {
                     v6->dad_requested = 0;
                     v6->dad_state = IPV6_DAD_IN_PROGRESS;
                     v6->dad_probes_sent = 0;
-                    v6->dad_timer_ms = 0;
+                    v6->dad_timer_ms = NDP_DAD_INTERVAL_MS;
 
                     uint8_t sn[16];
                     ipv6_make_multicast(2, IPV6_MCAST_SOLICITED_NODE, v6->ip, sn);
@@ -1165,10 +1236,10 @@ int ndp_daemon_entry(int argc, char* argv[]) {
                 }
 
                 if (v6->dad_state == IPV6_DAD_IN_PROGRESS) {
-                    v6->dad_timer_ms += tick_ms;
+                    v6->dad_timer_ms += elapsed_ms;
 
                     if (v6->dad_probes_sent < g_ndp_max_probes) {
-                        if (v6->dad_timer_ms >= 1000) {
+                        if (v6->dad_timer_ms >= NDP_DAD_INTERVAL_MS) {
                             v6->dad_timer_ms = 0;
 
                             uint8_t sn[16];
@@ -1181,7 +1252,7 @@ int ndp_daemon_entry(int argc, char* argv[]) {
                             v6->dad_probes_sent++;
                         }
                     } else {
-                        if (v6->dad_timer_ms >= 1000) {
+                        if (v6->dad_timer_ms >= NDP_DAD_INTERVAL_MS) {
                             v6->dad_timer_ms = 0;
                             v6->dad_state = IPV6_DAD_OK;
 
@@ -1191,12 +1262,16 @@ int ndp_daemon_entry(int argc, char* argv[]) {
 
                             const uint8_t* my_mac = network_get_mac(l2->ifindex);
                             if (my_mac) (void)ndp_send_na_on(l2->ifindex, all_nodes, v6->ip, v6->ip, 0, my_mac, 0);
+                            //RA policy and solicitation wait on a usable address, give them another pass
+                            ndp_kick();
                         }
                     }
+
+                    if (v6->dad_state == IPV6_DAD_IN_PROGRESS) ndp_due_min(&next, NDP_DAD_INTERVAL_MS - v6->dad_timer_ms);
                 }
 
                 if (v6->dad_state == IPV6_DAD_OK && ipv6_is_linklocal(v6->ip)) has_lla_ok = 1;
-                handle_lifetimes(now_ms, v6);
+                ndp_due_min(&next, handle_lifetimes(now_ms, v6));
             }
 
             if (!has_lla_ok && l2->ifindex && l2->ifindex <= MAX_L2_INTERFACES) {
@@ -1212,17 +1287,20 @@ int ndp_daemon_entry(int argc, char* argv[]) {
                     g_rs_tries[idx] = 1;
                     g_rs_timer_ms[idx] = 0;
                 } else if (g_rs_tries[idx] < 3) {
-                    g_rs_timer_ms[idx] += tick_ms;
+                    g_rs_timer_ms[idx] += elapsed_ms;
 
-                    if (g_rs_timer_ms[idx] >= 4000) {
+                    if (g_rs_timer_ms[idx] >= NDP_RS_INTERVAL_MS) {
                         g_rs_timer_ms[idx] = 0;
                         ndp_send_rs_on(l2->ifindex);
                         g_rs_tries[idx]++;
                     }
                 }
+
+                if (g_rs_tries[idx] < 3) ndp_due_min(&next, NDP_RS_INTERVAL_MS - g_rs_timer_ms[idx]);
             }
         }
 
-        msleep(tick_ms);
+        if (next) ndp_timer_schedule(next);
+        kevent_wait(&g_ndp_event, 0);
     }
 }
\ No newline at end of file
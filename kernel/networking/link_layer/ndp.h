@@ -1,6 +1,7 @@
 #pragma once
 
 #include "types.h"
+#include "networking/netpkt.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -32,6 +33,7 @@ typedef struct {
 } ndp_entry_t;
 
 #define NDP_TABLE_MAX 64
+#define NDP_PENDING_MAX 8
 
 ndp_table_t* ndp_table_create(void);
 void ndp_table_destroy(ndp_table_t* t);
@@ -40,9 +42,12 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
 
 void ndp_table_put_for_l2(uint8_t ifindex, const uint8_t ip[16], const uint8_t mac[6], uint32_t ttl_ms, bool router);
 
-bool ndp_resolve_on(uint16_t ifindex, const uint8_t next_hop[16], uint8_t out_mac[6], uint32_t timeout_ms);
+//Sends pkt to next_hop on ifindex, queueing it until the neighbor answers if its address is not known yet
+bool ndp_output(uint16_t ifindex, const uint8_t next_hop[16], netpkt_t* pkt);
 
 bool ndp_request_dad_on(uint8_t ifindex, const uint8_t ip[16]);
+//Wakes the daemon after an interface or address change it has to act on
+void ndp_kick(void);
 
 int ndp_daemon_entry(int argc, char* argv[]);
 
@@ -20,10 +20,16 @@
 #define TASK_RX_BATCH_LIMIT 256
 #define TASK_TX_BATCH_LIMIT 256
 
+static void rx_due_expired(ktimer *timer)
+{
+    kevent_signal((kevent*)timer->ctx);
+}
+
 NetworkDispatch::NetworkDispatch()
 {
     nic_num = 0;
     g_net_pid = 0xFFFF;
+    ktimer_init(&rx_due_timer, rx_due_expired, &work);
     for (int i = 0; i <= (int)MAX_L2_INTERFACES; ++i) ifindex_to_nicid[i] = 0xFF;
     for (size_t i = 0; i < MAX_NIC; ++i) {
         nics[i].drv = nullptr;
@@ -69,6 +75,7 @@ void NetworkDispatch::handle_rx_irq(size_t nic_id)
 {
     if (nic_id >= nic_num) return;
     if (!nics[nic_id].drv) return;
+    kevent_signal(&work);
 }
 
 void NetworkDispatch::handle_tx_irq(size_t nic_id)
@@ -77,6 +84,7 @@ void NetworkDispatch::handle_tx_irq(size_t nic_id)
     NetDriver* driver = nics[nic_id].drv;
     if (!driver) return;
     driver->handle_sent_packet();
+    kevent_signal(&work);
 }
 
 bool NetworkDispatch::enqueue_frame(uint8_t ifindex, const sizedptr& frame)
@@ -100,9 +108,21 @@ bool NetworkDispatch::enqueue_frame(uint8_t ifindex, const sizedptr& frame)
         return false;
     }
     nics[nic_id].tx_produced++;
+    kevent_signal(&work);
     return true;
 }
 
+uint64_t NetworkDispatch::next_rx_due_us() const
+{
+    uint64_t due = 0;
+    for (size_t n = 0; n < nic_num; ++n) {
+        if (!nics[n].drv) continue;
+        uint64_t d = nics[n].drv->next_rx_due_us();
+        if (d && (!due || d < due)) due = d;
+    }
+    return due;
+}
+
 int NetworkDispatch::net_task()
 {
     set_net_pid(get_current_proc_pid());
@@ -114,14 +134,14 @@ int NetworkDispatch::net_task()
             if (driver) {
                 int lim = nics[n].kind_val == NET_IFK_LOCALHOST ? TASK_RX_BATCH_LIMIT : RX_INTR_BATCH_LIMIT;
                 for (int i = 0; i < lim; ++i) {
-                    sizedptr raw = driver->handle_receive_packet();
-                    if (!raw.ptr || raw.size == 0) break;
-                    if (raw.size < sizeof(eth_hdr_t)) {
-                        free_frame(raw);
+                    netpkt_t* np = driver->receive_netpkt();
+                    if (!np) break;
+                    if (netpkt_len(np) < sizeof(eth_hdr_t)) {
+                        netpkt_unref(np);
                         continue;
                     }
-                    if (!nics[n].rx.push(raw)) {
-                        free_frame(raw);
+                    if (!nics[n].rx.push(np)) {
+                        netpkt_unref(np);
                         nics[n].rx_dropped++;
                         continue;
                     }
@@ -131,14 +151,11 @@ int NetworkDispatch::net_task()
             int processed = 0;
             for (int i = 0; i < TASK_RX_BATCH_LIMIT; ++i) {
                 if (nics[n].rx.is_empty()) break;
-                sizedptr pkt{0,0};
-                if (!nics[n].rx.pop(pkt)) break;
-                netpkt_t* np = netpkt_wrap(pkt.ptr, pkt.size, 0 , pkt.size, NULL, 0);
-                if (np) {
-                    eth_input(nics[n].ifindex, np);
-                    netpkt_unref(np);
-                }
-                free_frame(pkt);
+                netpkt_t* np = nullptr;
+                if (!nics[n].rx.pop(np)) break;
+                //The stack may keep views of the frame, it is freed with the last one
+                eth_input(nics[n].ifindex, np);
+                netpkt_unref(np);
                 nics[n].rx_consumed++;
                 processed++;
             }
@@ -163,7 +180,12 @@ int NetworkDispatch::net_task()
             if (processed) did_work = true;
         }
 
-        if (!did_work) msleep(1);//TODO: manage it with an event
+        //Woken by RX/TX interrupts and enqueue_frame. Drivers without an RX interrupt get a timer for their next due frame
+        if (!did_work) {
+            uint64_t due = next_rx_due_us();
+            if (due) ktimer_arm(&rx_due_timer, due);
+            kevent_wait(&work, 0);
+        }
     }
 }
 
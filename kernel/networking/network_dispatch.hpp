@@ -6,6 +6,8 @@
 #include "networking/internet_layer/ipv4.h"
 #include "interface_manager.h"
 #include "data/struct/ring_buffer.hpp"
+#include "process/waitqueue.h"
+#include "exceptions/ktimer.h"
 
 class NetworkDispatch {
 public:
@@ -50,7 +52,7 @@ private:
         uint8_t duplex_mode;
         uint8_t kind_val;
         RingBuffer<sizedptr, 1024> tx;
-        RingBuffer<sizedptr, 1024> rx;
+        RingBuffer<netpkt_t*, 1024> rx;
         uint64_t rx_produced;
         uint64_t rx_consumed;
         uint64_t tx_produced;
@@ -64,6 +66,8 @@ private:
     NICCtx nics[MAX_NIC];
     size_t nic_num;
     uint16_t g_net_pid;
+    kevent work = {};
+    ktimer rx_due_timer = {};
 
     uint8_t ifindex_to_nicid[MAX_L2_INTERFACES + 1];
 
@@ -72,4 +76,5 @@ private:
     void copy_str(char* dst, int cap, const char* src);
 
     int nic_for_ifindex(uint8_t ifindex) const;
+    uint64_t next_rx_due_us() const;
 };
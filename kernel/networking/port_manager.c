@@ -2,19 +2,141 @@
 #include "types.h"
 #include "random/random.h"
 #include "net/network_types.h"
+#include "memory/page_allocator.h"
+#include "std/memory.h"
+
+#define CHUNK_WORDS (PORTS_PER_CHUNK / 64)
+
+static void *port_page;
 
 static inline bool proto_valid(protocol_t proto) {
     return (uint32_t)proto < PROTO_COUNT;
 }
 
+static inline uint32_t port_hash(const port_table_t *t, uint16_t port) {
+    return (uint32_t)(port ^ (port >> 9)) & (t->bucket_count - 1);
+}
+
+static port_entry_t* port_find(const port_table_t *t, uint16_t port) {
+    if (!t->buckets) return NULL;
+    for (port_entry_t *e = t->buckets[port_hash(t, port)]; e; e = e->next)
+        if (e->port == port) return e;
+    return NULL;
+}
+
+//Doubles the bucket array and rehashes every binding, keeping the old one if the allocation fails
+static bool port_hash_grow(port_table_t *t) {
+    uint32_t count = t->bucket_count ? t->bucket_count * 2 : PORT_HASH_MIN_BUCKETS;
+    port_entry_t **buckets = (port_entry_t**)palloc(count * sizeof(port_entry_t*), MEM_PRIV_KERNEL, MEM_RW, false);
+    if (!buckets) return t->buckets != NULL;
+    memset(buckets, 0, count * sizeof(port_entry_t*));
+
+    port_table_t next = { .buckets = buckets, .bucket_count = count };
+    for (uint32_t b = 0; b < t->bucket_count; ++b) {
+        port_entry_t *e = t->buckets[b];
+        while (e) {
+            port_entry_t *n = e->next;
+            uint32_t h = port_hash(&next, e->port);
+            e->next = buckets[h];
+            buckets[h] = e;
+            e = n;
+        }
+    }
+    if (t->buckets) pfree(t->buckets, t->bucket_count * sizeof(port_entry_t*));
+    t->buckets = buckets;
+    t->bucket_count = count;
+    return true;
+}
+
+static bool port_bit(const port_table_t *t, uint32_t port) {
+    const uint64_t *chunk = t->chunks[port / PORTS_PER_CHUNK];
+    if (!chunk) return false;
+    uint32_t off = port % PORTS_PER_CHUNK;
+    return (chunk[off / 64] >> (off % 64)) & 1;
+}
+
+static bool port_insert(port_table_t *t, uint16_t port, uint16_t pid, port_recv_handler_t handler) {
+    if (!port_page) port_page = palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, false);
+    if (!port_page) return false;
+    if (t->bound >= t->bucket_count * PORT_HASH_LOAD && !port_hash_grow(t)) return false;
+
+    uint32_t c = port / PORTS_PER_CHUNK;
+    if (!t->chunks[c]) {
+        t->chunks[c] = (uint64_t*)kalloc(port_page, CHUNK_WORDS * sizeof(uint64_t), ALIGN_16B, MEM_PRIV_KERNEL);
+        if (!t->chunks[c]) return false;
+    }
+    port_entry_t *e = (port_entry_t*)kalloc(port_page, sizeof(port_entry_t), ALIGN_16B, MEM_PRIV_KERNEL);
+    if (!e) {
+        if (!t->chunk_bound[c]) {
+            kfree(t->chunks[c], CHUNK_WORDS * sizeof(uint64_t));
+            t->chunks[c] = NULL;
+        }
+        return false;
+    }
+    e->port = port;
+    e->pid = pid;
+    e->handler = handler;
+    uint32_t b = port_hash(t, port);
+    e->next = t->buckets[b];
+    t->buckets[b] = e;
+
+    uint32_t off = port % PORTS_PER_CHUNK;
+    t->chunks[c][off / 64] |= 1ULL << (off % 64);
+    t->chunk_bound[c]++;
+    t->bound++;
+    return true;
+}
+
+static void port_remove(port_table_t *t, port_entry_t **link) {
+    port_entry_t *e = *link;
+    *link = e->next;
+
+    uint32_t c = e->port / PORTS_PER_CHUNK;
+    uint32_t off = e->port % PORTS_PER_CHUNK;
+    t->chunks[c][off / 64] &= ~(1ULL << (off % 64));
+    if (--t->chunk_bound[c] == 0) {
+        kfree(t->chunks[c], CHUNK_WORDS * sizeof(uint64_t));
+        t->chunks[c] = NULL;
+    }
+    t->bound--;
+    kfree(e, sizeof(port_entry_t));
+}
+
+//Next unbound port in [from, to], skipping chunks with nothing bound
+static int port_next_free(const port_table_t *t, uint32_t from, uint32_t to) {
+    uint32_t p = from;
+    while (p <= to) {
+        const uint64_t *chunk = t->chunks[p / PORTS_PER_CHUNK];
+        if (!chunk) return (int)p;
+        if (t->chunk_bound[p / PORTS_PER_CHUNK] == PORTS_PER_CHUNK) {
+            p = ((p / PORTS_PER_CHUNK) + 1) * PORTS_PER_CHUNK;
+            continue;
+        }
+        uint32_t off = p % PORTS_PER_CHUNK;
+        uint64_t free = ~chunk[off / 64] & ~((1ULL << (off % 64)) - 1);
+        if (free) {
+            uint32_t port = (p - (off % 64)) + __builtin_ctzll(free);
+            return port <= to ? (int)port : -1;
+        }
+        p = (p - (off % 64)) + 64;
+    }
+    return -1;
+}
+
 void port_manager_init(port_manager_t* pm) {
+    if (!pm) return;
+    memset(pm, 0, sizeof(port_manager_t));
+}
+
+void port_manager_destroy(port_manager_t* pm) {
     if (!pm) return;
     for (uint32_t pr = 0; pr < PROTO_COUNT; ++pr) {
-        for (uint32_t p = 0; p < MAX_PORTS; ++p) {
-            pm->tab[pr][p].used    = false;
-            pm->tab[pr][p].pid     = PORT_FREE_OWNER;
-            pm->tab[pr][p].handler = NULL;
-        }
+        port_table_t *t = &pm->tab[pr];
+        for (uint32_t b = 0; b < t->bucket_count; ++b)
+            while (t->buckets[b]) port_remove(t, &t->buckets[b]);
+        if (t->buckets) pfree(t->buckets, t->bucket_count * sizeof(port_entry_t*));
+        t->buckets = NULL;
+        t->bucket_count = 0;
     }
 }
 
@@ -24,6 +146,7 @@ int port_alloc_ephemeral(port_manager_t* pm,
                          port_recv_handler_t handler)
 {
     if (!pm || !proto_valid(proto)) return -1;
+    port_table_t *t = &pm->tab[proto];
 
     rng_t rng;
     rng_init_random(&rng);
@@ -34,17 +157,11 @@ int port_alloc_ephemeral(port_manager_t* pm,
     const uint32_t range = maxp - minp + 1u;
     const uint32_t first = minp + (seed % range);
 
-    for (uint32_t i = 0; i < range; ++i) {
-        uint32_t p = minp + ((first - minp + i) % range);
-        port_entry_t *e = &pm->tab[proto][p];
-        if (!e->used) {
-            e->used = true;
-            e->pid = pid;
-            e->handler = handler;
-            return (int)p;
-        }
-    }
-    return -1;
+    int p = port_next_free(t, first, maxp);
+    if (p < 0) p = port_next_free(t, minp, first - 1);
+    if (p < 0) return -1;
+    if (!port_insert(t, (uint16_t)p, pid, handler)) return -1;
+    return p;
 }
 
 bool port_bind_manual(port_manager_t* pm,
@@ -54,12 +171,9 @@ bool port_bind_manual(port_manager_t* pm,
                       port_recv_handler_t handler)
 {
     if (!pm || !proto_valid(proto)) return false;
-    port_entry_t *e = &pm->tab[proto][port];
-    if (e->used) return false;
-    e->used = true;
-    e->pid = pid;
-    e->handler = handler;
-    return true;
+    port_table_t *t = &pm->tab[proto];
+    if (port_bit(t, port)) return false;
+    return port_insert(t, port, pid, handler);
 }
 
 bool port_unbind(port_manager_t* pm,
@@ -68,23 +182,26 @@ bool port_unbind(port_manager_t* pm,
                  uint16_t pid)
 {
     if (!pm || !proto_valid(proto)) return false;
-    port_entry_t *e = &pm->tab[proto][port];
-    if (!e->used || e->pid != pid) return false;
-    e->used = false;
-    e->pid = PORT_FREE_OWNER;
-    e->handler = NULL;
-    return true;
+    port_table_t *t = &pm->tab[proto];
+    if (!t->buckets) return false;
+    for (port_entry_t **link = &t->buckets[port_hash(t, port)]; *link; link = &(*link)->next) {
+        if ((*link)->port != port) continue;
+        if ((*link)->pid != pid) return false;
+        port_remove(t, link);
+        return true;
+    }
+    return false;
 }
 
 void port_unbind_all(port_manager_t* pm, uint16_t pid) {
     if (!pm) return;
     for (uint32_t pr = 0; pr < PROTO_COUNT; ++pr) {
-        for (uint32_t p = 1; p < MAX_PORTS; ++p) {
-            port_entry_t *e = &pm->tab[pr][p];
-            if (e->used && e->pid == pid) {
-                e->used    = false;
-                e->pid     = PORT_FREE_OWNER;
-                e->handler = NULL;
+        port_table_t *t = &pm->tab[pr];
+        for (uint32_t b = 0; b < t->bucket_count && t->bound; ++b) {
+            port_entry_t **link = &t->buckets[b];
+            while (*link) {
+                if ((*link)->pid == pid && (*link)->port) port_remove(t, link);
+                else link = &(*link)->next;
             }
         }
     }
@@ -92,16 +209,42 @@ void port_unbind_all(port_manager_t* pm, uint16_t pid) {
 
 bool port_is_bound(const port_manager_t* pm, protocol_t proto, uint16_t port) {
     if (!pm || !proto_valid(proto)) return false;
-    return pm->tab[proto][port].used;
+    return port_bit(&pm->tab[proto], port);
 }
 
 uint16_t port_owner_of(const port_manager_t* pm, protocol_t proto, uint16_t port) {
     if (!pm || !proto_valid(proto)) return PORT_FREE_OWNER;
-    return pm->tab[proto][port].pid;
+    const port_entry_t *e = port_find(&pm->tab[proto], port);
+    return e ? e->pid : PORT_FREE_OWNER;
 }
 
 port_recv_handler_t port_get_handler(const port_manager_t* pm, protocol_t proto, uint16_t port) {
     if (!pm || !proto_valid(proto)) return NULL;
-    const port_entry_t* e = &pm->tab[proto][port];
-    return e->used ? e->handler : NULL;
+    const port_table_t *t = &pm->tab[proto];
+    if (!port_bit(t, port)) return NULL;
+    const port_entry_t *e = port_find(t, port);
+    return e ? e->handler : NULL;
+}
+
+uint32_t port_list_bindings(const port_manager_t* pm, uint32_t skip, port_binding_t* out, uint32_t max) {
+    if (!pm || !out) return 0;
+    uint32_t count = 0;
+    for (uint32_t pr = 0; pr < PROTO_COUNT; ++pr) {
+        const port_table_t *t = &pm->tab[pr];
+        if (skip >= t->bound) {
+            skip -= t->bound;
+            continue;
+        }
+        for (uint32_t b = 0; b < t->bucket_count && t->bound; ++b) {
+            for (const port_entry_t *e = t->buckets[b]; e; e = e->next) {
+                if (skip) {
+                    skip--;
+                    continue;
+                }
+                if (count == max) return count;
+                out[count++] = (port_binding_t){ .proto = (protocol_t)pr, .port = e->port, .pid = e->pid };
+            }
+        }
+    }
+    return count;
 }
@@ -24,17 +24,40 @@ typedef uint32_t (*port_recv_handler_t)(
     uint16_t dst_port
 );
 
-typedef struct {
+//The binding hash starts at one page of buckets and doubles past PORT_HASH_LOAD entries per bucket
+#define PORT_HASH_MIN_BUCKETS 512
+#define PORT_HASH_LOAD 2
+#define PORTS_PER_CHUNK 4096
+#define PORT_CHUNKS (MAX_PORTS / PORTS_PER_CHUNK)
+
+typedef struct port_entry {
+    uint16_t port;
     uint16_t pid;
     port_recv_handler_t handler;
-    bool used;
+    struct port_entry *next;
 } port_entry_t;
 
+//Chunks of the usage bitmap are only allocated while one of their ports is bound
+typedef struct {
+    uint64_t *chunks[PORT_CHUNKS];
+    uint16_t chunk_bound[PORT_CHUNKS];
+    port_entry_t **buckets;
+    uint32_t bucket_count;
+    uint32_t bound;
+} port_table_t;
+
 typedef struct {
-    port_entry_t tab[PROTO_COUNT][MAX_PORTS];
+    port_table_t tab[PROTO_COUNT];
 } port_manager_t;
 
+typedef struct {
+    protocol_t proto;
+    uint16_t port;
+    uint16_t pid;
+} port_binding_t;
+
 void port_manager_init(port_manager_t* pm);
+void port_manager_destroy(port_manager_t* pm);
 
 int  port_alloc_ephemeral(port_manager_t* pm,
                           protocol_t proto,
@@ -58,6 +81,9 @@ bool port_is_bound(const port_manager_t* pm, protocol_t proto, uint16_t port);
 uint16_t port_owner_of(const port_manager_t* pm, protocol_t proto, uint16_t port);
 port_recv_handler_t port_get_handler(const port_manager_t* pm, protocol_t proto, uint16_t port);
 
+//Bindings in table order, skip leaves out the first ones so callers can page through large tables
+uint32_t port_list_bindings(const port_manager_t* pm, uint32_t skip, port_binding_t* out, uint32_t max);
+
 #ifdef __cplusplus
 }
 #endif
@@ -85,4 +85,9 @@ bool socket_is_connected_tcp(socket_handle_t sh) {
     return reinterpret_cast<TCPSocket*>(sh)->is_connected();
 }
 
+int32_t socket_set_cc_tcp(socket_handle_t sh, uint8_t algo) {
+    if (!sh) return SOCK_ERR_INVAL;
+    return reinterpret_cast<TCPSocket*>(sh)->set_congestion_control(static_cast<tcp_cc_algo_t>(algo));
+}
+
 }
@@ -28,6 +28,8 @@ uint8_t socket_get_role_tcp(socket_handle_t sh);
 bool socket_is_bound_tcp(socket_handle_t sh);
 bool socket_is_connected_tcp(socket_handle_t sh);
 
+int32_t socket_set_cc_tcp(socket_handle_t sh, uint8_t algo);
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,29 +7,32 @@
 #include "networking/internet_layer/ipv4.h"
 #include "networking/application_layer/dns/dns.h"
 #include "types.h"
-#include "data/struct/ring_buffer.hpp"
 #include "net/socket_types.h"
 #include "networking/internet_layer/ipv4_route.h"
 #include "networking/internet_layer/ipv6_route.h"
 #include "networking/internet_layer/ipv6_utils.h"
 #include "networking/transport_layer/trans_utils.h"
 #include "syscalls/syscalls.h"
+#include "process/waitqueue.h"
 
 static constexpr int TCP_MAX_BACKLOG = 8;
 static constexpr dns_server_sel_t TCP_DNS_SEL = DNS_USE_BOTH;
 static constexpr uint32_t TCP_DNS_TIMEOUT_MS = 3000;
+static constexpr uint32_t TCP_ACCEPT_TIMEOUT_MS = 1000;
 
 class TCPSocket : public Socket {
     inline static TCPSocket* s_list_head = nullptr;
 
-    static constexpr uint32_t TCP_RING_CAP = 256 * 1024;
-    RingBuffer<uint8_t, TCP_RING_CAP> ring;
-    tcp_data* flow = nullptr;
+    static constexpr uint32_t TCP_RCVBUF_CAP = 256 * 1024;
+    //The stack frees flows on reset or timeout, so the flow is looked up again on every use
+    tcp_flow_ref flowRef = {};
 
     TCPSocket* pending[TCP_MAX_BACKLOG] = { nullptr };
     int backlogCap = 0;
     int backlogLen = 0;
+    wait_queue acceptWaiters = {};
     TCPSocket* next = nullptr;
+    tcp_cc_algo_t ccAlgo = TCP_CC_DEFAULT;
 
     static bool is_valid_v4_l3_for_bind(l3_ipv4_interface_t* v4) {
         if (!v4 || !v4->l2) return false;
@@ -87,6 +90,7 @@ class TCPSocket : public Socket {
                 if (srv->backlogLen >= srv->backlogCap) break;
 
                 TCPSocket* child = new TCPSocket(SOCK_ROLE_CLIENT, srv->pid, &srv->extraOpts);
+                child->ccAlgo = srv->ccAlgo;
 
                 child->localPort = dst_port;
                 child->connected = true;
@@ -162,89 +166,26 @@ class TCPSocket : public Socket {
                     }
                 }
 
-                child->flow = tcp_get_ctx(dst_port, ipver, dst_ip_addr, child->remoteEP.ip, src_port);
-                if (!child->flow){
+                tcp_data* child_flow = tcp_get_ctx(dst_port, ipver, dst_ip_addr, child->remoteEP.ip, src_port);
+                if (!child_flow){
                     child->close();
                     delete child;
                     break;
                 }
+                child->flowRef = tcp_ctx_ref(child_flow);
 
 			    child->insert_in_list();
 
                 srv->pending[srv->backlogLen++] = child;
+                wait_queue_wake_all(&srv->acceptWaiters);
                 break;
             }
             return 0;
         }
 
-        for (TCPSocket* s = s_list_head; s; s = s->next) {
-            if (!s->connected) continue;
-            if (s->localPort != dst_port) continue;
-            if (s->remoteEP.port != src_port) continue;
-            if (s->remoteEP.ver != ipver) continue;
-
-            bool matches_dst = (s->bound_l3_count == 0);
-            for (int i = 0; !matches_dst && i < s->bound_l3_count; ++i) {
-                uint8_t id = s->bound_l3[i];
-
-                if (ipver == IP_VER4) {
-                    l3_ipv4_interface_t* v4 = l3_ipv4_find_by_id(id);
-                    if (!is_valid_v4_l3_for_bind(v4)) continue;
-                    if (v4->l2->ifindex != ifindex) continue;
-                    if (v4->ip == *(const uint32_t*)dst_ip_addr) {
-                        matches_dst = true;
-                        break;
-                    }
-                } else {
-                    l3_ipv6_interface_t* v6 = l3_ipv6_find_by_id(id);
-                    if (!is_valid_v6_l3_for_bind(v6)) continue;
-                    if (v6->l2->ifindex != ifindex) continue;
-                    if (memcmp(v6->ip, dst_ip_addr, 16) == 0) {
-                        matches_dst = true;
-                        break;
-                    }
-                }
-            }
-
-            if (!matches_dst) continue;
-
-            if (ipver == IP_VER4) {
-                if (*(const uint32_t*)s->remoteEP.ip != *(const uint32_t*)src_ip_addr) continue;
-            } else {
-                if (memcmp(s->remoteEP.ip, src_ip_addr, 16) != 0) continue;
-            }
-
-            return s->on_receive(frame_ptr, frame_len);
-        }
-
+        //Payload stays queued on the flow as received frames, recv() copies it out from there
         return 0;
     }
-    
-    uint32_t on_receive(uintptr_t ptr, uint32_t len) {
-        if(!ptr || !len) return 0;
-
-        uint64_t limit = ring.capacity();
-        if ((extraOpts.flags & SOCK_OPT_BUF_SIZE) && extraOpts.buf_size) {
-            uint64_t m = extraOpts.buf_size;
-            if (m < limit) limit = m;
-        }
-        if (!limit) return 0;
-
-        const uint8_t* src = (const uint8_t*)ptr;
-        uint32_t pushed = 0;
-
-        uint64_t sz = ring.size();
-        if (sz < limit) {
-            uint64_t free = limit - sz;
-
-            uint32_t accept = len;
-            if((uint64_t)accept > free) accept = (uint32_t)free;
-
-            pushed = (uint32_t)ring.push_buf(src, accept);
-        }
-
-        return pushed;
-    }
 
     void insert_in_list() {
         for (TCPSocket* it = s_list_head; it; it = it->next){
@@ -337,14 +278,24 @@ public:
         pid = pid_;
         if (!(extraOpts.flags & SOCK_OPT_BUF_SIZE)) {
             extraOpts.flags |= SOCK_OPT_BUF_SIZE;
-            extraOpts.buf_size = TCP_RING_CAP;
+            extraOpts.buf_size = TCP_RCVBUF_CAP;
         }
 
-        if (!extraOpts.buf_size) extraOpts.buf_size = TCP_RING_CAP;
-        if (extraOpts.buf_size > TCP_RING_CAP) extraOpts.buf_size = TCP_RING_CAP;
+        if (!extraOpts.buf_size) extraOpts.buf_size = TCP_RCVBUF_CAP;
+        if (extraOpts.buf_size > TCP_RCVBUF_CAP) extraOpts.buf_size = TCP_RCVBUF_CAP;
         insert_in_list();
     }
 
+    //Only takes effect for flows created afterwards, so set it before bind or connect
+    int32_t set_congestion_control(tcp_cc_algo_t algo) {
+        if ((uint32_t)algo >= TCP_CC_COUNT) return SOCK_ERR_INVAL;
+        if (bound || connected) return SOCK_ERR_STATE;
+        ccAlgo = algo;
+        return SOCK_OK;
+    }
+
+    tcp_cc_algo_t get_congestion_control() const { return ccAlgo; }
+
     ~TCPSocket() override {
         remove_from_list();
         close();
@@ -440,7 +391,7 @@ public:
 
         for (int i = 0; i < m; ++i){
             uint8_t id = dedup_ids[i];
-            bool ok = tcp_bind_l3(id, port, pid, dispatch, &extraOpts);
+            bool ok = tcp_bind_l3(id, port, pid, dispatch, &extraOpts, ccAlgo);
             if (!ok){
                 for (int j=0;j<bdone;++j) (void)tcp_unbind_l3(bound_ids[j], port, pid);
                 return SOCK_ERR_SYS;
@@ -467,14 +418,13 @@ public:
         return SOCK_OK;
     }
 
-    TCPSocket* accept(){
-        const int max_iters = 100;
-        int iter = 0;
+    static bool has_pending(void* ctx){
+        return ((TCPSocket*)ctx)->backlogLen > 0;
+    }
 
-        while (backlogLen == 0){
-            if (++iter > max_iters) return nullptr;
-            msleep(10);
-        }
+    TCPSocket* accept(){
+        //Nothing has happened yet, so a syscall can be parked and reissued when a connection lands
+        if (!wait_queue_wait_restartable(&acceptWaiters, has_pending, this, TCP_ACCEPT_TIMEOUT_MS)) return nullptr;
 
         TCPSocket* client = pending[0];
 
@@ -596,7 +546,7 @@ public:
         bound = true;
 
         tcp_data ctx_copy{};
-        if (!tcp_handshake_l3(chosen_l3, localPort, &d, &ctx_copy, pid, &extraOpts)) {
+        if (!tcp_handshake_l3(chosen_l3, localPort, &d, &ctx_copy, pid, &extraOpts, ccAlgo)) {
             Socket::close();
             return SOCK_ERR_SYS;
         }
@@ -619,11 +569,12 @@ public:
             memcpy(local_ip, v6->ip, 16);
         }
 
-        flow = tcp_get_ctx(localPort, d.ver, local_ip, (const void*)d.ip, d.port);
+        tcp_data* flow = tcp_get_ctx(localPort, d.ver, local_ip, (const void*)d.ip, d.port);
         if (!flow) {
             Socket::close();
             return SOCK_ERR_SYS;
         }
+        flowRef = tcp_ctx_ref(flow);
 
         remoteEP = d;
         connected = true;
@@ -648,12 +599,14 @@ public:
         ev.local_port = localPort;
         ev.remote_ep = remoteEP;
         netlog_socket_event(&extraOpts, &ev);
-        if (!connected || !flow) return SOCK_ERR_STATE;
+        if (!connected || !tcp_ctx_lookup(flowRef)) return SOCK_ERR_STATE;
 
         const uint8_t* p = (const uint8_t*)buf;
         uint64_t sent_total = 0;
 
         while (sent_total < len) {
+            tcp_data* flow = tcp_ctx_lookup(flowRef);
+            if (!flow) break;
             uint64_t remain = len - sent_total;
             uint32_t chunk = remain > UINT32_MAX ? UINT32_MAX : (uint32_t)remain;
             flow->payload.ptr = (uintptr_t)(p + sent_total);
@@ -686,15 +639,11 @@ public:
         netlog_socket_event(&extraOpts, &ev);
         if (!buf || !len) return 0;
 
-        uint8_t* out = (uint8_t*)buf;
-        uint64_t n = 0;
-
-        n = ring.pop_buf(out, len);
+        if (len > UINT32_MAX) len = UINT32_MAX;
 
-        if (n) {
-            if (flow) tcp_flow_on_app_read(flow, (uint32_t)n);
-            return (int64_t)n;
-        }
+        tcp_data* flow = tcp_ctx_lookup(flowRef);
+        uint32_t n = flow ? tcp_flow_recv(flow, buf, (uint32_t)len) : 0;
+        if (n) return (int64_t)n;
         if (connected) return TCP_WOULDBLOCK;
         return 0;
     }
@@ -707,13 +656,13 @@ public:
         ev.local_port = localPort;
         ev.remote_ep = remoteEP;
         netlog_socket_event(&extraOpts, &ev);
-        if (connected && flow){
-            tcp_flow_close(flow);
+        if (connected){
+            tcp_data* flow = tcp_ctx_lookup(flowRef);
+            if (flow) tcp_flow_close(flow);
             connected = false;
-            flow = nullptr;
+            flowRef = {};
         }
 
-        ring.clear();
         for (int i = 0; i < backlogLen; ++i) delete pending[i];
         backlogLen = 0;
 
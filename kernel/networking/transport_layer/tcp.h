@@ -56,6 +56,12 @@ typedef struct {
     uint32_t ack_received;
 } tcp_data;
 
+//Names a flow without pointing into it, so a holder can find out its flow was freed without touching freed memory
+typedef struct {
+    uint32_t slot;
+    uint32_t gen;
+} tcp_flow_ref;
+
 typedef enum {
     TCP_STATE_CLOSED = 0,
     TCP_LISTEN,
@@ -70,7 +76,7 @@ typedef enum {
     TCP_TIME_WAIT
 } tcp_state_t;
 
-#define MAX_TCP_FLOWS 512
+#define MAX_TCP_FLOWS 65536
 #define TCP_SYN_RETRIES 5
 #define TCP_DATA_RETRIES 5
 #define TCP_RETRY_TIMEOUT_MS 200
@@ -84,23 +90,38 @@ typedef enum {
 #define TCP_MAX_RETRANS 8
 #define TCP_MAX_PERSIST_PROBES 8
 
+typedef enum {
+    TCP_CC_RENO = 0,
+    TCP_CC_CUBIC,
+    TCP_CC_BBR,
+    TCP_CC_COUNT
+} tcp_cc_algo_t;
+
+#define TCP_CC_DEFAULT TCP_CC_CUBIC
+
 int find_flow(uint16_t local_port, ip_version_t ver, const void *local_ip, const void *remote_ip, uint16_t remote_port);
 tcp_data* tcp_get_ctx(uint16_t local_port, ip_version_t ver, const void *local_ip, const void *remote_ip, uint16_t remote_port);
+//ctx must be live, as returned by tcp_get_ctx
+tcp_flow_ref tcp_ctx_ref(const tcp_data *ctx);
+//The ctx of the flow ref names, NULL once that flow was freed
+tcp_data* tcp_ctx_lookup(tcp_flow_ref ref);
 
-bool tcp_bind_l3(uint8_t l3_id, uint16_t port, uint16_t pid, port_recv_handler_t handler, const SocketExtraOptions* extra);
+bool tcp_bind_l3(uint8_t l3_id, uint16_t port, uint16_t pid, port_recv_handler_t handler, const SocketExtraOptions* extra, tcp_cc_algo_t cc);
 int tcp_alloc_ephemeral_l3(uint8_t l3_id, uint16_t pid, port_recv_handler_t handler);
 bool tcp_unbind_l3(uint8_t l3_id, uint16_t port, uint16_t pid);
-bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst, tcp_data *flow_ctx, uint16_t pid, const SocketExtraOptions* extra);
+bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst, tcp_data *flow_ctx, uint16_t pid, const SocketExtraOptions* extra, tcp_cc_algo_t cc);
 
 tcp_result_t tcp_flow_send(tcp_data *flow_ctx);
 tcp_result_t tcp_flow_close(tcp_data *flow_ctx);
 
 void tcp_flow_window_update(tcp_data *flow_ctx);
-void tcp_flow_on_app_read(tcp_data *flow_ctx, uint32_t bytes_read);
+uint32_t tcp_flow_recv(tcp_data *flow_ctx, void *buf, uint32_t len);
+
+const char *tcp_cc_name(tcp_cc_algo_t algo);
 
-void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_addr, uint8_t l3_id, uintptr_t ptr, uint32_t len);
+//pkt holds the segment at ptr so payload can be queued without a copy, NULL when it lives elsewhere
+void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_addr, uint8_t l3_id, uintptr_t ptr, uint32_t len, netpkt_t *pkt);
 
-void tcp_tick_all(uint32_t elapsed_ms);
 int tcp_daemon_entry(int argc, char *argv[]);
 
 #ifdef __cplusplus
@@ -0,0 +1,177 @@
+#include "tcp_internal.h"
+
+//BBR v1 model: windowed max delivery rate and min RTT. Gains are fixed point with BBR_UNIT == 1.0
+#define BBR_UNIT 256
+#define BBR_HIGH_GAIN 739
+#define BBR_DRAIN_GAIN 88
+#define BBR_CWND_GAIN 512
+#define BBR_FULL_BW_GROWTH 320
+#define BBR_FULL_BW_ROUNDS 3
+#define BBR_MIN_CWND_SEGS 4
+#define BBR_CYCLE_LEN 8
+
+static const uint16_t bbr_cycle_gains[BBR_CYCLE_LEN] = { 320, 192, 256, 256, 256, 256, 256, 256 };
+
+static uint64_t bbr_max_bw(const tcp_bbr_t *b) {
+    uint64_t bw = 0;
+    for (int i = 0; i < TCP_BBR_BW_ROUNDS; i++)
+        if (b->bw_rounds[i] > bw) bw = b->bw_rounds[i];
+    return bw;
+}
+
+//gain * BDP plus a few segments for delayed and stretched ACKs, 0 while there is no model yet
+static uint32_t bbr_target_cwnd(const tcp_flow_t *f, const tcp_bbr_t *b, uint32_t gain) {
+    uint64_t bw = bbr_max_bw(b);
+    if (!bw || !b->min_rtt_ms) return 0;
+
+    uint32_t mss = tcp_flow_mss(f);
+    uint64_t bdp = (bw * b->min_rtt_ms) / 1000;
+    uint64_t cwnd = (bdp * gain) / BBR_UNIT + 3u * mss;
+    if (cwnd < BBR_MIN_CWND_SEGS * mss) cwnd = BBR_MIN_CWND_SEGS * mss;
+    if (cwnd > UINT32_MAX / 2) cwnd = UINT32_MAX / 2;
+    return (uint32_t)cwnd;
+}
+
+static void bbr_enter_probe_bw(tcp_bbr_t *b, uint64_t now) {
+    b->mode = TCP_BBR_PROBE_BW;
+    b->cwnd_gain = BBR_CWND_GAIN;
+    b->cycle_idx = 2;
+    b->pacing_gain = bbr_cycle_gains[b->cycle_idx];
+    b->cycle_stamp_ms = now;
+}
+
+static void tcp_bbr_init(tcp_flow_t *f) {
+    tcp_bbr_t *b = &f->cc.bbr;
+
+    b->mode = TCP_BBR_STARTUP;
+    b->pacing_gain = BBR_HIGH_GAIN;
+    b->cwnd_gain = BBR_HIGH_GAIN;
+    b->min_rtt_stamp_ms = timer_now_msec();
+}
+
+static bool bbr_update_model(tcp_flow_t *f, tcp_bbr_t *b, const tcp_rate_sample_t *rs, uint64_t now) {
+    bool round_start = false;
+
+    if (rs->prior_us && rs->prior_delivered >= b->next_round_delivered) {
+        b->next_round_delivered = f->delivered;
+        b->round_count++;
+        b->bw_rounds[b->round_count % TCP_BBR_BW_ROUNDS] = 0;
+        round_start = true;
+    }
+
+    uint64_t *slot = &b->bw_rounds[b->round_count % TCP_BBR_BW_ROUNDS];
+    if (rs->delivery_rate > *slot) *slot = rs->delivery_rate;
+
+    bool rtt_expired = now - b->min_rtt_stamp_ms > TCP_BBR_MIN_RTT_WIN_MS;
+    if (rs->rtt_ms && (!b->min_rtt_ms || rs->rtt_ms <= b->min_rtt_ms || rtt_expired)) {
+        b->min_rtt_ms = rs->rtt_ms;
+        b->min_rtt_stamp_ms = now;
+    }
+
+    //The pipe is full once three rounds in a row failed to grow the bandwidth by a quarter
+    if (!b->full_bw_reached && round_start) {
+        uint64_t bw = bbr_max_bw(b);
+        if (bw >= (b->full_bw * BBR_FULL_BW_GROWTH) / BBR_UNIT) {
+            b->full_bw = bw;
+            b->full_bw_cnt = 0;
+        } else if (++b->full_bw_cnt >= BBR_FULL_BW_ROUNDS) {
+            b->full_bw_reached = 1;
+        }
+    }
+
+    return rtt_expired;
+}
+
+static void bbr_update_mode(tcp_flow_t *f, tcp_bbr_t *b, const tcp_rate_sample_t *rs, bool rtt_expired, uint64_t now) {
+    switch (b->mode) {
+    case TCP_BBR_STARTUP:
+        if (!b->full_bw_reached) break;
+        b->mode = TCP_BBR_DRAIN;
+        b->pacing_gain = BBR_DRAIN_GAIN;
+        b->cwnd_gain = BBR_HIGH_GAIN;
+        //fallthrough
+    case TCP_BBR_DRAIN:
+        if (rs->inflight <= bbr_target_cwnd(f, b, BBR_UNIT)) bbr_enter_probe_bw(b, now);
+        break;
+    case TCP_BBR_PROBE_BW:
+        if (now - b->cycle_stamp_ms > b->min_rtt_ms) {
+            b->cycle_idx = (uint8_t)((b->cycle_idx + 1) % BBR_CYCLE_LEN);
+            b->pacing_gain = bbr_cycle_gains[b->cycle_idx];
+            b->cycle_stamp_ms = now;
+        }
+        break;
+    case TCP_BBR_PROBE_RTT:
+        if (now < b->probe_rtt_done_ms) break;
+        b->min_rtt_stamp_ms = now;
+        if (f->cwnd < b->prior_cwnd) f->cwnd = b->prior_cwnd;
+        if (b->full_bw_reached) {
+            bbr_enter_probe_bw(b, now);
+        } else {
+            b->mode = TCP_BBR_STARTUP;
+            b->pacing_gain = BBR_HIGH_GAIN;
+            b->cwnd_gain = BBR_HIGH_GAIN;
+        }
+        break;
+    }
+
+    if (b->mode != TCP_BBR_PROBE_RTT && rtt_expired) {
+        uint32_t hold = b->min_rtt_ms > TCP_BBR_PROBE_RTT_MS ? b->min_rtt_ms : TCP_BBR_PROBE_RTT_MS;
+        b->mode = TCP_BBR_PROBE_RTT;
+        b->pacing_gain = BBR_UNIT;
+        b->cwnd_gain = BBR_UNIT;
+        b->prior_cwnd = f->cwnd;
+        b->probe_rtt_done_ms = now + hold;
+    }
+}
+
+static void tcp_bbr_on_ack(tcp_flow_t *f, const tcp_rate_sample_t *rs) {
+    tcp_bbr_t *b = &f->cc.bbr;
+    uint64_t now = timer_now_msec();
+    uint32_t mss = tcp_flow_mss(f);
+
+    bool rtt_expired = bbr_update_model(f, b, rs, now);
+    bbr_update_mode(f, b, rs, rtt_expired, now);
+
+    if (b->mode == TCP_BBR_PROBE_RTT) {
+        if (f->cwnd > BBR_MIN_CWND_SEGS * mss) f->cwnd = BBR_MIN_CWND_SEGS * mss;
+        return;
+    }
+
+    uint32_t target = bbr_target_cwnd(f, b, b->cwnd_gain);
+    if (!target) {
+        f->cwnd += rs->acked;
+    } else if (b->full_bw_reached) {
+        f->cwnd = f->cwnd + rs->acked < target ? f->cwnd + rs->acked : target;
+    } else if (f->cwnd < target) {
+        f->cwnd += rs->acked;
+    }
+
+    if (f->cwnd < BBR_MIN_CWND_SEGS * mss) f->cwnd = BBR_MIN_CWND_SEGS * mss;
+}
+
+//Loss is not a congestion signal for the model, recovery keeps the window and the model bounds it again
+static void tcp_bbr_on_loss(tcp_flow_t *f) {
+    f->cc.bbr.prior_cwnd = f->cwnd;
+    f->ssthresh = f->cwnd;
+}
+
+static uint64_t tcp_bbr_pacing_rate(tcp_flow_t *f) {
+    tcp_bbr_t *b = &f->cc.bbr;
+    uint64_t bw = bbr_max_bw(b);
+
+    if (!bw) {
+        if (!b->min_rtt_ms) return 0;
+        bw = ((uint64_t)f->cwnd * 1000) / b->min_rtt_ms;
+    }
+
+    return (bw * b->pacing_gain) / BBR_UNIT;
+}
+
+const tcp_cc_ops_t tcp_bbr_ops = {
+    .name = "bbr",
+    .init = tcp_bbr_init,
+    .on_ack = tcp_bbr_on_ack,
+    .on_loss = tcp_bbr_on_loss,
+    .on_rto = tcp_bbr_on_loss,
+    .pacing_rate = tcp_bbr_pacing_rate,
+};
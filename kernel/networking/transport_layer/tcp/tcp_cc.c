@@ -0,0 +1,187 @@
+#include "tcp_internal.h"
+
+#define TCP_PACING_MAX_BURST (64u * 1024u)
+
+static const tcp_cc_ops_t *const tcp_cc_table[TCP_CC_COUNT] = {
+    [TCP_CC_RENO] = &tcp_reno_ops,
+    [TCP_CC_CUBIC] = &tcp_cubic_ops,
+    [TCP_CC_BBR] = &tcp_bbr_ops,
+};
+
+const char *tcp_cc_name(tcp_cc_algo_t algo) {
+    if ((uint32_t)algo >= TCP_CC_COUNT) return "unknown";
+    return tcp_cc_table[algo]->name;
+}
+
+void tcp_cc_init(tcp_flow_t *f, tcp_cc_algo_t algo) {
+    if ((uint32_t)algo >= TCP_CC_COUNT) algo = TCP_CC_DEFAULT;
+
+    f->cc_algo = (uint8_t)algo;
+    f->cc_ops = tcp_cc_table[algo];
+    memset(&f->cc, 0, sizeof(f->cc));
+
+    f->cwnd = tcp_flow_mss(f);
+    f->ssthresh = TCP_RECV_WINDOW;
+    f->dup_acks = 0;
+    f->in_fast_recovery = 0;
+    f->recover = 0;
+    f->cwnd_acc = 0;
+
+    f->delivered = 0;
+    f->delivered_us = timer_now_usec();
+    f->pacing_next_us = 0;
+
+    if (f->cc_ops->init) f->cc_ops->init(f);
+}
+
+void tcp_cc_on_send(tcp_flow_t *f, tcp_tx_seg_t *s) {
+    if (f->snd_nxt == f->snd_una) f->delivered_us = timer_now_usec();
+    s->tx_delivered = f->delivered;
+    s->tx_delivered_us = f->delivered_us;
+}
+
+void tcp_cc_delivered(tcp_flow_t *f, const tcp_tx_seg_t *s, tcp_rate_sample_t *rs) {
+    uint64_t now = timer_now_usec();
+
+    f->delivered += tcp_seg_end(s) - s->seq;
+    f->delivered_us = now;
+
+    //Karn, a retransmitted segment can't tell which send was acknowledged
+    if (!rs || s->retransmit_cnt) return;
+    if (rs->prior_us && s->tx_delivered < rs->prior_delivered) return;
+
+    rs->prior_delivered = s->tx_delivered;
+    rs->prior_us = s->tx_delivered_us;
+    rs->rtt_ms = (uint32_t)(timer_now_msec() - s->sent_ms);
+    if (!rs->rtt_ms) rs->rtt_ms = 1;
+}
+
+void tcp_cc_on_new_ack(tcp_flow_t *f, uint32_t ack, const tcp_rate_sample_t *rs) {
+    uint32_t mss = tcp_flow_mss(f);
+    tcp_rate_sample_t sample = *rs;
+
+    sample.inflight = tcp_flow_inflight(f);
+    if (sample.prior_us) {
+        uint64_t interval = timer_now_usec() - sample.prior_us;
+        if (!interval) interval = 1;
+        sample.delivery_rate = ((f->delivered - sample.prior_delivered) * 1000000ull) / interval;
+    }
+
+    if (f->in_fast_recovery){
+        f->cwnd = f->ssthresh;
+        if (f->cwnd < mss) f->cwnd = mss;
+
+        if (ack >= f->recover){
+            f->in_fast_recovery = 0;
+            f->dup_acks = 0;
+            f->cwnd_acc = 0;
+        }
+    }
+
+    f->cc_ops->on_ack(f, &sample);
+}
+
+void tcp_cc_enter_recovery(tcp_flow_t *f) {
+    uint32_t mss = tcp_flow_mss(f);
+
+    f->cc_ops->on_loss(f);
+    if (f->ssthresh < 2u * mss) f->ssthresh = 2u * mss;
+
+    f->cwnd = f->ssthresh;
+    f->cwnd_acc = 0;
+    f->recover = f->snd_nxt;
+    f->in_fast_recovery = 1;
+}
+
+//NewReno fast retransmit for peers without SACK, with SACK tcp_sack_recover drives recovery instead
+void tcp_cc_on_dupack(tcp_flow_t *f) {
+    uint32_t mss = tcp_flow_mss(f);
+
+    if (f->in_fast_recovery){
+        f->cwnd += mss;
+        return;
+    }
+
+    if (f->dup_acks != TCP_DUPTHRESH) return;
+
+    tcp_cc_enter_recovery(f);
+    f->cwnd = f->ssthresh + TCP_DUPTHRESH * mss;
+
+    tcp_tx_seg_t *s = tcp_find_first_unacked(f);
+    if (s) {
+        tcp_send_from_seg(f, s);
+        s->retransmit_cnt++;
+        s->sent_ms = timer_now_msec();
+    }
+}
+
+void tcp_cc_on_timeout(tcp_flow_t *f) {
+    uint32_t mss = tcp_flow_mss(f);
+
+    f->cc_ops->on_rto(f);
+    if (f->ssthresh < 2u * mss) f->ssthresh = 2u * mss;
+
+    f->cwnd = mss;
+    f->cwnd_acc = 0;
+    f->dup_acks = 0;
+    f->in_fast_recovery = 0;
+    f->recover = 0;
+    f->pacing_next_us = 0;
+}
+
+static uint64_t tcp_cc_rate(tcp_flow_t *f) {
+    return f->cc_ops->pacing_rate ? f->cc_ops->pacing_rate(f) : 0;
+}
+
+uint32_t tcp_cc_pacing_budget(tcp_flow_t *f) {
+    uint64_t rate = tcp_cc_rate(f);
+    if (!rate) return UINT32_MAX;
+    if (timer_now_usec() < f->pacing_next_us) return 0;
+
+    //One burst is about 1ms worth of data, never less than two segments
+    uint64_t quantum = rate / 1000;
+    uint32_t mss = tcp_flow_mss(f);
+    if (quantum < 2u * mss) quantum = 2u * mss;
+    if (quantum > TCP_PACING_MAX_BURST) quantum = TCP_PACING_MAX_BURST;
+    return (uint32_t)quantum;
+}
+
+void tcp_cc_paced(tcp_flow_t *f, uint32_t bytes) {
+    uint64_t rate = tcp_cc_rate(f);
+    if (!rate || !bytes) return;
+
+    uint64_t now = timer_now_usec();
+    if (f->pacing_next_us < now) f->pacing_next_us = now;
+    f->pacing_next_us += ((uint64_t)bytes * 1000000ull) / rate;
+}
+
+static void tcp_reno_on_ack(tcp_flow_t *f, const tcp_rate_sample_t *rs) {
+    if (f->in_fast_recovery) return;
+
+    uint32_t mss = tcp_flow_mss(f);
+
+    if (f->cwnd < f->ssthresh){
+        f->cwnd += mss;
+        return;
+    }
+
+    uint32_t denom = f->cwnd ? f->cwnd : 1u;
+    uint32_t inc = (mss * mss) / denom;
+
+    if (inc == 0) inc = 1;
+
+    f->cwnd += inc;
+}
+
+static void tcp_reno_on_loss(tcp_flow_t *f) {
+    f->ssthresh = tcp_flow_inflight(f) / 2;
+}
+
+const tcp_cc_ops_t tcp_reno_ops = {
+    .name = "reno",
+    .init = NULL,
+    .on_ack = tcp_reno_on_ack,
+    .on_loss = tcp_reno_on_loss,
+    .on_rto = tcp_reno_on_loss,
+    .pacing_rate = NULL,
+};
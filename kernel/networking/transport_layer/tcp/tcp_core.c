@@ -10,48 +10,173 @@
 #include "syscalls/syscalls.h"
 #include "networking/transport_layer/trans_utils.h"
 
-tcp_flow_t *tcp_flows[MAX_TCP_FLOWS];
+tcp_flow_t **tcp_flows;
+uint32_t tcp_flow_cap;
+
+static uint32_t tcp_flow_count;
+static uint32_t tcp_flow_hint;
+static uint32_t tcp_flow_gen;
+static uint32_t tcp_syn_pending;
+static tcp_flow_t **tcp_conn_buckets;
+static tcp_flow_t *tcp_listen_buckets[TCP_LISTEN_BUCKETS];
+
+static inline size_t tcp_ip_len(ip_version_t ver){
+    return (size_t)(ver == IP_VER6 ? 16 : 4);
+}
 
+static uint32_t tcp_tuple_hash(ip_version_t ver, const void *local_ip, uint16_t local_port, const void *remote_ip, uint16_t remote_port){
+    const uint8_t *l = (const uint8_t *)local_ip;
+    const uint8_t *r = (const uint8_t *)remote_ip;
+    uint32_t h = 2166136261u ^ (((uint32_t)local_port << 16) | remote_port);
+    for (size_t i = 0; i < tcp_ip_len(ver); i++){
+        h = (h ^ l[i]) * 16777619u;
+        h = (h ^ r[i]) * 16777619u;
+    }
+    return h ^ (h >> 16);
+}
 
-int find_flow(uint16_t local_port, ip_version_t ver, const void *local_ip, const void *remote_ip, uint16_t remote_port){
-    for (int i = 0; i < MAX_TCP_FLOWS; i++){
-        tcp_flow_t *f = tcp_flows[i];
-        if (!f) continue;
+static inline uint32_t tcp_listen_hash(uint16_t port){
+    return (uint32_t)(port ^ (port >> 6)) % TCP_LISTEN_BUCKETS;
+}
+
+static tcp_flow_t **tcp_flow_bucket(tcp_flow_t *f){
+    if (f->hash_kind == TCP_HASH_LISTEN) return &tcp_listen_buckets[tcp_listen_hash(f->local_port)];
+    return &tcp_conn_buckets[tcp_tuple_hash(f->remote.ver, f->local.ip, f->local_port, f->remote.ip, f->remote.port) & (tcp_flow_cap - 1)];
+}
 
+void tcp_flow_hash(tcp_flow_t *f){
+    if (!f || f->hash_kind != TCP_HASH_NONE) return;
+    f->hash_kind = f->state == TCP_LISTEN ? TCP_HASH_LISTEN : TCP_HASH_CONN;
+    tcp_flow_t **bucket = tcp_flow_bucket(f);
+    f->hash_next = *bucket;
+    *bucket = f;
+}
+
+static void tcp_flow_unhash(tcp_flow_t *f){
+    if (f->hash_kind == TCP_HASH_NONE) return;
+    for (tcp_flow_t **link = tcp_flow_bucket(f); *link; link = &(*link)->hash_next){
+        if (*link != f) continue;
+        *link = f->hash_next;
+        break;
+    }
+    f->hash_next = NULL;
+    f->hash_kind = TCP_HASH_NONE;
+}
+
+//Flows are allocated individually, only the slot and bucket arrays move when the table doubles
+static bool tcp_flow_table_grow(void){
+    uint32_t cap = tcp_flow_cap ? tcp_flow_cap << 1 : TCP_FLOW_TABLE_MIN;
+    if (cap > MAX_TCP_FLOWS) return false;
+
+    tcp_flow_t **flows = (tcp_flow_t **)malloc(cap * sizeof(tcp_flow_t *));
+    tcp_flow_t **buckets = (tcp_flow_t **)malloc(cap * sizeof(tcp_flow_t *));
+    if (!flows || !buckets){
+        if (flows) free_sized(flows, cap * sizeof(tcp_flow_t *));
+        if (buckets) free_sized(buckets, cap * sizeof(tcp_flow_t *));
+        return false;
+    }
+    memset(flows, 0, cap * sizeof(tcp_flow_t *));
+    memset(buckets, 0, cap * sizeof(tcp_flow_t *));
+
+    uint32_t old_cap = tcp_flow_cap;
+    tcp_flow_t **old_flows = tcp_flows;
+    tcp_flow_t **old_buckets = tcp_conn_buckets;
+    if (old_flows) memcpy(flows, old_flows, old_cap * sizeof(tcp_flow_t *));
+
+    tcp_flows = flows;
+    tcp_conn_buckets = buckets;
+    tcp_flow_cap = cap;
+    tcp_flow_hint = old_cap;
+
+    for (uint32_t i = 0; i < old_cap; i++){
+        tcp_flow_t *f = flows[i];
+        if (!f || f->hash_kind != TCP_HASH_CONN) continue;
+        tcp_flow_t **bucket = tcp_flow_bucket(f);
+        f->hash_next = *bucket;
+        *bucket = f;
+    }
+
+    if (old_flows) free_sized(old_flows, old_cap * sizeof(tcp_flow_t *));
+    if (old_buckets) free_sized(old_buckets, old_cap * sizeof(tcp_flow_t *));
+    return true;
+}
+
+static tcp_flow_t *tcp_lookup_conn(ip_version_t ver, const void *local_ip, uint16_t local_port, const void *remote_ip, uint16_t remote_port){
+    if (!tcp_conn_buckets) return NULL;
+
+    size_t l = tcp_ip_len(ver);
+    uint32_t h = tcp_tuple_hash(ver, local_ip, local_port, remote_ip, remote_port) & (tcp_flow_cap - 1);
+    for (tcp_flow_t *f = tcp_conn_buckets[h]; f; f = f->hash_next){
         if (f->state == TCP_STATE_CLOSED) continue;
-        if (f->local_port != local_port) continue;
-
-        if (f->state == TCP_LISTEN){
-            if (remote_ip || remote_port) continue;
-            if (f->local.ver && f->local.ver != ver) continue;
-            if (!local_ip) return i;
-
-            size_t l = (size_t)(ver == IP_VER6 ? 16 : 4);
-            int unspec = 1;
-            for (size_t k = 0; k < l; ++k){
-                if (f->local.ip[k]){
-                    unspec = 0;
-                    break;
-                }
+        if (f->local_port != local_port || f->remote.port != remote_port || f->remote.ver != ver) continue;
+        if (memcmp(f->local.ip, local_ip, l) != 0) continue;
+        if (memcmp(f->remote.ip, remote_ip, l) != 0) continue;
+        return f;
+    }
+    return NULL;
+}
+
+//A listener bound to local_ip wins over a wildcard one, a NULL local_ip takes any listener on the port
+static tcp_flow_t *tcp_lookup_listener(uint16_t local_port, ip_version_t ver, const void *local_ip){
+    tcp_flow_t *wildcard = NULL;
+    size_t l = tcp_ip_len(ver);
+
+    for (tcp_flow_t *f = tcp_listen_buckets[tcp_listen_hash(local_port)]; f; f = f->hash_next){
+        if (f->state != TCP_LISTEN || f->local_port != local_port) continue;
+        if (f->local.ver && f->local.ver != ver) continue;
+        if (!local_ip) return f;
+
+        int unspec = 1;
+        for (size_t k = 0; k < l; ++k){
+            if (f->local.ip[k]){
+                unspec = 0;
+                break;
             }
-            if (unspec) return i;
-            if (memcmp(f->local.ip, local_ip, l) == 0) return i;
+        }
+        if (unspec){
+            if (!wildcard) wildcard = f;
             continue;
         }
+        if (memcmp(f->local.ip, local_ip, l) == 0) return f;
+    }
 
-        if (!remote_ip) continue;
-        if (!local_ip) continue;
-        if (f->remote.ver != ver) continue;
-        if (f->remote.port != remote_port) continue;
+    return wildcard;
+}
 
-        size_t l = (size_t)(ver == IP_VER6 ? 16 : 4);
-        if (memcmp(f->local.ip, local_ip, l) != 0) continue;
-        if (memcmp(f->remote.ip, remote_ip, l) != 0) continue;
+int find_flow(uint16_t local_port, ip_version_t ver, const void *local_ip, const void *remote_ip, uint16_t remote_port){
+    tcp_flow_t *f = NULL;
 
-        return i;
+    if (remote_ip) {
+        if (local_ip) f = tcp_lookup_conn(ver, local_ip, local_port, remote_ip, remote_port);
+    } else if (!remote_port) {
+        f = tcp_lookup_listener(local_port, ver, local_ip);
     }
 
-    return -1;
+    return f ? (int)f->slot : -1;
+}
+
+tcp_flow_t *tcp_listener_for(uint16_t local_port, ip_version_t ver, const void *local_ip){
+    tcp_flow_t *f = tcp_lookup_listener(local_port, ver, local_ip);
+    return f ? f : tcp_lookup_listener(local_port, ver, NULL);
+}
+
+bool tcp_syn_admit(tcp_flow_t *listener, tcp_flow_t *child){
+    if (tcp_syn_pending >= TCP_SYN_BACKLOG_MAX) return false;
+    if (listener->syn_backlog >= TCP_SYN_BACKLOG_PER_LISTENER) return false;
+
+    tcp_syn_pending++;
+    listener->syn_backlog++;
+    child->syn_counted = 1;
+    return true;
+}
+
+void tcp_syn_done(tcp_flow_t *child){
+    if (!child || !child->syn_counted) return;
+    child->syn_counted = 0;
+    if (tcp_syn_pending) tcp_syn_pending--;
+
+    tcp_flow_t *lf = tcp_listener_for(child->local_port, child->local.ver, child->local.ip);
+    if (lf && lf->syn_backlog) lf->syn_backlog--;
 }
 
 tcp_data *tcp_get_ctx(uint16_t local_port, ip_version_t ver, const void *local_ip, const void *remote_ip, uint16_t remote_port){
@@ -61,6 +186,19 @@ tcp_data *tcp_get_ctx(uint16_t local_port, ip_version_t ver, const void *local_i
     return &tcp_flows[idx]->ctx;
 }
 
+tcp_flow_ref tcp_ctx_ref(const tcp_data *ctx){
+    if (!ctx) return (tcp_flow_ref){0};
+    const tcp_flow_t *f = (const tcp_flow_t *)((const uint8_t *)ctx - __builtin_offsetof(tcp_flow_t, ctx));
+    return (tcp_flow_ref){ .slot = f->slot, .gen = f->gen };
+}
+
+tcp_data *tcp_ctx_lookup(tcp_flow_ref ref){
+    if (!ref.gen || ref.slot >= tcp_flow_cap) return NULL;
+    tcp_flow_t *f = tcp_flows[ref.slot];
+    if (!f || f->gen != ref.gen) return NULL;
+    return &f->ctx;
+}
+
 static void clear_txq(tcp_flow_t *f){
     for (int i = 0; i < TCP_MAX_TX_SEGS; i++){
         tcp_tx_seg_t *s = &f->txq[i];
@@ -72,46 +210,54 @@ static void clear_txq(tcp_flow_t *f){
         s->fin = 0;
         s->rtt_sample = 0;
         s->retransmit_cnt = 0;
+        s->sacked = 0;
+        s->lost = 0;
+        s->recovery_rexmit = 0;
         s->seq = 0;
         s->len = 0;
         s->buf = 0;
-        s->timer_ms = 0;
+        s->sent_ms = 0;
         s->timeout_ms = 0;
 }
 }
 
 static void clear_reass(tcp_flow_t *f){
     for (int i = 0; i < TCP_REASS_MAX_SEGS; i++){
-        if (f->reass[i].buf && f->reass[i].end > f->reass[i].seq){
-            uint32_t l = f->reass[i].end - f->reass[i].seq;
-            free_sized((void *)f->reass[i].buf, l);
-        }
+        if (f->reass[i].pkt) netpkt_unref(f->reass[i].pkt);
 
         f->reass[i].seq = 0;
         f->reass[i].end = 0;
-        f->reass[i].buf = 0;
+        f->reass[i].pkt = NULL;
     }
 
     f->reass_count = 0;
+    tcp_rcvq_purge(f);
     f->rcv_buf_used = 0;
 }
 
 tcp_flow_t *tcp_alloc_flow(void){
-    for (int i = 0; i < MAX_TCP_FLOWS; i++){
+    if (tcp_flow_count == tcp_flow_cap && !tcp_flow_table_grow()) return NULL;
+
+    for (uint32_t n = 0; n < tcp_flow_cap; n++){
+        uint32_t i = (tcp_flow_hint + n) & (tcp_flow_cap - 1);
         if (tcp_flows[i]) continue;
 
         tcp_flow_t *f = (tcp_flow_t *)malloc(sizeof(tcp_flow_t));
         if (!f) return NULL;
         memset(f, 0, sizeof(tcp_flow_t));
         tcp_flows[i] = f;
+        f->slot = i;
+        if (!++tcp_flow_gen) tcp_flow_gen = 1;
+        f->gen = tcp_flow_gen;
+        tcp_flow_hint = (i + 1) & (tcp_flow_cap - 1);
+        tcp_flow_count++;
 
         f->rto = TCP_INIT_RTO;
         f->rcv_wnd_max = TCP_DEFAULT_RCV_BUF;
         f->rcv_wnd = f->rcv_wnd_max;
 
         f->mss = TCP_DEFAULT_MSS;
-        f->cwnd = f->mss;
-        f->ssthresh = TCP_RECV_WINDOW;
+        tcp_cc_init(f, TCP_CC_DEFAULT);
 
         clear_reass(f);
         clear_txq(f);
@@ -123,29 +269,21 @@ tcp_flow_t *tcp_alloc_flow(void){
 }
 
 void tcp_free_flow(int idx) {
-    if (idx < 0 || idx >= MAX_TCP_FLOWS) return;
+    if (idx < 0 || (uint32_t)idx >= tcp_flow_cap) return;
 
     tcp_flow_t *f = tcp_flows[idx];
     if (!f) return;
 
+    tcp_timer_cancel(f);
+    tcp_syn_done(f);
+    tcp_flow_unhash(f);
     clear_txq(f);
     clear_reass(f);
-
-    memset(f, 0, sizeof(*f));
-
-    f->state = TCP_STATE_CLOSED;
-
-    f->rto = TCP_INIT_RTO;
-
-    f->rcv_wnd_max = TCP_DEFAULT_RCV_BUF;
-    f->rcv_wnd = f->rcv_wnd_max;
-
-    f->mss = TCP_DEFAULT_MSS;
-    f->cwnd = f->mss;
-    f->ssthresh = TCP_RECV_WINDOW;
+    if (f->pace_buf) free_sized(f->pace_buf, TCP_PACE_QUEUE_MAX);
 
     free_sized(f, sizeof(*f));
     tcp_flows[idx] = NULL;
+    tcp_flow_count--;
 }
 
 bool tcp_send_segment(ip_version_t ver, const void *src_ip_addr, const void *dst_ip_addr, tcp_hdr_t *hdr, const uint8_t *opts, uint8_t opts_len, const uint8_t *payload, uint16_t payload_len, const ip_tx_opts_t *txp, uint8_t ttl, uint8_t dontfrag){
@@ -258,7 +396,7 @@ void tcp_rtt_update(tcp_flow_t *flow, uint32_t sample_ms){
     flow->rto = rto;
 }
 
-bool tcp_bind_l3(uint8_t l3_id, uint16_t port, uint16_t pid, port_recv_handler_t handler, const SocketExtraOptions* extra){
+bool tcp_bind_l3(uint8_t l3_id, uint16_t port, uint16_t pid, port_recv_handler_t handler, const SocketExtraOptions* extra, tcp_cc_algo_t cc){
     ip_version_t ver = l3_is_v6_from_id(l3_id) ? IP_VER6 : IP_VER4;
 
     port_manager_t *pm = (ver == IP_VER6) ? ifmgr_pm_v6(l3_id) : ifmgr_pm_v4(l3_id);
@@ -301,9 +439,10 @@ bool tcp_bind_l3(uint8_t l3_id, uint16_t port, uint16_t pid, port_recv_handler_t
         f->ip_dontfrag = extra && (extra->flags & SOCK_OPT_DONTFRAG) ? 1 : 0;
         f->keepalive_on = extra && (extra->flags & SOCK_OPT_KEEPALIVE) ? 1 : 0;
         f->keepalive_ms = extra && (extra->flags & SOCK_OPT_KEEPALIVE) ? extra->keepalive_ms : 0;
-        f->keepalive_idle_ms = 0;
+        f->keepalive_start_ms = timer_now_msec();
 
         f->mss = TCP_DEFAULT_MSS;
+        tcp_cc_init(f, cc);
                 if (f->rcv_wnd_max > 65535u) {
             f->ws_send = 8;
             f->ws_recv = 0;
@@ -325,8 +464,10 @@ bool tcp_bind_l3(uint8_t l3_id, uint16_t port, uint16_t pid, port_recv_handler_t
         f->ctx.expected_ack = 0;
         f->ctx.ack_received = 0;
 
-        f->time_wait_ms = 0;
-        f->fin_wait2_ms = 0;
+        f->time_wait_start_ms = timer_now_msec();
+        f->fin_wait2_start_ms = timer_now_msec();
+
+        tcp_flow_hash(f);
     }
 
     return true;
@@ -350,30 +491,24 @@ bool tcp_unbind_l3(uint8_t l3_id, uint16_t port, uint16_t pid){
     bool res = port_unbind(pm, PROTO_TCP, port, pid);
 
     if (res){
-        for (int i = 0; i < MAX_TCP_FLOWS; i++){
-            tcp_flow_t *f = tcp_flows[i];
-            if (!f) continue;
-            if (f->state==TCP_LISTEN && f->local_port==port && f->local.ver==ver) tcp_free_flow(i);
+        tcp_flow_t *f = tcp_listen_buckets[tcp_listen_hash(port)];
+        while (f){
+            tcp_flow_t *next = f->hash_next;
+            if (f->state==TCP_LISTEN && f->local_port==port && f->local.ver==ver) tcp_free_flow((int)f->slot);
+            f = next;
         }
     }
 
     return res;
 }
 
-bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst, tcp_data *flow_ctx, uint16_t pid, const SocketExtraOptions* extra){
+bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst, tcp_data *flow_ctx, uint16_t pid, const SocketExtraOptions* extra, tcp_cc_algo_t cc){
     (void)pid;
 
     tcp_flow_t *flow = tcp_alloc_flow();
     if (!flow) return false;
 
-    int idx = -1;
-    for (int i = 0; i < MAX_TCP_FLOWS; i++) {
-        if (tcp_flows[i] == flow) {
-            idx = i;
-            break;
-        }
-    }
-    if (idx < 0) return false;
+    int idx = (int)flow->slot;
 
     flow->local_port = local_port;
     flow->l3_id = l3_id;
@@ -407,6 +542,7 @@ bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst,
 
     flow->state = TCP_SYN_SENT;
     flow->retries = TCP_SYN_RETRIES;
+    tcp_flow_hash(flow);
 
     rng_t rng;
     uint64_t virt_timer;
@@ -442,7 +578,7 @@ bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst,
     flow->ip_dontfrag = extra && (extra->flags & SOCK_OPT_DONTFRAG) ? 1 : 0;
     flow->keepalive_on = extra && (extra->flags & SOCK_OPT_KEEPALIVE) ? 1 : 0;
     flow->keepalive_ms = extra && (extra->flags & SOCK_OPT_KEEPALIVE) ? extra->keepalive_ms : 0;
-    flow->keepalive_idle_ms = 0;
+    flow->keepalive_start_ms = timer_now_msec();
 
     flow->ctx.options.ptr = 0;
     flow->ctx.options.size = 0;
@@ -457,15 +593,10 @@ bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst,
     flow->snd_nxt = iss;
     flow->snd_wnd = 0;
 
-    flow->cwnd = flow->mss;
-    flow->ssthresh = TCP_RECV_WINDOW;
-    flow->dup_acks = 0;
-    flow->in_fast_recovery = 0;
-    flow->recover = 0;
-    flow->cwnd_acc = 0;
+    tcp_cc_init(flow, cc);
 
-    flow->time_wait_ms = 0;
-    flow->fin_wait2_ms = 0;
+    flow->time_wait_start_ms = timer_now_msec();
+    flow->fin_wait2_start_ms = timer_now_msec();
 
     clear_reass(flow);
     clear_txq(flow);
@@ -484,7 +615,7 @@ bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst,
     seg->seq = flow->snd_nxt;
     seg->len = 0;
     seg->buf = 0;
-    seg->timer_ms = 0;
+    seg->sent_ms = timer_now_msec();
     seg->timeout_ms = flow->rto ? flow->rto : TCP_INIT_RTO;
 
     tcp_hdr_t syn_hdr;
@@ -517,7 +648,7 @@ bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst,
     flow->ctx.sequence = flow->snd_nxt;
     flow->ctx.expected_ack = flow->snd_nxt;
 
-    tcp_daemon_kick();
+    tcp_timer_update(flow);
 
     uint64_t waited = 0;
     const uint64_t interval = 50;
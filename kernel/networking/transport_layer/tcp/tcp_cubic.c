@@ -0,0 +1,102 @@
+#include "tcp_internal.h"
+
+//RFC 9438. C = 0.4 segments/s^3 and beta = 0.7, kept as integer fractions
+#define CUBIC_C_NUM 4
+#define CUBIC_C_DEN 10
+#define CUBIC_BETA_NUM 7
+#define CUBIC_BETA_DEN 10
+//Reno friendly additive increase alpha = 3(1 - beta)/(1 + beta)
+#define CUBIC_ALPHA_NUM 9
+#define CUBIC_ALPHA_DEN 17
+#define CUBIC_MAX_T_MS 60000
+
+static uint32_t cubic_cbrt(uint64_t v) {
+    uint64_t lo = 0;
+    uint64_t hi = 2097152;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi + 1) / 2;
+        if (mid * mid * mid <= v) lo = mid;
+        else hi = mid - 1;
+    }
+    return (uint32_t)lo;
+}
+
+//Offset of the cubic curve from its plateau t ms into the epoch, in bytes
+static int64_t cubic_offset(const tcp_cubic_t *c, uint64_t t, uint32_t mss) {
+    int64_t d = (int64_t)t - (int64_t)c->k_ms;
+    if (d > CUBIC_MAX_T_MS) d = CUBIC_MAX_T_MS;
+    if (d < -CUBIC_MAX_T_MS) d = -CUBIC_MAX_T_MS;
+
+    int64_t d3 = d * d * d / 1000;
+    return d3 * CUBIC_C_NUM * (int64_t)mss / (CUBIC_C_DEN * 1000000ll);
+}
+
+static void cubic_epoch_start(tcp_flow_t *f, tcp_cubic_t *c, uint64_t now) {
+    uint32_t mss = tcp_flow_mss(f);
+
+    c->epoch_ms = now;
+    c->w_est = f->cwnd;
+    c->cwnd_rem = 0;
+    c->est_rem = 0;
+
+    if (c->w_max > f->cwnd) {
+        uint64_t segs_ms3 = ((uint64_t)(c->w_max - f->cwnd) * CUBIC_C_DEN * 1000000000ull) / ((uint64_t)mss * CUBIC_C_NUM);
+        c->k_ms = cubic_cbrt(segs_ms3);
+        c->origin = c->w_max;
+    } else {
+        c->k_ms = 0;
+        c->origin = f->cwnd;
+    }
+}
+
+static void tcp_cubic_on_ack(tcp_flow_t *f, const tcp_rate_sample_t *rs) {
+    tcp_cubic_t *c = &f->cc.cubic;
+    uint32_t mss = tcp_flow_mss(f);
+
+    if (rs->rtt_ms && (!c->min_rtt_ms || rs->rtt_ms < c->min_rtt_ms)) c->min_rtt_ms = rs->rtt_ms;
+    if (f->in_fast_recovery || !rs->acked) return;
+
+    if (f->cwnd < f->ssthresh) {
+        uint32_t inc = rs->acked < 2u * mss ? rs->acked : 2u * mss;
+        f->cwnd += inc;
+        return;
+    }
+
+    uint64_t now = timer_now_msec();
+    if (!c->epoch_ms) cubic_epoch_start(f, c, now);
+
+    uint64_t t = now - c->epoch_ms + c->min_rtt_ms;
+    int64_t target = (int64_t)c->origin + cubic_offset(c, t, mss);
+    if (target < (int64_t)f->cwnd) target = f->cwnd;
+    if (target > (int64_t)f->cwnd + f->cwnd / 2) target = f->cwnd + f->cwnd / 2;
+
+    uint64_t est = (uint64_t)rs->acked * mss * CUBIC_ALPHA_NUM + c->est_rem;
+    uint64_t est_den = (uint64_t)f->cwnd * CUBIC_ALPHA_DEN;
+    c->w_est += (uint32_t)(est / est_den);
+    c->est_rem = est % est_den;
+    if ((int64_t)c->w_est > target) target = c->w_est;
+
+    uint64_t grow = (uint64_t)(target - (int64_t)f->cwnd) * rs->acked + c->cwnd_rem;
+    f->cwnd += (uint32_t)(grow / f->cwnd);
+    c->cwnd_rem = grow % f->cwnd;
+}
+
+//Fast convergence, a flow that lost before regaining its last plateau gives up some of it for newer flows
+static void tcp_cubic_on_loss(tcp_flow_t *f) {
+    tcp_cubic_t *c = &f->cc.cubic;
+
+    if (f->cwnd < c->w_max) c->w_max = (uint32_t)(((uint64_t)f->cwnd * (CUBIC_BETA_DEN + CUBIC_BETA_NUM)) / (2 * CUBIC_BETA_DEN));
+    else c->w_max = f->cwnd;
+
+    f->ssthresh = (uint32_t)(((uint64_t)f->cwnd * CUBIC_BETA_NUM) / CUBIC_BETA_DEN);
+    c->epoch_ms = 0;
+}
+
+const tcp_cc_ops_t tcp_cubic_ops = {
+    .name = "cubic",
+    .init = NULL,
+    .on_ack = tcp_cubic_on_ack,
+    .on_loss = tcp_cubic_on_loss,
+    .on_rto = tcp_cubic_on_loss,
+    .pacing_rate = NULL,
+};
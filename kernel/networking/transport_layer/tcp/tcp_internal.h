@@ -12,40 +12,138 @@
 #include "math/rng.h"
 #include "syscalls/syscalls.h"
 #include "tcp_utils.h"
+#include "exceptions/ktimer.h"
+#include "exceptions/timer.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define TCP_REASS_MAX_SEGS 32
+#define TCP_RCVQ_SEGS 256
 #define TCP_DEFAULT_MSS 1460
 #define TCP_DEFAULT_RCV_BUF (256u * 1024u)
+#define TCP_PACE_QUEUE_MAX (64u * 1024u)
 #define TCP_PERSIST_PROBE_BUFSZ 1
 
 #define TCP_DELAYED_ACK_MS 200
 #define TCP_PERSIST_MIN_MS 500
 #define TCP_PERSIST_MAX_MS 60000
 
+#define TCP_DUPTHRESH 3
+#define TCP_TLP_MIN_MS 10
+#define TCP_TLP_NO_RTT_MS 1000
+
+#define TCP_BBR_BW_ROUNDS 10
+#define TCP_BBR_PROBE_RTT_MS 200
+#define TCP_BBR_MIN_RTT_WIN_MS 10000
+
+#define TCP_FLOW_TABLE_MIN 64
+#define TCP_LISTEN_BUCKETS 64
+#define TCP_SYN_BACKLOG_MAX 128
+#define TCP_SYN_BACKLOG_PER_LISTENER 32
+
+enum {
+    TCP_HASH_NONE = 0,
+    TCP_HASH_CONN,
+    TCP_HASH_LISTEN
+};
+
 typedef struct {
     uint8_t used;
     uint8_t syn;
     uint8_t fin;
     uint8_t rtt_sample;
     uint8_t retransmit_cnt;
+    uint8_t sacked;
+    uint8_t lost;
+    uint8_t recovery_rexmit;
     uint32_t seq;
     uint64_t len;
     uintptr_t buf;
-    uint32_t timer_ms;
+    uint64_t sent_ms;
     uint32_t timeout_ms;
+    uint64_t tx_delivered;
+    uint64_t tx_delivered_us;
 } tcp_tx_seg_t;
 
 typedef struct {
     uint32_t seq;
     uint32_t end;
-    uintptr_t buf;
+    netpkt_t *pkt;
 } tcp_reass_seg_t;
 
+struct tcp_flow;
+
+//Per ACK input to the congestion controller. Delivery rate follows the flow's delivered counter
+//between the newest acknowledged segment's send and now
+typedef struct {
+    uint32_t acked;
+    uint32_t rtt_ms;
+    uint32_t inflight;
+    uint64_t prior_delivered;
+    uint64_t prior_us;
+    uint64_t delivery_rate;
+} tcp_rate_sample_t;
+
+//on_ack runs for every ACK that advances snd_una, including during recovery. on_loss and on_rto only
+//pick ssthresh for a new loss episode, tcp_cc.c sets cwnd from it and owns the recovery state.
+//pacing_rate is bytes per second, 0 leaves the flow unpaced
+typedef struct {
+    const char *name;
+    void (*init)(struct tcp_flow *f);
+    void (*on_ack)(struct tcp_flow *f, const tcp_rate_sample_t *rs);
+    void (*on_loss)(struct tcp_flow *f);
+    void (*on_rto)(struct tcp_flow *f);
+    uint64_t (*pacing_rate)(struct tcp_flow *f);
+} tcp_cc_ops_t;
+
 typedef struct {
+    uint32_t w_max;
+    uint32_t origin;
+    uint32_t k_ms;
+    uint64_t epoch_ms;
+    uint32_t w_est;
+    uint32_t min_rtt_ms;
+    uint64_t cwnd_rem;
+    uint64_t est_rem;
+} tcp_cubic_t;
+
+enum {
+    TCP_BBR_STARTUP = 0,
+    TCP_BBR_DRAIN,
+    TCP_BBR_PROBE_BW,
+    TCP_BBR_PROBE_RTT
+};
+
+typedef struct {
+    uint8_t mode;
+    uint8_t cycle_idx;
+    uint8_t full_bw_cnt;
+    uint8_t full_bw_reached;
+    uint16_t pacing_gain;
+    uint16_t cwnd_gain;
+    uint64_t bw_rounds[TCP_BBR_BW_ROUNDS];
+    uint64_t full_bw;
+    uint32_t min_rtt_ms;
+    uint64_t min_rtt_stamp_ms;
+    uint64_t probe_rtt_done_ms;
+    uint64_t cycle_stamp_ms;
+    uint64_t next_round_delivered;
+    uint32_t round_count;
+    uint32_t prior_cwnd;
+} tcp_bbr_t;
+
+//Timer fields hold the timer_now_msec() at which each timer was started, tcp_timer_update arms
+//the flow timer for the earliest resulting deadline
+typedef struct tcp_flow {
+    uint32_t slot;
+    uint32_t gen;//Unique per allocation, see tcp_flow_ref
+    struct tcp_flow *hash_next;
+    uint8_t hash_kind;
+    uint8_t syn_counted;
+    uint16_t syn_backlog;
+
     uint16_t local_port;
     net_l4_endpoint local;
     net_l4_endpoint remote;
@@ -60,8 +158,8 @@ typedef struct {
     uint32_t rttvar;
     uint32_t rto;
     uint8_t rtt_valid;
-    uint32_t time_wait_ms;
-    uint32_t fin_wait2_ms;
+    uint64_t time_wait_start_ms;
+    uint64_t fin_wait2_start_ms;
 
     uint32_t rcv_nxt;
     uint32_t rcv_buf_used;
@@ -82,16 +180,41 @@ typedef struct {
     uint32_t recover;
     uint32_t cwnd_acc;
 
+    uint8_t cc_algo;
+    const tcp_cc_ops_t *cc_ops;
+    union {
+        tcp_cubic_t cubic;
+        tcp_bbr_t bbr;
+    } cc;
+    uint64_t delivered;
+    uint64_t delivered_us;
+    uint64_t pacing_next_us;
+    uint8_t *pace_buf;
+    uint32_t pace_off;
+    uint32_t pace_len;
+    uint8_t pace_fin;
+
+    uint64_t rack_xmit_ms;
+    uint32_t rack_rtt_ms;
+    uint8_t tlp_active;
+    uint8_t tlp_outstanding;
+    uint64_t tlp_start_ms;
+    uint32_t tlp_timeout_ms;
+
     uint8_t persist_active;
     uint8_t persist_probe_cnt;
-    uint32_t persist_timer_ms;
+    uint64_t persist_start_ms;
     uint32_t persist_timeout_ms;
 
     uint8_t delayed_ack_pending;
-    uint32_t delayed_ack_timer_ms;
+    uint64_t delayed_ack_start_ms;
 
     tcp_reass_seg_t reass[TCP_REASS_MAX_SEGS];
     uint8_t reass_count;
+    //In-order data not yet read by the app, views into the received frames
+    netpkt_t *rcvq[TCP_RCVQ_SEGS];
+    uint16_t rcvq_head;
+    uint16_t rcvq_count;
     tcp_tx_seg_t txq[TCP_MAX_TX_SEGS];
     uint8_t fin_pending;
     uint32_t fin_seq;
@@ -100,19 +223,40 @@ typedef struct {
     uint8_t ip_dontfrag;
     uint8_t keepalive_on;
     uint32_t keepalive_ms;
-    uint32_t keepalive_idle_ms;
+    uint64_t keepalive_start_ms;
+
+    ktimer timer;
+    uint8_t timer_due;
+    struct tcp_flow *due_next;
 } tcp_flow_t;
 
-extern tcp_flow_t *tcp_flows[MAX_TCP_FLOWS];
+//Indexed by flow slot, grows on demand up to MAX_TCP_FLOWS
+extern tcp_flow_t **tcp_flows;
+extern uint32_t tcp_flow_cap;
 
 tcp_flow_t *tcp_alloc_flow(void);
 void tcp_free_flow(int idx);
 
+//Maps a ctx back to its flow. ctx must belong to a live flow, holders that can outlive it resolve theirs with tcp_ctx_lookup first
+static inline tcp_flow_t *tcp_flow_from_ctx(tcp_data *ctx) {
+    if (!ctx) return NULL;
+    return (tcp_flow_t *)((uint8_t *)ctx - __builtin_offsetof(tcp_flow_t, ctx));
+}
+
+//Makes the flow visible to find_flow once its addresses and state are set. Listeners go to a per-port
+//table, everything else to the 4-tuple table
+void tcp_flow_hash(tcp_flow_t *f);
+tcp_flow_t *tcp_listener_for(uint16_t local_port, ip_version_t ver, const void *local_ip);
+bool tcp_syn_admit(tcp_flow_t *listener, tcp_flow_t *child);
+void tcp_syn_done(tcp_flow_t *child);
+
 void tcp_rtt_update(tcp_flow_t *flow, uint32_t sample_ms);
 
 tcp_tx_seg_t *tcp_alloc_tx_seg(tcp_flow_t *flow);
 void tcp_send_from_seg(tcp_flow_t *flow, tcp_tx_seg_t *seg);
 void tcp_send_ack_now(tcp_flow_t *flow);
+//Sends what the pacer held back, runs at the release time and on new ACKs
+void tcp_pace_drain(tcp_flow_t *flow);
 
 static inline uint16_t tcp_checksum_ipv4(const void *segment, uint16_t seg_len, uint32_t src_ip, uint32_t dst_ip) {
     uint16_t csum = checksum16_pipv4(src_ip, dst_ip, 6, (const uint8_t *)segment, seg_len);
@@ -126,11 +270,71 @@ static inline uint16_t tcp_checksum_ipv6(const void *segment, uint16_t seg_len,
 bool tcp_send_segment(ip_version_t ver, const void *src_ip_addr, const void *dst_ip_addr, tcp_hdr_t *hdr, const uint8_t *opts, uint8_t opts_len, const uint8_t *payload, uint16_t payload_len, const ip_tx_opts_t *txp, uint8_t ttl, uint8_t dontfrag);
 void tcp_send_reset(ip_version_t ver, const void *src_ip_addr, const void *dst_ip_addr, uint16_t src_port, uint16_t dst_port, uint32_t seq, uint32_t ack, bool ack_valid);
 tcp_tx_seg_t *tcp_find_first_unacked(tcp_flow_t *flow);
+void tcp_rcvq_purge(tcp_flow_t *flow);
+
+extern const tcp_cc_ops_t tcp_reno_ops;
+extern const tcp_cc_ops_t tcp_cubic_ops;
+extern const tcp_cc_ops_t tcp_bbr_ops;
+
+//Congestion control entry points, dispatch to the flow's ops table
+void tcp_cc_init(tcp_flow_t *f, tcp_cc_algo_t algo);
+void tcp_cc_on_new_ack(tcp_flow_t *f, uint32_t ack, const tcp_rate_sample_t *rs);
+void tcp_cc_on_dupack(tcp_flow_t *f);
+void tcp_cc_enter_recovery(tcp_flow_t *f);
 void tcp_cc_on_timeout(tcp_flow_t *f);
+void tcp_cc_on_send(tcp_flow_t *f, tcp_tx_seg_t *s);
+//Counts a cumulatively ACKed or SACKed segment as delivered, rs may be NULL when it should not drive a rate sample
+void tcp_cc_delivered(tcp_flow_t *f, const tcp_tx_seg_t *s, tcp_rate_sample_t *rs);
+//Bytes the pacer lets through now, UINT32_MAX when the flow is unpaced
+uint32_t tcp_cc_pacing_budget(tcp_flow_t *f);
+void tcp_cc_paced(tcp_flow_t *f, uint32_t bytes);
+
+static inline uint32_t tcp_flow_mss(const tcp_flow_t *f) {
+    return f->mss ? f->mss : TCP_DEFAULT_MSS;
+}
+
+static inline uint32_t tcp_flow_inflight(const tcp_flow_t *f) {
+    return f->snd_nxt > f->snd_una ? f->snd_nxt - f->snd_una : 0;
+}
+
+static inline uint32_t tcp_seg_end(const tcp_tx_seg_t *s) {
+    return s->seq + s->len + (s->syn ? 1u : 0u) + (s->fin ? 1u : 0u);
+}
+
+typedef struct {
+    uint64_t recoveries;
+    uint64_t sack_rexmits;
+    uint64_t rack_lost;
+    uint64_t tlp_probes;
+    uint64_t rto_rexmits;
+} tcp_recovery_stats_t;
+
+extern tcp_recovery_stats_t tcp_recovery_stats;
+
+typedef struct {
+    uint64_t view_segs;
+    uint64_t copied_segs;
+    uint64_t copied_bytes;
+} tcp_rx_stats_t;
+
+extern tcp_rx_stats_t tcp_rx_stats;
+
+//SACK scoreboard over txq (RFC 6675) with RACK time based loss marking (RFC 8985)
+void tcp_sack_update(tcp_flow_t *f, const tcp_parsed_opts_t *opts);
+void tcp_rack_delivered(tcp_flow_t *f, const tcp_tx_seg_t *s, uint64_t now);
+uint32_t tcp_sack_pipe(tcp_flow_t *f);
+void tcp_sack_recover(tcp_flow_t *f);
+void tcp_sack_on_rto(tcp_flow_t *f);
+
+//Tail loss probe, re-sends the last segment when the ACK clock stops before the RTO would
+void tcp_tlp_arm(tcp_flow_t *f);
+void tcp_tlp_fire(tcp_flow_t *f);
 
 int tcp_has_pending_timers(void);
 
-void tcp_daemon_kick(void);
+//Call after changing any timer state of the flow. Arming early is fine, the deadline is rechecked on expiry
+void tcp_timer_update(tcp_flow_t *flow);
+void tcp_timer_cancel(tcp_flow_t *flow);
 uint16_t tcp_calc_adv_wnd_field(tcp_flow_t *flow, uint8_t apply_scale);
 
 #ifdef __cplusplus
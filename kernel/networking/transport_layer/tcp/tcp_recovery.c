@@ -0,0 +1,193 @@
+#include "tcp_internal.h"
+
+tcp_recovery_stats_t tcp_recovery_stats;
+
+static inline int tcp_seg_outstanding(const tcp_flow_t *f, const tcp_tx_seg_t *s) {
+    return s->used && tcp_seg_end(s) > f->snd_una;
+}
+
+static inline uint32_t tcp_seg_unacked_bytes(const tcp_flow_t *f, const tcp_tx_seg_t *s) {
+    uint32_t start = s->seq > f->snd_una ? s->seq : f->snd_una;
+    return tcp_seg_end(s) - start;
+}
+
+static inline uint32_t tcp_rack_reo_wnd(const tcp_flow_t *f) {
+    uint32_t w = f->srtt / 4;
+    return w ? w : 1;
+}
+
+static inline int tcp_rack_expired(const tcp_flow_t *f, const tcp_tx_seg_t *s, uint64_t now) {
+    if (!f->rack_xmit_ms || s->sent_ms > f->rack_xmit_ms) return 0;
+    return now - s->sent_ms >= (uint64_t)f->rack_rtt_ms + tcp_rack_reo_wnd(f);
+}
+
+void tcp_rack_delivered(tcp_flow_t *f, const tcp_tx_seg_t *s, uint64_t now) {
+    if (s->retransmit_cnt) return;
+    if (s->sent_ms < f->rack_xmit_ms) return;
+    f->rack_xmit_ms = s->sent_ms;
+    f->rack_rtt_ms = (uint32_t)(now - s->sent_ms);
+}
+
+void tcp_sack_update(tcp_flow_t *f, const tcp_parsed_opts_t *opts) {
+    if (!f->sack_ok || !opts || !opts->sack_count) return;
+
+    uint64_t now = timer_now_msec();
+    for (uint8_t b = 0; b < opts->sack_count; b++) {
+        uint32_t left = opts->sack_left[b];
+        uint32_t right = opts->sack_right[b];
+        if (right <= left || right <= f->snd_una || right > f->snd_nxt) continue;
+
+        for (int i = 0; i < TCP_MAX_TX_SEGS; i++) {
+            tcp_tx_seg_t *s = &f->txq[i];
+            if (!tcp_seg_outstanding(f, s) || s->sacked) continue;
+            if (s->seq < left || tcp_seg_end(s) > right) continue;
+
+            s->sacked = 1;
+            s->lost = 0;
+            tcp_rack_delivered(f, s, now);
+            tcp_cc_delivered(f, s, NULL);
+        }
+    }
+}
+
+//A hole is lost once DupThresh segments above it were SACKed, or once RACK saw a later send delivered
+//and the hole has been out longer than that RTT plus the reordering window. A lost retransmission is
+//caught the same way against its own send time
+static uint32_t tcp_sack_mark_lost(tcp_flow_t *f) {
+    uint64_t now = timer_now_msec();
+    uint32_t lost = 0;
+
+    for (int i = 0; i < TCP_MAX_TX_SEGS; i++) {
+        tcp_tx_seg_t *s = &f->txq[i];
+        if (!tcp_seg_outstanding(f, s) || s->sacked) continue;
+
+        if (s->lost) {
+            if (s->recovery_rexmit && tcp_rack_expired(f, s, now)) s->recovery_rexmit = 0;
+            lost++;
+            continue;
+        }
+
+        uint32_t sacked_above = 0;
+        for (int j = 0; j < TCP_MAX_TX_SEGS; j++) {
+            tcp_tx_seg_t *t = &f->txq[j];
+            if (tcp_seg_outstanding(f, t) && t->sacked && t->seq > s->seq) sacked_above++;
+        }
+
+        if (sacked_above >= TCP_DUPTHRESH) {
+            s->lost = 1;
+        } else if (tcp_rack_expired(f, s, now)) {
+            s->lost = 1;
+            tcp_recovery_stats.rack_lost++;
+        }
+        if (s->lost) lost++;
+    }
+
+    return lost;
+}
+
+//RFC 6675 pipe: bytes not SACKed and not deemed lost, plus every retransmission still in flight
+uint32_t tcp_sack_pipe(tcp_flow_t *f) {
+    uint32_t pipe = 0;
+
+    for (int i = 0; i < TCP_MAX_TX_SEGS; i++) {
+        tcp_tx_seg_t *s = &f->txq[i];
+        if (!tcp_seg_outstanding(f, s) || s->sacked) continue;
+
+        uint32_t bytes = tcp_seg_unacked_bytes(f, s);
+        if (!s->lost) pipe += bytes;
+        if (s->recovery_rexmit) pipe += bytes;
+    }
+
+    return pipe;
+}
+
+static tcp_tx_seg_t *tcp_sack_next_hole(tcp_flow_t *f) {
+    tcp_tx_seg_t *best = NULL;
+
+    for (int i = 0; i < TCP_MAX_TX_SEGS; i++) {
+        tcp_tx_seg_t *s = &f->txq[i];
+        if (!tcp_seg_outstanding(f, s) || s->sacked || !s->lost || s->recovery_rexmit) continue;
+        if (!best || s->seq < best->seq) best = s;
+    }
+
+    return best;
+}
+
+void tcp_sack_recover(tcp_flow_t *f) {
+    if (!f->sack_ok) return;
+    if (!tcp_sack_mark_lost(f)) return;
+
+    if (!f->in_fast_recovery) {
+        tcp_cc_enter_recovery(f);
+        f->tlp_active = 0;
+
+        for (int i = 0; i < TCP_MAX_TX_SEGS; i++) f->txq[i].recovery_rexmit = 0;
+        tcp_recovery_stats.recoveries++;
+    }
+
+    uint32_t pipe = tcp_sack_pipe(f);
+    while (pipe < f->cwnd) {
+        tcp_tx_seg_t *s = tcp_sack_next_hole(f);
+        if (!s) break;
+
+        tcp_send_from_seg(f, s);
+        s->retransmit_cnt++;
+        s->recovery_rexmit = 1;
+        pipe += tcp_seg_unacked_bytes(f, s);
+        tcp_recovery_stats.sack_rexmits++;
+    }
+}
+
+//SACK information is advisory, the receiver may have dropped it, so a timeout starts over from the cumulative ACK
+void tcp_sack_on_rto(tcp_flow_t *f) {
+    uint64_t now = timer_now_msec();
+
+    for (int i = 0; i < TCP_MAX_TX_SEGS; i++) {
+        tcp_tx_seg_t *s = &f->txq[i];
+        if (s->sacked) s->sent_ms = now;
+        s->sacked = 0;
+        s->lost = 0;
+        s->recovery_rexmit = 0;
+    }
+
+    f->rack_xmit_ms = 0;
+    f->rack_rtt_ms = 0;
+    f->tlp_active = 0;
+    f->tlp_outstanding = 0;
+}
+
+void tcp_tlp_arm(tcp_flow_t *f) {
+    f->tlp_active = 0;
+    if (!f->sack_ok || f->in_fast_recovery || f->tlp_outstanding) return;
+    if (f->state != TCP_ESTABLISHED && f->state != TCP_CLOSE_WAIT) return;
+    if (f->snd_nxt <= f->snd_una) return;
+
+    uint32_t mss = f->mss ? f->mss : TCP_DEFAULT_MSS;
+    uint32_t pto = f->rtt_valid ? 2u * f->srtt : TCP_TLP_NO_RTT_MS;
+    if (f->snd_nxt - f->snd_una <= mss) pto += TCP_DELAYED_ACK_MS;
+    if (pto < TCP_TLP_MIN_MS) pto = TCP_TLP_MIN_MS;
+    if (pto >= f->rto) return;
+
+    f->tlp_active = 1;
+    f->tlp_start_ms = timer_now_msec();
+    f->tlp_timeout_ms = pto;
+    tcp_timer_update(f);
+}
+
+void tcp_tlp_fire(tcp_flow_t *f) {
+    f->tlp_active = 0;
+    if (f->in_fast_recovery) return;
+
+    tcp_tx_seg_t *last = NULL;
+    for (int i = 0; i < TCP_MAX_TX_SEGS; i++) {
+        tcp_tx_seg_t *s = &f->txq[i];
+        if (!tcp_seg_outstanding(f, s) || s->sacked) continue;
+        if (!last || s->seq > last->seq) last = s;
+    }
+    if (!last) return;
+
+    tcp_send_from_seg(f, last);
+    last->retransmit_cnt++;
+    f->tlp_outstanding = 1;
+    tcp_recovery_stats.tlp_probes++;
+}
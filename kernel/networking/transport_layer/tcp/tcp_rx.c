@@ -7,8 +7,73 @@
 #include "std/memory.h"
 #include "math/rng.h"
 #include "syscalls/syscalls.h"
+#include "exceptions/irq.h"
 #include "../tcp.h"
 
+tcp_rx_stats_t tcp_rx_stats;
+
+//A view of the received frame when the bytes are in it, otherwise a private copy
+static netpkt_t *tcp_payload_pkt(netpkt_t *pkt, const uint8_t *data, uint32_t len) {
+    if (pkt) {
+        uintptr_t base = netpkt_data(pkt);
+        uintptr_t p = (uintptr_t)data;
+        if (p >= base && p + len <= base + netpkt_len(pkt)) {
+            netpkt_t *v = netpkt_view(pkt, (uint32_t)(p - base), len);
+            if (v) tcp_rx_stats.view_segs++;
+            return v;
+        }
+    }
+
+    netpkt_t *c = netpkt_alloc(len, 0, 0);
+    if (!c) return NULL;
+
+    void *dst = netpkt_put(c, len);
+    if (!dst) {
+        netpkt_unref(c);
+        return NULL;
+    }
+
+    memcpy(dst, data, len);
+    tcp_rx_stats.copied_segs++;
+    tcp_rx_stats.copied_bytes += len;
+    return c;
+}
+
+static bool tcp_rcvq_append(tcp_flow_t *flow, netpkt_t *p) {
+    if (flow->rcvq_count >= TCP_RCVQ_SEGS) return false;
+
+    flow->rcvq[(flow->rcvq_head + flow->rcvq_count) % TCP_RCVQ_SEGS] = p;
+    flow->rcvq_count++;
+    return true;
+}
+
+void tcp_rcvq_purge(tcp_flow_t *flow) {
+    irq_flags_t irq = irq_save_disable();
+    while (flow->rcvq_count) {
+        netpkt_t *p = flow->rcvq[flow->rcvq_head];
+        uint32_t l = netpkt_len(p);
+
+        if (flow->rcv_buf_used >= l) flow->rcv_buf_used -= l;
+        else flow->rcv_buf_used = 0;
+
+        netpkt_unref(p);
+        flow->rcvq[flow->rcvq_head] = NULL;
+        flow->rcvq_head = (uint16_t)((flow->rcvq_head + 1) % TCP_RCVQ_SEGS);
+        flow->rcvq_count--;
+    }
+
+    flow->rcvq_head = 0;
+    irq_restore(irq);
+}
+
+static void tcp_reass_remove(tcp_flow_t *flow, int idx) {
+    flow->reass[idx] = flow->reass[flow->reass_count - 1];
+    flow->reass[flow->reass_count - 1].seq = 0;
+    flow->reass[flow->reass_count - 1].end = 0;
+    flow->reass[flow->reass_count - 1].pkt = NULL;
+    flow->reass_count--;
+}
+
 static void tcp_reass_evict_tail(tcp_flow_t *flow, uint32_t need) {
     while (flow->reass_count && flow->rcv_buf_used + need > flow->rcv_wnd_max) {
         int idx = 0;
@@ -22,19 +87,15 @@ static void tcp_reass_evict_tail(tcp_flow_t *flow, uint32_t need) {
 
         tcp_reass_seg_t *r = &flow->reass[idx];
         uint32_t olen = r->end - r->seq;
-        if (r->buf && olen) free_sized((void *)r->buf, olen);
+        if (r->pkt) netpkt_unref(r->pkt);
         if (flow->rcv_buf_used >= olen) flow->rcv_buf_used -= olen;
         else flow->rcv_buf_used = 0;
 
-        flow->reass[idx] = flow->reass[flow->reass_count - 1];
-        flow->reass[flow->reass_count - 1].seq = 0;
-        flow->reass[flow->reass_count - 1].end = 0;
-        flow->reass[flow->reass_count - 1].buf = 0;
-        flow->reass_count--;
+        tcp_reass_remove(flow, idx);
     }
 }
 
-static void tcp_reass_insert(tcp_flow_t *flow, uint32_t seq, const uint8_t *data, uint32_t len) {
+static void tcp_reass_insert(tcp_flow_t *flow, netpkt_t *pkt, uint32_t seq, const uint8_t *data, uint32_t len) {
     if (!len) return;
     if (flow->reass_count >= TCP_REASS_MAX_SEGS) return;
     if (seq < flow->rcv_nxt) {
@@ -71,13 +132,8 @@ static void tcp_reass_insert(tcp_flow_t *flow, uint32_t seq, const uint8_t *data
             if (start <= rs && end >= re) {
                 uint32_t olen = re - rs;
 
-                if (r->buf && olen) free_sized((void *)r->buf, olen);
-
-                flow->reass[i] = flow->reass[flow->reass_count - 1];
-                flow->reass[flow->reass_count - 1].seq = 0;
-                flow->reass[flow->reass_count - 1].end = 0;
-                flow->reass[flow->reass_count - 1].buf = 0;
-                flow->reass_count--;
+                if (r->pkt) netpkt_unref(r->pkt);
+                tcp_reass_remove(flow, i);
 
                 flow->rcv_buf_used -= olen;
                 changed = 1;
@@ -108,11 +164,8 @@ static void tcp_reass_insert(tcp_flow_t *flow, uint32_t seq, const uint8_t *data
     if (flow->rcv_buf_used + len > flow->rcv_wnd_max) tcp_reass_evict_tail(flow, len);
     if (flow->rcv_buf_used + len > flow->rcv_wnd_max) return;
 
-    uintptr_t buf = (uintptr_t)malloc(len);
-    if (!buf) return;
-
-    uint32_t offset = start - orig_seq;
-    memcpy((void *)buf, data + offset, len);
+    netpkt_t *p = tcp_payload_pkt(pkt, data + (start - orig_seq), len);
+    if (!p) return;
 
     int pos = flow->reass_count;
     while (pos > 0 && flow->reass[pos - 1].seq > start){
@@ -122,7 +175,7 @@ static void tcp_reass_insert(tcp_flow_t *flow, uint32_t seq, const uint8_t *data
 
     flow->reass[pos].seq = start;
     flow->reass[pos].end = start + len;
-    flow->reass[pos].buf = buf;
+    flow->reass[pos].pkt = p;
     flow->reass_count++;
 
     flow->rcv_buf_used += len;
@@ -130,8 +183,10 @@ static void tcp_reass_insert(tcp_flow_t *flow, uint32_t seq, const uint8_t *data
     (void)tcp_calc_adv_wnd_field(flow, 1);
 }
 
-static void tcp_reass_drain_inseq(tcp_flow_t *flow, port_manager_t *pm, uint8_t ifx, ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_addr, uint16_t src_port, uint16_t dst_port) {
+//Reassembled segments move to the receive queue as they are, their bytes stay counted in rcv_buf_used
+static void tcp_reass_drain_inseq(tcp_flow_t *flow) {
     uint32_t rcv_nxt = flow->rcv_nxt;
+    bool discard = flow->state == TCP_FIN_WAIT_1 || flow->state == TCP_FIN_WAIT_2 || flow->state == TCP_CLOSING || flow->state == TCP_LAST_ACK || flow->state == TCP_TIME_WAIT;
 
     for(;;){
         int idx = -1;
@@ -147,77 +202,16 @@ static void tcp_reass_drain_inseq(tcp_flow_t *flow, port_manager_t *pm, uint8_t
         tcp_reass_seg_t *seg = &flow->reass[idx];
         uint32_t seg_len = seg->end - seg->seq;
 
-        if (!seg_len) {
-            flow->reass[idx] = flow->reass[flow->reass_count - 1];
-            flow->reass[flow->reass_count - 1].seq = 0;
-            flow->reass[flow->reass_count - 1].end = 0;
-            flow->reass[flow->reass_count - 1].buf = 0;
-            flow->reass_count--;
-            continue;
-        }
-
-        if (pm) {
-            port_recv_handler_t h = port_get_handler(pm, PROTO_TCP, dst_port);
-            uint32_t accepted = seg_len;
-
-            if (h) accepted = h(ifx, ipver, src_ip_addr, dst_ip_addr, seg->buf, seg_len, src_port, dst_port);
-            if (accepted > seg_len) accepted = seg_len;
-
-            if (accepted == 0) {
-                if (flow->state == TCP_FIN_WAIT_1 || flow->state == TCP_FIN_WAIT_2 || flow->state == TCP_CLOSING || flow->state == TCP_LAST_ACK || flow->state == TCP_TIME_WAIT) {
-                    if (seg->buf) free_sized((void *)seg->buf, seg_len);
-
-                    if (flow->rcv_buf_used >= seg_len) flow->rcv_buf_used -= seg_len;
-                    else flow->rcv_buf_used = 0;
-
-                    rcv_nxt += seg_len;
-
-                    flow->reass[idx] = flow->reass[flow->reass_count - 1];
-                    flow->reass[flow->reass_count - 1].seq = 0;
-                    flow->reass[flow->reass_count - 1].end = 0;
-                    flow->reass[flow->reass_count - 1].buf = 0;
-                    flow->reass_count--;
-                    continue;
-                }
-
-                break;
-            }
-
-            if (accepted < seg_len) {
-                uint32_t rem = seg_len - accepted;
-                uintptr_t newbuf = (uintptr_t)malloc(rem);
-                if (!newbuf) break;
-
-                memcpy((void *)newbuf, ((const uint8_t *)seg->buf) + accepted, rem);
-                if (seg->buf) free_sized((void *)seg->buf, seg_len);
-
-                seg->buf = newbuf;
-                seg->seq += accepted;
-
-                if (flow->rcv_buf_used >= accepted) flow->rcv_buf_used -= accepted;
-                else flow->rcv_buf_used = 0;
-
-                rcv_nxt += accepted;
-
-                flow->rcv_nxt = rcv_nxt;
-                flow->ctx.ack = rcv_nxt;
-
-                (void)tcp_calc_adv_wnd_field(flow, 1);
-                continue;
-            }
+        if (seg_len && !discard) {
+            if (!tcp_rcvq_append(flow, seg->pkt)) break;
+        } else {
+            if (seg->pkt) netpkt_unref(seg->pkt);
+            if (flow->rcv_buf_used >= seg_len) flow->rcv_buf_used -= seg_len;
+            else flow->rcv_buf_used = 0;
         }
 
         rcv_nxt += seg_len;
-
-        if (seg->buf) free_sized((void *)seg->buf, seg_len);
-        if (flow->rcv_buf_used >= seg_len) flow->rcv_buf_used -= seg_len;
-        else flow->rcv_buf_used = 0;
-
-        flow->reass[idx] = flow->reass[flow->reass_count - 1];
-        flow->reass[flow->reass_count - 1].seq = 0;
-        flow->reass[flow->reass_count - 1].end = 0;
-        flow->reass[flow->reass_count - 1].buf = 0;
-        flow->reass_count--;
+        tcp_reass_remove(flow, idx);
     }
 
     flow->rcv_nxt = rcv_nxt;
@@ -247,85 +241,7 @@ tcp_tx_seg_t *tcp_find_first_unacked(tcp_flow_t *flow) {
     return best;
 }
 
-void tcp_cc_on_timeout(tcp_flow_t *f){
-    uint32_t mss = f->mss ? f->mss : TCP_DEFAULT_MSS;
-    uint32_t flight = f->snd_nxt > f->snd_una ? f->snd_nxt - f->snd_una : 0;
-    uint32_t half = flight / 2;
-    uint32_t minth = 2u * mss;
-
-    if (half < minth) half = minth;
-
-    f->ssthresh = half;
-    f->cwnd = mss;
-    f->cwnd_acc = 0;
-    f->dup_acks = 0;
-    f->in_fast_recovery = 0;
-    f->recover = 0;
-}
-
-static void tcp_cc_on_new_ack(tcp_flow_t *f, uint32_t ack) {
-    uint32_t mss = f->mss ? f->mss : TCP_DEFAULT_MSS;
-
-    if (f->in_fast_recovery){
-        if (ack >= f->recover){
-            f->cwnd = f->ssthresh;
-            if (f->cwnd < mss) f->cwnd = mss;
-
-            f->in_fast_recovery = 0;
-            f->dup_acks = 0;
-            f->cwnd_acc = 0;
-            return;
-        }
-
-        f->cwnd = f->ssthresh;
-        if (f->cwnd < mss) f->cwnd = mss;
-        return;
-    }
-
-    if (f->cwnd < f->ssthresh){
-        f->cwnd += mss;
-        if (f->cwnd < mss) f->cwnd = mss;
-        return;
-    }
-
-    uint32_t denom = f->cwnd ? f->cwnd : 1u;
-    uint32_t inc = (mss * mss) / denom;
-
-    if (inc == 0) inc = 1;
-
-    f->cwnd += inc;
-}
-
-static void tcp_cc_on_dupack(tcp_flow_t *f) {
-    uint32_t mss = f->mss ? f->mss : TCP_DEFAULT_MSS;
-
-    if (f->in_fast_recovery){
-        f->cwnd += mss;
-        return;
-    }
-
-    if (f->dup_acks != 3) return;
-
-    uint32_t flight = f->snd_nxt - f->snd_una;
-    uint32_t half = flight / 2;
-    uint32_t minth = 2u * mss;
-
-    if (half < minth) half = minth;
-
-    f->ssthresh = half;
-    f->recover = f->snd_nxt;
-    f->cwnd = f->ssthresh + 3u * mss;
-    f->in_fast_recovery = 1;
-
-    tcp_tx_seg_t *s = tcp_find_first_unacked(f);
-    if (s) {
-        tcp_send_from_seg(f, s);
-        s->retransmit_cnt++;
-        s->timer_ms = 0;
-    }
-}
-
-void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_addr, uint8_t l3_id, uintptr_t ptr, uint32_t len) {
+void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_addr, uint8_t l3_id, uintptr_t ptr, uint32_t len, netpkt_t *pkt) {
     if (len < sizeof(tcp_hdr_t)) return;
 
     tcp_hdr_t *hdr = (tcp_hdr_t *)ptr;
@@ -355,7 +271,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
 
     int idx = find_flow(dst_port, ipver, dst_ip_addr, src_ip_addr, src_port);
     tcp_flow_t *flow = idx >= 0 ? tcp_flows[idx] : NULL;
-    if (flow) flow->keepalive_idle_ms = 0;
+    if (flow) flow->keepalive_start_ms = timer_now_msec();
     if (flow) flow->l3_id = l3_id;
 
     port_manager_t *pm = NULL;
@@ -376,38 +292,23 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
     if (!pm) return;
 
     if (!flow){
-        int listen_idx = find_flow(dst_port, ipver, dst_ip_addr, NULL, 0);
-        if (listen_idx < 0)
-            listen_idx = find_flow(dst_port, ipver, NULL, NULL, 0);
+        tcp_flow_t *lf = tcp_listener_for(dst_port, ipver, dst_ip_addr);
 
-        if ((flags & (1u << SYN_F)) && !(flags & (1u << ACK_F)) && listen_idx >= 0){
+        if ((flags & (1u << SYN_F)) && !(flags & (1u << ACK_F)) && lf){
             rng_t rng;
             uint64_t virt_timer;
             asm volatile ("mrs %0, cntvct_el0" : "=r"(virt_timer));
             rng_seed(&rng, virt_timer);
 
-            int syn_total = 0;
-            int syn_port = 0;
-            for (int k = 0; k < MAX_TCP_FLOWS; k++){
-                tcp_flow_t *f = tcp_flows[k];
-                if (!f) continue;
-                if (f->state != TCP_SYN_RECEIVED) continue;
-                syn_total++;
-                if (f->local_port == dst_port && f->l3_id == l3_id) syn_port++;
-            }
-            if (syn_total >= (MAX_TCP_FLOWS / 4) || syn_port >= 32) return;
-
-            tcp_flow_t *lf = tcp_flows[listen_idx];
             tcp_flow_t *nf = tcp_alloc_flow();
             if (!nf) return;
+            if (!tcp_syn_admit(lf, nf)){
+                tcp_free_flow((int)nf->slot);
+                return;
+            }
 
             flow = nf;
-            for (int k = 0; k < MAX_TCP_FLOWS; k++) {
-                if (tcp_flows[k] == nf) {
-                    idx = k;
-                    break;
-                }
-            }
+            idx = (int)nf->slot;
 
             flow->local_port = dst_port;
             flow->l3_id = l3_id;
@@ -424,6 +325,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
 
             flow->state = TCP_SYN_RECEIVED;
             flow->retries = TCP_SYN_RETRIES;
+            tcp_flow_hash(flow);
 
             tcp_parsed_opts_t pop;
             tcp_parse_options((const uint8_t *)(ptr + sizeof(tcp_hdr_t)), (uint32_t)(hdr_len > sizeof(tcp_hdr_t) ? hdr_len - sizeof(tcp_hdr_t) : 0), &pop);
@@ -471,11 +373,11 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
             flow->snd_wnd = new_wnd;
 
             flow->persist_active = 0;
-            flow->persist_timer_ms = 0;
+            flow->persist_start_ms = timer_now_msec();
             flow->persist_timeout_ms = 0;
 
             flow->delayed_ack_pending = 0;
-            flow->delayed_ack_timer_ms = 0;
+            flow->delayed_ack_start_ms = timer_now_msec();
 
             flow->rcv_wnd_max = lf->rcv_wnd_max;
             flow->rcv_buf_used = 0;
@@ -485,17 +387,12 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
             flow->ip_dontfrag = lf->ip_dontfrag;
             flow->keepalive_on = lf->keepalive_on;
             flow->keepalive_ms = lf->keepalive_ms;
-            flow->keepalive_idle_ms = 0;
+            flow->keepalive_start_ms = timer_now_msec();
 
-            flow->cwnd = flow->mss;
-            flow->ssthresh = TCP_RECV_WINDOW;
-            flow->dup_acks = 0;
-            flow->in_fast_recovery = 0;
-            flow->recover = 0;
-            flow->cwnd_acc = 0;
+            tcp_cc_init(flow, (tcp_cc_algo_t)lf->cc_algo);
 
-            flow->time_wait_ms = 0;
-            flow->fin_wait2_ms = 0;
+            flow->time_wait_start_ms = timer_now_msec();
+            flow->fin_wait2_start_ms = timer_now_msec();
 
             tcp_hdr_t synack_hdr;
             synack_hdr.src_port = bswap16(dst_port);
@@ -521,7 +418,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
                 tcp_send_segment(IP_VER6, flow->local.ip, src_ip_addr, &synack_hdr, syn_opts, syn_opts_len, NULL, 0, (const ip_tx_opts_t *)&tx, flow->ip_ttl, flow->ip_dontfrag);
             }
 
-            tcp_daemon_kick();
+            tcp_timer_update(flow);
             return;
         }
 
@@ -552,7 +449,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
         uint32_t seg_end = seq + seg_len;
 
         if (seq <= flow->rcv_nxt && seg_end >= flow->rcv_nxt){
-            flow->time_wait_ms = 0;
+            flow->time_wait_start_ms = timer_now_msec();
             tcp_send_ack_now(flow);
         }
 
@@ -564,23 +461,32 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
 
     if (flow->snd_wnd > 0){
         flow->persist_active = 0;
-        flow->persist_timer_ms = 0;
+        flow->persist_start_ms = timer_now_msec();
         flow->persist_timeout_ms = 0;
         flow->persist_probe_cnt = 0;
     } else {
-        tcp_daemon_kick();
+        tcp_timer_update(flow);
     }
 
     uint8_t fin = (flags & (1u << FIN_F)) ? 1u : 0u;
 
     if (flags & (1u << ACK_F)){
+        tcp_parsed_opts_t ack_opts;
+        ack_opts.sack_count = 0;
+        if (flow->sack_ok) tcp_parse_options((const uint8_t *)(ptr + sizeof(tcp_hdr_t)), (uint32_t)(hdr_len > sizeof(tcp_hdr_t) ? hdr_len - sizeof(tcp_hdr_t) : 0), &ack_opts);
+
         if (ack > flow->snd_una && ack <= flow->snd_nxt){
             uint32_t prev_una = flow->snd_una;
+            uint64_t now = timer_now_msec();
 
             flow->snd_una = ack;
             flow->ctx.ack_received = ack;
             flow->dup_acks = 0;
 
+            tcp_rate_sample_t rs;
+            memset(&rs, 0, sizeof(rs));
+            rs.acked = ack - prev_una;
+
             for (int i = 0; i < TCP_MAX_TX_SEGS; i++){
                 tcp_tx_seg_t *s = &flow->txq[i];
                 if (!s->used) continue;
@@ -588,7 +494,11 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
                 uint32_t s_end = s->seq + s->len + (s->syn ? 1u : 0u) + (s->fin ? 1u : 0u);
 
                 if (s_end <= ack){
-                    if (s->rtt_sample && s->retransmit_cnt == 0) tcp_rtt_update(flow, s->timer_ms);
+                    if (s->rtt_sample && s->retransmit_cnt == 0) tcp_rtt_update(flow, (uint32_t)(now - s->sent_ms));
+                    if (!s->sacked) {
+                        tcp_rack_delivered(flow, s, now);
+                        tcp_cc_delivered(flow, s, &rs);
+                    }
 
                     if (s->buf && s->len) free_sized((void *)s->buf, s->len);
 
@@ -598,19 +508,31 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
                 }
             }
 
-            if (ack > prev_una) tcp_cc_on_new_ack(flow, ack);
+            tcp_sack_update(flow, &ack_opts);
+            tcp_cc_on_new_ack(flow, ack, &rs);
+            tcp_sack_recover(flow);
+
+            flow->tlp_outstanding = 0;
+            tcp_tlp_arm(flow);
+            tcp_pace_drain(flow);
 
-            if (flow->state == TCP_FIN_WAIT_1 && ack >= flow->ctx.expected_ack){
+            //A FIN still held by the pacer has not been sent, expected_ack does not cover it yet
+            if (!flow->pace_fin && flow->state == TCP_FIN_WAIT_1 && ack >= flow->ctx.expected_ack){
                 flow->state = TCP_FIN_WAIT_2;
-                flow->fin_wait2_ms = 0;
-                tcp_daemon_kick();
-            } else if ((flow->state == TCP_LAST_ACK || flow->state == TCP_CLOSING) && ack >= flow->ctx.expected_ack){
+                flow->fin_wait2_start_ms = timer_now_msec();
+                tcp_timer_update(flow);
+            } else if (!flow->pace_fin && (flow->state == TCP_LAST_ACK || flow->state == TCP_CLOSING) && ack >= flow->ctx.expected_ack){
                 tcp_free_flow(idx);
                 return;
             }
         } else if (ack == flow->snd_una && data_len == 0 && !fin){
             if (flow->dup_acks < UINT8_MAX) flow->dup_acks++;
-            tcp_cc_on_dupack(flow);
+            if (ack_opts.sack_count) {
+                tcp_sack_update(flow, &ack_opts);
+                tcp_sack_recover(flow);
+            } else {
+                tcp_cc_on_dupack(flow);
+            }
         } else {
             flow->dup_acks = 0;
         }
@@ -680,8 +602,8 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
 
             flow->state = TCP_ESTABLISHED;
             flow->delayed_ack_pending = 0;
-            flow->delayed_ack_timer_ms = 0;
-            tcp_daemon_kick();
+            flow->delayed_ack_start_ms = timer_now_msec();
+            tcp_timer_update(flow);
         } else if (flags & (1u << RST_F)){
             flow->state = TCP_STATE_CLOSED;
         }
@@ -694,14 +616,15 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
             flow->snd_una = ack;
             flow->snd_nxt = flow->ctx.sequence;
             flow->state = TCP_ESTABLISHED;
+            tcp_syn_done(flow);
             flow->delayed_ack_pending = 0;
-            flow->delayed_ack_timer_ms = 0;
+            flow->delayed_ack_start_ms = timer_now_msec();
             flow->ctx.ack_received = ack;
 
             port_recv_handler_t h = port_get_handler(pm, PROTO_TCP, dst_port);
             if (h) (void)h(ifx, ipver, src_ip_addr, dst_ip_addr, 0, 0, src_port, dst_port);
 
-            tcp_daemon_kick();
+            tcp_timer_update(flow);
         } else if (flags & (1u << RST_F)){
             tcp_free_flow(idx);
         }
@@ -721,6 +644,8 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
     int ack_immediate = 0;
     int ack_defer = 0;
 
+    //The receive queue, reassembly and rcv_nxt are shared with tcp_flow_recv, which runs in the reader's context
+    irq_flags_t rx_irq = irq_save_disable();
     if (data_len || fin) {
         uint32_t rcv_nxt = flow->rcv_nxt;
         uint32_t wnd_end = rcv_nxt + flow->rcv_wnd;
@@ -765,30 +690,30 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
                 if (data_len){
                     uint32_t free_space = (flow->rcv_buf_used < flow->rcv_wnd_max) ? (flow->rcv_wnd_max - flow->rcv_buf_used) : 0;
 
-                    port_recv_handler_t h = port_get_handler(pm, PROTO_TCP, dst_port);
-
                     uint32_t offer = data_len;
                     if (offer > free_space) offer = free_space;
 
                     uint32_t accepted = 0;
-                    if (offer && h) accepted = h(ifx, ipver, src_ip_addr, dst_ip_addr, (uintptr_t)payload, offer, src_port, dst_port);
-                    if (accepted > offer) accepted = offer;
+                    if (offer && (flow->state == TCP_FIN_WAIT_1 || flow->state == TCP_FIN_WAIT_2 || flow->state == TCP_CLOSING || flow->state == TCP_LAST_ACK || flow->state == TCP_TIME_WAIT)) {
+                        flow->rcv_nxt += offer;
+                        flow->ctx.ack = flow->rcv_nxt;
+                        accepted = offer;
+                    } else if (offer && flow->rcvq_count < TCP_RCVQ_SEGS) {
+                        netpkt_t *p = tcp_payload_pkt(pkt, payload, offer);
+                        if (p) {
+                            (void)tcp_rcvq_append(flow, p);
+                            flow->rcv_nxt += offer;
+                            flow->ctx.ack = flow->rcv_nxt;
+                            flow->rcv_buf_used += offer;
+                            accepted = offer;
+                        }
+                    }
 
-                    if (h && accepted == 0 && data_len) {
+                    if (!accepted) {
                         (void)tcp_calc_adv_wnd_field(flow, 1);
                         need_ack = 1;
                         ack_immediate = 1;
                     }
-
-                    if (!accepted && offer && (flow->state == TCP_FIN_WAIT_1 || flow->state == TCP_FIN_WAIT_2 || flow->state == TCP_CLOSING || flow->state == TCP_LAST_ACK || flow->state == TCP_TIME_WAIT)) {
-                        flow->rcv_nxt += offer;
-                        flow->ctx.ack = flow->rcv_nxt;
-                        accepted = offer;
-                    } else if (accepted) {
-                        flow->rcv_nxt += accepted;
-                        flow->ctx.ack = flow->rcv_nxt;
-                        flow->rcv_buf_used += accepted;
-                    }
                     if (accepted < data_len) {
                         ack_immediate = 1;
                     }
@@ -805,8 +730,8 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
                         else if (old == TCP_FIN_WAIT_1) flow->state = TCP_CLOSING;
                         else if (old == TCP_FIN_WAIT_2 || old == TCP_CLOSING || old == TCP_LAST_ACK) {
                             flow->state = TCP_TIME_WAIT;
-                            flow->time_wait_ms = 0;
-                            tcp_daemon_kick();
+                            flow->time_wait_start_ms = timer_now_msec();
+                            tcp_timer_update(flow);
                         }
 
                         ack_immediate = 1;
@@ -816,7 +741,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
                     }
                 }
 
-                tcp_reass_drain_inseq(flow, pm, ifx, ipver, src_ip_addr, dst_ip_addr, src_port, dst_port);
+                tcp_reass_drain_inseq(flow);
 
                 if (flow->fin_pending && flow->fin_seq == flow->rcv_nxt){
                     flow->fin_pending = 0;
@@ -829,8 +754,8 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
                     else if (old == TCP_FIN_WAIT_1) flow->state = TCP_CLOSING;
                     else if (old == TCP_FIN_WAIT_2 || old == TCP_CLOSING || old == TCP_LAST_ACK) {
                         flow->state = TCP_TIME_WAIT;
-                        flow->time_wait_ms = 0;
-                        tcp_daemon_kick();
+                        flow->time_wait_start_ms = timer_now_msec();
+                        tcp_timer_update(flow);
                     }
 
                     ack_immediate = 1;
@@ -841,7 +766,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
                 if (!ack_immediate && data_len) ack_defer = 1;
                 need_ack = 1;
             } else {
-                if (!(flow->state == TCP_FIN_WAIT_1 || flow->state == TCP_FIN_WAIT_2 || flow->state == TCP_CLOSING || flow->state == TCP_LAST_ACK || flow->state == TCP_TIME_WAIT) && data_len) tcp_reass_insert(flow, seg_seq, payload, data_len);
+                if (!(flow->state == TCP_FIN_WAIT_1 || flow->state == TCP_FIN_WAIT_2 || flow->state == TCP_CLOSING || flow->state == TCP_LAST_ACK || flow->state == TCP_TIME_WAIT) && data_len) tcp_reass_insert(flow, pkt, seg_seq, payload, data_len);
 
                 if (fin_in){
                     flow->fin_pending = 1;
@@ -853,6 +778,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
             }
         }
     }
+    irq_restore(rx_irq);
 
     if (need_ack){
         if (ack_immediate){
@@ -860,16 +786,16 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
         } else if (ack_defer){
             if (!flow->delayed_ack_pending){
                 flow->delayed_ack_pending = 1;
-                flow->delayed_ack_timer_ms = 0;
-                tcp_daemon_kick();
+                flow->delayed_ack_start_ms = timer_now_msec();
+                tcp_timer_update(flow);
             } else {
                 tcp_send_ack_now(flow);
             }
         } else {
             if (!flow->delayed_ack_pending){
                 flow->delayed_ack_pending = 1;
-                flow->delayed_ack_timer_ms = 0;
-                tcp_daemon_kick();
+                flow->delayed_ack_start_ms = timer_now_msec();
+                tcp_timer_update(flow);
             } else {
                 tcp_send_ack_now(flow);
             }
@@ -877,46 +803,52 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
     }
 }
 
-void tcp_flow_on_app_read(tcp_data *flow_ctx, uint32_t bytes_read){
-    if (!flow_ctx || bytes_read == 0) return;
+//The only copy of received payload, straight from the frames into the caller's buffer
+uint32_t tcp_flow_recv(tcp_data *flow_ctx, void *buf, uint32_t len){
+    if (!flow_ctx || !buf || len == 0) return 0;
 
-    tcp_flow_t *flow = NULL;
-    for (int i = 0; i < MAX_TCP_FLOWS; ++i) {
-        tcp_flow_t *f = tcp_flows[i];
-        if (!f) continue;
-        if (&f->ctx == flow_ctx) {
-            flow = f;
-            break;
-        }
-    }
-    if (!flow) return;
+    tcp_flow_t *flow = tcp_flow_from_ctx(flow_ctx);
+    if (!flow) return 0;
 
-    if (bytes_read > flow->rcv_buf_used) bytes_read = flow->rcv_buf_used;
-    flow->rcv_buf_used -= bytes_read;
+    uint8_t *out = (uint8_t *)buf;
+    uint32_t copied = 0;
 
-    port_manager_t *pm = NULL;
-    uint8_t ifx = 0;
+    irq_flags_t irq = irq_save_disable();
+    while (copied < len && flow->rcvq_count) {
+        netpkt_t *p = flow->rcvq[flow->rcvq_head];
+        uint32_t avail = netpkt_len(p);
+        uint32_t n = len - copied;
+        if (n > avail) n = avail;
 
-    if (flow->local.ver == IP_VER4) {
-        l3_ipv4_interface_t *v4 = l3_ipv4_find_by_id(flow->l3_id);
-        if (v4 && v4->l2) {
-            pm = ifmgr_pm_v4(flow->l3_id);
-            ifx = v4->l2->ifindex;
-        }
-    } else if (flow->local.ver == IP_VER6) {
-        l3_ipv6_interface_t *v6 = l3_ipv6_find_by_id(flow->l3_id);
-        if (v6 && v6->l2) {
-            pm = ifmgr_pm_v6(flow->l3_id);
-            ifx = v6->l2->ifindex;
+        memcpy(out + copied, (const void *)netpkt_data(p), n);
+        copied += n;
+
+        if (n < avail) {
+            (void)netpkt_pull(p, n);
+            break;
         }
+
+        netpkt_unref(p);
+        flow->rcvq[flow->rcvq_head] = NULL;
+        flow->rcvq_head = (uint16_t)((flow->rcvq_head + 1) % TCP_RCVQ_SEGS);
+        flow->rcvq_count--;
     }
 
-    if (pm) {
-        tcp_reass_drain_inseq(flow, pm, ifx, flow->local.ver, flow->remote.ip, flow->local.ip, flow->remote.port, flow->local_port);
+    if (!copied) {
+        irq_restore(irq);
+        return 0;
     }
 
+    if (copied > flow->rcv_buf_used) flow->rcv_buf_used = 0;
+    else flow->rcv_buf_used -= copied;
+
+    tcp_reass_drain_inseq(flow);
+    irq_restore(irq);
+
     if (flow->state != TCP_STATE_CLOSED && flow->state != TCP_TIME_WAIT) {
         (void)tcp_calc_adv_wnd_field(flow, 1);
         tcp_send_ack_now(flow);
     }
+
+    return copied;
 }
@@ -1,12 +1,16 @@
 #include "tcp_internal.h"
 #include "kernel_processes/kprocess_loader.h"
 #include "exceptions/irq.h"
+#include "process/waitqueue.h"
+
+#define TCP_DAEMON_GRACE_MS 10000
 
 static volatile int tcp_daemon_running = 0;
-//TODO make tcp_daemon_running atomic or use a lock, this may end in a double deamon process
-void tcp_daemon_kick(void) {
-    if(!tcp_has_pending_timers()) return;
+static kevent tcp_timer_event;
+static tcp_flow_t *tcp_due_head;
+static uint32_t tcp_timers_armed;
 
+static void tcp_daemon_kick(void) {
     disable_interrupt();
     if(tcp_daemon_running){
         enable_interrupt();
@@ -23,214 +27,267 @@ void tcp_daemon_kick(void) {
     }
 }
 
-int tcp_has_pending_timers(void) { //TODO mhh this should be event driven to avoid MAX_TCP_FLOWS*TCP_MAX_TX_SEGS scans.
+int tcp_has_pending_timers(void) {
+    return tcp_timers_armed || tcp_due_head;
+}
 
+//Runs from the timer interrupt, the flow is handled by the daemon
+static void tcp_flow_timer_fired(ktimer *t) {
+    tcp_flow_t *f = (tcp_flow_t *)t->ctx;
+    if (tcp_timers_armed) tcp_timers_armed--;
+    if (!f->timer_due) {
+        f->timer_due = 1;
+        f->due_next = tcp_due_head;
+        tcp_due_head = f;
+    }
+    kevent_signal(&tcp_timer_event);
+}
 
-    for (int i = 0; i < MAX_TCP_FLOWS; i++) {
-        tcp_flow_t *f = tcp_flows[i];
-        if (!f) continue;
-        if (f->state == TCP_STATE_CLOSED) continue;
+static void tcp_persist_check(tcp_flow_t *f, uint64_t now) {
+    if (f->snd_wnd == 0 && f->snd_nxt > f->snd_una) {
+        if (f->persist_active) return;
+        f->persist_active = 1;
+        f->persist_start_ms = now;
+        f->persist_probe_cnt = 0;
+        f->persist_timeout_ms = TCP_PERSIST_MIN_MS;
+    } else {
+        f->persist_active = 0;
+        f->persist_start_ms = now;
+        f->persist_timeout_ms = 0;
+        f->persist_probe_cnt = 0;
+    }
+}
 
-        if (f->state == TCP_TIME_WAIT) return 1;
-        if (f->state == TCP_FIN_WAIT_2) return 1;
-        if (f->delayed_ack_pending) return 1;
-        if (f->persist_active) return 1;
-        if (f->keepalive_on && f->state == TCP_ESTABLISHED && f->keepalive_ms) return 1;
+static inline void tcp_deadline_min(uint64_t *deadline, uint64_t when) {
+    if (when < *deadline) *deadline = when;
+}
 
-        for (int j = 0; j < TCP_MAX_TX_SEGS; j++) {
-            tcp_tx_seg_t *s = &f->txq[j];
-            if (!s->used) continue;
-            uint32_t end = s->seq + s->len + (s->syn ? 1u : 0u) + (s->fin ? 1u : 0u);
-            if (end > f->snd_una) return 1;
-        }
+static uint64_t tcp_flow_deadline(tcp_flow_t *f) {
+    uint64_t deadline = UINT64_MAX;
+    if (f->state == TCP_STATE_CLOSED) return deadline;
+
+    if (f->state == TCP_TIME_WAIT) tcp_deadline_min(&deadline, f->time_wait_start_ms + TCP_2MSL_MS);
+    if (f->state == TCP_FIN_WAIT_2) tcp_deadline_min(&deadline, f->fin_wait2_start_ms + TCP_2MSL_MS);
+    if (f->delayed_ack_pending) tcp_deadline_min(&deadline, f->delayed_ack_start_ms + TCP_DELAYED_ACK_MS);
+    if (f->keepalive_on && f->state == TCP_ESTABLISHED && f->keepalive_ms) tcp_deadline_min(&deadline, f->keepalive_start_ms + f->keepalive_ms);
+    if (f->persist_active) tcp_deadline_min(&deadline, f->persist_start_ms + f->persist_timeout_ms);
+    if (f->tlp_active) tcp_deadline_min(&deadline, f->tlp_start_ms + f->tlp_timeout_ms);
+    //Held back data waits for the pacer release, ACKs drain it when the windows are the limit
+    if ((f->pace_len || f->pace_fin) && tcp_cc_pacing_budget(f) == 0) tcp_deadline_min(&deadline, (f->pacing_next_us + 999) / 1000);
+
+    for (int j = 0; j < TCP_MAX_TX_SEGS; j++) {
+        tcp_tx_seg_t *s = &f->txq[j];
+        if (s->used && !s->sacked) tcp_deadline_min(&deadline, s->sent_ms + s->timeout_ms);
     }
+    return deadline;
+}
 
-    return 0;
+void tcp_timer_update(tcp_flow_t *flow) {
+    if (!flow) return;
+    tcp_persist_check(flow, timer_now_msec());
+    uint64_t deadline = tcp_flow_deadline(flow);
+
+    irq_flags_t irq = irq_save_disable();
+    if (!flow->timer.fn) ktimer_init(&flow->timer, tcp_flow_timer_fired, flow);
+    if (deadline != UINT64_MAX) {
+        if (!flow->timer.armed) tcp_timers_armed++;
+        ktimer_arm(&flow->timer, deadline * 1000);
+    } else if (ktimer_cancel(&flow->timer)) tcp_timers_armed--;
+    irq_restore(irq);
+
+    if (deadline != UINT64_MAX) tcp_daemon_kick();
 }
 
-void tcp_tick_all(uint32_t elapsed_ms) {
-    for (int i = 0; i < MAX_TCP_FLOWS; i++) {
-        tcp_flow_t *f = tcp_flows[i];
-        if (!f) continue;
-        if (f->state == TCP_STATE_CLOSED) continue;
-
-        if (f->state == TCP_TIME_WAIT) {
-            f->time_wait_ms += elapsed_ms;
-            if (f->time_wait_ms >= TCP_2MSL_MS) {
-                tcp_free_flow(i);
-                continue;
-            }
+void tcp_timer_cancel(tcp_flow_t *flow) {
+    if (!flow) return;
+    irq_flags_t irq = irq_save_disable();
+    if (ktimer_cancel(&flow->timer)) tcp_timers_armed--;
+    if (flow->timer_due) {
+        for (tcp_flow_t **link = &tcp_due_head; *link; link = &(*link)->due_next) {
+            if (*link != flow) continue;
+            *link = flow->due_next;
+            break;
         }
+        flow->timer_due = 0;
+        flow->due_next = NULL;
+    }
+    irq_restore(irq);
+}
 
-        if (f->state == TCP_FIN_WAIT_2) {
-            f->fin_wait2_ms += elapsed_ms;
-            if (f->fin_wait2_ms >= TCP_2MSL_MS) {
-                tcp_free_flow(i);
-                continue;
-            }
-        }
+static tcp_flow_t *tcp_pop_due(void) {
+    irq_flags_t irq = irq_save_disable();
+    tcp_flow_t *f = tcp_due_head;
+    if (f) {
+        tcp_due_head = f->due_next;
+        f->due_next = NULL;
+        f->timer_due = 0;
+    }
+    irq_restore(irq);
+    return f;
+}
 
-        if (f->delayed_ack_pending) {
-            f->delayed_ack_timer_ms += elapsed_ms;
-            if (f->delayed_ack_timer_ms >= TCP_DELAYED_ACK_MS) tcp_send_ack_now(f);
-        }
+static void tcp_send_keepalive(tcp_flow_t *f) {
+    tcp_hdr_t hdr;
+    hdr.src_port = bswap16(f->local_port);
+    hdr.dst_port = bswap16(f->remote.port);
+    uint32_t seq = f->snd_nxt;
+    if (seq) seq -= 1;
+    hdr.sequence = bswap32(seq);
+    hdr.ack = bswap32(f->ctx.ack);
+    hdr.flags = (uint8_t)(1u << ACK_F);
+    hdr.window = tcp_calc_adv_wnd_field(f, 1);
+    hdr.urgent_ptr = 0;
+
+    if (f->local.ver == IP_VER4) {
+        ipv4_tx_opts_t tx;
+        tcp_build_tx_opts_from_local_v4(f->local.ip, &tx);
+        (void)tcp_send_segment(IP_VER4, f->local.ip, f->remote.ip, &hdr, NULL, 0, NULL, 0, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
+    } else if (f->local.ver == IP_VER6) {
+        ipv6_tx_opts_t tx;
+        tcp_build_tx_opts_from_local_v6(f->local.ip, &tx);
+        (void)tcp_send_segment(IP_VER6, f->local.ip, f->remote.ip, &hdr, NULL, 0, NULL, 0, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
+    }
+}
 
-        if (f->keepalive_on && f->state == TCP_ESTABLISHED && f->keepalive_ms) {
-            f->keepalive_idle_ms += elapsed_ms;
-            if (f->keepalive_idle_ms >= f->keepalive_ms) {
-                tcp_hdr_t hdr;
-                hdr.src_port = bswap16(f->local_port);
-                hdr.dst_port = bswap16(f->remote.port);
-                uint32_t seq = f->snd_nxt;
-                if (seq) seq -= 1;
-                hdr.sequence = bswap32(seq);
-                hdr.ack = bswap32(f->ctx.ack);
-                hdr.flags = (uint8_t)(1u << ACK_F);
-                hdr.window = tcp_calc_adv_wnd_field(f, 1);
-                hdr.urgent_ptr = 0;
-
-                if (f->local.ver == IP_VER4) {
-                    ipv4_tx_opts_t tx;
-                    tcp_build_tx_opts_from_local_v4(f->local.ip, &tx);
-                    (void)tcp_send_segment(IP_VER4, f->local.ip, f->remote.ip, &hdr, NULL, 0, NULL, 0, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
-                } else if (f->local.ver == IP_VER6) {
-                    ipv6_tx_opts_t tx;
-                    tcp_build_tx_opts_from_local_v6(f->local.ip, &tx);
-                    (void)tcp_send_segment(IP_VER6, f->local.ip, f->remote.ip, &hdr, NULL, 0, NULL, 0, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
-                }
-                f->keepalive_idle_ms = 0;
-            }
-        }
+static void tcp_send_persist_probe(tcp_flow_t *f) {
+    tcp_tx_seg_t *best = tcp_find_first_unacked(f);
+
+    tcp_hdr_t hdr;
+    hdr.src_port = bswap16(f->local_port);
+    hdr.dst_port = bswap16(f->remote.port);
+
+    uint8_t payload[1];
+    const uint8_t *pp = NULL;
+    uint16_t pl = 0;
+
+    uint32_t probe_seq = f->snd_una;
+
+    if (best && best->buf && best->len && probe_seq >= best->seq && probe_seq < best->seq + best->len) {
+        payload[0] = *((uint8_t *)best->buf + (probe_seq - best->seq));
+        pp = payload;
+        pl = 1;
+    }
+
+    hdr.sequence = bswap32(probe_seq);
+    hdr.ack = bswap32(f->ctx.ack);
+    hdr.flags = (uint8_t)(1u << ACK_F);
+    hdr.window = tcp_calc_adv_wnd_field(f, 1);
+    hdr.urgent_ptr = 0;
+
+    if (f->local.ver == IP_VER4) {
+        ipv4_tx_opts_t tx;
+        tcp_build_tx_opts_from_local_v4(f->local.ip, &tx);
+        (void)tcp_send_segment(IP_VER4, f->local.ip, f->remote.ip, &hdr, NULL, 0, pp, pl, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
+    } else if (f->local.ver == IP_VER6) {
+        ipv6_tx_opts_t tx;
+        tcp_build_tx_opts_from_local_v6(f->local.ip, &tx);
+        (void)tcp_send_segment(IP_VER6, f->local.ip, f->remote.ip, &hdr, NULL, 0, pp, pl, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
+    }
+}
+
+//Handles whatever is due on one flow and re-arms it for the next deadline
+static void tcp_flow_expire(tcp_flow_t *f, uint64_t now) {
+    if (f->state == TCP_STATE_CLOSED) return;
+
+    if ((f->state == TCP_TIME_WAIT && now - f->time_wait_start_ms >= TCP_2MSL_MS) ||
+        (f->state == TCP_FIN_WAIT_2 && now - f->fin_wait2_start_ms >= TCP_2MSL_MS)) {
+        tcp_free_flow((int)f->slot);
+        return;
+    }
+
+    if (f->delayed_ack_pending && now - f->delayed_ack_start_ms >= TCP_DELAYED_ACK_MS) tcp_send_ack_now(f);
+
+    if (f->keepalive_on && f->state == TCP_ESTABLISHED && f->keepalive_ms && now - f->keepalive_start_ms >= f->keepalive_ms) {
+        tcp_send_keepalive(f);
+        f->keepalive_start_ms = now;
+    }
 
-        if (f->snd_wnd == 0 && f->snd_nxt > f->snd_una) {
-            if (!f->persist_active) {
-                f->persist_active = 1;
-                f->persist_timer_ms = 0;
-                f->persist_probe_cnt = 0;
-                f->persist_timeout_ms = TCP_PERSIST_MIN_MS;
+    tcp_persist_check(f, now);
+    if (f->persist_active && now - f->persist_start_ms >= f->persist_timeout_ms) {
+        if (f->persist_probe_cnt >= TCP_MAX_PERSIST_PROBES) {
+            if (f->state == TCP_ESTABLISHED) {
+                f->ctx.flags = (uint8_t)((1u << FIN_F) | (1u << ACK_F));
+                f->ctx.payload.ptr = 0;
+                f->ctx.payload.size = 0;
+
+                tcp_flow_send(&f->ctx);
+                f->state = TCP_FIN_WAIT_1;
+                f->ctx.expected_ack = f->snd_nxt;
+                tcp_timer_update(f);
             } else {
-                f->persist_timer_ms += elapsed_ms;
-                if (f->persist_timer_ms >= f->persist_timeout_ms) {
-                    if (f->persist_probe_cnt >= TCP_MAX_PERSIST_PROBES) {
-                        if (f->state == TCP_ESTABLISHED) {
-                            f->ctx.flags = (uint8_t)((1u << FIN_F) | (1u << ACK_F));
-                            f->ctx.payload.ptr = 0;
-                            f->ctx.payload.size = 0;
-
-                            tcp_flow_send(&f->ctx);
-                            f->state = TCP_FIN_WAIT_1;
-                            f->ctx.expected_ack = f->snd_nxt;
-                            tcp_daemon_kick();
-                        } else {
-                            tcp_free_flow(i);
-                        }
-                        continue;
-                    }
-                    tcp_tx_seg_t *best = tcp_find_first_unacked(f);
-
-                    tcp_hdr_t hdr;
-                    hdr.src_port = bswap16(f->local_port);
-                    hdr.dst_port = bswap16(f->remote.port);
-
-                    uint8_t payload[1];
-                    const uint8_t *pp = NULL;
-                    uint16_t pl = 0;
-
-                    uint32_t probe_seq = f->snd_una;
-
-                    if (best && best->buf && best->len && probe_seq >= best->seq && probe_seq < best->seq + best->len) {
-                        payload[0] = *((uint8_t *)best->buf + (probe_seq - best->seq));
-                        pp = payload;
-                        pl = 1;
-                    }
-
-                    hdr.sequence = bswap32(probe_seq);
-                    hdr.ack = bswap32(f->ctx.ack);
-                    hdr.flags = (uint8_t)(1u << ACK_F);
-                    hdr.window = tcp_calc_adv_wnd_field(f, 1);
-                    hdr.urgent_ptr = 0;
-
-                    if (f->local.ver == IP_VER4) {
-                        ipv4_tx_opts_t tx;
-                        tcp_build_tx_opts_from_local_v4(f->local.ip, &tx);
-                        (void)tcp_send_segment(IP_VER4, f->local.ip, f->remote.ip, &hdr, NULL, 0, pp, pl, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
-                    } else if (f->local.ver == IP_VER6) {
-                        ipv6_tx_opts_t tx;
-                        tcp_build_tx_opts_from_local_v6(f->local.ip, &tx);
-                        (void)tcp_send_segment(IP_VER6, f->local.ip, f->remote.ip, &hdr, NULL, 0, pp, pl, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
-                    }
-
-                    if (f->persist_probe_cnt < UINT8_MAX) f->persist_probe_cnt++;
-                    f->persist_timer_ms = 0;
-
-                    if (f->persist_timeout_ms < TCP_PERSIST_MAX_MS) {
-                        uint32_t next = f->persist_timeout_ms << 1;
-                        if (next > TCP_PERSIST_MAX_MS) next = TCP_PERSIST_MAX_MS;
-                        f->persist_timeout_ms = next;
-                    }
-                }
+                tcp_free_flow((int)f->slot);
             }
-        } else {
-            f->persist_active = 0;
-            f->persist_timer_ms = 0;
-            f->persist_timeout_ms = 0;
-            f->persist_probe_cnt = 0;
+            return;
         }
 
-        for (int j = 0; j < TCP_MAX_TX_SEGS; j++) {
-            tcp_tx_seg_t *s = &f->txq[j];
-            if (!s->used) continue;
+        tcp_send_persist_probe(f);
 
-            s->timer_ms += elapsed_ms;
-            if (s->timer_ms < s->timeout_ms) continue;
+        if (f->persist_probe_cnt < UINT8_MAX) f->persist_probe_cnt++;
+        f->persist_start_ms = now;
 
-            if (s->retransmit_cnt >= TCP_MAX_RETRANS) {
-                tcp_free_flow(i);
-                break;
-            }
+        if (f->persist_timeout_ms < TCP_PERSIST_MAX_MS) {
+            uint32_t next = f->persist_timeout_ms << 1;
+            if (next > TCP_PERSIST_MAX_MS) next = TCP_PERSIST_MAX_MS;
+            f->persist_timeout_ms = next;
+        }
+    }
 
-            tcp_cc_on_timeout(f);
+    if (f->tlp_active && now - f->tlp_start_ms >= f->tlp_timeout_ms) tcp_tlp_fire(f);
 
-            tcp_send_from_seg(f, s);
+    tcp_pace_drain(f);
 
-            s->retransmit_cnt++;
-            s->timer_ms = 0;
+    for (int j = 0; j < TCP_MAX_TX_SEGS; j++) {
+        tcp_tx_seg_t *s = &f->txq[j];
+        if (!s->used || s->sacked) continue;
+        if (now - s->sent_ms < s->timeout_ms) continue;
 
-            if (s->timeout_ms == 0) {
-                uint32_t rto = f->rto ? f->rto : TCP_INIT_RTO;
-                if (rto < TCP_MIN_RTO) rto = TCP_MIN_RTO;
-                s->timeout_ms = rto;
-            } else if (s->timeout_ms < TCP_MAX_RTO) {
-                uint32_t next = s->timeout_ms << 1;
-                if (next > TCP_MAX_RTO) next = TCP_MAX_RTO;
-                s->timeout_ms = next;
-            }
+        if (s->retransmit_cnt >= TCP_MAX_RETRANS) {
+            tcp_free_flow((int)f->slot);
+            return;
+        }
+
+        tcp_cc_on_timeout(f);
+        tcp_sack_on_rto(f);
+
+        tcp_send_from_seg(f, s);
+
+        s->retransmit_cnt++;
+        tcp_recovery_stats.rto_rexmits++;
+
+        if (s->timeout_ms == 0) {
+            uint32_t rto = f->rto ? f->rto : TCP_INIT_RTO;
+            if (rto < TCP_MIN_RTO) rto = TCP_MIN_RTO;
+            s->timeout_ms = rto;
+        } else if (s->timeout_ms < TCP_MAX_RTO) {
+            uint32_t next = s->timeout_ms << 1;
+            if (next > TCP_MAX_RTO) next = TCP_MAX_RTO;
+            s->timeout_ms = next;
         }
     }
-}
 
+    tcp_timer_update(f);
+}
 
 int tcp_daemon_entry(int argc, char *argv[]) {
     (void)argc;
     (void)argv;
 
-    const uint32_t tick_ms = 25;
-    const uint32_t grace_ms = 10000;
-    uint32_t idle_ms = 0;
-
     while (1) {
-        if (tcp_has_pending_timers()) {
-            tcp_tick_all(tick_ms);
-            idle_ms = 0;
-        } else {
-            idle_ms += tick_ms;
-            if(idle_ms >= grace_ms) break;
+        bool woken = kevent_wait(&tcp_timer_event, TCP_DAEMON_GRACE_MS);
+
+        tcp_flow_t *f;
+        while ((f = tcp_pop_due())) tcp_flow_expire(f, timer_now_msec());
+
+        if (woken) continue;
+
+        irq_flags_t irq = irq_save_disable();
+        if (!tcp_has_pending_timers()) {
+            tcp_daemon_running = 0;
+            irq_restore(irq);
+            break;
         }
-        msleep(tick_ms);
+        irq_restore(irq);
     }
 
-    disable_interrupt();
-    tcp_daemon_running = 0;
-    enable_interrupt();
     return 0;
 }
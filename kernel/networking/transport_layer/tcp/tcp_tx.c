@@ -38,11 +38,11 @@ uint16_t tcp_calc_adv_wnd_field(tcp_flow_t *flow, uint8_t apply_scale) {
 static void tcp_persist_arm(tcp_flow_t *flow) {
     if (!flow) return;
     flow->persist_active = 1;
-    flow->persist_timer_ms = 0;
+    flow->persist_start_ms = timer_now_msec();
     if (flow->persist_timeout_ms == 0) flow->persist_timeout_ms = TCP_PERSIST_MIN_MS;
     if (flow->persist_timeout_ms < TCP_PERSIST_MIN_MS) flow->persist_timeout_ms = TCP_PERSIST_MIN_MS;
     if (flow->persist_timeout_ms > TCP_PERSIST_MAX_MS) flow->persist_timeout_ms = TCP_PERSIST_MAX_MS;
-    tcp_daemon_kick();
+    tcp_timer_update(flow);
 }
 
 tcp_tx_seg_t *tcp_alloc_tx_seg(tcp_flow_t *flow){
@@ -54,12 +54,15 @@ tcp_tx_seg_t *tcp_alloc_tx_seg(tcp_flow_t *flow){
             s->fin = 0;
             s->rtt_sample = 0;
             s->retransmit_cnt = 0;
+            s->sacked = 0;
+            s->lost = 0;
+            s->recovery_rexmit = 0;
             s->seq = 0;
             s->len = 0;
             s->buf = 0;
-            s->timer_ms = 0;
+            s->sent_ms = timer_now_msec();
             s->timeout_ms = flow->rto ? flow->rto : TCP_INIT_RTO;
-            tcp_daemon_kick();
+            tcp_timer_update(flow);
             return s;
         }
     }
@@ -67,7 +70,9 @@ tcp_tx_seg_t *tcp_alloc_tx_seg(tcp_flow_t *flow){
 }
 
 void tcp_send_from_seg(tcp_flow_t *flow, tcp_tx_seg_t *seg){
-    if (flow) flow->keepalive_idle_ms = 0;
+    if (flow) flow->keepalive_start_ms = timer_now_msec();
+    seg->sent_ms = timer_now_msec();
+    tcp_cc_on_send(flow, seg);
     tcp_hdr_t hdr;
 
     hdr.src_port = bswap16(flow->local_port);
@@ -94,7 +99,7 @@ void tcp_send_from_seg(tcp_flow_t *flow, tcp_tx_seg_t *seg){
         (void)tcp_send_segment(IP_VER6, flow->local.ip, flow->remote.ip, &hdr, NULL, 0, seg->buf ? (const uint8_t *)seg->buf : NULL, seg->len, (const ip_tx_opts_t *)&tx, flow->ip_ttl, flow->ip_dontfrag);
     }
 
-    tcp_daemon_kick();
+    tcp_timer_update(flow);
 }
 
 void tcp_send_ack_now(tcp_flow_t *flow){
@@ -172,128 +177,190 @@ void tcp_send_ack_now(tcp_flow_t *flow){
     }
 
     flow->delayed_ack_pending = 0;
-    flow->delayed_ack_timer_ms = 0;
-    tcp_daemon_kick();
+    flow->delayed_ack_start_ms = timer_now_msec();
+    tcp_timer_update(flow);
 }
 
-tcp_result_t tcp_flow_send(tcp_data *flow_ctx){
-    if (!flow_ctx) return TCP_INVALID;
-
-    tcp_flow_t *flow = NULL;
-    for (int i = 0; i < MAX_TCP_FLOWS; i++) {
-        if (!tcp_flows[i]) continue;
-        if (&tcp_flows[i]->ctx == flow_ctx) {
-            flow = tcp_flows[i];
-            break;
-        }
-    }
-    if (!flow) return TCP_INVALID;
-
-    uint8_t flags = flow_ctx->flags;
-    uint8_t *payload_ptr = (uint8_t *)flow_ctx->payload.ptr;
-    uint64_t payload_len = flow_ctx->payload.size;
-    flow_ctx->payload.size = 0;
-
-    if (flow->state != TCP_ESTABLISHED && !(flags & (1u << FIN_F))) {
-        if (!(flow->state == TCP_CLOSE_WAIT && (flags & (1u << FIN_F)))) return TCP_INVALID;
-    }
-
-    if (flow->snd_wnd == 0 && !(flags & (1u << FIN_F))) {
-        tcp_persist_arm(flow);
-        return TCP_WOULDBLOCK;
-    }
+//Bytes the peer window and the congestion window still leave room for
+static uint64_t tcp_send_room(tcp_flow_t *flow) {
+    if (flow->snd_wnd == 0) return 0;
 
     uint64_t in_flight = flow->snd_nxt - flow->snd_una;
+    uint64_t cc_flight = flow->sack_ok ? tcp_sack_pipe(flow) : in_flight;
     uint32_t wnd = flow->snd_wnd;
     uint32_t cwnd = flow->cwnd ? flow->cwnd : (flow->mss ? flow->mss : TCP_DEFAULT_MSS);
-    uint32_t eff_wnd = wnd < cwnd ? wnd : cwnd;
-
-    if (eff_wnd == 0) eff_wnd = 1;
-    if (in_flight >= eff_wnd && !(flags & (1u << FIN_F))) return TCP_WOULDBLOCK;
 
-    uint64_t can_send = eff_wnd - in_flight;
-    if (can_send == 0 && !(flags & (1u << FIN_F))) return TCP_WOULDBLOCK;
+    uint64_t room = in_flight < wnd ? wnd - in_flight : 0;
+    uint64_t cc_room = cc_flight < cwnd ? cwnd - cc_flight : 0;
+    return cc_room < room ? cc_room : room;
+}
 
-    uint64_t remaining = payload_len;
-    uint64_t sent_bytes = 0;
-    int first_segment = 1;
+static uint64_t tcp_push_data(tcp_flow_t *flow, const uint8_t *data, uint64_t len, uint64_t room) {
+    uint64_t sent = 0;
 
-    while (remaining > 0 && can_send > 0) {
-        uint64_t seg_len = (uint64_t)(remaining > can_send ? can_send : remaining);
+    while (sent < len && room > 0) {
+        uint64_t seg_len = len - sent > room ? room : len - sent;
         if (flow->mss && seg_len > flow->mss) seg_len = (uint64_t)flow->mss;
 
         tcp_tx_seg_t *seg = tcp_alloc_tx_seg(flow);
         if (!seg) break;
 
-        uintptr_t buf = 0;
-        if (seg_len) {
-            buf = (uintptr_t)malloc(seg_len);
-            if (!buf) { seg->used = 0; break; }
-            memcpy((void *)buf, payload_ptr + sent_bytes, seg_len);
-        }
+        uintptr_t buf = (uintptr_t)malloc(seg_len);
+        if (!buf) { seg->used = 0; break; }
+        memcpy((void *)buf, data + sent, seg_len);
 
         seg->seq = flow->snd_nxt;
         seg->len = seg_len;
         seg->buf = buf;
         seg->syn = 0;
         seg->fin = 0;
-        seg->timer_ms = 0;
+        seg->sent_ms = timer_now_msec();
         seg->timeout_ms = flow->rto ? flow->rto : TCP_INIT_RTO;
         seg->retransmit_cnt = 0;
         seg->rtt_sample = 0;
-        if (!flow->rtt_valid && first_segment) seg->rtt_sample = 1;
+        if (!flow->rtt_valid && sent == 0) seg->rtt_sample = 1;
 
         tcp_send_from_seg(flow, seg);
 
         flow->snd_nxt += seg_len;
-        sent_bytes += seg_len;
-        remaining -= seg_len;
-        can_send -= seg_len;
-        first_segment = 0;
+        sent += seg_len;
+        room -= seg_len;
     }
 
-    if ((flags & (1u << FIN_F)) && remaining == 0) {
-        tcp_tx_seg_t *seg = tcp_alloc_tx_seg(flow);
-        if (!seg) return sent_bytes ? TCP_OK : TCP_WOULDBLOCK;
+    return sent;
+}
 
-        seg->seq = flow->snd_nxt;
-        seg->len = 0;
-        seg->buf = 0;
-        seg->syn = 0;
-        seg->fin = 1;
-        seg->timer_ms = 0;
-        seg->timeout_ms = flow->rto ? flow->rto : TCP_INIT_RTO;
-        seg->retransmit_cnt = 0;
-        seg->rtt_sample = 0;
+static bool tcp_push_fin(tcp_flow_t *flow) {
+    tcp_tx_seg_t *seg = tcp_alloc_tx_seg(flow);
+    if (!seg) return false;
+
+    seg->seq = flow->snd_nxt;
+    seg->len = 0;
+    seg->buf = 0;
+    seg->syn = 0;
+    seg->fin = 1;
+    seg->sent_ms = timer_now_msec();
+    seg->timeout_ms = flow->rto ? flow->rto : TCP_INIT_RTO;
+    seg->retransmit_cnt = 0;
+    seg->rtt_sample = 0;
+
+    tcp_send_from_seg(flow, seg);
+
+    flow->snd_nxt += 1;
+    flow->ctx.expected_ack = flow->snd_nxt;
+    return true;
+}
 
-        tcp_send_from_seg(flow, seg);
+//Keeps what the pacer held back, never more than the windows would have taken
+static uint64_t tcp_pace_queue(tcp_flow_t *flow, const uint8_t *data, uint64_t len, uint64_t room) {
+    if (room > TCP_PACE_QUEUE_MAX - flow->pace_len) room = TCP_PACE_QUEUE_MAX - flow->pace_len;
+    if (len > room) len = room;
+    if (!len) return 0;
+
+    if (!flow->pace_buf) {
+        flow->pace_buf = (uint8_t *)malloc(TCP_PACE_QUEUE_MAX);
+        if (!flow->pace_buf) return 0;
+    }
+
+    if (flow->pace_off + flow->pace_len + len > TCP_PACE_QUEUE_MAX) {
+        for (uint32_t i = 0; i < flow->pace_len; i++) flow->pace_buf[i] = flow->pace_buf[flow->pace_off + i];
+        flow->pace_off = 0;
+    }
+
+    memcpy(flow->pace_buf + flow->pace_off + flow->pace_len, data, len);
+    flow->pace_len += (uint32_t)len;
+    return len;
+}
+
+void tcp_pace_drain(tcp_flow_t *flow) {
+    if (!flow->pace_len && !flow->pace_fin) return;
+
+    uint64_t room = tcp_send_room(flow);
+    uint32_t pace_room = tcp_cc_pacing_budget(flow);
+    if (pace_room < room) room = pace_room;
+
+    uint64_t sent = flow->pace_len ? tcp_push_data(flow, flow->pace_buf + flow->pace_off, flow->pace_len, room) : 0;
+    flow->pace_off += (uint32_t)sent;
+    flow->pace_len -= (uint32_t)sent;
+    if (!flow->pace_len) flow->pace_off = 0;
+    if (!flow->pace_len && flow->pace_fin && tcp_push_fin(flow)) flow->pace_fin = 0;
+
+    flow->ctx.sequence = flow->snd_nxt;
+    tcp_cc_paced(flow, (uint32_t)sent);
+    if (sent) tcp_tlp_arm(flow);
+    tcp_timer_update(flow);
+}
+
+tcp_result_t tcp_flow_send(tcp_data *flow_ctx){
+    if (!flow_ctx) return TCP_INVALID;
 
-        flow->snd_nxt += 1;
-        flow->ctx.expected_ack = flow->snd_nxt;
+    tcp_flow_t *flow = tcp_flow_from_ctx(flow_ctx);
+    if (!flow) return TCP_INVALID;
+
+    uint8_t flags = flow_ctx->flags;
+    uint8_t *payload_ptr = (uint8_t *)flow_ctx->payload.ptr;
+    uint64_t payload_len = flow_ctx->payload.size;
+    flow_ctx->payload.size = 0;
+
+    if (flow->state != TCP_ESTABLISHED && !(flags & (1u << FIN_F))) {
+        if (!(flow->state == TCP_CLOSE_WAIT && (flags & (1u << FIN_F)))) return TCP_INVALID;
+    }
+
+    if (flow->snd_wnd == 0 && !(flags & (1u << FIN_F))) {
+        tcp_persist_arm(flow);
+        return TCP_WOULDBLOCK;
+    }
+
+    //Whatever the pacer already holds goes first, new data lines up behind it
+    tcp_pace_drain(flow);
+    uint64_t room = tcp_send_room(flow);
+
+    if (flow->pace_len || flow->pace_fin) {
+        uint64_t queued = tcp_pace_queue(flow, payload_ptr, payload_len, room > flow->pace_len ? room - flow->pace_len : 0);
+        if ((flags & (1u << FIN_F)) && queued == payload_len) flow->pace_fin = 1;
+        tcp_timer_update(flow);
+
+        flow_ctx->sequence = flow->snd_nxt;
+        flow_ctx->payload.size = queued;
+        return queued || (flags & (1u << FIN_F)) ? TCP_OK : TCP_WOULDBLOCK;
+    }
+
+    if (room == 0 && !(flags & (1u << FIN_F))) return TCP_WOULDBLOCK;
+
+    uint64_t can_send = room;
+    uint32_t pace_room = tcp_cc_pacing_budget(flow);
+    if (pace_room < can_send) can_send = pace_room;
+
+    uint64_t sent_bytes = tcp_push_data(flow, payload_ptr, payload_len, can_send);
+    uint64_t queued = 0;
+    //The pacer cut this burst short, the flow timer sends the rest at the release time
+    if (pace_room < room && sent_bytes < payload_len) queued = tcp_pace_queue(flow, payload_ptr + sent_bytes, payload_len - sent_bytes, room - sent_bytes);
+
+    if ((flags & (1u << FIN_F)) && sent_bytes + queued == payload_len) {
+        if (queued) flow->pace_fin = 1;
+        else if (!tcp_push_fin(flow)) return sent_bytes ? TCP_OK : TCP_WOULDBLOCK;
     }
 
     flow_ctx->sequence = flow->snd_nxt;
     flow->ctx.sequence = flow->snd_nxt;
 
-    tcp_daemon_kick();
+    tcp_cc_paced(flow, (uint32_t)sent_bytes);
+    if (sent_bytes) tcp_tlp_arm(flow);
+    tcp_timer_update(flow);
 
-    flow_ctx->payload.size = sent_bytes;
-    return sent_bytes || (flags & (1u << FIN_F)) ? TCP_OK : TCP_WOULDBLOCK;
+    flow_ctx->payload.size = sent_bytes + queued;
+    return sent_bytes || queued || (flags & (1u << FIN_F)) ? TCP_OK : TCP_WOULDBLOCK;
 }
 
 tcp_result_t tcp_flow_close(tcp_data *flow_ctx){
     if (!flow_ctx) return TCP_INVALID;
 
-    tcp_flow_t *flow = NULL;
-    for (int i = 0; i < MAX_TCP_FLOWS; i++) {
-        if (!tcp_flows[i]) continue;
-        if (&tcp_flows[i]->ctx == flow_ctx) {
-            flow = tcp_flows[i];
-            break;
-        }
-    }
+    tcp_flow_t *flow = tcp_flow_from_ctx(flow_ctx);
     if (!flow) return TCP_INVALID;
 
+    //Nothing reads the flow after close, release the frames it still holds
+    tcp_rcvq_purge(flow);
+
     if (flow->state == TCP_ESTABLISHED || flow->state == TCP_CLOSE_WAIT) {
         flow_ctx->sequence = flow->snd_nxt;
         flow_ctx->ack = flow->ctx.ack;
@@ -307,7 +374,7 @@ tcp_result_t tcp_flow_close(tcp_data *flow_ctx){
             if (flow->state == TCP_ESTABLISHED) flow->state = TCP_FIN_WAIT_1;
             else flow->state = TCP_LAST_ACK;
         }
-        tcp_daemon_kick();
+        tcp_timer_update(flow);
         return res;
     }
 
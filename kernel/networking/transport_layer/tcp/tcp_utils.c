@@ -63,6 +63,7 @@ void tcp_parse_options(const uint8_t *opts, uint32_t len, tcp_parsed_opts_t *out
     out->sack_permitted = 0;
     out->has_mss = 0;
     out->has_wscale = 0;
+    out->sack_count = 0;
 
     if (!opts || len == 0) return;
 
@@ -88,6 +89,12 @@ void tcp_parse_options(const uint8_t *opts, uint32_t len, tcp_parsed_opts_t *out
             out->has_wscale = 1;
         } else if (kind == 4 && olen == 2) {
             out->sack_permitted = 1;
+        } else if (kind == 5 && olen >= 10 && ((olen - 2) & 7) == 0) {
+            for (uint32_t o = i + 2; o + 8 <= i + olen && out->sack_count < TCP_MAX_SACK_BLOCKS; o += 8) {
+                out->sack_left[out->sack_count] = ((uint32_t)opts[o] << 24) | ((uint32_t)opts[o + 1] << 16) | ((uint32_t)opts[o + 2] << 8) | opts[o + 3];
+                out->sack_right[out->sack_count] = ((uint32_t)opts[o + 4] << 24) | ((uint32_t)opts[o + 5] << 16) | ((uint32_t)opts[o + 6] << 8) | opts[o + 7];
+                out->sack_count++;
+            }
         }
 
         i += olen;
@@ -11,12 +11,17 @@
 extern "C" {
 #endif
 
+#define TCP_MAX_SACK_BLOCKS 4
+
 typedef struct {
     uint16_t mss;
     uint8_t wscale;
     uint8_t sack_permitted;
     uint8_t has_mss;
     uint8_t has_wscale;
+    uint8_t sack_count;
+    uint32_t sack_left[TCP_MAX_SACK_BLOCKS];
+    uint32_t sack_right[TCP_MAX_SACK_BLOCKS];
 } tcp_parsed_opts_t;
 
 void tcp_parse_options(const uint8_t *opts, uint32_t len, tcp_parsed_opts_t *out);
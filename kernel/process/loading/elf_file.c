@@ -12,6 +12,7 @@
 #include "process/scheduler.h"
 #include "filesystem/filesystem.h"
 #include "process/uaccess.h"
+#include "exec_cache.h"
 
 typedef struct elf_header {
     char magic[4];//should be " ELF"
@@ -195,27 +196,43 @@ bool setup_process_args(process_t *proc, int argc, const char *argv[]) {
     return true;
 }
 
-process_t* load_elf_process_path(const char *name, const char *bundle, const char *path, int argc, const char *argv[]) {
-    if (!path || !*path) return 0;
-    
-    file fd = {};
-    if (open_file(kernel_fs(), path, &fd) != FS_RESULT_SUCCESS) return 0;
-    
-    char *program = (char*)zalloc(fd.size);
-    if (!program) {
-        close_file(&fd);
-        return 0;
+//Segments can be mapped straight out of the file when each sits at the same page offset in the file and in memory
+//and no page is shared between two of them or needs to be both writable and executable
+static bool elf_demand_mappable(elf_program_header *ph, int count, size_t filesize){
+    uaddr_t prev_end = 0;
+    bool any = false;
+    for (int i = 0; i < count; i++) {
+        if (ph[i].segment_type != 1) continue;
+        if (ph[i].p_memsz == 0) continue;
+        if ((elf_to_red_permissions(ph[i].flags) & (MEM_RW | MEM_EXEC)) == (MEM_RW | MEM_EXEC)) return false;
+        if ((ph[i].p_vaddr - ph[i].p_offset) & (PAGE_SIZE - 1)) return false;
+        if (ph[i].p_filez > ph[i].p_memsz) return false;
+        if (ph[i].p_offset > filesize || ph[i].p_filez > filesize - ph[i].p_offset) return false;
+
+        uaddr_t start = ph[i].p_vaddr & ~(PAGE_SIZE - 1);
+        if (any && start < prev_end) return false;
+        prev_end = (ph[i].p_vaddr + ph[i].p_memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        any = true;
     }
-    
-    bool ok = read_file(&fd, program, fd.size) == fd.size;
-    close_file(&fd);
-    if (!ok) {
-        release(program);
-        return 0;
-    }
-    
-    process_t *proc = load_elf_file(name, bundle,program, fd.size);
-    release(program);
+    return any;
+}
+
+static process_t* load_elf(const char *name, const char *bundle, void* file, size_t filesize, exec_image *image);
+
+process_t* load_elf_process_cached(const char *name, const char *bundle, const char *path) {
+    if (!path || !*path) return 0;
+
+    //Launching a binary that already ran reuses its cached image and doesn't touch the filesystem
+    exec_image *image = exec_cache_get(path);
+    if (!image) return 0;
+
+    process_t *proc = load_elf(name, bundle, (void*)dmap_pa_to_kva(image->phys), image->size, image);
+    exec_cache_put(image);
+    return proc;
+}
+
+process_t* load_elf_process_path(const char *name, const char *bundle, const char *path, int argc, const char *argv[]) {
+    process_t *proc = load_elf_process_cached(name, bundle, path);
     if (!proc) return 0;
     if (!setup_process_args(proc, argc, argv)) {
         reset_process(proc);
@@ -227,6 +244,11 @@ process_t* load_elf_process_path(const char *name, const char *bundle, const cha
 }
 
 process_t* load_elf_file(const char *name, const char *bundle, void* file, size_t filesize){
+    return load_elf(name, bundle, file, filesize, 0);
+}
+
+//With an image holding file, suitable programs are demand paged from it instead of copied
+static process_t* load_elf(const char *name, const char *bundle, void* file, size_t filesize, exec_image *image){
     if (!file) return 0;
     if (filesize < sizeof(elf_header)) return 0;
 
@@ -374,7 +396,10 @@ process_t* load_elf_file(const char *name, const char *bundle, void* file, size_
         return 0;
     }
 
-    process_t *proc = create_process(name, bundle, data, di, header->program_entry_offset, false);
+    process_t *proc = 0;
+    if (image && elf_demand_mappable(program_headers, header->program_header_num_entries, filesize))
+        proc = create_process_image(name, bundle, data, di, header->program_entry_offset, image);
+    else proc = create_process(name, bundle, data, di, header->program_entry_offset, false);
     temp_free(data, load_count * sizeof(program_load_data));
     if (!proc) return 0;
 
@@ -9,6 +9,8 @@ extern "C" {
 #include "std/string.h"
 
 process_t* load_elf_file(const char *name, const char *bundle, void* file, size_t filesize);
+//Loaded from the executable cache but not started, load_elf_process_path also sets up arguments and readies it
+process_t* load_elf_process_cached(const char *name, const char *bundle, const char *path);
 process_t* load_elf_process_path(const char *name, const char *bundle, const char *path, int argc, const char *argv[]);
 bool setup_process_args(process_t *proc, int argc, const char *argv[]);
 void get_elf_debug_info(process_t* proc, void* file, size_t filesize);
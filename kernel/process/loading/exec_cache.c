@@ -0,0 +1,191 @@
+#include "exec_cache.h"
+#include "memory/page_allocator.h"
+#include "memory/addr.h"
+#include "memory/slab.h"
+#include "std/memory.h"
+#include "std/string.h"
+#include "exceptions/irq.h"
+#include "filesystem/filesystem.h"
+
+static exec_image *exec_cache_head;
+static uint64_t exec_cache_bytes;
+static uint64_t exec_cache_clock;
+static uint64_t exec_cache_hits;
+static uint64_t exec_cache_misses;
+
+static void exec_image_free(exec_image *img){
+    if (img->phys) pfree((void*)dmap_pa_to_kva(img->phys), img->map_size);
+    slab_free(img);
+}
+
+//Caller holds irqs off. The image stays alive while referenced and is freed by the last put
+static void exec_cache_unlink(exec_image *img){
+    exec_image **pp = &exec_cache_head;
+    while (*pp && *pp != img) pp = &(*pp)->next;
+    if (!*pp) return;
+    *pp = img->next;
+    img->next = 0;
+    img->stale = true;
+    exec_cache_bytes -= img->map_size;
+}
+
+//Unlinks unused images oldest first until need more bytes fit, returns the ones to free
+static exec_image* exec_cache_evict(uint64_t need){
+    exec_image *victims = 0;
+    while (exec_cache_bytes + need > EXEC_CACHE_MAX_BYTES) {
+        exec_image *old = 0;
+        for (exec_image *img = exec_cache_head; img; img = img->next)
+            if (!img->refs && (!old || img->last_use < old->last_use)) old = img;
+        if (!old) break;
+        exec_cache_unlink(old);
+        old->next = victims;
+        victims = old;
+    }
+    return victims;
+}
+
+//Paths are compared without their leading slash, loaders and filesystems don't agree on it
+static exec_image* exec_cache_find(const char *path){
+    if (*path == '/') path++;
+    for (exec_image *img = exec_cache_head; img; img = img->next){
+        const char *key = img->path;
+        if (*key == '/') key++;
+        if (strcmp_case(key, path, true) == 0) return img;
+    }
+    return 0;
+}
+
+static exec_image* exec_cache_read(const char *path){
+    file fd = {};
+    if (open_file(kernel_fs(), path, &fd) != FS_RESULT_SUCCESS) return 0;
+    if (!fd.size) {
+        close_file(&fd);
+        return 0;
+    }
+
+    exec_image *img = (exec_image*)slab_alloc(sizeof(exec_image), 8);
+    if (!img) {
+        close_file(&fd);
+        return 0;
+    }
+    memset(img, 0, sizeof(exec_image));
+    strncpy(img->path, path, sizeof(img->path));
+    img->size = fd.size;
+    img->map_size = (fd.size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    img->phys = palloc_inner(img->map_size, MEM_PRIV_USER, MEM_RW, true, false);
+    if (!img->phys) {
+        close_file(&fd);
+        slab_free(img);
+        return 0;
+    }
+
+    //The tail of the last page can end up mapped past the file data, it must not hold stale memory
+    void *data = (void*)dmap_pa_to_kva(img->phys);
+    memset((uint8_t*)data + img->size, 0, img->map_size - img->size);
+    bool ok = read_file(&fd, (char*)data, fd.size) == fd.size;
+    close_file(&fd);
+    if (!ok) {
+        exec_image_free(img);
+        return 0;
+    }
+    return img;
+}
+
+exec_image* exec_cache_get(const char *path){
+    if (!path || !*path) return 0;
+    if (strlen(path) >= EXEC_CACHE_PATH_MAX) return 0;
+
+    fs_stat st = {};
+    bool have_stat = get_stat(kernel_fs(), path, &st);
+
+    irq_flags_t irq = irq_save_disable();
+    exec_image *img = exec_cache_find(path);
+    exec_image *victims = 0;
+    //A changed size means the file was rewritten, running instances keep the old copy
+    if (img && have_stat && st.size != img->size) {
+        exec_cache_unlink(img);
+        if (!img->refs) {
+            img->next = victims;
+            victims = img;
+        }
+        img = 0;
+    }
+    if (img) {
+        img->refs++;
+        img->last_use = ++exec_cache_clock;
+        exec_cache_hits++;
+    }
+    irq_restore(irq);
+
+    while (victims) {
+        exec_image *next = victims->next;
+        exec_image_free(victims);
+        victims = next;
+    }
+    if (img) return img;
+
+    img = exec_cache_read(path);
+    if (!img) return 0;
+
+    irq = irq_save_disable();
+    exec_cache_misses++;
+    //Another loader may have read the same file meanwhile, keep a single copy
+    exec_image *raced = exec_cache_find(path);
+    if (raced && raced->size == img->size) {
+        raced->refs++;
+        raced->last_use = ++exec_cache_clock;
+        irq_restore(irq);
+        exec_image_free(img);
+        return raced;
+    }
+    victims = exec_cache_evict(img->map_size);
+    img->refs = 1;
+    img->last_use = ++exec_cache_clock;
+    img->next = exec_cache_head;
+    exec_cache_head = img;
+    exec_cache_bytes += img->map_size;
+    irq_restore(irq);
+
+    while (victims) {
+        exec_image *next = victims->next;
+        exec_image_free(victims);
+        victims = next;
+    }
+    return img;
+}
+
+void exec_cache_ref(exec_image *img){
+    if (!img) return;
+    irq_flags_t irq = irq_save_disable();
+    img->refs++;
+    irq_restore(irq);
+}
+
+void exec_cache_put(exec_image *img){
+    if (!img) return;
+    irq_flags_t irq = irq_save_disable();
+    bool release = img->refs && --img->refs == 0 && img->stale;
+    irq_restore(irq);
+    if (release) exec_image_free(img);
+}
+
+void exec_cache_drop(const char *path){
+    if (!path) return;
+    irq_flags_t irq = irq_save_disable();
+    exec_image *img = exec_cache_find(path);
+    bool release = false;
+    if (img) {
+        exec_cache_unlink(img);
+        release = !img->refs;
+    }
+    irq_restore(irq);
+    if (release) exec_image_free(img);
+}
+
+void exec_cache_get_stats(exec_cache_stats *out){
+    if (!out) return;
+    irq_flags_t irq = irq_save_disable();
+    *out = (exec_cache_stats){ .bytes = exec_cache_bytes, .hits = exec_cache_hits, .misses = exec_cache_misses };
+    for (exec_image *img = exec_cache_head; img; img = img->next) out->images++;
+    irq_restore(irq);
+}
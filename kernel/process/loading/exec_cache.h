@@ -0,0 +1,48 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "types.h"
+
+#define EXEC_CACHE_PATH_MAX 128
+//Images nobody runs are evicted oldest first once the cache holds more than this
+#define EXEC_CACHE_MAX_BYTES (32ULL << 20)
+
+//A whole executable read once into physically contiguous pages. Processes map its pages directly,
+//read only, so every instance of a binary shares the same text
+typedef struct exec_image {
+    char path[EXEC_CACHE_PATH_MAX];
+    size_t size;
+    paddr_t phys;
+    size_t map_size;
+    uint32_t refs;
+    bool stale;
+    uint64_t last_use;
+    struct exec_image *next;
+} exec_image;
+
+typedef struct exec_cache_stats {
+    uint64_t images;
+    uint64_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+} exec_cache_stats;
+
+//Returns the image with a reference held, reading the file on a miss or when its size changed
+exec_image* exec_cache_get(const char *path);
+void exec_cache_ref(exec_image *img);
+void exec_cache_put(exec_image *img);
+//Forgets the cached copy of path, processes still running it keep theirs until they exit.
+//Filesystems call it whenever a file is written or truncated in place
+void exec_cache_drop(const char *path);
+void exec_cache_get_stats(exec_cache_stats *out);
+
+static inline bool exec_image_owns(const exec_image *img, paddr_t pa){
+    return img && pa >= img->phys && pa < img->phys + img->map_size;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -12,6 +12,7 @@
 #include "string/string.h"
 #include "syscalls/syscall_codes.h"
 #include "process/isolated_fs/isolated_fs.h"
+#include "exec_cache.h"
 
 typedef struct {
     uint64_t code_base_start;
@@ -279,14 +280,31 @@ size_t map_section(process_t *proc, kaddr_t base, uaddr_t off, program_load_data
     return data.virt_mem.size;
 }
 
-process_t* create_process(const char *name, const char *bundle, program_load_data *data, size_t data_count, uintptr_t entry, bool allow_rwx) {
-
+static process_t* process_new_user(const char *name, const char *bundle){
     process_t* proc = init_process();
 
     name_process(proc, name);
 
     proc->bundle = bundle && *bundle ? string_from_literal(bundle).data : 0;
 
+    uintptr_t *ttbr = mmu_new_ttbr();
+
+    memset(&proc->mm, 0, sizeof(proc->mm));
+    proc->mm.ttbr0 = ttbr;
+    proc->mm.ttbr0_phys = pt_va_to_pa(ttbr);
+    return proc;
+}
+
+static bool ensure_shared_page(){
+    if (shared_page) return true;
+    shared_page = palloc_inner(PAGE_SIZE, MEM_PRIV_SHARED, MEM_EXEC, true, false);
+    if (!shared_page) return false;
+    memset((void*)dmap_pa_to_kva(shared_page), 0, PAGE_SIZE);
+    *(uint32_t*)(uintptr_t)dmap_pa_to_kva(shared_page) = aarch64_svc(HALT_CODE);
+    return true;
+}
+
+static void program_bounds(program_load_data *data, size_t data_count, uaddr_t *min_map, uaddr_t *max_map){
     uaddr_t min_addr = UINT64_MAX;
     uaddr_t max_addr = 0;
     
@@ -296,33 +314,89 @@ process_t* create_process(const char *name, const char *bundle, program_load_dat
         if (s0 < min_addr) min_addr = s0;
         if (s1 > max_addr) max_addr = s1;
     } 
-    uaddr_t min_map = min_addr & ~(GRANULE_4KB - 1);
-    uaddr_t max_map = (max_addr + (GRANULE_4KB - 1)) & ~(GRANULE_4KB - 1);
+    *min_map = min_addr & ~(GRANULE_4KB - 1);
+    *max_map = (max_addr + (GRANULE_4KB - 1)) & ~(GRANULE_4KB - 1);
+}
 
-    size_t code_size = max_map -min_map;
+//Stack, mmap area and the shared return page above the program image that ends at max_map
+static process_t* process_setup_user(process_t *proc, const char *name, uaddr_t max_map, uintptr_t entry){
+    uintptr_t *ttbr = proc->mm.ttbr0;
 
-    // kprintf("Code takes %x from %x to %x",code_size, min_addr, max_addr);
+    uint64_t stack_max_size = 0x800000; //TODO it shouldnt be fix
+    uint64_t shared_pages = 1;
+    size_t shared_size = shared_pages * PAGE_SIZE;
+    uaddr_t stack_top = 0x00007FFFFFFFF000ULL;
+    uaddr_t stack_limit = stack_top - stack_max_size;
+    uaddr_t stack_commit = stack_top;
+    uaddr_t mmap_top = stack_limit - PAGE_SIZE;
+    uaddr_t shared_base = mmap_top - (shared_size - PAGE_SIZE);
 
-    uintptr_t *ttbr = mmu_new_ttbr();
+    uaddr_t mmap_bottom = (max_map + (PAGE_SIZE*4) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (mmap_bottom > shared_base) {
+        reset_process(proc);
+        return 0;
+    }
+    proc->heap_phys = 0;
 
-    memset(&proc->mm, 0, sizeof(proc->mm));
-    proc->mm.ttbr0 = ttbr;
-    proc->mm.ttbr0_phys = pt_va_to_pa(ttbr);
+    proc->mm.mmap_bottom = mmap_bottom;
+    proc->mm.mmap_top = mmap_top;
+    proc->mm.mmap_cursor = shared_base;
+    proc->mm.stack_top = stack_top;
+    proc->mm.stack_limit = stack_limit;
+    proc->mm.stack_commit = stack_commit;
+
+
+    uint64_t total_pages = get_total_user_ram() / PAGE_SIZE;
+    if (!total_pages) total_pages = 1;
+
+    proc->mm.cap_stack_pages = stack_max_size / PAGE_SIZE;
+    proc->mm.cap_anon_pages = total_pages / 2;
+    if (proc->mm.cap_anon_pages < 128) proc->mm.cap_anon_pages = 128;
+
+    for (uint64_t i = 0; i < shared_pages; i++) mmu_map_4kb((uint64_t*)ttbr, (uint64_t)(shared_base + (i * PAGE_SIZE)), (paddr_t)(shared_page + (i * PAGE_SIZE)), MAIR_IDX_NORMAL, MEM_EXEC | MEM_NORM, MEM_PRIV_SHARED);
+    mm_add_vma(&proc->mm, shared_base, shared_base + shared_size, MEM_EXEC | MEM_NORM, VMA_KIND_SPECIAL, VMA_FLAG_NOFREE);
+    mm_add_vma(&proc->mm, proc->mm.stack_limit, proc->mm.stack_top, MEM_RW, VMA_KIND_STACK, VMA_FLAG_DEMAND);
+
+    proc->stack = stack_top;
+    proc->stack_phys = 0;
+    proc->stack_size = stack_max_size;
+    proc->mm.rss_stack_pages = 0;
+
+    proc->sp = proc->stack;
+
+    proc->pc = (uintptr_t)(entry);
+    proc->regs[30] = shared_base;
+    kprintf("User process %s (%i) allocated at %llx entry=%llx stack=%llx-%llx (phys=%llx-%llx) anon=%llx (phys=%llx)", name, proc->id, proc, (uint64_t)proc->pc, (uint64_t)proc->mm.stack_limit, (uint64_t)proc->mm.stack_top, (uint64_t)proc->stack_phys, (uint64_t)proc->stack_phys, (uint64_t)proc->mm.mmap_bottom, (uint64_t)proc->heap_phys);
+    proc->spsr = 0;
+    proc->state = BLOCKED;
+
+    make_process_fs(proc,proc->bundle);
+    
+    return proc;
+}
+
+process_t* create_process(const char *name, const char *bundle, program_load_data *data, size_t data_count, uintptr_t entry, bool allow_rwx) {
+
+    process_t* proc = process_new_user(name, bundle);
+    uintptr_t *ttbr = proc->mm.ttbr0;
+
+    uaddr_t min_map = 0;
+    uaddr_t max_map = 0;
+    program_bounds(data, data_count, &min_map, &max_map);
+
+    size_t code_size = max_map -min_map;
+
+    // kprintf("Code takes %x from %x to %x",code_size, min_addr, max_addr);
 
     paddr_t dest = palloc_inner(code_size, MEM_PRIV_USER, MEM_RW, true, false);
     if (!dest) {
         reset_process(proc);
         return 0;
     }
-    if (!shared_page) {
-        shared_page = palloc_inner(PAGE_SIZE, MEM_PRIV_SHARED, MEM_EXEC, true, false);
-        if (!shared_page) {
-            pfree((void*)dmap_pa_to_kva(dest), code_size);
-            reset_process(proc);
-            return 0;
-        }
-        memset((void*)dmap_pa_to_kva(shared_page), 0, PAGE_SIZE);
-        *(uint32_t*)(uintptr_t)dmap_pa_to_kva(shared_page) = aarch64_svc(HALT_CODE);
+    if (!ensure_shared_page()) {
+        pfree((void*)dmap_pa_to_kva(dest), code_size);
+        reset_process(proc);
+        return 0;
     }
     
     // kprintf("Allocated space for process between %x and %x",dest,dest+((code_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)));
@@ -371,55 +445,70 @@ process_t* create_process(const char *name, const char *bundle, program_load_dat
     proc->code = dest;
     proc->code_size = code_size;
 
-    uint64_t stack_max_size = 0x800000; //TODO it shouldnt be fix
-    uint64_t shared_pages = 1;
-    size_t shared_size = shared_pages * PAGE_SIZE;
-    uaddr_t stack_top = 0x00007FFFFFFFF000ULL;
-    uaddr_t stack_limit = stack_top - stack_max_size;
-    uaddr_t stack_commit = stack_top;
-    uaddr_t mmap_top = stack_limit - PAGE_SIZE;
-    uaddr_t shared_base = mmap_top - (shared_size - PAGE_SIZE);
+    return process_setup_user(proc, name, max_map, entry);
+}
 
-    uaddr_t mmap_bottom = (max_map + (PAGE_SIZE*4) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-    if (mmap_bottom > shared_base) {
-        reset_process(proc);
-        return 0;
-    }
-    proc->heap_phys = 0;
+process_t* create_process_image(const char *name, const char *bundle, program_load_data *data, size_t data_count, uintptr_t entry, exec_image *image) {
+    if (!image || !ensure_shared_page()) return 0;
 
-    proc->mm.mmap_bottom = mmap_bottom;
-    proc->mm.mmap_top = mmap_top;
-    proc->mm.mmap_cursor = shared_base;
-    proc->mm.stack_top = stack_top;
-    proc->mm.stack_limit = stack_limit;
-    proc->mm.stack_commit = stack_commit;
+    process_t* proc = process_new_user(name, bundle);
 
+    uaddr_t min_map = 0;
+    uaddr_t max_map = 0;
+    program_bounds(data, data_count, &min_map, &max_map);
 
-    uint64_t total_pages = get_total_user_ram() / PAGE_SIZE;
-    if (!total_pages) total_pages = 1;
+    exec_cache_ref(image);
+    proc->mm.exec = image;
 
-    proc->mm.cap_stack_pages = stack_max_size / PAGE_SIZE;
-    proc->mm.cap_anon_pages = total_pages / 2;
-    if (proc->mm.cap_anon_pages < 128) proc->mm.cap_anon_pages = 128;
+    //Nothing is copied or mapped here, every page comes in on its first fault
+    uintptr_t file_base = (uintptr_t)dmap_pa_to_kva(image->phys);
+    for (size_t i = 0; i < data_count; i++) {
+        uaddr_t start = data[i].virt_mem.ptr & ~(GRANULE_4KB - 1);
+        uint64_t file_off = (data[i].file_cpy.ptr - file_base) - (data[i].virt_mem.ptr - start);
+        uint8_t prot = MEM_NORM;
+        if (data[i].permissions & MEM_RW) prot |= MEM_RW;
+        if (data[i].permissions & MEM_EXEC) prot |= MEM_EXEC;
+        if (!mm_add_file_vma(&proc->mm, start, data[i].virt_mem.ptr + data[i].virt_mem.size, prot, file_off, data[i].virt_mem.ptr + data[i].file_cpy.size)) {
+            reset_process(proc);
+            return 0;
+        }
+    }
 
-    for (uint64_t i = 0; i < shared_pages; i++) mmu_map_4kb((uint64_t*)ttbr, (uint64_t)(shared_base + (i * PAGE_SIZE)), (paddr_t)(shared_page + (i * PAGE_SIZE)), MAIR_IDX_NORMAL, MEM_EXEC | MEM_NORM, MEM_PRIV_SHARED);
-    mm_add_vma(&proc->mm, shared_base, shared_base + shared_size, MEM_EXEC | MEM_NORM, VMA_KIND_SPECIAL, VMA_FLAG_NOFREE);
-    mm_add_vma(&proc->mm, proc->mm.stack_limit, proc->mm.stack_top, MEM_RW, VMA_KIND_STACK, VMA_FLAG_DEMAND);
+    proc->va = min_map;
+    proc->code = 0;
+    proc->code_size = max_map - min_map;
 
-    proc->stack = stack_top;
-    proc->stack_phys = 0;
-    proc->stack_size = stack_max_size;
-    proc->mm.rss_stack_pages = 0;
+    return process_setup_user(proc, name, max_map, entry);
+}
 
-    proc->sp = proc->stack;
+process_t* spawn_process(process_t *parent) {
+    if (!parent || !parent->mm.ttbr0) return 0;
 
-    proc->pc = (uintptr_t)(entry);
-    proc->regs[30] = shared_base;
-    kprintf("User process %s (%i) allocated at %llx entry=%llx stack=%llx-%llx (phys=%llx-%llx) anon=%llx (phys=%llx)", name, proc->id, proc, (uint64_t)proc->pc, (uint64_t)proc->mm.stack_limit, (uint64_t)proc->mm.stack_top, (uint64_t)proc->stack_phys, (uint64_t)proc->stack_phys, (uint64_t)proc->mm.mmap_bottom, (uint64_t)proc->heap_phys);
-    proc->spsr = 0;
+    process_t* proc = process_new_user(parent->name, parent->bundle);
+    bool cloned = mm_clone(&proc->mm, &parent->mm);
+    //Every writable page of the parent just lost write access, including the ones its TLB entries still allow
+    if (parent->mm.asid) mmu_flush_asid(parent->mm.asid);
+    if (!cloned) {
+        reset_process(proc);
+        return 0;
+    }
+
+    memcpy(proc->regs, parent->regs, sizeof(proc->regs));
+    proc->PROC_X0 = 0;
+    proc->sp = parent->sp;
+    proc->pc = parent->pc;
+    proc->spsr = parent->spsr;
+    proc->stack = parent->stack;
+    proc->stack_size = parent->stack_size;
+    proc->va = parent->va;
+    proc->code = 0;
+    proc->code_size = parent->code_size;
+    proc->heap_phys = 0;
+    proc->priority = parent->priority;
+    proc->win_id = parent->win_id;
+    memcpy(proc->signal_handlers, parent->signal_handlers, sizeof(proc->signal_handlers));
     proc->state = BLOCKED;
 
-    make_process_fs(proc,proc->bundle);
-    
+    make_process_fs(proc, proc->bundle);
     return proc;
 }
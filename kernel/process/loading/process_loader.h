@@ -5,6 +5,7 @@ extern "C" {
 #endif
 #include "types.h"
 #include "process/process.h"
+#include "exec_cache.h"
 
 typedef struct {
     sizedptr file_cpy;
@@ -13,6 +14,10 @@ typedef struct {
 } program_load_data;
 
 process_t* create_process(const char *name, const char *bundle, program_load_data *data, size_t data_count, uintptr_t entry, bool allow_rwx);
+//Segments are mapped lazily out of image, file_cpy must point into its pages
+process_t* create_process_image(const char *name, const char *bundle, program_load_data *data, size_t data_count, uintptr_t entry, exec_image *image);
+//Copy of parent sharing its memory copy on write, it resumes at the same point with 0 in x0. Not readied yet
+process_t* spawn_process(process_t *parent);
 void translate_enable_verbose();
 void decode_instruction(uint32_t instruction);
 #ifdef __cplusplus
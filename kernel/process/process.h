@@ -12,6 +12,7 @@ extern "C" {
 #include "graphic_types.h"
 #include "signals/signals.h"
 #include "environment/environment.h"
+#include "exceptions/ktimer.h"
 
 #define INPUT_BUFFER_CAPACITY 64
 #define PACKET_BUFFER_CAPACITY 128
@@ -55,6 +56,13 @@ typedef struct {
     u64 fs_id;
 } system_permissions;
 
+typedef struct wait_entry {
+    struct process *proc;
+    struct wait_entry *next;
+    struct wait_entry *prev;
+    bool woken;
+} wait_entry;
+
 typedef struct process {
     //We use the addresses of these variables to save and restore process state
     uint64_t regs[31]; // x0–x30
@@ -67,6 +75,12 @@ typedef struct process {
     bool sleeping;
     bool suspended;
     uint64_t wake_at_msec;
+    ktimer sleep_timer;
+    //A syscall parked on a wait queue, reissued once woken, see wait_queue_wait_restartable
+    wait_entry park_entry;
+    void *park_queue;
+    ktimer park_timer;
+    uint64_t park_deadline_us;
     uintptr_t stack;
     paddr_t stack_phys;
     uint64_t stack_size;
@@ -93,6 +107,16 @@ typedef struct process {
     __attribute__((aligned(16))) signal_buffer_t signal_buffer;
     __attribute__((aligned(16))) signal_handler signal_handlers[NUMBER_SIGNALS];
     uint8_t priority;
+    uint64_t vruntime;
+    //Run queue tree links, keyed by vruntime then enqueue order
+    struct process *ready_left;
+    struct process *ready_right;
+    uint64_t ready_seq;
+    uint8_t ready_height;
+    uint64_t exec_start_us;
+    uint64_t runtime_us;
+    uint64_t wait_us;
+    uint64_t ready_at_us;
     system_permissions permissions;
     uint16_t win_id;
     uaddr_t win_fb_va;
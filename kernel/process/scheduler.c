@@ -5,9 +5,9 @@
 #include "input/input_dispatch.h"
 #include "exceptions/exception_handler.h"
 #include "exceptions/timer.h"
+#include "exceptions/ktimer.h"
 #include "console/kconsole/kconsole.h"
 #include "data/struct/hashmap.h"
-#include "data/struct/queue.h"
 #include "data/struct/linked_list.h"
 #include "std/memory.h"
 #include "math/math.h"
@@ -20,20 +20,40 @@
 #include "string/string.h"
 #include "alloc/allocate.h"
 #include "files/dir_list.h"
+#include "process/loading/exec_cache.h"
+#include "process/waitqueue.h"
 
 extern void save_pc_interrupt(uintptr_t ptr);
 extern void restore_context(uintptr_t ptr);
 
-static process_t *current_proc = 0;
 static process_t *kernel_proc = 0;
-static process_t *idle_proc = 0;
 static process_t *process_list = 0;
+static process_t *process_tail = 0;
 uint16_t proc_count = 0;
 uint16_t next_proc_index = 1;
 
-//TODO maybe use a weighted ready queue based on process priority
-CQueue ready_queue = {};
-linked_list_t sleeping_list = {};
+//Ready processes are kept in an AVL tree ordered by vruntime, which advances slower the higher the priority
+typedef struct {
+    process_t *current;
+    process_t *idle;
+    process_t *ready_root;
+    uint64_t ready_seq;
+    uint32_t nr_ready;
+    uint64_t min_vruntime;
+    bool need_resched;
+    uint64_t switches;
+} sched_runqueue;
+
+//Only the boot core runs processes, so there is a single run queue
+static sched_runqueue runqueue;
+
+static inline process_t* current_proc(){
+    return runqueue.current;
+}
+
+static inline process_t* idle_proc(){
+    return runqueue.idle;
+}
 
 hash_map_t *proc_opened_files;
 
@@ -44,6 +64,18 @@ typedef struct {
     uint16_t pid;
 } procfs_owner;
 
+#define MAX_PROCFS_ENTRIES 32
+#define PROCFS_ENTRY_SIZE 0x400
+#define PROCFS_ENTRY_MAX 0x40000
+
+typedef struct {
+    const char *name;
+    procfs_entry_fn fn;
+} procfs_entry;
+
+static procfs_entry procfs_entries[MAX_PROCFS_ENTRIES];
+static uint32_t procfs_entry_count = 0;
+
 __attribute__((noreturn)) static void idle_entry() {
     for (;;) {
         asm volatile("dsb sy" ::: "memory");
@@ -51,15 +83,47 @@ __attribute__((noreturn)) static void idle_entry() {
     }
 }
 
+static bool process_is_idle(process_t *proc){
+    return proc == runqueue.idle;
+}
+
+#define PID_TABLE_FANOUT 256
+
+//Two-level radix table from pid to process, leaves are allocated on first use
+static process_t **pid_table[PID_TABLE_FANOUT];
+
+static inline process_t* pid_table_get(uint16_t pid){
+    process_t **leaf = pid_table[pid >> 8];
+    return leaf ? leaf[pid & 0xFF] : 0;
+}
+
+static bool pid_table_set(uint16_t pid, process_t *proc){
+    process_t **leaf = pid_table[pid >> 8];
+    if (!leaf) {
+        if (!proc) return true;
+        leaf = (process_t**)kalloc(proc_page, PID_TABLE_FANOUT * sizeof(process_t*), ALIGN_64B, MEM_PRIV_KERNEL);
+        if (!leaf) return false;
+        memset(leaf, 0, PID_TABLE_FANOUT * sizeof(process_t*));
+        pid_table[pid >> 8] = leaf;
+    }
+    leaf[pid & 0xFF] = proc;
+    return true;
+}
+
+//Pids are handed out in order. After wrapping, 0 and pids still held by a process are skipped
+static uint16_t pid_assign(process_t *proc){
+    for (uint32_t tries = 0; tries < 0x10000; tries++) {
+        uint16_t pid = next_proc_index++;
+        if (!pid || pid_table_get(pid)) continue;
+        if (!pid_table_set(pid, proc)) return 0;
+        return pid;
+    }
+    return 0;
+}
+
 static bool process_is_known(process_t *proc){
     if (!proc) return false;
-    if (proc == idle_proc) return true;
-    process_t *it = process_list;
-    while (it) {
-        if (it == proc) return true;
-        it = it->process_next;
-    }
-    return false;
+    return pid_table_get(proc->id) == proc || process_is_idle(proc);
 }
 
 static bool process_has_runtime_state(process_t *proc){
@@ -78,117 +142,235 @@ static bool process_can_reset(process_t *proc){
     return proc && proc->state == STOPPED && proc->pending_reset && !proc->procfs_refs;
 }
 
-static void enqueue_ready_process(process_t *proc){
-    if (!proc || proc == idle_proc || proc->in_ready_queue) return;
-    if (!ready_queue.elem_size) cqueue_init(&ready_queue, 0, sizeof(process_t*),0,0);
-    if (!cqueue_enqueue(&ready_queue, &proc)) panic("ready enqueue failed", proc->id);
+//Equal vruntimes run in the order they were queued
+static inline bool ready_before(process_t *a, process_t *b){
+    if (a->vruntime != b->vruntime) return a->vruntime < b->vruntime;
+    return a->ready_seq < b->ready_seq;
+}
+
+static inline uint8_t ready_height(process_t *n){
+    return n ? n->ready_height : 0;
+}
+
+static inline void ready_fix_height(process_t *n){
+    uint8_t l = ready_height(n->ready_left);
+    uint8_t r = ready_height(n->ready_right);
+    n->ready_height = (l > r ? l : r) + 1;
+}
+
+static process_t* ready_rotate_right(process_t *n){
+    process_t *l = n->ready_left;
+    n->ready_left = l->ready_right;
+    l->ready_right = n;
+    ready_fix_height(n);
+    ready_fix_height(l);
+    return l;
+}
+
+static process_t* ready_rotate_left(process_t *n){
+    process_t *r = n->ready_right;
+    n->ready_right = r->ready_left;
+    r->ready_left = n;
+    ready_fix_height(n);
+    ready_fix_height(r);
+    return r;
+}
+
+static process_t* ready_balance(process_t *n){
+    ready_fix_height(n);
+    int bf = (int)ready_height(n->ready_left) - (int)ready_height(n->ready_right);
+    if (bf > 1){
+        if (ready_height(n->ready_left->ready_left) < ready_height(n->ready_left->ready_right)) n->ready_left = ready_rotate_left(n->ready_left);
+        return ready_rotate_right(n);
+    }
+    if (bf < -1){
+        if (ready_height(n->ready_right->ready_right) < ready_height(n->ready_right->ready_left)) n->ready_right = ready_rotate_right(n->ready_right);
+        return ready_rotate_left(n);
+    }
+    return n;
+}
+
+static process_t* ready_tree_insert(process_t *root, process_t *n){
+    if (!root) return n;
+    if (ready_before(n, root)) root->ready_left = ready_tree_insert(root->ready_left, n);
+    else root->ready_right = ready_tree_insert(root->ready_right, n);
+    return ready_balance(root);
+}
+
+static process_t* ready_tree_take_min(process_t *root, process_t **min){
+    if (!root->ready_left){
+        *min = root;
+        return root->ready_right;
+    }
+    root->ready_left = ready_tree_take_min(root->ready_left, min);
+    return ready_balance(root);
+}
+
+static process_t* ready_tree_erase(process_t *root, process_t *n, bool *found){
+    if (!root) return 0;
+    if (root == n){
+        *found = true;
+        process_t *l = root->ready_left;
+        process_t *r = root->ready_right;
+        if (!r) return l;
+        process_t *min = 0;
+        r = ready_tree_take_min(r, &min);
+        min->ready_left = l;
+        min->ready_right = r;
+        return ready_balance(min);
+    }
+    if (ready_before(n, root)) root->ready_left = ready_tree_erase(root->ready_left, n, found);
+    else root->ready_right = ready_tree_erase(root->ready_right, n, found);
+    return ready_balance(root);
+}
+
+static inline uint64_t sched_weight(process_t *proc){
+    return proc->priority ? proc->priority : PROC_PRIORITY_LOW;
+}
+
+static void update_curr(sched_runqueue *rq, uint64_t now){
+    process_t *cur = rq->current;
+    if (!cur || cur == rq->idle || !cur->exec_start_us) return;
+    uint64_t delta = now > cur->exec_start_us ? now - cur->exec_start_us : 0;
+    cur->exec_start_us = now;
+    cur->runtime_us += delta;
+    cur->vruntime += (delta * PROC_PRIORITY_HIGH) / sched_weight(cur);
+}
+
+static void enqueue_ready_process(process_t *proc, bool wakeup){
+    if (!proc || process_is_idle(proc) || proc->in_ready_queue) return;
+    sched_runqueue *rq = &runqueue;
+    uint64_t now = timer_now_usec();
+
+    uint64_t base = rq->min_vruntime > SCHED_WAKEUP_BONUS_US ? rq->min_vruntime - SCHED_WAKEUP_BONUS_US : 0;
+    if (proc->vruntime < base) proc->vruntime = base;
+
+    proc->ready_left = proc->ready_right = 0;
+    proc->ready_height = 1;
+    proc->ready_seq = rq->ready_seq++;
+    rq->ready_root = ready_tree_insert(rq->ready_root, proc);
+    rq->nr_ready++;
     proc->in_ready_queue = true;
+    proc->ready_at_us = now;
     proc->state = READY;
+
+    if (wakeup && rq->current && rq->current != rq->idle) {
+        update_curr(rq, now);
+        if (proc->vruntime + SCHED_WAKEUP_GRAN_US < rq->current->vruntime) rq->need_resched = true;
+    }
 }
 
-static bool remove_sleeping_process(process_t *proc, uint16_t pid){
-    bool removed = false;
-    linked_list_node_t *sleep = sleeping_list.head;
-    while (sleep) {
-        linked_list_node_t *next = sleep->next;
-        process_t *sleep_proc = (process_t*)sleep->data;
-        if (sleep_proc == proc || (sleep_proc && sleep_proc->id == pid)) {
-            linked_list_remove(&sleeping_list, sleep);
-            removed = true;
-        }
-        sleep = next;
+static void remove_ready_process(process_t *proc){
+    if (!proc->in_ready_queue) return;
+    proc->in_ready_queue = false;
+    sched_runqueue *rq = &runqueue;
+    bool found = false;
+    rq->ready_root = ready_tree_erase(rq->ready_root, proc, &found);
+    if (found && rq->nr_ready) rq->nr_ready--;
+}
+
+static process_t* runqueue_pop(sched_runqueue *rq){
+    while (rq->ready_root) {
+        process_t *queued = 0;
+        rq->ready_root = ready_tree_take_min(rq->ready_root, &queued);
+        if (rq->nr_ready) rq->nr_ready--;
+        queued->in_ready_queue = false;
+        if (queued->state != READY || !process_can_run(queued)) continue;
+        uint64_t now = timer_now_usec();
+        if (queued->ready_at_us && now > queued->ready_at_us) queued->wait_us += now - queued->ready_at_us;
+        if (queued->vruntime > rq->min_vruntime) rq->min_vruntime = queued->vruntime;
+        return queued;
     }
-    return removed;
+    return 0;
 }
 
-void save_return_address_interrupt(){
-    save_pc_interrupt(cpec);
+static bool remove_sleeping_process(process_t *proc){
+    return ktimer_cancel(&proc->sleep_timer);
+}
+
+static void sleep_timer_expired(ktimer *timer){
+    process_t *proc = (process_t*)timer->ctx;
+    proc->sleeping = false;
+    proc->wake_at_msec = 0;
+    if (proc->state != STOPPED) enqueue_ready_process(proc, true);
 }
 
-void update_sleep_timer() {
-    if (sleeping_list.head) {
-        process_t *head_proc = (process_t*)sleeping_list.head->data;
-        if (head_proc) {
-            uint64_t now = timer_now_msec();
-            uint64_t wait = head_proc->wake_at_msec > now ? head_proc->wake_at_msec - now : 1;
-            virtual_timer_reset(wait);
-            virtual_timer_enable();
-        } else virtual_timer_disable();
-    } else virtual_timer_disable();
+void save_return_address_interrupt(){
+    save_pc_interrupt(cpec);
 }
 
 void switch_proc(ProcSwitchReason reason) {
     if (proc_count == 0)
         panic("No processes active", 0);
-    process_t *prev = current_proc, *next_proc = 0;
+    sched_runqueue *rq = &runqueue;
+    process_t *prev = rq->current, *next_proc = 0;
+    uint64_t now = timer_now_usec();
+    update_curr(rq, now);
     if (prev && prev->state == RUNNING) {
-        if (prev == idle_proc) prev->state = BLOCKED;
+        if (prev == rq->idle) prev->state = BLOCKED;
         else ready_process(prev);
     }
 
-    while (!cqueue_is_empty(&ready_queue)) {
-        process_t *queued = 0;
-        if (!cqueue_dequeue(&ready_queue, &queued)) break;
-        if (!queued) continue;
-        if (process_is_known(queued)) queued->in_ready_queue = false;
-        if (queued->state != READY || !process_can_run(queued)) continue;
-        next_proc = queued;
-        break;
-    }
+    next_proc = runqueue_pop(rq);
 
-    if (!next_proc && current_proc && current_proc != idle_proc && current_proc->state == RUNNING && process_can_run(current_proc)) next_proc = current_proc;
-    if (!next_proc) next_proc = idle_proc;
+    if (!next_proc && prev && prev != rq->idle && prev->state == RUNNING && process_can_run(prev)) next_proc = prev;
+    if (!next_proc) next_proc = rq->idle;
     if (!next_proc || !process_can_run(next_proc)) panic("no runnable process", 0);
-    //if (next_proc == idle_proc && prev != idle_proc) kprint("entering idle");
+    //if (next_proc == rq->idle && prev != rq->idle) kprint("entering idle");
 
     next_proc->state = RUNNING;
-    current_proc = next_proc;
-    cpec = (uintptr_t)current_proc;
-    if (current_proc == idle_proc) timer_disable();
+    if (next_proc != prev) rq->switches++;
+    next_proc->exec_start_us = now;
+    rq->need_resched = false;
+    rq->current = next_proc;
+    cpec = (uintptr_t)next_proc;
+    if (next_proc == rq->idle) timer_disable();
     else {
         timer_enable();
-        timer_reset(current_proc->priority);
+        timer_reset(next_proc->priority);
     }
 
-    if (current_proc->mm.ttbr0) mmu_asid_ensure(&current_proc->mm);
-    mmu_swap_ttbr(current_proc->mm.ttbr0 ? &current_proc->mm : 0);
-    if (prev && prev != current_proc && prev != idle_proc && process_can_reset(prev)) reset_process(prev);
+    if (next_proc->mm.ttbr0) mmu_asid_ensure(&next_proc->mm);
+    mmu_swap_ttbr(next_proc->mm.ttbr0 ? &next_proc->mm : 0);
+    if (prev && prev != next_proc && prev != rq->idle && process_can_reset(prev)) reset_process(prev);
 
     process_restore();
 }
 
 void save_syscall_return(uint64_t value){
-    if (!current_proc) return;
-    current_proc->PROC_X0 = value;
+    process_t *proc = current_proc();
+    if (!proc) return;
+    proc->PROC_X0 = value;
 }
 
 void process_restore(){
-    if (!current_proc) panic("process_restore null process", 0);
-    if (!process_is_known(current_proc)) panic("process_restore unknown process", cpec);
-    if (current_proc->pending_reset || current_proc->state == STOPPED || !current_proc->pc || !current_proc->sp) {
-        if (current_proc->mm.ttbr0) {
-            current_proc->pending_reset = true;
-            current_proc->state = STOPPED;
-            current_proc->sleeping = false;
-            current_proc->in_ready_queue = false;
+    process_t *proc = current_proc();
+    if (!proc) panic("process_restore null process", 0);
+    if (!process_is_known(proc)) panic("process_restore unknown process", cpec);
+    if (proc->pending_reset || proc->state == STOPPED || !proc->pc || !proc->sp) {
+        if (proc->mm.ttbr0) {
+            proc->pending_reset = true;
+            proc->state = STOPPED;
+            proc->sleeping = false;
+            remove_ready_process(proc);
             switch_proc(HALT);
             panic("process_restore recovery returned", cpec);
         }
         panic("process_restore invalid process", cpec);
     }
-    if ((current_proc->spsr & 0xF) == 0) {
-        if (!current_proc->mm.ttbr0) panic("process_restore user process without ttbr0", cpec);
-        if (current_proc->pc >= HIGH_VA) panic("user pc in kernel VA", current_proc->pc);
+    if ((proc->spsr & 0xF) == 0) {
+        if (!proc->mm.ttbr0) panic("process_restore user process without ttbr0", cpec);
+        if (proc->pc >= HIGH_VA) panic("user pc in kernel VA", proc->pc);
         mmu_ttbr0_enable_user();
     } else mmu_ttbr0_disable_user();
-    if (current_proc->signal_buffer.read_index != current_proc->signal_buffer.write_index){
-        signal_info_t *info = &current_proc->signal_buffer.entries[current_proc->signal_buffer.read_index];//TODO: Wrong, this should be copied into userland mem
-        current_proc->signal_buffer.read_index = (current_proc->signal_buffer.read_index + 1) % INPUT_BUFFER_CAPACITY;
+    if (proc->signal_buffer.read_index != proc->signal_buffer.write_index){
+        signal_info_t *info = &proc->signal_buffer.entries[proc->signal_buffer.read_index];//TODO: Wrong, this should be copied into userland mem
+        proc->signal_buffer.read_index = (proc->signal_buffer.read_index + 1) % INPUT_BUFFER_CAPACITY;
         if (can_signal_be_handled(info->type)){
-            signal_handler handler = current_proc->signal_handlers[info->type];
+            signal_handler handler = proc->signal_handlers[info->type];
             if (handler) handler(info);
-            else handle_signal_default(current_proc, info);
-        } else handle_signal_default(current_proc, info);
+            else handle_signal_default(proc, info);
+        } else handle_signal_default(proc, info);
         switch_proc(RECV_SIGNAL);//TODO: wasteful, we might have a lot of CPU time left for this proc to use
     } else 
         restore_context(cpec);
@@ -198,11 +380,24 @@ bool start_scheduler(){
     kprint("Starting scheduler");
     kconsole_clear();
     disable_interrupt();
-    timer_init(current_proc ? current_proc->priority : PROC_PRIORITY_LOW);
+    timer_init(current_proc() ? current_proc()->priority : PROC_PRIORITY_LOW);
     switch_proc(YIELD);
     return true;
 }
 
+static size_t sched_proc_stats(char *buf, size_t size){
+    irq_flags_t irq = irq_save_disable();
+    size_t len = 0;
+    len += string_format_buf(buf, size, "switches %llu ready %u\n", runqueue.switches, runqueue.nr_ready);
+    if (len < size) len += string_format_buf(buf + len, size - len, "pid prio runtime_ms wait_ms vruntime name\n");
+    for (process_t *proc = process_list; proc && len < size; proc = proc->process_next) {
+        if (proc->state == STOPPED) continue;
+        len += string_format_buf(buf + len, size - len, "%u %u %llu %llu %llu %s\n", proc->id, proc->priority, proc->runtime_us / 1000, proc->wait_us / 1000, proc->vruntime, proc->name);
+    }
+    irq_restore(irq);
+    return len;
+}
+
 void* list_alloc(size_t size){
     return kalloc(proc_page, size, ALIGN_64B, MEM_PRIV_KERNEL);
 }
@@ -213,22 +408,22 @@ bool init_scheduler_module(){
         proc_opened_files->free = kfree;
         proc_opened_files->alloc = list_alloc;
     }
-    if (!ready_queue.elem_size) cqueue_init(&ready_queue, 0, sizeof(process_t*),0,0);
+    procfs_register("sched", sched_proc_stats);
     return true;
 }
 
 
 uintptr_t get_current_heap(){
-    if (current_proc->heap_phys) return (uintptr_t)dmap_pa_to_kva(current_proc->heap_phys);
-    return current_proc->mm.mmap_bottom;
+    if (current_proc()->heap_phys) return (uintptr_t)dmap_pa_to_kva(current_proc()->heap_phys);
+    return current_proc()->mm.mmap_bottom;
 }
 
 bool get_current_privilege(){
-    return current_proc && (current_proc->spsr & 0b1111) != 0;
+    return current_proc() && (current_proc()->spsr & 0b1111) != 0;
 }
 
 process_t* get_current_proc(){
-    return current_proc;
+    return current_proc();
 }
 
 process_t* get_kernel_proc(){
@@ -236,11 +431,29 @@ process_t* get_kernel_proc(){
 }
 
 process_t* get_idle_proc(){
-    return idle_proc;
+    return idle_proc();
 }
 
 bool scheduler_in_idle(){
-    return current_proc == idle_proc;
+    return current_proc() == idle_proc();
+}
+
+bool scheduler_need_resched(){
+    sched_runqueue *rq = &runqueue;
+    if (rq->current == rq->idle) return true;
+    if (!rq->need_resched) return false;
+    process_t *cur = rq->current;
+    return !(cur && cur->mm.ttbr0 && (cur->spsr & 0xF) != 0);
+}
+
+bool scheduler_can_block(){
+    return current_proc() && current_proc() != kernel_proc && current_proc() != idle_proc() && !current_proc()->mm.ttbr0 && syscall_depth == 0;
+}
+
+//A user process in the outermost syscall, it can be switched out and have the svc reissued later
+bool scheduler_can_park(){
+    process_t *cur = current_proc();
+    return cur && cur->mm.ttbr0 && (cur->spsr & 0xF) == 0 && syscall_depth == 1;
 }
 
 void ready_process(process_t *proc){
@@ -250,41 +463,36 @@ void ready_process(process_t *proc){
         return;
     }
 
-    enqueue_ready_process(proc);
+    enqueue_ready_process(proc, false);
     irq_restore(irq);
 }
 
 process_t* get_proc_by_pid(uint16_t pid){
-    process_t *proc = process_list;
-    while (proc) {
-        if (proc->id == pid) return proc;
-        proc = proc->process_next;
-    }
-    return NULL;
+    return pid_table_get(pid);
 }
 
 uint16_t get_current_proc_pid(){
-    return current_proc ? current_proc->id : 0;
+    return current_proc() ? current_proc()->id : 0;
 }
 
 void reset_process(process_t *proc){
     if (!proc) panic("reset_process null", 0);
-    if (proc == current_proc) panic("reset_process current", proc->id);
+    if (proc == current_proc()) panic("reset_process current", proc->id);
     if (proc->procfs_refs) panic("reset_process with procfs refs", proc->id);
 
     uint16_t pid = proc->id;
     int32_t exit_code = proc->exit_code;
-    bool counted = proc->sp || proc->pc || proc->spsr || proc->stack || proc->heap_phys || proc->mm.ttbr0;
+    bool counted = proc->state != STOPPED || proc->sp || proc->pc || proc->spsr || proc->stack || proc->heap_phys || proc->mm.ttbr0;
 
     irq_flags_t irq = irq_save_disable();
     proc->pending_reset = false;
     proc->sleeping = false;
     proc->wake_at_msec = 0;
-    proc->in_ready_queue = false;
+    remove_ready_process(proc);
 
-    remove_sleeping_process(proc, pid);
-
-    update_sleep_timer();
+    remove_sleeping_process(proc);
+    wait_queue_unpark(proc);
+    proc->park_deadline_us = 0;
     irq_restore(irq);
     proc->sp = 0;
     proc->pc = 0;
@@ -392,8 +600,7 @@ void reset_process(process_t *proc){
     }
 
     if (proc->mm.ttbr0) {
-        for (uint16_t i = 0; i < proc->mm.vma_count; i++) {
-            vma *m = &proc->mm.vmas[i];
+        for (vma *m = proc->mm.vma_head; m; m = m->next) {
             bool nofree = (m->flags & VMA_FLAG_NOFREE) != 0;
             uaddr_t start = m->start;
             uaddr_t end = m->end;
@@ -403,18 +610,16 @@ void reset_process(process_t *proc){
                 if (start < m->start) start = m->start;
                 if (start >= end) continue;
             } else if (m->kind == VMA_KIND_ANON && !proc->mm.rss_anon_pages) continue;
-            for (uaddr_t va = start; va < end; va += GRANULE_4KB) {
-                paddr_t pa = 0;
-                if (!mmu_unmap_and_get_pa((uint64_t*)proc->mm.ttbr0, (uint64_t)va, &pa)) continue;
-                if (!nofree) pfree((void*)dmap_pa_to_kva(pa), GRANULE_4KB);
-                if (m->kind == VMA_KIND_STACK) {
-                    if (proc->mm.rss_stack_pages) proc->mm.rss_stack_pages--;
-                } else if (m->kind == VMA_KIND_ANON) {
-                    if (proc->mm.rss_anon_pages) proc->mm.rss_anon_pages--;
-                }
+            uint64_t pages = mm_unmap_range(&proc->mm, start, end, !nofree);
+            if (m->kind == VMA_KIND_STACK) {
+                proc->mm.rss_stack_pages = proc->mm.rss_stack_pages > pages ? proc->mm.rss_stack_pages - pages : 0;
+            } else if (m->kind == VMA_KIND_ANON) {
+                proc->mm.rss_anon_pages = proc->mm.rss_anon_pages > pages ? proc->mm.rss_anon_pages - pages : 0;
             }
         }
-        proc->mm.vma_count = 0;
+        exec_cache_put(proc->mm.exec);
+        proc->mm.exec = 0;
+        mm_release(&proc->mm);
     }
 
     if (proc->alloc_map) {
@@ -465,17 +670,19 @@ void reset_process(process_t *proc){
 
 void init_main_process(){
     proc_page = palloc(PAGE_SIZE*16, MEM_PRIV_KERNEL, MEM_RW, false);
-    if (!ready_queue.elem_size) cqueue_init(&ready_queue, 0, sizeof(process_t*),0,0);
     size_t kernel_proc_size = (sizeof(process_t) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     kernel_proc = (process_t*)palloc(kernel_proc_size, MEM_PRIV_KERNEL, MEM_RW, true);
     if (!kernel_proc) panic("kernel process alloc failed", 0);
-    idle_proc = (process_t*)palloc(kernel_proc_size, MEM_PRIV_KERNEL, MEM_RW, true);
-    if (!idle_proc) panic("idle process alloc failed", 0);
+    process_t *idle = (process_t*)palloc(kernel_proc_size, MEM_PRIV_KERNEL, MEM_RW, true);
+    if (!idle) panic("idle process alloc failed", 0);
+    runqueue.idle = idle;
 
-    current_proc = kernel_proc;
+    runqueue.current = kernel_proc;
     process_list = kernel_proc;
+    process_tail = kernel_proc;
     cpec = (uintptr_t)kernel_proc;
-    kernel_proc->id = next_proc_index++;
+    kernel_proc->id = pid_assign(kernel_proc);
+    if (!kernel_proc->id) panic("kernel pid alloc failed", 0);
     kernel_proc->alloc_map = make_page_index();
     kernel_proc->state = BLOCKED;
     kernel_proc->heap_phys = (uintptr_t)palloc(0x1000, MEM_PRIV_KERNEL, MEM_RW, false);
@@ -488,16 +695,16 @@ void init_main_process(){
     kernel_proc->postmortem_output_size = 0;
     kernel_proc->priority = PROC_PRIORITY_LOW;
     name_process(kernel_proc, "kernel");
-    idle_proc->state = BLOCKED;
-    idle_proc->priority = PROC_PRIORITY_LOW;
-    idle_proc->stack_size = 0x4000;
-    uintptr_t idle_stack = (uintptr_t)palloc(idle_proc->stack_size,MEM_PRIV_KERNEL, MEM_RW,true);
+    idle->state = BLOCKED;
+    idle->priority = PROC_PRIORITY_LOW;
+    idle->stack_size = 0x4000;
+    uintptr_t idle_stack = (uintptr_t)palloc(idle->stack_size,MEM_PRIV_KERNEL, MEM_RW,true);
     if (!idle_stack) panic("idle stack alloc failed", 0);
-    idle_proc->stack = idle_stack + idle_proc->stack_size;
-    idle_proc->sp = idle_proc->stack;
-    idle_proc->pc = (uintptr_t)idle_entry;
-    idle_proc->spsr = 0x205;
-    name_process(idle_proc, "idle");
+    idle->stack = idle_stack + idle->stack_size;
+    idle->sp = idle->stack;
+    idle->pc = (uintptr_t)idle_entry;
+    idle->spsr = 0x205;
+    name_process(idle, "idle");
 
     proc_count++;
 }
@@ -518,11 +725,18 @@ process_t* init_process(){
                     proc->postmortem_output = 0;
                     proc->postmortem_output_size = 0;
                 }
-                proc->id = next_proc_index++;
+                pid_table_set(proc->id, 0);
+                proc->id = pid_assign(proc);
+                if (!proc->id) panic("Out of process ids", 0);
                 proc->exit_code = 0;
                 proc->state = BLOCKED;
                 proc->priority = PROC_PRIORITY_LOW;
-                proc->in_ready_queue = false;
+                proc->vruntime = 0;
+                proc->exec_start_us = 0;
+                proc->runtime_us = 0;
+                proc->wait_us = 0;
+                proc->ready_at_us = 0;
+                remove_ready_process(proc);
                 proc->sleeping = false;
                 proc->wake_at_msec = 0;
                 proc->pending_reset = false;
@@ -538,18 +752,16 @@ process_t* init_process(){
     proc = palloc(proc_size, MEM_PRIV_KERNEL, MEM_RW, true);
     if (!proc) panic("Out of process memory", 0);
 
-    proc->id = next_proc_index++;
+    proc->id = pid_assign(proc);
+    if (!proc->id) panic("Out of process ids", 0);
     proc->state = BLOCKED;
     proc->priority = PROC_PRIORITY_LOW;
     proc->postmortem_output = 0;
     proc->postmortem_output_size = 0;
     proc->process_next = 0;
-    if (!process_list) process_list= proc;
-    else {
-        process_t *tail = process_list;
-        while (tail->process_next) tail = tail->process_next;
-        tail->process_next = proc;
-    }
+    if (!process_list) process_list = proc;
+    else process_tail->process_next = proc;
+    process_tail = proc;
 
     proc_count++;
     irq_restore(irq);
@@ -577,20 +789,20 @@ void stop_process(uint16_t pid, int32_t exit_code){
         return;
     }
 
-    bool current = proc == current_proc;
+    bool current = proc == current_proc();
     proc->state = STOPPED;
     proc->exit_code = exit_code;
 
     kprintf("[SCHEDULER] Stop process %i with code %i",proc->id,proc->exit_code);
     
-    proc->in_ready_queue = false;
+    remove_ready_process(proc);
     proc->sleeping = false;
     proc->wake_at_msec = 0;
     if (proc->focused)
         sys_unset_focus(false);
     
-    remove_sleeping_process(proc, pid);
-    update_sleep_timer();
+    remove_sleeping_process(proc);
+    wait_queue_unpark(proc);
     if (!current) {
         irq_restore(irq);
         return;
@@ -611,7 +823,7 @@ void block_process(process_t *proc){
 
 void resume_blocked_process(process_t *proc){
     proc->suspended = false;
-    enqueue_ready_process(proc);
+    enqueue_ready_process(proc, true);
 }
 
 uint16_t process_count(){
@@ -631,24 +843,12 @@ void sleep_process(uint64_t msec){
         return;
     }
 
-    uint64_t wake_at = timer_now_msec() + msec;
-    current_proc->state = BLOCKED;
-    current_proc->sleeping = true;
-    current_proc->wake_at_msec = wake_at;
-
-    linked_list_node_t *it = sleeping_list.head, *prev = 0;
-    while (it) {
-        process_t *cur = (process_t*)it->data;
-        if (!cur || cur->wake_at_msec > wake_at) break;
-        prev = it;
-        it = it->next;
-    }
-
-    linked_list_insert_after(&sleeping_list, prev, current_proc);
-    if (sleeping_list.head && sleeping_list.head->data == current_proc){
-        virtual_timer_reset(msec);
-        virtual_timer_enable();
-    }
+    process_t *proc = current_proc();
+    proc->state = BLOCKED;
+    proc->sleeping = true;
+    proc->wake_at_msec = timer_now_msec() + msec;
+    ktimer_init(&proc->sleep_timer, sleep_timer_expired, proc);
+    ktimer_arm_in(&proc->sleep_timer, msec * 1000);
     switch_proc(YIELD);
     irq_restore(irq);
 }
@@ -662,40 +862,13 @@ void wake_process(process_t *proc){
         return;
     }
 
-    if (remove_sleeping_process(proc, proc->id)) {
+    if (remove_sleeping_process(proc)) {
         proc->sleeping = false;
         proc->wake_at_msec = 0;
 
-        if (proc->state == BLOCKED) enqueue_ready_process(proc);
+        if (proc->state == BLOCKED) enqueue_ready_process(proc, true);
     }
 
-    update_sleep_timer();
-    irq_restore(irq);
-}
-
-void wake_processes(){
-    irq_flags_t irq = irq_save_disable();
-    uint64_t now = timer_now_msec();
-    while (sleeping_list.head) {
-        process_t *proc = (process_t*)sleeping_list.head->data;
-
-        if (!proc) {
-            linked_list_pop_front(&sleeping_list);
-            continue;
-        }
-
-        if (proc->wake_at_msec > now) break;
-        proc = (process_t*)linked_list_pop_front(&sleeping_list);
-
-        if (proc) {
-            proc->sleeping = false;
-            proc->wake_at_msec = 0;
-
-            if (proc->state != STOPPED) enqueue_ready_process(proc);
-        }
-    }
-
-    update_sleep_timer();
     irq_restore(irq);
 }
 
@@ -710,11 +883,42 @@ bool load_process_module(process_t *p, system_module *m){
     return load_module(&p->exposed_fs);
 }
 
+bool procfs_register(const char *name, procfs_entry_fn fn){
+    if (!name || !fn || procfs_entry_count >= MAX_PROCFS_ENTRIES) return false;
+    procfs_entries[procfs_entry_count++] = (procfs_entry){ .name = name, .fn = fn };
+    return true;
+}
+
+static procfs_entry* find_procfs_entry(const char *name){
+    for (uint32_t i = 0; i < procfs_entry_count; i++)
+        if (strcmp_case(name, procfs_entries[i].name, true) == 0) return &procfs_entries[i];
+    return 0;
+}
+
+//Renders the view into a buffer that doubles until the output no longer fills it, the caller releases it
+static char* render_procfs_entry(procfs_entry *entry, size_t *len, size_t *limit){
+    for (size_t size = PROCFS_ENTRY_SIZE;; size *= 2){
+        char *text = (char*)zalloc(size);
+        if (!text) return 0;
+        size_t written = entry->fn(text, size);
+        if (written + 1 < size || size >= PROCFS_ENTRY_MAX){
+            *len = written < size ? written : size;
+            *limit = size;
+            return text;
+        }
+        release(text);
+    }
+}
+
 size_t list_processes(void *buf, size_t size, file_offset *offset){
 
     if (!buf || !offset || size < sizeof(uint32_t)) return 0;
 	
 	fs_dir_list_helper helper = create_dir_list_helper(buf, size);
+
+    if (!*offset)
+        for (uint32_t i = 0; i < procfs_entry_count; i++)
+            if (!dir_list_fill(&helper, (char*)procfs_entries[i].name)) return dir_buf_size(&helper);
     
 	process_t *proc = process_list;
     if (*offset) {
@@ -790,6 +994,41 @@ size_t readdir_proc(const char *path, void *buf, size_t size, file_offset *offse
     return false;
 }
 
+static FS_RESULT open_procfs_entry(procfs_entry *entry, uint64_t fid, file *descriptor){
+    size_t len = 0, limit = 0;
+    char *text = render_procfs_entry(entry, &len, &limit);
+    if (!text) return FS_RESULT_DRIVER_ERROR;
+    irq_flags_t irq = irq_save_disable();
+    module_file *file = kalloc(proc_page, sizeof(module_file), ALIGN_64B, MEM_PRIV_KERNEL);
+    if (!file) {
+        irq_restore(irq);
+        release(text);
+        return FS_RESULT_DRIVER_ERROR;
+    }
+    descriptor->id = fid;
+    descriptor->cursor = 0;
+    descriptor->size = len;
+    file->fid = fid;
+    file->private_data = 0;
+    file->references = 1;
+    file->read_only = true;
+    file->buf = (uptr)text;
+    file->file_buffer = (buffer){
+        .buffer = text,
+        .buffer_size = len,
+        .limit = limit,
+        .options = buffer_opt_none,
+        .cursor = 0,
+    };
+    file->file_size = len;
+    int put = chashmap_put(proc_opened_files, &descriptor->id, sizeof(uint64_t), file);
+    irq_restore(irq);
+    if (put >= 0) return FS_RESULT_SUCCESS;
+    release(text);
+    kfree(file, sizeof(module_file));
+    return FS_RESULT_DRIVER_ERROR;
+}
+
 FS_RESULT open_proc(const char *path, file *descriptor){
     uint64_t fid = reserve_fd_gid(path);
     irq_flags_t irq = irq_save_disable();
@@ -805,6 +1044,11 @@ FS_RESULT open_proc(const char *path, file *descriptor){
         return FS_RESULT_SUCCESS;
     }
     const char *pid_s = seek_to(path, '/');
+    procfs_entry *entry = find_procfs_entry(pid_s);
+    if (entry){
+        irq_restore(irq);
+        return open_procfs_entry(entry, fid, descriptor);
+    }
     path = seek_to(pid_s, '/');
     uint64_t pid = parse_int_u64(pid_s, path - pid_s);
     process_t *proc = get_proc_by_pid(pid);
@@ -881,6 +1125,18 @@ bool stat_proc(const char *path, fs_stat *out_stat){
         return res;
     }
     const char *pid_s = seek_to(path, '/');
+    procfs_entry *entry = find_procfs_entry(pid_s);
+    if (entry){
+        irq_restore(irq);
+        size_t len = 0, limit = 0;
+        char *text = render_procfs_entry(entry, &len, &limit);
+        if (!text) return false;
+        out_stat->type = entry_file;
+        out_stat->size = len;
+        out_stat->data_type = DATA_SIG_TEXT;
+        release(text);
+        return true;
+    }
     path = seek_to(pid_s, '/');
     uint64_t pid = parse_int_u64(pid_s, path - pid_s);
     process_t *proc = get_proc_by_pid(pid);
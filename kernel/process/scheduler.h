@@ -12,6 +12,8 @@ typedef enum {
 } ProcSwitchReason;
 
 #define MAX_REUSABLE_EMPTY_PROCS 64
+#define SCHED_WAKEUP_BONUS_US 6000
+#define SCHED_WAKEUP_GRAN_US 1000
 
 #define PROC_PRIORITY_FULL 25
 #define PROC_PRIORITY_HIGH 10
@@ -40,7 +42,6 @@ void resume_blocked_process(process_t *proc);
 void name_process(process_t *proc, const char *name);
 
 void sleep_process(uint64_t msec);
-void wake_processes();
 void wake_process(process_t *proc);
 
 bool load_process_module(process_t *p, system_module *m);
@@ -49,9 +50,16 @@ process_t* get_current_proc();
 process_t* get_kernel_proc();
 process_t* get_idle_proc();
 bool scheduler_in_idle();
+bool scheduler_need_resched();
+bool scheduler_can_block();
+bool scheduler_can_park();
 process_t* get_proc_by_pid(uint16_t pid);
 uint16_t get_current_proc_pid();
 
+//Writes at most size bytes and returns the length. Output that fills buf is rendered again into a larger one
+typedef size_t (*procfs_entry_fn)(char *buf, size_t size);
+bool procfs_register(const char *name, procfs_entry_fn fn);
+
 uintptr_t get_current_heap();
 bool get_current_privilege();
 #ifdef __cplusplus
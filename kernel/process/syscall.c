@@ -65,15 +65,18 @@ u64 syscall_malloc(process_t *ctx){
     size_t size = ctx->PROC_X0;
     if (!size) return 0;
 
+    //Small requests share arena pages instead of each taking a page and a VMA
+    if (ctx->mm.ttbr0 && size <= MM_HEAP_MAX_OBJ) {
+        uptr va = mm_heap_alloc(&ctx->mm, size);
+        if (va) return va;
+    }
+
     u64 pages = count_pages(size, PAGE_SIZE);
     size_t alloc_size = pages * PAGE_SIZE;
     if (ctx->mm.rss_anon_pages + pages > ctx->mm.cap_anon_pages) return 0;
 
-    uptr va = mm_alloc_mmap(&ctx->mm, alloc_size, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC | VMA_FLAG_ZERO);
-    if (!va) return 0;
-
-    mmu_flush_asid(ctx->mm.asid);
-    return va;
+    //Nothing is mapped in a fresh VMA yet, so there is nothing to invalidate
+    return mm_alloc_mmap(&ctx->mm, alloc_size, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC | VMA_FLAG_ZERO);
 }
 
 uptr syscall_palloc(process_t *ctx){
@@ -84,10 +87,7 @@ uptr syscall_palloc(process_t *ctx){
 
     if (ctx->mm.ttbr0){
         if (ctx->mm.rss_anon_pages + pages > ctx->mm.cap_anon_pages) return 0;
-        uptr va = mm_alloc_mmap(&ctx->mm, alloc_size, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC | VMA_FLAG_ZERO);
-        if (!va) return 0;
-        mmu_flush_asid(ctx->mm.asid);
-        return va;
+        return mm_alloc_mmap(&ctx->mm, alloc_size, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC | VMA_FLAG_ZERO);
     }
 
     paddr_t ptr = palloc_inner(alloc_size, MEM_PRIV_USER, MEM_RW, true, true);
@@ -102,6 +102,8 @@ u64 syscall_pfree(process_t *ctx){
     if (!va) return 0;
 
     if (ctx->mm.ttbr0) {
+        if (mm_heap_free(&ctx->mm, va)) return 0;
+
         vma *m = mm_find_vma(&ctx->mm,va);
         if (!m) return 0;
         if (m->kind != VMA_KIND_ANON) return 0;
@@ -111,14 +113,10 @@ u64 syscall_pfree(process_t *ctx){
         uintptr_t end = m->end;
         if (!mm_remove_vma(&ctx->mm, start, end)) return 0;
 
-        for (uintptr_t a = start; a < end; a += PAGE_SIZE) {
-            uint64_t pa = 0;
-            if (!mmu_unmap_and_get_pa((uint64_t*)ctx->mm.ttbr0, a, &pa)) continue;
-            pfree((void*)dmap_pa_to_kva((paddr_t)pa), PAGE_SIZE);
-            if (ctx->mm.rss_anon_pages) ctx->mm.rss_anon_pages--;
-        }
+        uint64_t pages = mm_unmap_range(&ctx->mm, start, end, true);
+        ctx->mm.rss_anon_pages = ctx->mm.rss_anon_pages > pages ? ctx->mm.rss_anon_pages - pages : 0;
 
-        mmu_flush_asid(ctx->mm.asid);
+        mmu_flush_range(ctx->mm.asid, start, end);
         return 0;
     }
 
@@ -243,6 +241,59 @@ u64 syscall_exec(process_t *ctx){
     return p ? p->id : 0;
 }
 
+//Not in the shared syscall code list yet, which is where userland gets its numbers from.
+//Defined without a guard so a shared definition with another value fails to build instead of being
+//shadowed, and checked against every code the table below uses
+#define SPAWN_CODE 60
+#define SPAWN_CODE_FREE(code) _Static_assert(SPAWN_CODE != (code), "SPAWN_CODE collides with " #code)
+SPAWN_CODE_FREE(MALLOC_CODE);
+SPAWN_CODE_FREE(FREE_CODE);
+SPAWN_CODE_FREE(PALLOC_CODE);
+SPAWN_CODE_FREE(PFREE_CODE);
+SPAWN_CODE_FREE(PRINTL_CODE);
+SPAWN_CODE_FREE(READ_KEY_CODE);
+SPAWN_CODE_FREE(READ_EVENT_CODE);
+SPAWN_CODE_FREE(READ_SHORTCUT_CODE);
+SPAWN_CODE_FREE(GET_MOUSE_STATUS_CODE);
+SPAWN_CODE_FREE(REQUEST_DRAW_CTX_CODE);
+SPAWN_CODE_FREE(GPU_FLUSH_DATA_CODE);
+SPAWN_CODE_FREE(GPU_CHAR_SIZE_CODE);
+SPAWN_CODE_FREE(RESIZE_DRAW_CTX_CODE);
+SPAWN_CODE_FREE(SLEEP_CODE);
+SPAWN_CODE_FREE(HALT_CODE);
+SPAWN_CODE_FREE(EXEC_CODE);
+SPAWN_CODE_FREE(KILL_PROCESS_CODE);
+SPAWN_CODE_FREE(GET_TIME_CODE);
+SPAWN_CODE_FREE(SOCKET_CREATE_CODE);
+SPAWN_CODE_FREE(SOCKET_BIND_CODE);
+SPAWN_CODE_FREE(SOCKET_CONNECT_CODE);
+SPAWN_CODE_FREE(SOCKET_LISTEN_CODE);
+SPAWN_CODE_FREE(SOCKET_ACCEPT_CODE);
+SPAWN_CODE_FREE(SOCKET_SEND_CODE);
+SPAWN_CODE_FREE(SOCKET_RECEIVE_CODE);
+SPAWN_CODE_FREE(SOCKET_CLOSE_CODE);
+SPAWN_CODE_FREE(FILE_OPEN_CODE);
+SPAWN_CODE_FREE(FILE_READ_CODE);
+SPAWN_CODE_FREE(FILE_WRITE_CODE);
+SPAWN_CODE_FREE(FILE_CLOSE_CODE);
+SPAWN_CODE_FREE(FILE_SIMPLE_READ_CODE);
+SPAWN_CODE_FREE(FILE_SIMPLE_WRITE_CODE);
+SPAWN_CODE_FREE(DIR_LIST_CODE);
+SPAWN_CODE_FREE(FILE_STAT_CODE);
+SPAWN_CODE_FREE(FILE_TRNC_CODE);
+SPAWN_CODE_FREE(SIGNAL_SEND_CODE);
+SPAWN_CODE_FREE(SIGNAL_HANDLER_CODE);
+SPAWN_CODE_FREE(IN_CASE_OF_JS_CODE);
+#undef SPAWN_CODE_FREE
+
+//Child pid in the parent, 0 in the child, which resumes after the same svc. 0 is taken, so failure is -1
+u64 syscall_spawn(process_t *ctx){
+    process_t *p = spawn_process(ctx);
+    if (!p) return UINT64_MAX;
+    ready_process(p);
+    return p->id;
+}
+
 u64 syscall_kill_process(process_t *ctx) {
     uint16_t pid = (uint16_t)ctx->PROC_X0;
     if (!pid) return 0;
@@ -541,6 +592,7 @@ syscall_entry syscalls[] = {
     [SLEEP_CODE] = syscall_msleep,
     [HALT_CODE] = syscall_halt,
     [EXEC_CODE] = syscall_exec,
+    [SPAWN_CODE] = syscall_spawn,
     [KILL_PROCESS_CODE] = syscall_kill_process,
     [GET_TIME_CODE] = syscall_get_time,
     [SOCKET_CREATE_CODE] = syscall_socket_create,
@@ -80,6 +80,8 @@ bool validate_address(process_t *proc, uintptr_t addr, size_t size, bool want_wr
             mmu_translate((uint64_t*)proc->mm.ttbr0, addr, &st);
             if (st) return false;
         }
+        //The caller writes through the user mapping, which has to be writable by then
+        if (want_write) mm_break_cow(&proc->mm, addr);
 
         addr += chunk;
         size -= chunk;
@@ -109,6 +111,11 @@ uaccess_result_t copy_to_user(process_t *proc, uintptr_t dst, const void *src, s
             pa = mmu_translate((uint64_t*)proc->mm.ttbr0, dst, &st);
             if (st) return UACCESS_EFAULT;
         }
+        //Writes through the direct map never fault, a page still shared copy on write is split here
+        if (mm_break_cow(&proc->mm, dst)) {
+            pa = mmu_translate((uint64_t*)proc->mm.ttbr0, dst, &st);
+            if (st) return UACCESS_EFAULT;
+        }
 
         memcpy((void*)dmap_pa_to_kva((paddr_t)pa), s, chunk);
         s += chunk;
@@ -0,0 +1,180 @@
+#include "waitqueue.h"
+#include "process/scheduler.h"
+#include "exceptions/irq.h"
+#include "exceptions/ktimer.h"
+#include "exceptions/timer.h"
+#include "syscalls/syscalls.h"
+#include "process/syscall.h"
+#include "exceptions/exception_handler.h"
+
+typedef struct {
+    wait_queue *wq;
+    wait_entry *entry;
+} wait_timeout;
+
+static void wait_link(wait_queue *wq, wait_entry *entry){
+    entry->next = 0;
+    entry->prev = wq->tail;
+    if (wq->tail) wq->tail->next = entry;
+    else wq->head = entry;
+    wq->tail = entry;
+}
+
+static void wait_unlink(wait_queue *wq, wait_entry *entry){
+    if (entry->prev) entry->prev->next = entry->next;
+    else if (wq->head == entry) wq->head = entry->next;
+    else return;
+    if (entry->next) entry->next->prev = entry->prev;
+    else wq->tail = entry->prev;
+    entry->next = entry->prev = 0;
+}
+
+static void wait_wake_entry(wait_queue *wq, wait_entry *entry){
+    wait_unlink(wq, entry);
+    entry->woken = true;
+    if (entry == &entry->proc->park_entry){
+        ktimer_cancel(&entry->proc->park_timer);
+        entry->proc->park_queue = 0;
+    }
+    resume_blocked_process(entry->proc);
+}
+
+static void wait_timeout_expired(ktimer *timer){
+    wait_timeout *t = (wait_timeout*)timer->ctx;
+    wait_unlink(t->wq, t->entry);
+    resume_blocked_process(t->entry->proc);
+}
+
+bool wait_queue_wait(wait_queue *wq, wait_cond_fn cond, void *ctx, uint64_t timeout_ms){
+    uint64_t deadline = timeout_ms ? timer_now_usec() + (timeout_ms * 1000) : 0;
+    for (;;){
+        irq_flags_t irq = irq_save_disable();
+        if (cond && cond(ctx)){
+            irq_restore(irq);
+            return true;
+        }
+        if (deadline && timer_now_usec() >= deadline){
+            irq_restore(irq);
+            return false;
+        }
+        if (!scheduler_can_block()){
+            irq_restore(irq);
+            return false;
+        }
+
+        wait_entry entry = { .proc = get_current_proc() };
+        wait_timeout timeout = { .wq = wq, .entry = &entry };
+        ktimer timer;
+        ktimer_init(&timer, wait_timeout_expired, &timeout);
+        wait_link(wq, &entry);
+        if (deadline) ktimer_arm(&timer, deadline);
+        block_process(entry.proc);
+        msleep(0);
+        ktimer_cancel(&timer);
+        wait_unlink(wq, &entry);
+        irq_restore(irq);
+        if (!cond && entry.woken) return true;
+    }
+}
+
+static void wait_park_expired(ktimer *timer){
+    process_t *proc = (process_t*)timer->ctx;
+    if (proc->park_queue) wait_unlink((wait_queue*)proc->park_queue, &proc->park_entry);
+    proc->park_queue = 0;
+    resume_blocked_process(proc);
+}
+
+void wait_queue_unpark(process_t *proc){
+    irq_flags_t irq = irq_save_disable();
+    ktimer_cancel(&proc->park_timer);
+    if (proc->park_queue) wait_unlink((wait_queue*)proc->park_queue, &proc->park_entry);
+    proc->park_queue = 0;
+    irq_restore(irq);
+}
+
+bool wait_queue_wait_restartable(wait_queue *wq, wait_cond_fn cond, void *ctx, uint64_t timeout_ms){
+    if (!scheduler_can_park()) return wait_queue_wait(wq, cond, ctx, timeout_ms);
+
+    process_t *proc = get_current_proc();
+    irq_flags_t irq = irq_save_disable();
+    wait_queue_unpark(proc);
+
+    uint64_t now = timer_now_usec();
+    //The deadline outlives each reissue of the syscall, it's cleared once the wait is over
+    if (!proc->park_deadline_us) proc->park_deadline_us = timeout_ms ? now + (timeout_ms * 1000) : UINT64_MAX;
+    bool ready = cond(ctx);
+    if (ready || now >= proc->park_deadline_us){
+        proc->park_deadline_us = 0;
+        irq_restore(irq);
+        return ready;
+    }
+
+    proc->park_entry = (wait_entry){ .proc = proc };
+    proc->park_queue = wq;
+    wait_link(wq, &proc->park_entry);
+    if (proc->park_deadline_us != UINT64_MAX){
+        ktimer_init(&proc->park_timer, wait_park_expired, proc);
+        ktimer_arm(&proc->park_timer, proc->park_deadline_us);
+    }
+    block_process(proc);
+
+    //The syscall's frame is dropped, the process resumes on the svc and asks again
+    proc->pc -= 4;
+    syscall_depth--;
+    switch_proc(YIELD);
+    panic("parked syscall returned", proc->id);
+    return false;
+}
+
+void wait_queue_wake_one(wait_queue *wq){
+    irq_flags_t irq = irq_save_disable();
+    if (wq->head) wait_wake_entry(wq, wq->head);
+    irq_restore(irq);
+}
+
+void wait_queue_wake_all(wait_queue *wq){
+    irq_flags_t irq = irq_save_disable();
+    while (wq->head) wait_wake_entry(wq, wq->head);
+    irq_restore(irq);
+}
+
+static bool kevent_take(void *ctx){
+    kevent *ev = (kevent*)ctx;
+    if (!ev->signaled) return false;
+    ev->signaled = false;
+    return true;
+}
+
+bool kevent_wait(kevent *ev, uint64_t timeout_ms){
+    return wait_queue_wait(&ev->waiters, kevent_take, ev, timeout_ms);
+}
+
+void kevent_signal(kevent *ev){
+    irq_flags_t irq = irq_save_disable();
+    ev->signaled = true;
+    wait_queue_wake_one(&ev->waiters);
+    irq_restore(irq);
+}
+
+static bool ksemaphore_take(void *ctx){
+    ksemaphore *sem = (ksemaphore*)ctx;
+    if (sem->count <= 0) return false;
+    sem->count--;
+    return true;
+}
+
+void ksemaphore_init(ksemaphore *sem, int32_t count){
+    sem->waiters = (wait_queue){0};
+    sem->count = count;
+}
+
+bool ksemaphore_down(ksemaphore *sem, uint64_t timeout_ms){
+    return wait_queue_wait(&sem->waiters, ksemaphore_take, sem, timeout_ms);
+}
+
+void ksemaphore_up(ksemaphore *sem){
+    irq_flags_t irq = irq_save_disable();
+    sem->count++;
+    wait_queue_wake_one(&sem->waiters);
+    irq_restore(irq);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "types.h"
+#include "process/process.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    wait_entry *head;
+    wait_entry *tail;
+} wait_queue;
+
+typedef bool (*wait_cond_fn)(void *ctx);
+
+//Blocks the current process until cond(ctx) holds, it is woken, or timeout_ms passes (0 waits forever).
+//cond is rechecked with interrupts disabled. Callers that can't block, see scheduler_can_block, only get the first check
+bool wait_queue_wait(wait_queue *wq, wait_cond_fn cond, void *ctx, uint64_t timeout_ms);
+//Same, but a user process inside a syscall is parked on wq and the svc reissued when it's woken or times out.
+//Only for waits ahead of any side effect of the syscall, cond must hold or timeout_ms pass for it to return
+bool wait_queue_wait_restartable(wait_queue *wq, wait_cond_fn cond, void *ctx, uint64_t timeout_ms);
+//Drops a parked syscall, for processes stopped while parked
+void wait_queue_unpark(process_t *proc);
+//Safe from IRQ context
+void wait_queue_wake_one(wait_queue *wq);
+void wait_queue_wake_all(wait_queue *wq);
+
+//Auto-reset event, a signal with nobody waiting is kept for the next waiter
+typedef struct {
+    wait_queue waiters;
+    volatile bool signaled;
+} kevent;
+
+bool kevent_wait(kevent *ev, uint64_t timeout_ms);
+void kevent_signal(kevent *ev);
+
+typedef struct {
+    wait_queue waiters;
+    volatile int32_t count;
+} ksemaphore;
+
+void ksemaphore_init(ksemaphore *sem, int32_t count);
+bool ksemaphore_down(ksemaphore *sem, uint64_t timeout_ms);
+void ksemaphore_up(ksemaphore *sem);
+
+#ifdef __cplusplus
+}
+#endif
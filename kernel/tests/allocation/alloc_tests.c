@@ -1,6 +1,12 @@
 #include "alloc_tests.h"
 #include "debug/assert.h"
 #include "memory/page_allocator.h"
+#include "memory/slab.h"
+#include "memory/mmu.h"
+#include "memory/mm_process.h"
+#include "process/loading/exec_cache.h"
+#include "std/memory.h"
+#include "sysregs.h"
 
 bool test_kalloc_free(){
     void *page = palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, false);
@@ -86,6 +92,55 @@ bool test_palloc_large_reuse() {
     return true;
 }
 
+bool test_palloc_huge_aligned() {
+    page_alloc_report before, during;
+    page_alloc_get_report(&before);
+    void *mem = palloc(GRANULE_2MB, MEM_PRIV_KERNEL, MEM_RW, true);
+    assert_true(mem != 0, "2MB allocation failed");
+    assert_eq(VIRT_TO_PHYS((uintptr_t)mem) & (GRANULE_2MB - 1), 0, "2MB allocation not naturally aligned: %llx", (uint64_t)mem);
+    page_alloc_get_report(&during);
+    assert_eq(before.free_pages - during.free_pages, GRANULE_2MB / PAGE_SIZE, "free page count off by %llu", before.free_pages - during.free_pages);
+    pfree(mem, GRANULE_2MB);
+    return true;
+}
+
+bool test_palloc_64kb_aligned() {
+    void *pad = palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+    void *mem = palloc(GRANULE_64KB, MEM_PRIV_KERNEL, MEM_RW, true);
+    assert_true(mem != 0, "64KB allocation failed");
+    assert_eq(VIRT_TO_PHYS((uintptr_t)mem) & (GRANULE_64KB - 1), 0, "64KB allocation not naturally aligned: %llx", (uint64_t)mem);
+    pfree(mem, GRANULE_64KB);
+    pfree(pad, PAGE_SIZE);
+    return true;
+}
+
+bool test_palloc_shared_refs() {
+    uint64_t shared = page_shared_count();
+    uint8_t *mem = (uint8_t*)palloc(4 * PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+    assert_true(mem != 0, "shared allocation failed");
+    paddr_t pa = VIRT_TO_PHYS((uintptr_t)mem);
+    page_ref_get(pa + PAGE_SIZE);
+    page_ref_get(pa + PAGE_SIZE);
+    page_ref_get(pa + 2 * PAGE_SIZE);
+    assert_eq(page_ref_count(pa), 1, "unshared page has %u refs", page_ref_count(pa));
+    assert_eq(page_ref_count(pa + PAGE_SIZE), 3, "page shared twice has %u refs", page_ref_count(pa + PAGE_SIZE));
+
+    pfree(mem, 4 * PAGE_SIZE);
+    assert_false(page_used((uintptr_t)mem), "unshared first page not freed");
+    assert_false(page_used((uintptr_t)(mem + 3 * PAGE_SIZE)), "unshared last page not freed");
+    assert_true(page_used((uintptr_t)(mem + PAGE_SIZE)), "shared page freed with references left");
+    assert_true(page_used((uintptr_t)(mem + 2 * PAGE_SIZE)), "shared page freed with a reference left");
+
+    pfree(mem + PAGE_SIZE, PAGE_SIZE);
+    pfree(mem + 2 * PAGE_SIZE, PAGE_SIZE);
+    assert_true(page_used((uintptr_t)(mem + PAGE_SIZE)), "page freed before its last reference");
+    assert_false(page_used((uintptr_t)(mem + 2 * PAGE_SIZE)), "page not freed by its last reference");
+    pfree(mem + PAGE_SIZE, PAGE_SIZE);
+    assert_false(page_used((uintptr_t)(mem + PAGE_SIZE)), "page not freed by its last reference");
+    assert_eq(page_shared_count(), shared, "shared page count leaked: %llu", page_shared_count());
+    return true;
+}
+
 bool test_kalloc_fragment_reuse() {
     void *page = palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, false);
     void *a = kalloc(page, 64, ALIGN_16B, MEM_PRIV_KERNEL);
@@ -101,6 +156,41 @@ bool test_kalloc_fragment_reuse() {
     return true;
 }
 
+bool test_slab_release(){
+    void *page = palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, false);
+    slab_stats before;
+    assert_true(slab_get_stats(SLAB_CLASSES - 1, &before), "no stats for largest slab class");
+    void *objs[4];
+    for (int i = 0; i < 4; i++){
+        objs[i] = kalloc(page, 1500, ALIGN_16B, MEM_PRIV_KERNEL);
+        assert_true(slab_owns(objs[i]), "object not served by slab: %llx", (uint64_t)objs[i]);
+        assert_eq((uintptr_t)objs[i] & (SLAB_MAX_SIZE - 1), 0, "object not aligned to its class: %llx", (uint64_t)objs[i]);
+    }
+    for (int i = 0; i < 4; i++) kfree(objs[i], 1500);
+    slab_stats after;
+    slab_get_stats(SLAB_CLASSES - 1, &after);
+    assert_eq(after.in_use, before.in_use, "objects still in use: %llu", after.in_use);
+    assert_true(after.slabs <= before.slabs + 1, "empty slabs not released: %u", after.slabs);
+    free_managed_page(page);
+    return true;
+}
+
+bool test_slab_capacity(){
+    for (uint32_t i = 0; i < SLAB_CLASSES; i++){
+        slab_stats stats;
+        assert_true(slab_get_stats(i, &stats), "no stats for slab class %i", i);
+        if (stats.object_size < SLAB_OFFSLAB_MIN) continue;
+        assert_eq(stats.capacity, PAGE_SIZE / stats.object_size, "slab class %i holds %i objects per page", stats.object_size, stats.capacity);
+    }
+
+    void *page = palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, false);
+    void *obj = kalloc(page, SLAB_MAX_SIZE, ALIGN_16B, MEM_PRIV_KERNEL);
+    assert_true(slab_owns(obj), "page aligned slab object not recognized: %llx", (uint64_t)obj);
+    kfree(obj, SLAB_MAX_SIZE);
+    free_managed_page(page);
+    return true;
+}
+
 bool test_after_free(){
     uint64_t *a = malloc(64);
     a[3] = 12345678;
@@ -109,16 +199,129 @@ bool test_after_free(){
     return true;
 }
 
+static mm_struct test_mm;
+
+static void test_mm_reset(){
+    memset(&test_mm, 0, sizeof(test_mm));
+    test_mm.mmap_bottom = 0x0000000100000000ULL;
+    test_mm.mmap_top = 0x0000001000000000ULL;
+    test_mm.mmap_cursor = test_mm.mmap_top;
+    test_mm.cap_anon_pages = UINT64_MAX;
+}
+
+bool test_vma_tree_uncapped(){
+    static uaddr_t vas[512];
+    test_mm_reset();
+    for (int i = 0; i < 512; i++){
+        vas[i] = mm_alloc_mmap(&test_mm, PAGE_SIZE, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC);
+        assert_true(vas[i], "mmap %i failed", i);
+    }
+    assert_eq(test_mm.vma_count, 512, "user allocations merged or dropped: %u", test_mm.vma_count);
+    for (int i = 0; i < 512; i++){
+        vma *m = mm_find_vma(&test_mm, vas[i] + 8);
+        assert_true(m && m->start == vas[i], "lookup %i found wrong VMA", i);
+    }
+
+    uaddr_t cursor = test_mm.mmap_cursor;
+    for (int i = 0; i < 512; i += 2) assert_true(mm_remove_vma(&test_mm, vas[i], vas[i] + PAGE_SIZE), "remove %i failed", i);
+    for (int i = 0; i < 512; i += 2) assert_false(mm_find_vma(&test_mm, vas[i]), "removed VMA %i still found", i);
+    for (int i = 0; i < 256; i++) assert_true(mm_alloc_mmap(&test_mm, PAGE_SIZE, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC), "refill %i failed", i);
+    assert_eq(test_mm.mmap_cursor, cursor, "holes not reused, cursor moved to %llx", test_mm.mmap_cursor);
+    assert_eq(test_mm.vma_count, 512, "wrong VMA count after refill: %u", test_mm.vma_count);
+
+    mm_release(&test_mm);
+    return true;
+}
+
+bool test_mmap_large_alignment(){
+    test_mm_reset();
+    uaddr_t small = mm_alloc_mmap(&test_mm, PAGE_SIZE, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC);
+    uaddr_t big = mm_alloc_mmap(&test_mm, 3 * GRANULE_2MB, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC);
+    uaddr_t mid = mm_alloc_mmap(&test_mm, GRANULE_64KB + PAGE_SIZE, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC);
+    assert_true(small && big && mid, "mmap failed");
+    assert_eq(big & (GRANULE_2MB - 1), 0, "2MB mapping misaligned: %llx", big);
+    assert_eq(mid & (GRANULE_64KB - 1), 0, "64KB mapping misaligned: %llx", mid);
+
+    uaddr_t phased = mm_alloc_mmap_aligned(&test_mm, GRANULE_2MB, GRANULE_2MB, 0x123000, MEM_RW, VMA_KIND_SPECIAL, 0);
+    assert_eq(phased & (GRANULE_2MB - 1), 0x123000, "phase not kept: %llx", phased);
+
+    //The gap left by alignment is a hole that later small mappings fill before the cursor moves
+    uaddr_t cursor = test_mm.mmap_cursor;
+    assert_true(mm_alloc_mmap(&test_mm, PAGE_SIZE, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC), "refill failed");
+    assert_eq(test_mm.mmap_cursor, cursor, "alignment gap not reused, cursor moved to %llx", test_mm.mmap_cursor);
+
+    mm_release(&test_mm);
+    return true;
+}
+
+bool test_file_vma_split(){
+    static exec_image image;
+    test_mm_reset();
+    image.size = 16 * PAGE_SIZE;
+    test_mm.exec = &image;
+    uaddr_t base = 0x400000;
+
+    assert_true(mm_add_file_vma(&test_mm, base, base + 8 * PAGE_SIZE, MEM_RW, 2 * PAGE_SIZE, base + 6 * PAGE_SIZE), "file VMA rejected");
+    assert_false(mm_add_file_vma(&test_mm, base + 8 * PAGE_SIZE, base + 12 * PAGE_SIZE, MEM_RW, 14 * PAGE_SIZE, base + 12 * PAGE_SIZE), "VMA past the image accepted");
+    assert_true(mm_remove_vma(&test_mm, base + 2 * PAGE_SIZE, base + 3 * PAGE_SIZE), "split failed");
+
+    vma *tail = mm_find_vma(&test_mm, base + 3 * PAGE_SIZE);
+    assert_true(tail && tail->start == base + 3 * PAGE_SIZE, "tail VMA missing");
+    assert_eq(tail->file_off, 5 * PAGE_SIZE, "tail maps file offset %llx", tail->file_off);
+    assert_eq(tail->file_end, base + 6 * PAGE_SIZE, "tail file end moved to %llx", tail->file_end);
+
+    test_mm.exec = 0;
+    mm_release(&test_mm);
+    return true;
+}
+
+bool test_mm_heap_arena(){
+    static uaddr_t objs[2048];
+    test_mm_reset();
+    uaddr_t a = mm_heap_alloc(&test_mm, 24);
+    uaddr_t b = mm_heap_alloc(&test_mm, 24);
+    assert_eq(b, a + MM_HEAP_MIN_OBJ, "small objects not packed: %llx %llx", a, b);
+    vma *arena = mm_find_vma(&test_mm, a);
+    assert_true(arena && (arena->flags & VMA_FLAG_HEAP), "arena VMA missing");
+
+    for (int i = 0; i < 2048; i++){
+        objs[i] = mm_heap_alloc(&test_mm, 500);
+        assert_true(objs[i], "arena alloc %i failed", i);
+    }
+    assert_eq(test_mm.vma_count, 1, "arena split into %u VMAs", test_mm.vma_count);
+    assert_true(test_mm.heap.page_cap > MM_HEAP_GROW_PAGES, "arena never grew");
+
+    for (int i = 0; i < 2048; i++) assert_true(mm_heap_free(&test_mm, objs[i]), "free %i not recognised", i);
+    assert_eq(test_mm.heap.objects, 2, "objects left: %llu", test_mm.heap.objects);
+    assert_false(mm_heap_free(&test_mm, test_mm.heap.end + PAGE_SIZE), "address outside arena claimed");
+
+    uint32_t top = test_mm.heap.page_top;
+    assert_true(mm_heap_alloc(&test_mm, 500), "alloc after free failed");
+    assert_eq(test_mm.heap.page_top, top, "empty pages not reused, arena grew to %u pages", test_mm.heap.page_top);
+
+    mm_release(&test_mm);
+    return true;
+}
+
 bool alloc_tests(){
     return 
     test_after_free() &&
     test_palloc_reuse_single() &&
     test_palloc_reuse_gap() &&
     test_palloc_large_reuse() &&
+    test_palloc_huge_aligned() &&
+    test_palloc_64kb_aligned() &&
+    test_palloc_shared_refs() &&
     test_kalloc_fragment_reuse() &&
     test_kalloc_free() &&
     test_page_kalloc_free_managed() && 
     test_page_kalloc_no_free_unmanaged() && 
     test_kalloc_alignment_free() &&
+    test_slab_release() &&
+    test_slab_capacity() &&
+    test_vma_tree_uncapped() &&
+    test_mmap_large_alignment() &&
+    test_file_vma_split() &&
+    test_mm_heap_arena() &&
     true;
 }
\ No newline at end of file
@@ -0,0 +1,72 @@
+#include "block_cache_tests.h"
+#include "debug/assert.h"
+#include "filesystem/block_cache.h"
+#include "memory/page_allocator.h"
+#include "std/memory.h"
+#include "console/kio.h"
+
+#define CACHE_TEST_SECTORS 16
+
+bool test_block_cache_hits(){
+    uint8_t *first = (uint8_t*)palloc(PAGE_SIZE * 2, MEM_PRIV_KERNEL, MEM_RW, true);
+    uint8_t *second = (uint8_t*)palloc(PAGE_SIZE * 2, MEM_PRIV_KERNEL, MEM_RW, true);
+    assert_true(first && second, "failed to allocate cache test buffers");
+
+    if (!bcache_read(first, 0, CACHE_TEST_SECTORS)){
+        kprint("[BCACHE test] no disk, skipping");
+        pfree(first, PAGE_SIZE * 2);
+        pfree(second, PAGE_SIZE * 2);
+        return true;
+    }
+
+    bcache_stats before = bcache_get_stats();
+    assert_true(bcache_read(second, 0, CACHE_TEST_SECTORS), "cached read failed");
+    bcache_stats after = bcache_get_stats();
+    assert_eq(after.misses, before.misses, "repeated read missed the cache");
+    assert_true(after.hits > before.hits, "repeated read did not hit the cache");
+    for (int i = 0; i < CACHE_TEST_SECTORS * 512; i++)
+        assert_eq(first[i], second[i], "cached read differs at byte %i", i);
+
+    memset(second, 0, 512);
+    assert_true(bcache_write(first + 512, 1, 1), "cached write failed");
+    assert_true(bcache_read(second, 1, 1), "read after write failed");
+    for (int i = 0; i < 512; i++)
+        assert_eq(first[512 + i], second[i], "write not visible at byte %i", i);
+
+    before = bcache_get_stats();
+    assert_true(bcache_sync(), "sync failed");
+    after = bcache_get_stats();
+    assert_true(after.writebacks > before.writebacks, "dirty block not written back");
+
+    pfree(first, PAGE_SIZE * 2);
+    pfree(second, PAGE_SIZE * 2);
+    return true;
+}
+
+bool test_block_cache_shrink(){
+    uint8_t *buf = (uint8_t*)palloc(PAGE_SIZE * 2, MEM_PRIV_KERNEL, MEM_RW, true);
+    assert_true(buf, "failed to allocate cache test buffer");
+
+    if (!bcache_read(buf, 0, CACHE_TEST_SECTORS)){
+        kprint("[BCACHE test] no disk, skipping");
+        pfree(buf, PAGE_SIZE * 2);
+        return true;
+    }
+    assert_true(bcache_sync(), "sync failed");
+
+    assert_true(bcache_shrink(BCACHE_BLOCKS) > 0, "clean blocks were not given back");
+    bcache_stats before = bcache_get_stats();
+    assert_true(bcache_read(buf, 0, CACHE_TEST_SECTORS), "read after shrink failed");
+    bcache_stats after = bcache_get_stats();
+    assert_true(after.misses > before.misses, "shrunk block still hit the cache");
+
+    pfree(buf, PAGE_SIZE * 2);
+    return true;
+}
+
+bool block_cache_tests(){
+    return
+    test_block_cache_hits() &&
+    test_block_cache_shrink() &&
+    true;
+}
@@ -0,0 +1,42 @@
+#include "fat32_tests.h"
+#include "debug/assert.h"
+#include "filesystem/filesystem.h"
+#include "syscalls/syscalls.h"
+#include "std/memory.h"
+#include "console/kio.h"
+
+//Grows an existing file past its last cluster and truncates it back, it is left as it was found
+#define FAT32_TEST_FILE "/boot/kernel.elf"
+#define FAT32_TEST_GROWTH 0x10000
+
+extern uint32_t boot_partition_free_clusters();
+
+bool test_fat32_truncate_frees(){
+    file fd = {};
+    if (openf(FAT32_TEST_FILE, &fd) != FS_RESULT_SUCCESS){
+        kprint("[FAT32 test] no boot partition, skipping");
+        return true;
+    }
+    size_t original_size = fd.size;
+    uint32_t free_before = boot_partition_free_clusters();
+
+    char *chunk = (char*)zalloc(FAT32_TEST_GROWTH);
+    assert_true(chunk, "failed to allocate growth buffer");
+    fd.cursor = original_size;
+    size_t written = writef(&fd, chunk, FAT32_TEST_GROWTH);
+    release(chunk);
+    assert_eq(written, FAT32_TEST_GROWTH, "append wrote %i bytes", (int)written);
+    assert_true(boot_partition_free_clusters() < free_before, "append did not allocate clusters");
+
+    assert_true(truncatef(&fd, original_size), "truncate failed");
+    assert_eq(fd.size, original_size, "truncate left size %i", (int)fd.size);
+    closef(&fd);
+    assert_eq(boot_partition_free_clusters(), free_before, "truncate leaked clusters");
+    return true;
+}
+
+bool fat32_tests(){
+    return
+    test_fat32_truncate_frees() &&
+    true;
+}
@@ -0,0 +1,89 @@
+#include "sched_tests.h"
+#include "debug/assert.h"
+#include "process/scheduler.h"
+#include "memory/page_allocator.h"
+#include "exceptions/timer.h"
+#include "exceptions/ktimer.h"
+#include "exceptions/irq.h"
+#include "console/kio.h"
+
+#define SCHED_TEST_SMALL 16
+#define SCHED_TEST_LARGE 256
+#define SCHED_TEST_ROUNDS 4096
+//Far enough that even the timer's level 3 slot comes up past the ~34s a signed 32 bit TVAL holds at 62.5MHz
+#define KTIMER_TEST_FAR_US (100ULL * 1000000ULL)
+
+static uint64_t lookup_cost(process_t *proc){
+    uint64_t start = timer_now();
+    for (uint32_t i = 0; i < SCHED_TEST_ROUNDS; i++)
+        if (get_proc_by_pid(proc->id) != proc) return 0;
+    return timer_now() - start;
+}
+
+bool test_proc_lookup_flat(){
+    process_t **procs = (process_t**)palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+    assert_true(procs, "failed to allocate process array");
+
+    uint32_t count = 0;
+    for (; count < SCHED_TEST_SMALL; count++) procs[count] = init_process();
+    uint64_t small = lookup_cost(procs[count - 1]);
+    assert_true(small, "lookup of process %i failed", procs[count - 1]->id);
+
+    for (; count < SCHED_TEST_LARGE; count++) procs[count] = init_process();
+    uint64_t large = lookup_cost(procs[count - 1]);
+    assert_true(large, "lookup of process %i failed", procs[count - 1]->id);
+
+    //Timings depend on the host, they're only reported. Every pid has to come back as its own process
+    kprintf("[SCHED test] %i lookups: %llu ticks with %i processes, %llu ticks with %i", SCHED_TEST_ROUNDS, small, SCHED_TEST_SMALL, large, SCHED_TEST_LARGE);
+    for (uint32_t i = 0; i < count; i++)
+        assert_true(get_proc_by_pid(procs[i]->id) == procs[i], "lookup of process %i returned another process", procs[i]->id);
+
+    for (uint32_t i = 0; i < count; i++){
+        uint16_t pid = procs[i]->id;
+        reset_process(procs[i]);
+        assert_true(get_proc_by_pid(pid) == procs[i], "stopped process %i lost its pid", pid);
+    }
+    pfree(procs, PAGE_SIZE);
+    return true;
+}
+
+static void far_timer_fired(ktimer *timer){
+    *(bool*)timer->ctx = true;
+}
+
+bool test_ktimer_far_deadline(){
+    bool fired = false;
+    ktimer timer;
+    ktimer_init(&timer, far_timer_fired, &fired);
+
+    irq_flags_t irq = irq_save_disable();
+    uint64_t before = ktimer_next_deadline_us();
+    uint64_t expires = timer_now_usec() + KTIMER_TEST_FAR_US;
+    ktimer_arm(&timer, expires);
+    uint64_t deadline = ktimer_next_deadline_us();
+    //Other armed timers may come first, the hardware timer only holds this one's interval when it's the earliest
+    bool programmed = deadline != before;
+    int32_t ticks = virtual_timer_remaining_ticks();
+    if (programmed) assert_true(ticks > 0, "far deadline programmed a wrapped interval: %i", ticks);
+
+    //What the capped interval firing early looks like, nothing is due and the wheel re-arms
+    ktimer_interrupt();
+    assert_false(fired, "far timer fired %llu us early", expires - timer_now_usec());
+    assert_true(timer.armed, "far timer dropped by an early interrupt");
+    if (programmed) {
+        ticks = virtual_timer_remaining_ticks();
+        assert_true(ticks > 0, "early interrupt re-armed a wrapped interval: %i", ticks);
+        assert_eq(ktimer_next_deadline_us(), deadline, "far deadline moved to %llu", ktimer_next_deadline_us());
+    }
+
+    assert_true(ktimer_cancel(&timer), "far timer not armed at cancel");
+    irq_restore(irq);
+    return true;
+}
+
+bool sched_tests(){
+    return
+    test_proc_lookup_flat() &&
+    test_ktimer_far_deadline() &&
+    true;
+}
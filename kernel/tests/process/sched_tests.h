@@ -0,0 +1,5 @@
+#pragma once
+
+#include "types.h"
+
+bool sched_tests();
@@ -1,11 +1,19 @@
 #include "test_runner.h"
 #include "allocation/alloc_tests.h"
+#include "virtio/virtio_tests.h"
+#include "filesystem/block_cache_tests.h"
+#include "filesystem/fat32_tests.h"
+#include "process/sched_tests.h"
 #include "console/kio.h"
 
 extern bool run_redlib_tests();
 
 bool run_tests(){
     return alloc_tests() &&
+    virtio_tests() &&
+    block_cache_tests() &&
+    fat32_tests() &&
+    sched_tests() &&
     run_redlib_tests() &&
     true;
 }
\ No newline at end of file
@@ -0,0 +1,125 @@
+#include "virtio_tests.h"
+#include "debug/assert.h"
+#include "virtio/virtio_pci.h"
+#include "memory/page_allocator.h"
+#include "std/memory.h"
+#include "console/kio.h"
+#include "filesystem/disk.h"
+
+#define FAKE_QUEUE_SIZE 16
+#define FAKE_REQUESTS 6
+
+static uint32_t completions = 0;
+
+static void count_completion(virtio_request *req){
+    completions++;
+}
+
+static bool make_fake_device(virtio_device *dev){
+    memset(dev, 0, sizeof(virtio_device));
+    virtio_queue *q = &dev->queues[0];
+    q->size = FAKE_QUEUE_SIZE;
+    q->desc = (volatile virtq_desc*)palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+    q->driver = (volatile virtq_avail*)palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+    q->device = (volatile virtq_used*)palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+    if (!q->desc || !q->driver || !q->device) return false;
+    q->valid = true;
+    dev->num_queues = 1;
+    return virtio_queue_reset(q);
+}
+
+static void free_fake_device(virtio_device *dev){
+    virtio_queue *q = &dev->queues[0];
+    pfree((void*)q->desc, PAGE_SIZE);
+    pfree((void*)q->driver, PAGE_SIZE);
+    pfree((void*)q->device, PAGE_SIZE);
+    pfree(q->requests, FAKE_QUEUE_SIZE * sizeof(virtio_request*));
+}
+
+static void fake_complete(virtio_queue *q, uint16_t avail_slot, uint32_t len){
+    uint16_t head = q->driver->ring[avail_slot % q->size];
+    q->device->ring[q->device->idx % q->size].id = head;
+    q->device->ring[q->device->idx % q->size].len = len;
+    q->device->idx++;
+}
+
+bool test_virtqueue_multiple_in_flight(){
+    virtio_device dev;
+    assert_true(make_fake_device(&dev), "fake virtqueue setup failed");
+    virtio_queue *q = &dev.queues[0];
+
+    uint8_t *data = (uint8_t*)palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+    virtio_request reqs[FAKE_REQUESTS] = {};
+    completions = 0;
+    for (int i = 0; i < FAKE_REQUESTS; i++){
+        virtio_buf b[2] = {VBUF(data + (i * 64), 32, 0), VBUF(data + (i * 64) + 32, 32, VIRTQ_DESC_F_WRITE)};
+        reqs[i].complete = count_completion;
+        assert_true(virtio_submit(&dev, 0, b, 2, &reqs[i]), "submit %i failed", i);
+    }
+    assert_eq(q->in_flight, FAKE_REQUESTS, "expected %i requests in flight, got %i", FAKE_REQUESTS, q->in_flight);
+    assert_eq(q->num_free, FAKE_QUEUE_SIZE - (FAKE_REQUESTS * 2), "descriptors not taken from free list: %i", q->num_free);
+
+    virtio_buf big[FAKE_QUEUE_SIZE];
+    for (int i = 0; i < FAKE_QUEUE_SIZE; i++) big[i] = VBUF(data, 8, 0);
+    assert_false(virtio_submit(&dev, 0, big, FAKE_QUEUE_SIZE, 0), "submit should fail without free descriptors");
+
+    fake_complete(q, 3, 11);
+    fake_complete(q, 0, 7);
+    assert_eq(virtio_reap(&dev, 0), 2, "out of order completions not reaped");
+    assert_true(reqs[3].done && reqs[0].done, "requests not marked done");
+    assert_false(reqs[1].done, "request completed early");
+    assert_eq(reqs[3].used_len, 11, "wrong used length %i", reqs[3].used_len);
+
+    for (int i = 0; i < FAKE_REQUESTS; i++)
+        if (i != 0 && i != 3) fake_complete(q, i, 1);
+    virtio_reap(&dev, 0);
+    assert_eq(completions, FAKE_REQUESTS, "missing completion callbacks: %i", completions);
+    assert_eq(q->num_free, FAKE_QUEUE_SIZE, "descriptors not returned: %i", q->num_free);
+    assert_eq(q->in_flight, 0, "requests still in flight: %i", q->in_flight);
+
+    kprintf("[VIRTIO test] max in flight %i, %i completed", q->max_in_flight, q->completed);
+    assert_eq(q->max_in_flight, FAKE_REQUESTS, "max in flight not tracked: %i", q->max_in_flight);
+
+    pfree(data, PAGE_SIZE);
+    free_fake_device(&dev);
+    return true;
+}
+
+#define DISK_TEST_SECTORS 8
+
+bool test_disk_batched_read(){
+    uint8_t *whole = (uint8_t*)palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+    uint8_t *parts = (uint8_t*)palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+    assert_true(whole && parts, "failed to allocate disk test buffers");
+
+    disk_request reqs[DISK_TEST_SECTORS];
+    memset(reqs, 0, sizeof(reqs));
+    disk_plug();
+    bool submitted = true;
+    for (int i = 0; i < DISK_TEST_SECTORS; i++){
+        reqs[i].buffer = parts + (i * 512);
+        reqs[i].sector = i;
+        reqs[i].count = 1;
+        if (!disk_submit(&reqs[i])) submitted = false;
+    }
+    disk_unplug();
+
+    if (submitted){
+        for (int i = 0; i < DISK_TEST_SECTORS; i++)
+            assert_true(disk_wait(&reqs[i]), "batched disk read %i failed", i);
+        disk_read(whole, 0, DISK_TEST_SECTORS);
+        for (int i = 0; i < DISK_TEST_SECTORS * 512; i++)
+            assert_eq(whole[i], parts[i], "batched read differs at byte %i", i);
+    } else kprint("[DISK test] no disk, skipping batched read");
+
+    pfree(whole, PAGE_SIZE);
+    pfree(parts, PAGE_SIZE);
+    return true;
+}
+
+bool virtio_tests(){
+    return
+    test_virtqueue_multiple_in_flight() &&
+    test_disk_batched_read() &&
+    true;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "types.h"
+
+bool virtio_tests();
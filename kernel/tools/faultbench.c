@@ -0,0 +1,113 @@
+#include "faultbench.h"
+
+#include "process/process.h"
+#include "memory/mm_process.h"
+#include "memory/page_allocator.h"
+#include "memory/mmu.h"
+#include "memory/addr.h"
+#include "exceptions/timer.h"
+#include "syscalls/syscalls.h"
+#include "string/string.h"
+#include "std/memory.h"
+
+#define FAULTBENCH_DEFAULT_MB 64
+#define FAULTBENCH_MAX_MB 512
+#define FAULTBENCH_BASE 0x0000001000000000ULL
+
+//Data abort from EL0, write, level 3 translation fault
+#define FAULTBENCH_ESR ((0x24ULL << 26) | (1ULL << 6) | 0x7)
+
+//A throwaway address space driven straight through the fault handler, it is never switched to
+static process_t faultbench_proc;
+
+typedef struct faultbench_result {
+    uint64_t traps;
+    uint64_t usec;
+    bool ok;
+} faultbench_result;
+
+static bool faultbench_setup(size_t size){
+    memset(&faultbench_proc, 0, sizeof(faultbench_proc));
+    mm_struct *mm = &faultbench_proc.mm;
+    mm->ttbr0 = mmu_new_ttbr();
+    if (!mm->ttbr0) return false;
+    mm->ttbr0_phys = pt_va_to_pa(mm->ttbr0);
+    mmu_asid_ensure(mm);
+    mm->mmap_bottom = FAULTBENCH_BASE;
+    mm->mmap_top = FAULTBENCH_BASE + size + (MM_GAP_PAGES * PAGE_SIZE);
+    mm->mmap_cursor = mm->mmap_top;
+    mm->cap_anon_pages = size / PAGE_SIZE;
+    return mm_add_vma(mm, FAULTBENCH_BASE, FAULTBENCH_BASE + size, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_ZERO);
+}
+
+static void faultbench_teardown(size_t size){
+    mm_struct *mm = &faultbench_proc.mm;
+    mm_unmap_range(mm, FAULTBENCH_BASE, FAULTBENCH_BASE + size, true);
+    mm_release(mm);
+    mmu_asid_release(mm);
+    mmu_free_ttbr(mm->ttbr0);
+    mm->ttbr0 = 0;
+}
+
+//Touches every page in order, a page that doesn't translate is what would trap from EL0
+static faultbench_result faultbench_touch(size_t size, uint32_t around, bool large, bool flush_asid){
+    faultbench_result r = {};
+    if (!faultbench_setup(size)) {
+        faultbench_teardown(size);
+        return r;
+    }
+
+    uint32_t saved = mm_fault_around_pages;
+    bool saved_large = mm_large_pages;
+    mm_fault_around_pages = around;
+    mm_large_pages = large;
+    uint64_t *root = (uint64_t*)faultbench_proc.mm.ttbr0;
+    r.ok = true;
+
+    uint64_t start = timer_now_usec();
+    for (uaddr_t va = FAULTBENCH_BASE; va < FAULTBENCH_BASE + size; va += PAGE_SIZE) {
+        int st = 0;
+        mmu_translate(root, va, &st);
+        if (st == 0) continue;
+        r.traps++;
+        if (!mm_try_handle_page_fault(&faultbench_proc, va, FAULTBENCH_ESR)) {
+            r.ok = false;
+            break;
+        }
+        if (flush_asid) mmu_flush_asid(faultbench_proc.mm.asid);
+    }
+    r.usec = timer_now_usec() - start;
+
+    mm_fault_around_pages = saved;
+    mm_large_pages = saved_large;
+    faultbench_teardown(size);
+    return r;
+}
+
+static void faultbench_report(const char *name, faultbench_result r, size_t size){
+    uint64_t pages = size / PAGE_SIZE;
+    if (!r.ok) {
+        print("faultbench: %s failed after %llu traps\n", name, r.traps);
+        return;
+    }
+    print("faultbench: %s %llu traps, %llu us, %llu ns/page\n", name, r.traps, r.usec, (r.usec * 1000) / pages);
+}
+
+int run_faultbench(int argc, char* argv[]){
+    uint64_t mb = FAULTBENCH_DEFAULT_MB;
+    if (argc > 1 && argv[1]) mb = parse_int_u64(argv[1], strlen(argv[1]));
+    if (!mb) mb = 1;
+    if (mb > FAULTBENCH_MAX_MB) mb = FAULTBENCH_MAX_MB;
+    size_t size = mb << 20;
+
+    print("faultbench: sequential touch of %llu MiB, fault-around %u pages\n", mb, mm_fault_around_pages);
+    faultbench_result single = faultbench_touch(size, 1, false, true);
+    faultbench_report("page per fault, ASID flush", single, size);
+    faultbench_result around = faultbench_touch(size, mm_fault_around_pages, false, false);
+    faultbench_report("fault-around, no flush", around, size);
+    faultbench_result large = faultbench_touch(size, mm_fault_around_pages, true, false);
+    faultbench_report("2MB/64KB mappings", large, size);
+
+    msleep(100);
+    return single.ok && around.ok && large.ok ? 0 : 1;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int run_faultbench(int argc, char* argv[]);
@@ -0,0 +1,61 @@
+#include "fsbench.h"
+
+#include "filesystem/filesystem.h"
+#include "filesystem/block_cache.h"
+#include "exceptions/timer.h"
+#include "syscalls/syscalls.h"
+#include "std/memory.h"
+
+#define FSBENCH_CHUNK 0x1000
+#define FSBENCH_TOTAL 0x100000
+
+int run_fsbench(int argc, char* argv[]){
+    if (argc < 2 || !argv[1]){
+        print("usage: fsbench <file>\n  appends 1MB in 4KB writes to an existing file, then restores its size\n");
+        msleep(100);
+        return 2;
+    }
+
+    file fd = {};
+    if (openf(argv[1], &fd) != FS_RESULT_SUCCESS){
+        print("fsbench: could not open %s\n", argv[1]);
+        msleep(100);
+        return 1;
+    }
+
+    char *chunk = (char*)zalloc(FSBENCH_CHUNK);
+    if (!chunk){
+        closef(&fd);
+        return 1;
+    }
+    for (int i = 0; i < FSBENCH_CHUNK; i++) chunk[i] = 'a' + (i % 26);
+
+    size_t original_size = fd.size;
+    fd.cursor = original_size;
+    bcache_stats before = bcache_get_stats();
+    uint64_t start = timer_now_msec();
+
+    size_t total = 0;
+    while (total < FSBENCH_TOTAL){
+        size_t written = writef(&fd, chunk, FSBENCH_CHUNK);
+        if (written != FSBENCH_CHUNK) break;
+        total += written;
+    }
+    closef(&fd);
+    sync_filesystems();
+
+    uint64_t elapsed = timer_now_msec() - start;
+    bcache_stats after = bcache_get_stats();
+    uint64_t device_bytes = (after.sectors_written - before.sectors_written) * 512;
+
+    print("fsbench: appended %llu bytes in %llu ms\n", (uint64_t)total, elapsed);
+    print("fsbench: %llu bytes written to the device (%llu%% of payload)\n", device_bytes, total ? (device_bytes * 100) / total : 0);
+
+    if (openf(argv[1], &fd) == FS_RESULT_SUCCESS){
+        truncatef(&fd, original_size);
+        closef(&fd);
+    }
+    release(chunk);
+    msleep(100);
+    return total == FSBENCH_TOTAL ? 0 : 1;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int run_fsbench(int argc, char* argv[]);
@@ -0,0 +1,40 @@
+#include "memcensus.h"
+
+#include "memory/page_allocator.h"
+#include "memory/slab.h"
+#include "memory/mmu.h"
+#include "process/loading/exec_cache.h"
+#include "syscalls/syscalls.h"
+
+#define MEMCENSUS_OWNERS 16
+
+int run_memcensus(int argc, char* argv[]){
+    page_alloc_report report;
+    page_alloc_get_report(&report);
+    print("pages: %llu free of %llu, largest free run %llu\n", report.free_pages, report.total_pages, report.largest_free_run);
+
+    mmu_large_stats large;
+    mmu_get_large_stats(&large);
+    print("large mappings: kernel %llu x 2MB %llu x 64KB, user %llu x 2MB %llu x 64KB, %llu promoted, %llu split\n", large.kernel_2mb, large.kernel_64kb, large.user_2mb, large.user_64kb, large.promotions, large.splits);
+
+    exec_cache_stats exec;
+    exec_cache_get_stats(&exec);
+    print("executable cache: %llu images, %llu bytes, %llu hits, %llu misses\n", exec.images, exec.bytes, exec.hits, exec.misses);
+
+    print("slab  size  slabs  in use/objects\n");
+    for (uint32_t i = 0; i < SLAB_CLASSES; i++){
+        slab_stats stats;
+        if (!slab_get_stats(i, &stats) || !stats.slabs) continue;
+        print("      %u  %u  %llu/%llu\n", stats.object_size, stats.slabs, stats.in_use, stats.objects);
+    }
+
+    kalloc_owner_usage owners[MEMCENSUS_OWNERS];
+    uint32_t count = kalloc_census(owners, MEMCENSUS_OWNERS);
+    print("large allocations by owner page:\n");
+    for (uint32_t i = 0; i < count; i++)
+        print("  %llx: %llu allocations, %llu bytes, largest %llu\n", (uint64_t)owners[i].owner, owners[i].allocations, owners[i].bytes, owners[i].largest);
+    if (!count) print("  none\n");
+
+    msleep(100);
+    return 0;
+}
@@ -47,6 +47,7 @@ void print_process_info(){
             print("Process %s [pid = %i | status = %s]",(uintptr_t)proc->name,proc->id,(uintptr_t)parse_proc_state(proc->state));
             print("Stack: %x (%x). SP: %x",proc->stack, proc->stack_size, proc->sp);
             print("Heap: %x (%x)",proc->mm.mmap_bottom, calc_heap(proc->heap_phys));
+            if (proc->mm.ttbr0) print("Faults: %i (%i pages, %i ahead, %i access, %i large, %i promoted, %i file, %i cow)", proc->mm.fault_stats.faults, proc->mm.fault_stats.pages, proc->mm.fault_stats.around_pages, proc->mm.fault_stats.access_faults, proc->mm.fault_stats.large_maps, proc->mm.fault_stats.promotions, proc->mm.fault_stats.file_pages, proc->mm.fault_stats.cow_copies);
             print("Flags: %x", proc->spsr);
             print("PC: %x",proc->pc);
         }
@@ -0,0 +1,46 @@
+#include "schedlat.h"
+
+#include "kernel_processes/kprocess_loader.h"
+#include "process/scheduler.h"
+#include "exceptions/timer.h"
+#include "syscalls/syscalls.h"
+#include "string/string.h"
+
+#define SCHEDLAT_MAX_HOGS 8
+#define SCHEDLAT_SAMPLES 50
+#define SCHEDLAT_SLEEP_MS 10
+
+static volatile bool schedlat_stop;
+
+static int schedlat_hog(int argc, char* argv[]){
+    volatile uint64_t spins = 0;
+    while (!schedlat_stop) spins++;
+    return 0;
+}
+
+int run_schedlat(int argc, char* argv[]){
+    uint32_t hogs = 4;
+    if (argc > 1 && argv[1]) hogs = parse_int_u64(argv[1], strlen(argv[1]));
+    if (hogs > SCHEDLAT_MAX_HOGS) hogs = SCHEDLAT_MAX_HOGS;
+
+    schedlat_stop = false;
+    uint32_t started = 0;
+    for (; started < hogs; started++)
+        if (!create_kernel_process("schedlat_hog", schedlat_hog, 0, 0)) break;
+
+    uint64_t total = 0, worst = 0;
+    for (int i = 0; i < SCHEDLAT_SAMPLES; i++){
+        uint64_t start = timer_now_usec();
+        msleep(SCHEDLAT_SLEEP_MS);
+        uint64_t elapsed = timer_now_usec() - start;
+        uint64_t late = elapsed > SCHEDLAT_SLEEP_MS * 1000 ? elapsed - (SCHEDLAT_SLEEP_MS * 1000) : 0;
+        total += late;
+        if (late > worst) worst = late;
+    }
+    schedlat_stop = true;
+
+    print("schedlat: %u CPU hogs, %u wakeups of %u ms\n", started, SCHEDLAT_SAMPLES, SCHEDLAT_SLEEP_MS);
+    print("schedlat: wakeup latency avg %llu us, max %llu us\n", total / SCHEDLAT_SAMPLES, worst);
+    msleep(100);
+    return started == hogs ? 0 : 1;
+}
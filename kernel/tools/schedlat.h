@@ -0,0 +1,3 @@
+#pragma once
+
+int run_schedlat(int argc, char* argv[]);
@@ -40,6 +40,7 @@ int run_shutdown(int argc, char* argv[]){
     if (mode == SHUTDOWN_REBOOT) print("Rebooting...\n");
     else print("Powering off...\n");
 
+    sync_filesystems();
     msleep(100);
     hw_shutdown(mode);
     return 0;
@@ -0,0 +1,100 @@
+#include "spawnbench.h"
+
+#include "process/process.h"
+#include "process/scheduler.h"
+#include "process/loading/elf_file.h"
+#include "process/loading/process_loader.h"
+#include "memory/mm_process.h"
+#include "memory/page_allocator.h"
+#include "memory/mmu.h"
+#include "exceptions/timer.h"
+#include "syscalls/syscalls.h"
+#include "string/string.h"
+#include "std/memory.h"
+
+#define SPAWNBENCH_DEFAULT_PATH "/boot/redos/system/launcher.red/launcher.elf"
+#define SPAWNBENCH_DEFAULT_ITERS 32
+#define SPAWNBENCH_MAX_ITERS 1024
+#define SPAWNBENCH_HEAP_MB 4
+
+//Data abort from EL0, level 3 translation fault, with or without the write bit
+#define SPAWNBENCH_ESR_READ ((0x24ULL << 26) | 0x7)
+#define SPAWNBENCH_ESR_WRITE (SPAWNBENCH_ESR_READ | (1ULL << 6))
+
+//Faults in the whole program image and a heap, so the parent looks like one that has been running a while.
+//Returns the pages mapped, 0 on failure
+static uint64_t spawnbench_populate(process_t *proc){
+    uaddr_t heap = mm_alloc_mmap(&proc->mm, SPAWNBENCH_HEAP_MB << 20, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC | VMA_FLAG_ZERO);
+    if (!heap) return 0;
+
+    uint64_t pages = 0;
+    for (vma *m = proc->mm.vma_head; m; m = m->next) {
+        if (m->kind != VMA_KIND_ELF && m->start != heap) continue;
+        uint64_t esr = (m->prot & MEM_RW) ? SPAWNBENCH_ESR_WRITE : SPAWNBENCH_ESR_READ;
+        for (uaddr_t va = m->start; va < m->end; va += PAGE_SIZE) {
+            int st = 0;
+            mmu_translate((uint64_t*)proc->mm.ttbr0, va, &st);
+            if (st != 0 && !mm_try_handle_page_fault(proc, va, esr)) return 0;
+            pages++;
+        }
+    }
+    return pages;
+}
+
+int run_spawnbench(int argc, char* argv[]){
+    const char *path = argc > 1 && argv[1] ? argv[1] : SPAWNBENCH_DEFAULT_PATH;
+    uint64_t iters = SPAWNBENCH_DEFAULT_ITERS;
+    if (argc > 2 && argv[2]) iters = parse_int_u64(argv[2], strlen(argv[2]));
+    if (!iters) iters = 1;
+    if (iters > SPAWNBENCH_MAX_ITERS) iters = SPAWNBENCH_MAX_ITERS;
+
+    //Neither side is ever readied, only creation and teardown are measured
+    process_t *parent = load_elf_process_cached("spawnbench", 0, path);
+    if (!parent) {
+        print("spawnbench: could not load %s\n", path);
+        return 1;
+    }
+    mmu_asid_ensure(&parent->mm);
+    uint64_t resident = spawnbench_populate(parent);
+    if (!resident) {
+        print("spawnbench: could not populate %s\n", path);
+        reset_process(parent);
+        return 1;
+    }
+
+    uint64_t exec_us = 0, spawn_us = 0, teardown_us = 0, shared = 0;
+    bool ok = true;
+    for (uint64_t i = 0; i < iters && ok; i++) {
+        uint64_t start = timer_now_usec();
+        process_t *p = load_elf_process_cached("spawnbench", 0, path);
+        exec_us += timer_now_usec() - start;
+        if (!p) {
+            ok = false;
+            break;
+        }
+        reset_process(p);
+
+        start = timer_now_usec();
+        p = spawn_process(parent);
+        spawn_us += timer_now_usec() - start;
+        if (!p) {
+            ok = false;
+            break;
+        }
+        shared = page_shared_count();
+        start = timer_now_usec();
+        reset_process(p);
+        teardown_us += timer_now_usec() - start;
+    }
+    reset_process(parent);
+
+    if (!ok) {
+        print("spawnbench: process creation failed\n");
+        return 1;
+    }
+    print("spawnbench: %s, parent with %llu resident pages, %llu rounds\n", path, resident, iters);
+    print("spawnbench: exec from cached file %llu us, copy on write spawn %llu us, spawn teardown %llu us\n", exec_us / iters, spawn_us / iters, teardown_us / iters);
+    print("spawnbench: %llu pages shared while a child was alive\n", shared);
+    msleep(100);
+    return 0;
+}
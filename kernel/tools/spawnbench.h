@@ -0,0 +1,3 @@
+#pragma once
+
+int run_spawnbench(int argc, char* argv[]);
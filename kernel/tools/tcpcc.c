@@ -0,0 +1,42 @@
+#include "tcpcc.h"
+#include "tcpstream.h"
+
+#include "networking/drivers/loopback/loopback.h"
+#include "syscalls/syscalls.h"
+#include "string/string.h"
+
+#define TCPCC_DEFAULT_KIB 4096
+#define TCPCC_DEFAULT_DELAY_MS 20
+#define TCPCC_PORT 5100
+#define TCPCC_TIMEOUT_MS 120000
+
+//Every frame is held for the loopback delay while each algorithm in turn streams the same amount
+int run_tcpcc(int argc, char* argv[]){
+    uint64_t delay = TCPCC_DEFAULT_DELAY_MS;
+    uint64_t kib = TCPCC_DEFAULT_KIB;
+    if (argc > 1 && argv[1]) delay = parse_int_u64(argv[1], strlen(argv[1]));
+    if (argc > 2 && argv[2]) kib = parse_int_u64(argv[2], strlen(argv[2]));
+    if (!kib) kib = 1;
+    uint64_t bytes = kib * 1024;
+
+    uint32_t prev_delay = loopback_get_delay_ms();
+    loopback_set_delay_ms((uint32_t)delay);
+
+    int failed = 0;
+    for (uint32_t algo = 0; algo < TCP_CC_COUNT; algo++){
+        tcpstream_t s = {
+            .port = (uint16_t)(TCPCC_PORT + algo),
+            .bytes = bytes,
+            .timeout_ms = TCPCC_TIMEOUT_MS,
+            .cc = (tcp_cc_algo_t)algo,
+        };
+        bool ok = tcpstream_run(&s);
+
+        print("tcpcc: %s delay %llu ms %s %llu bytes in %llu ms, %llu KiB/s\n", tcp_cc_name((tcp_cc_algo_t)algo), delay, ok ? "ok" : "FAILED", bytes, s.elapsed_ms, (bytes * 1000) / (s.elapsed_ms * 1024));
+        if (!ok) failed++;
+    }
+
+    loopback_set_delay_ms(prev_delay);
+    msleep(100);
+    return failed ? 1 : 0;
+}
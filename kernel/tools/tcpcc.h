@@ -0,0 +1,3 @@
+#pragma once
+
+int run_tcpcc(int argc, char* argv[]);
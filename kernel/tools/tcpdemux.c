@@ -0,0 +1,67 @@
+#include "tcpdemux.h"
+
+#include "networking/transport_layer/tcp/tcp_internal.h"
+#include "exceptions/timer.h"
+#include "syscalls/syscalls.h"
+#include "string/string.h"
+
+#define TCPDEMUX_DEFAULT_FLOWS 10000
+#define TCPDEMUX_SEGMENTS 200000
+#define TCPDEMUX_LOCAL_PORT 40000
+
+//Synthetic flows use 198.18.0.0/15, which is reserved for benchmarking and never routed
+static void tcpdemux_addr(uint32_t i, uint8_t local[4], uint8_t remote[4], uint16_t *remote_port){
+    local[0] = 198; local[1] = 18; local[2] = 0; local[3] = 1;
+    remote[0] = 198; remote[1] = 19; remote[2] = (uint8_t)(i >> 8); remote[3] = (uint8_t)i;
+    *remote_port = (uint16_t)(1024 + (i >> 16));
+}
+
+int run_tcpdemux(int argc, char* argv[]){
+    uint32_t count = TCPDEMUX_DEFAULT_FLOWS;
+    if (argc > 1 && argv[1]) count = parse_int_u64(argv[1], strlen(argv[1]));
+    if (!count) count = 1;
+
+    tcp_flow_t **flows = (tcp_flow_t **)malloc(count * sizeof(tcp_flow_t *));
+    if (!flows) return 1;
+
+    uint32_t created = 0;
+    for (; created < count; created++){
+        tcp_flow_t *f = tcp_alloc_flow();
+        if (!f) break;
+        uint16_t remote_port;
+        tcpdemux_addr(created, f->local.ip, f->remote.ip, &remote_port);
+        f->local.ver = IP_VER4;
+        f->local.port = TCPDEMUX_LOCAL_PORT;
+        f->local_port = TCPDEMUX_LOCAL_PORT;
+        f->remote.ver = IP_VER4;
+        f->remote.port = remote_port;
+        f->state = TCP_ESTABLISHED;
+        tcp_flow_hash(f);
+        flows[created] = f;
+    }
+
+    tcp_hdr_t hdr = {};
+    uint8_t local[4], remote[4];
+    uint32_t found = 0;
+    uint32_t seed = 0x9E3779B9u;
+    uint64_t start = timer_now_usec();
+    for (uint32_t n = 0; n < TCPDEMUX_SEGMENTS && created; n++){
+        seed = seed * 1664525u + 1013904223u;
+        uint32_t i = seed % created;
+        uint16_t remote_port;
+        tcpdemux_addr(i, local, remote, &remote_port);
+        hdr.src_port = bswap16(remote_port);
+        hdr.dst_port = bswap16(TCPDEMUX_LOCAL_PORT);
+        if (find_flow(bswap16(hdr.dst_port), IP_VER4, local, remote, bswap16(hdr.src_port)) >= 0) found++;
+    }
+    uint64_t elapsed = timer_now_usec() - start;
+    if (!elapsed) elapsed = 1;
+
+    for (uint32_t i = 0; i < created; i++) tcp_free_flow((int)flows[i]->slot);
+    free_sized(flows, count * sizeof(tcp_flow_t *));
+
+    print("tcpdemux: %u flows, %u segments, %u matched\n", created, created ? TCPDEMUX_SEGMENTS : 0, found);
+    print("tcpdemux: %llu us, %llu lookups/s\n", elapsed, created ? ((uint64_t)TCPDEMUX_SEGMENTS * 1000000) / elapsed : 0);
+    msleep(100);
+    return created == count && found == TCPDEMUX_SEGMENTS ? 0 : 1;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int run_tcpdemux(int argc, char* argv[]);
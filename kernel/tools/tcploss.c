@@ -0,0 +1,43 @@
+#include "tcploss.h"
+#include "tcpstream.h"
+
+#include "networking/transport_layer/tcp/tcp_internal.h"
+#include "syscalls/syscalls.h"
+#include "string/string.h"
+
+#define TCPLOSS_DEFAULT_KIB 1024
+#define TCPLOSS_PORT 5000
+#define TCPLOSS_CHUNK 4096
+#define TCPLOSS_TIMEOUT_MS 60000
+
+int run_tcploss(int argc, char* argv[]){
+    uint64_t kib = TCPLOSS_DEFAULT_KIB;
+    if (argc > 1 && argv[1]) kib = parse_int_u64(argv[1], strlen(argv[1]));
+    if (!kib) kib = 1;
+    uint64_t bytes = kib * 1024;
+
+    int failed = 0;
+    for (uint32_t pct = 1; pct <= 5; pct++){
+        tcpstream_t s = {
+            .port = (uint16_t)(TCPLOSS_PORT + pct),
+            .bytes = bytes,
+            .chunk = TCPLOSS_CHUNK,
+            .timeout_ms = TCPLOSS_TIMEOUT_MS,
+            .cc = TCP_CC_DEFAULT,
+            .loss_permille = pct * 10,
+        };
+        tcp_recovery_stats_t before = tcp_recovery_stats;
+        bool ok = tcpstream_run(&s);
+        tcp_recovery_stats_t after = tcp_recovery_stats;
+
+        print("tcploss: loss %u/100 %s %llu bytes in %llu ms, %llu KiB/s\n", pct, ok ? "ok" : "FAILED", bytes, s.elapsed_ms, (bytes * 1000) / (s.elapsed_ms * 1024));
+        print("tcploss:   recoveries %llu sack_rexmits %llu rack_lost %llu tlp %llu rto %llu\n",
+            after.recoveries - before.recoveries, after.sack_rexmits - before.sack_rexmits,
+            after.rack_lost - before.rack_lost, after.tlp_probes - before.tlp_probes,
+            after.rto_rexmits - before.rto_rexmits);
+        if (!ok) failed++;
+    }
+
+    msleep(100);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int run_tcploss(int argc, char* argv[]);
@@ -0,0 +1,38 @@
+#include "tcprx.h"
+#include "tcpstream.h"
+
+#include "networking/transport_layer/tcp/tcp_internal.h"
+#include "syscalls/syscalls.h"
+#include "string/string.h"
+
+#define TCPRX_DEFAULT_KIB 8192
+#define TCPRX_PORT 5200
+#define TCPRX_TIMEOUT_MS 60000
+
+//Bulk download over loopback, only the time spent inside recv is reported per KiB
+int run_tcprx(int argc, char* argv[]){
+    uint64_t kib = TCPRX_DEFAULT_KIB;
+    if (argc > 1 && argv[1]) kib = parse_int_u64(argv[1], strlen(argv[1]));
+    if (!kib) kib = 1;
+    uint64_t bytes = kib * 1024;
+
+    tcpstream_t s = {
+        .port = TCPRX_PORT,
+        .bytes = bytes,
+        .timeout_ms = TCPRX_TIMEOUT_MS,
+        .cc = TCP_CC_DEFAULT,
+        .download = true,
+    };
+    tcp_rx_stats_t before = tcp_rx_stats;
+    bool ok = tcpstream_run(&s);
+    tcp_rx_stats_t after = tcp_rx_stats;
+
+    print("tcprx: %s %llu bytes in %llu ms, %llu KiB/s\n", ok ? "ok" : "FAILED", bytes, s.elapsed_ms, (bytes * 1000) / (s.elapsed_ms * 1024));
+    print("tcprx:   recv %llu us total, %llu ns/KiB\n", s.recv_us, (s.recv_us * 1000) / kib);
+    print("tcprx:   segments zero-copy %llu copied %llu (%llu bytes)\n",
+        after.view_segs - before.view_segs, after.copied_segs - before.copied_segs,
+        after.copied_bytes - before.copied_bytes);
+
+    msleep(100);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int run_tcprx(int argc, char* argv[]);
@@ -0,0 +1,86 @@
+#include "tcpstream.h"
+
+#include "networking/transport_layer/csocket_tcp.h"
+#include "networking/transport_layer/trans_utils.h"
+#include "networking/drivers/loopback/loopback.h"
+#include "exceptions/timer.h"
+#include "process/scheduler.h"
+#include "syscalls/syscalls.h"
+
+static uint8_t tcpstream_tx[TCPSTREAM_CHUNK];
+static uint8_t tcpstream_rx[TCPSTREAM_CHUNK];
+
+static void tcpstream_release(socket_handle_t sh){
+    if (!sh) return;
+    socket_close_tcp(sh);
+    socket_destroy_tcp(sh);
+}
+
+bool tcpstream_run(tcpstream_t *s){
+    uint16_t pid = get_current_proc_pid();
+    SocketExtraOptions opt = {0};
+    bool ok = false;
+    uint32_t chunk = s->chunk && s->chunk < TCPSTREAM_CHUNK ? s->chunk : TCPSTREAM_CHUNK;
+    s->elapsed_ms = 0;
+    s->recv_us = 0;
+
+    for (uint32_t i = 0; i < TCPSTREAM_CHUNK; i++) tcpstream_tx[i] = (uint8_t)i;
+
+    socket_handle_t srv = socket_tcp_create(SOCK_ROLE_SERVER, pid, &opt);
+    socket_handle_t cli = socket_tcp_create(SOCK_ROLE_CLIENT, pid, &opt);
+    socket_handle_t conn = NULL;
+    if (!srv || !cli) goto out;
+    //The accepted socket inherits the listener's algorithm, so either side can be the sender
+    if (socket_set_cc_tcp(srv, (uint8_t)s->cc) < 0 || socket_set_cc_tcp(cli, (uint8_t)s->cc) < 0) goto out;
+
+    struct SockBindSpec spec = {0};
+    spec.kind = BIND_ANY;
+    if (socket_bind_tcp_ex(srv, &spec, s->port) < 0) goto out;
+    if (socket_listen_tcp(srv, 1) < 0) goto out;
+
+    net_l4_endpoint ep;
+    make_ep(0x7F000001u, s->port, IP_VER4, &ep);
+    if (socket_connect_tcp_ex(cli, DST_ENDPOINT, &ep, s->port) < 0) goto out;
+    conn = socket_accept_tcp(srv);
+    if (!conn) goto out;
+
+    socket_handle_t tx = s->download ? conn : cli;
+    socket_handle_t rx = s->download ? cli : conn;
+    loopback_set_loss_permille(s->loss_permille);
+
+    uint64_t sent = 0, received = 0;
+    bool intact = true;
+    uint64_t start = timer_now_msec();
+    while (received < s->bytes && timer_now_msec() - start < s->timeout_ms){
+        bool progress = false;
+        if (sent < s->bytes){
+            uint64_t off = sent % chunk;
+            uint64_t len = s->bytes - sent < chunk - off ? s->bytes - sent : chunk - off;
+            int64_t n = socket_send_tcp(tx, tcpstream_tx + off, len);
+            if (n > 0){
+                sent += (uint64_t)n;
+                progress = true;
+            }
+        }
+        uint64_t t0 = timer_now_usec();
+        int64_t n = socket_recv_tcp(rx, tcpstream_rx, sizeof(tcpstream_rx));
+        s->recv_us += timer_now_usec() - t0;
+        if (n > 0){
+            for (int64_t i = 0; i < n && intact; i++)
+                if (tcpstream_rx[i] != (uint8_t)(received + (uint64_t)i)) intact = false;
+            received += (uint64_t)n;
+            progress = true;
+        }
+        if (!progress) msleep(1);
+    }
+    s->elapsed_ms = timer_now_msec() - start;
+    if (!s->elapsed_ms) s->elapsed_ms = 1;
+    ok = received == s->bytes && intact;
+
+out:
+    loopback_set_loss_permille(0);
+    tcpstream_release(conn);
+    tcpstream_release(cli);
+    tcpstream_release(srv);
+    return ok;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "types.h"
+#include "networking/transport_layer/tcp.h"
+
+#define TCPSTREAM_CHUNK 16384
+
+//One bulk transfer over loopback between a listener and a client of the calling process
+typedef struct {
+    uint16_t port;
+    uint64_t bytes;
+    uint32_t chunk;//Bytes per send, at most TCPSTREAM_CHUNK
+    uint32_t timeout_ms;
+    tcp_cc_algo_t cc;
+    uint32_t loss_permille;//Dropped in both directions once the connection is up
+    bool download;//The accepted side sends and the client receives
+    uint64_t elapsed_ms;
+    uint64_t recv_us;//Time spent inside recv only
+} tcpstream_t;
+
+//True when every byte arrived intact before the timeout
+bool tcpstream_run(tcpstream_t *s);
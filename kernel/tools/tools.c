@@ -3,6 +3,16 @@
 #include "shutdown.h"
 #include "tracert.h"
 #include "monitor_processes.h"
+#include "fsbench.h"
+#include "memcensus.h"
+#include "schedlat.h"
+#include "tcpdemux.h"
+#include "tcploss.h"
+#include "tcpcc.h"
+#include "tcprx.h"
+#include "vmabench.h"
+#include "faultbench.h"
+#include "spawnbench.h"
 #include "kernel_processes/kprocess_loader.h"
 #include "filesystem/filesystem.h"
 #include "syscalls/syscalls.h"
@@ -27,6 +37,16 @@ open_tools_ref available_cmds[] = {
     { "shutdown", run_shutdown },
     { "tracert", run_tracert },
     { "monitor", monitor_procs },
+    { "fsbench", run_fsbench },
+    { "memcensus", run_memcensus },
+    { "schedlat", run_schedlat },
+    { "tcpdemux", run_tcpdemux },
+    { "tcploss", run_tcploss },
+    { "tcpcc", run_tcpcc },
+    { "tcprx", run_tcprx },
+    { "vmabench", run_vmabench },
+    { "faultbench", run_faultbench },
+    { "spawnbench", run_spawnbench },
 };
 
 process_t* execute(const char* prog_name, int argc, const char* argv[], uint32_t mode){
@@ -0,0 +1,96 @@
+#include "vmabench.h"
+
+#include "memory/mm_process.h"
+#include "memory/page_allocator.h"
+#include "exceptions/timer.h"
+#include "syscalls/syscalls.h"
+#include "string/string.h"
+#include "std/memory.h"
+
+#define VMABENCH_DEFAULT_VMAS 4096
+#define VMABENCH_MAX_VMAS 65536
+#define VMABENCH_LOOKUPS 100000
+#define VMABENCH_SMALL_PER_VMA 8
+
+//Synthetic address space laid out like process_loader does, nothing is ever mapped into it
+static mm_struct vmabench_mm;
+
+static void vmabench_reset(){
+    memset(&vmabench_mm, 0, sizeof(vmabench_mm));
+    vmabench_mm.mmap_bottom = 0x0000000100000000ULL;
+    vmabench_mm.mmap_top = 0x0000700000000000ULL;
+    vmabench_mm.mmap_cursor = vmabench_mm.mmap_top;
+    vmabench_mm.cap_anon_pages = UINT64_MAX;
+}
+
+static uint64_t vmabench_lookups(uaddr_t *vas, uint32_t count){
+    uint32_t seed = 0x1234567;
+    uint32_t misses = 0;
+    uint64_t start = timer_now_usec();
+    for (uint32_t i = 0; i < VMABENCH_LOOKUPS; i++){
+        seed = seed * 1103515245u + 12345u;
+        uaddr_t va = vas[(seed >> 8) % count] + (seed & (PAGE_SIZE - 1));
+        if (!mm_find_vma(&vmabench_mm, va)) misses++;
+    }
+    uint64_t elapsed = timer_now_usec() - start;
+    if (misses) print("vmabench: %u lookups missed\n", misses);
+    return (elapsed * 1000) / VMABENCH_LOOKUPS;
+}
+
+int run_vmabench(int argc, char* argv[]){
+    uint32_t count = VMABENCH_DEFAULT_VMAS;
+    if (argc > 1 && argv[1]) count = parse_int_u64(argv[1], strlen(argv[1]));
+    if (count < 128) count = 128;
+    if (count > VMABENCH_MAX_VMAS) count = VMABENCH_MAX_VMAS;
+
+    size_t vas_size = count * sizeof(uaddr_t);
+    uaddr_t *vas = (uaddr_t*)palloc(vas_size, MEM_PRIV_KERNEL, MEM_RW, true);
+    if (!vas) return 1;
+
+    //One VMA per allocation, the way page sized mallocs are served
+    vmabench_reset();
+    uint64_t start = timer_now_usec();
+    uint32_t mapped = 0;
+    for (; mapped < count; mapped++){
+        vas[mapped] = mm_alloc_mmap(&vmabench_mm, PAGE_SIZE, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC | VMA_FLAG_ZERO);
+        if (!vas[mapped]) break;
+    }
+    uint64_t map_us = timer_now_usec() - start;
+    print("vmabench: %u VMAs in %llu us, %llu ns each\n", mapped, map_us, mapped ? (map_us * 1000) / mapped : 0);
+
+    if (mapped >= 128){
+        print("vmabench: lookup %llu ns with 128 VMAs live, %llu ns with %u\n", vmabench_lookups(vas, 128), vmabench_lookups(vas, mapped), mapped);
+    }
+
+    start = timer_now_usec();
+    for (uint32_t i = 0; i < mapped; i += 2) mm_remove_vma(&vmabench_mm, vas[i], vas[i] + PAGE_SIZE);
+    for (uint32_t i = 0; i < mapped; i += 2) vas[i] = mm_alloc_mmap(&vmabench_mm, PAGE_SIZE, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC | VMA_FLAG_ZERO);
+    print("vmabench: freed and refilled every other VMA in %llu us, %u VMAs live\n", timer_now_usec() - start, vmabench_mm.vma_count);
+    mm_release(&vmabench_mm);
+
+    //Small allocations carved from the heap arena, all of them live under one VMA
+    vmabench_reset();
+    uint32_t small = count * VMABENCH_SMALL_PER_VMA;
+    uint32_t done = 0;
+    uint64_t live = 0;
+    start = timer_now_usec();
+    for (; done < small; done++){
+        uaddr_t va = mm_heap_alloc(&vmabench_mm, 16 + (done % 32) * 16);
+        if (!va) break;
+        if (done < count) vas[done] = va;
+        //Free a slice back as it goes so pages are recycled, not only appended
+        if ((done & 3) == 3 && done < count) {
+            mm_heap_free(&vmabench_mm, vas[done - 1]);
+            vas[done - 1] = 0;
+        }
+    }
+    uint64_t small_us = timer_now_usec() - start;
+    live = vmabench_mm.heap.objects;
+    print("vmabench: %u small allocs in %llu us, %llu ns each\n", done, small_us, done ? (small_us * 1000) / done : 0);
+    print("vmabench: %llu objects live in %u arena pages, %u VMAs\n", live, vmabench_mm.heap.page_top, vmabench_mm.vma_count);
+    mm_release(&vmabench_mm);
+
+    pfree(vas, vas_size);
+    msleep(100);
+    return mapped == count && done == small ? 0 : 1;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int run_vmabench(int argc, char* argv[]);
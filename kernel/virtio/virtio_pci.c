@@ -6,9 +6,7 @@
 #include "virtio_pci.h"
 #include "async.h"
 #include "sysregs.h"
-
-//TODO implement proper virtqueue handling w/ descriptor allocation, reuse and support for multiple in-flight requests using used.ring completions
-
+#include "exceptions/irq.h"
 
 #define VIRTIO_PCI_CAP_COMMON_CFG   1
 #define VIRTIO_PCI_CAP_NOTIFY_CFG   2
@@ -199,6 +197,7 @@ bool virtio_init_device(virtio_device *dev) {
         dev->queues[queue_index].desc = (volatile virtq_desc*)base;
         dev->queues[queue_index].driver = (volatile virtq_avail*)avail;
         dev->queues[queue_index].device = (volatile virtq_used*)used;
+        if (!virtio_queue_reset(&dev->queues[queue_index])) return false;
     }
 
     kprintfv("Device initialized %i virtqueues", dev->num_queues);
@@ -223,9 +222,8 @@ uint32_t select_queue(virtio_device *dev, uint32_t index){
     return dev->queues[index].size;
 }
 
-void virtio_notify(virtio_device *dev) {
+static void virtio_notify_queue(virtio_device *dev, uint16_t index) {
     if (!dev || !dev->notify_cfg) return;
-    uint16_t index = dev->current_queue;
     if (index >= VIRTIO_MAX_QUEUES) return;
     if (!dev->queues[index].valid) return;
 
@@ -238,48 +236,169 @@ void virtio_notify(virtio_device *dev) {
     *(volatile uint16_t*)((uintptr_t)dev->notify_cfg + (uint64_t)off * (uint64_t)mul) = value;
 }
 
-bool virtio_send_nd(virtio_device *dev, const virtio_buf *bufs, uint16_t n) {
+void virtio_notify(virtio_device *dev) {
+    if (!dev) return;
+    virtio_notify_queue(dev, dev->current_queue);
+}
 
-    if (!dev || !bufs || !n) return false;
+bool virtio_queue_reset(virtio_queue *queue){
+    if (!queue || !queue->size || !queue->desc) return false;
+    size_t requests_size = (size_t)queue->size * sizeof(virtio_request*);
+    if (!queue->requests){
+        queue->requests = (virtio_request**)palloc(requests_size, MEM_PRIV_KERNEL, MEM_RW, true);
+        if (!queue->requests) return false;
+    }
+    memset(queue->requests, 0, requests_size);
 
-    if (dev->current_queue >= VIRTIO_MAX_QUEUES) return false;
-    virtio_queue *queue = &dev->queues[dev->current_queue];
-    if (!queue->valid || !queue->size || n > queue->size) return false;
+    for (uint16_t i = 0; i < queue->size; i++){
+        queue->desc[i].flags = 0;
+        queue->desc[i].next = (uint16_t)(i + 1);
+    }
+    queue->free_head = 0;
+    queue->num_free = queue->size;
+    queue->last_used_idx = queue->device ? queue->device->idx : 0;
+    queue->in_flight = 0;
+    queue->max_in_flight = 0;
+    queue->submitted = 0;
+    queue->completed = 0;
+    return true;
+}
+
+static void virtio_free_chain(virtio_queue *queue, uint16_t head){
+    volatile virtq_desc* d = queue->desc;
+    uint16_t tail = head;
+    uint16_t count = 1;
+    while ((d[tail].flags & VIRTQ_DESC_F_NEXT) && count < queue->size){
+        tail = d[tail].next;
+        count++;
+    }
+    d[tail].flags = 0;
+    d[tail].next = queue->free_head;
+    queue->free_head = head;
+    queue->num_free += count;
+}
+
+uint16_t virtio_free_descriptors(virtio_device *dev, uint16_t index){
+    if (!dev || index >= VIRTIO_MAX_QUEUES) return 0;
+    return dev->queues[index].num_free;
+}
+
+bool virtio_submit(virtio_device *dev, uint16_t index, const virtio_buf *bufs, uint16_t n, virtio_request *req) {
+    if (!dev || !bufs || !n || index >= VIRTIO_MAX_QUEUES) return false;
+
+    virtio_queue *queue = &dev->queues[index];
+    if (!queue->valid || !queue->size || !queue->requests) return false;
 
     volatile virtq_desc* d = queue->desc;
     volatile virtq_avail* a = queue->driver;
-    volatile virtq_used* u = queue->device;
-    if (!d || !a || !u) return false;
+    if (!d || !a) return false;
+
+    for (uint16_t i = 0; i < n; ++i)
+        if (!bufs[i].addr || !bufs[i].len) return false;
 
-    uint16_t qsz = queue->size;
-    uint16_t last_used_idx = u->idx;
+    irq_flags_t irq = irq_save_disable();
+    if (queue->num_free < n){
+        irq_restore(irq);
+        return false;
+    }
 
+    uint16_t head = queue->free_head;
+    uint16_t di = head;
     for (uint16_t i = 0; i < n; ++i) {
-        if (!bufs[i].addr || !bufs[i].len) return false;
-        d[i].addr = VIRT_TO_PHYS(bufs[i].addr);
-        d[i].len = bufs[i].len;
-        d[i].flags = bufs[i].flags;
+        uint16_t next = d[di].next;
+        d[di].addr = VIRT_TO_PHYS(bufs[i].addr);
+        d[di].len = bufs[i].len;
+        d[di].flags = bufs[i].flags;
         if (i + 1 < n) {
-            d[i].flags |= VIRTQ_DESC_F_NEXT;
-            d[i].next = (uint16_t)(i + 1);
+            d[di].flags |= VIRTQ_DESC_F_NEXT;
+            di = next;
         } else {
-            d[i].next = 0;
+            queue->free_head = next;
+            d[di].next = 0;
         }
     }
+    queue->num_free -= n;
 
-    asm volatile ("dmb ishst" ::: "memory");
+    if (req){
+        req->done = false;
+        req->queue = index;
+        req->head = head;
+        req->used_len = 0;
+    }
+    queue->requests[head] = req;
+    queue->in_flight++;
+    if (queue->in_flight > queue->max_in_flight) queue->max_in_flight = queue->in_flight;
+    queue->submitted++;
 
-    a->ring[a->idx % qsz] = 0;
+    asm volatile ("dmb ishst" ::: "memory");
+    a->ring[a->idx % queue->size] = head;
     asm volatile ("dmb ishst" ::: "memory");
     a->idx++;
     asm volatile ("dmb ishst" ::: "memory");
-    virtio_notify(dev);
+    virtio_notify_queue(dev, index);
+    irq_restore(irq);
 
-    while (last_used_idx == u->idx);//TODO: OPT
+    return true;
+}
+
+uint16_t virtio_reap(virtio_device *dev, uint16_t index) {
+    if (!dev || index >= VIRTIO_MAX_QUEUES) return 0;
+
+    virtio_queue *queue = &dev->queues[index];
+    if (!queue->valid || !queue->size || !queue->requests || !queue->device) return 0;
+
+    irq_flags_t irq = irq_save_disable();
+    volatile virtq_used* u = queue->device;
+    uint16_t reaped = 0;
+    asm volatile ("dmb ishld" ::: "memory");
+    while (queue->last_used_idx != u->idx){
+        volatile virtq_used_elem* e = &u->ring[queue->last_used_idx % queue->size];
+        uint16_t head = (uint16_t)e->id;
+        uint32_t len = e->len;
+        queue->last_used_idx++;
+        if (head >= queue->size) continue;
+
+        virtio_request *req = queue->requests[head];
+        queue->requests[head] = 0;
+        virtio_free_chain(queue, head);
+        if (queue->in_flight) queue->in_flight--;
+        queue->completed++;
+        reaped++;
+
+        if (req){
+            req->used_len = len;
+            req->done = true;
+            if (req->complete) req->complete(req);
+        }
+    }
+    irq_restore(irq);
+    return reaped;
+}
 
+bool virtio_wait(virtio_device *dev, virtio_request *req) {
+    if (!dev || !req) return false;
+    while (!req->done)
+        if (!virtio_reap(dev, req->queue)) asm volatile ("yield");
     return true;
 }
 
+bool virtio_send_nd(virtio_device *dev, const virtio_buf *bufs, uint16_t n) {
+    if (!dev || !bufs || !n) return false;
+
+    uint16_t index = dev->current_queue;
+    if (index >= VIRTIO_MAX_QUEUES) return false;
+    virtio_queue *queue = &dev->queues[index];
+    if (!queue->valid || !queue->size || n > queue->size) return false;
+
+    virtio_request req = {};
+    while (!virtio_submit(dev, index, bufs, n, &req)){
+        if (queue->num_free >= n || !queue->in_flight) return false;
+        virtio_reap(dev, index);
+    }
+
+    return virtio_wait(dev, &req);
+}
+
 void virtio_add_buffer(virtio_device *dev, uint16_t index, uint64_t buf, uint32_t buf_len, bool host_to_dev) {
     if (!dev) return;
     if (dev->current_queue >= VIRTIO_MAX_QUEUES) return;
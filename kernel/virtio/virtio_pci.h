@@ -71,6 +71,20 @@ typedef struct {
     virtq_used_elem ring[];
 }__attribute__((packed)) virtq_used;
 
+typedef struct virtio_request virtio_request;
+
+typedef void (*virtio_complete_fn)(virtio_request *req);
+
+//Owned by the caller and must stay alive until done is set. complete runs with interrupts disabled
+struct virtio_request {
+    volatile bool done;
+    uint16_t queue;
+    uint16_t head;
+    uint32_t used_len;
+    virtio_complete_fn complete;
+    void *ctx;
+};
+
 typedef struct virtio_queue {
     bool valid;
     uint16_t size;
@@ -82,6 +96,14 @@ typedef struct virtio_queue {
     volatile virtq_desc *desc;
     volatile virtq_avail *driver;
     volatile virtq_used *device;
+    uint16_t free_head;
+    uint16_t num_free;
+    uint16_t last_used_idx;
+    uint16_t in_flight;
+    uint16_t max_in_flight;
+    uint64_t submitted;
+    uint64_t completed;
+    virtio_request **requests;
 } virtio_queue;
 
 typedef struct virtio_device {
@@ -112,6 +134,11 @@ void virtio_enable_verbose();
 void virtio_get_capabilities(virtio_device *dev, uint64_t pci_addr, uint64_t *mmio_start, uint64_t *mmio_size);
 bool virtio_init_device(virtio_device *dev);
 bool virtio_send_nd(virtio_device *dev, const virtio_buf *bufs, uint16_t n);
+bool virtio_queue_reset(virtio_queue *queue);
+bool virtio_submit(virtio_device *dev, uint16_t index, const virtio_buf *bufs, uint16_t n, virtio_request *req);
+uint16_t virtio_reap(virtio_device *dev, uint16_t index);
+bool virtio_wait(virtio_device *dev, virtio_request *req);
+uint16_t virtio_free_descriptors(virtio_device *dev, uint16_t index);
 void virtio_add_buffer(virtio_device *dev, uint16_t index, uint64_t buf, uint32_t buf_len, bool host_to_dev);
 uint32_t select_queue(virtio_device *dev, uint32_t index);
 
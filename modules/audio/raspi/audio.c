@@ -4,6 +4,7 @@ bool init_audio(){ return false; }
 
 sizedptr audio_request_buffer(uint32_t device){ return (sizedptr){}; }
 void audio_submit_buffer(){}
+void audio_handle_interrupt(){}
 
 process_t* init_audio_mixer() { return 0; }
 
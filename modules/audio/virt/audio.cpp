@@ -36,6 +36,10 @@ void audio_submit_buffer(){
     audio_driver->out_dev->submit_buffer(audio_driver);
 }
 
+void audio_handle_interrupt(){
+    if (audio_driver) audio_driver->handle_interrupt();
+}
+
 void audio_get_info(uint32_t* rate, uint8_t* channels) {
     if (!rate || !channels) return;
     if (!audio_driver || !audio_driver->out_dev) {
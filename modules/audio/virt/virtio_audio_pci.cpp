@@ -42,6 +42,9 @@
 #define TRANSMIT_QUEUE  2
 #define RECEIVE_QUEUE   3
 
+//Upper bound on one sleep for the used ring, in case an interrupt goes missing
+#define TX_WAIT_MS      100
+
 #define VIRTIO_SND_D_OUTPUT 0
 #define VIRTIO_SND_D_INPUT  1
 
@@ -99,6 +102,8 @@ bool VirtioAudioDriver::init(){
     
     pci_enable_device(addr);
 
+    tx_irq = pci_setup_interrupts(addr, AUDIO_IRQ, 1) != 0;
+
     if (!virtio_init_device(&audio_dev)){
         kprintf("[VIRTIO_AUDIO] Failed initialization");
         return false;
@@ -210,6 +215,10 @@ bool VirtioAudioDriver::config_streams(uint32_t streams){
     if (!found_output) return false;
 
     select_queue(&audio_dev, TRANSMIT_QUEUE);
+    if (tx_irq){
+        audio_dev.common_cfg->queue_msix_vector = 0;
+        if (audio_dev.common_cfg->queue_msix_vector != 0) tx_irq = false;
+    }
     return true;
 }
 
@@ -222,8 +231,22 @@ void VirtioAudioDriver::send_buffer(sizedptr buf){
     uint16_t index = cmd_index % qsz;
     virtio_add_buffer(&audio_dev, index, buf.ptr, buf.size, true);
     cmd_index++;
-    volatile virtq_used* u = audio_dev.queues[TRANSMIT_QUEUE].device;
-    while (u && (uint16_t)(cmd_index - u->idx) > 2) msleep(1);
+    if (!audio_dev.queues[TRANSMIT_QUEUE].device) return;
+
+    //The used ring interrupt wakes us, polling is left for when there's no interrupt or we can't block
+    while (!tx_has_room(this)){
+        if (!tx_irq || !wait_queue_wait(&tx_waiters, tx_has_room, this, TX_WAIT_MS)) msleep(1);
+    }
+}
+
+bool VirtioAudioDriver::tx_has_room(void *ctx){
+    VirtioAudioDriver *drv = (VirtioAudioDriver*)ctx;
+    volatile virtq_used* u = drv->audio_dev.queues[TRANSMIT_QUEUE].device;
+    return (uint16_t)(drv->cmd_index - u->idx) <= 2;
+}
+
+void VirtioAudioDriver::handle_interrupt(){
+    wait_queue_wake_all(&tx_waiters);
 }
 
 typedef struct virtio_snd_pcm_set_params { 
@@ -3,6 +3,7 @@
 #include "types.h"
 #include "virtio/virtio_pci.h"
 #include "audio/AudioDevice.hpp"
+#include "process/waitqueue.h"
 
 #define VIRTIO_AUDIO_ID 0x1059
 
@@ -16,6 +17,7 @@ class VirtioAudioDriver: public AudioDriver {
 public:
     bool init();
     void send_buffer(sizedptr buf) override;
+    void handle_interrupt();
 
     AudioDevice *out_dev = nullptr;//TODO: proper device management
 private:
@@ -28,9 +30,14 @@ private:
 
     void config_channel_maps();
 
+    static bool tx_has_room(void *ctx);
+
     uint16_t last_used_idx = 0;
 
     uint16_t cmd_index = 0;
 
+    bool tx_irq = false;
+    wait_queue tx_waiters = {};
+
     virtio_device audio_dev = {};
 };
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "sdhci.hpp"
 #include "hw/hw.h"
 #include "console/kio.h"
+#include "exceptions/irq.h"
 
 SDHCI sdhci_driver; 
 
@@ -22,6 +23,29 @@ extern "C" void disk_read(void *buffer, uint32_t sector, uint32_t count){
     sdhci_driver.read(buffer, sector, count);
 }
 
+extern "C" bool disk_submit(disk_request *req){
+    if (!req || !req->buffer || !req->count) return false;
+    bool ok = true;
+    if (req->write) sdhci_driver.write(req->buffer, req->sector, req->count);
+    else ok = sdhci_driver.read(req->buffer, req->sector, req->count);
+    irq_flags_t irq = irq_save_disable();
+    req->ok = ok;
+    req->done = true;
+    if (req->complete) req->complete(req);
+    irq_restore(irq);
+    return true;
+}
+
+extern "C" bool disk_wait(disk_request *req){
+    return req && req->done && req->ok;
+}
+
+extern "C" void disk_plug(){}
+
+extern "C" void disk_unplug(){}
+
+extern "C" void disk_handle_interrupt(){}
+
 system_module disk_module = (system_module){
     .name = "sdhci",
     .mount = "disk",
@@ -6,10 +6,14 @@
 #include "sysregs.h"
 #include "memory/page_allocator.h"
 #include "exceptions/irq.h"
+#include "process/scheduler.h"
+#include "syscalls/syscalls.h"
 
 #define VIRTIO_BLK_T_IN   0
 #define VIRTIO_BLK_T_OUT  1
 
+#define VIRTIO_BLK_S_OK   0
+
 typedef struct {
     uint32_t type;
     uint32_t reserved;
@@ -19,11 +23,33 @@ typedef struct {
 #define VIRTIO_BLK_SUPPORTED_FEATURES \
     ((1 << 0) | (1 << 1) | (1 << 4))
 
+#define BLK_QUEUE 0
+#define BLK_QUEUE_DEPTH 32
+#define BLK_MAX_SEGMENTS 16
+#define BLK_MAX_MERGE_SECTORS 2048
+//Buffers outside the direct map borrow one of these from submit until disk_wait, allocated up front
+#define BLK_BOUNCE_SECTORS 64
+#define BLK_BOUNCE_SIZE (BLK_BOUNCE_SECTORS * 512)
+
+typedef struct {
+    bool busy;
+    disk_request *requests;
+    virtio_request vreq;
+} blk_slot;
 
 static bool blk_disk_enable_verbose;
 static virtio_device blk_dev;
-static virtio_blk_req *disk_cmd;
-static uint8_t *disk_status;
+static virtio_blk_req *blk_headers;
+static uint8_t *blk_status;
+static blk_slot blk_slots[BLK_QUEUE_DEPTH];
+static uint8_t *blk_bounce;
+static uint32_t blk_bounce_used;
+static uint16_t blk_depth;
+static bool blk_irq;
+
+static disk_request *pending_head;
+static disk_request *pending_tail;
+static uint32_t plug_count;
 
 #define VIRTIO_BLK_ID 0x1001
 
@@ -42,7 +68,7 @@ void disk_verbose(){
 bool init_disk_device(){
     kprint("Initializing disk");
     uint64_t addr = find_pci_device(VIRTIO_VENDOR, VIRTIO_BLK_ID);
-    if (!addr){ 
+    if (!addr){
         kprintf("Disk device not found");
         return false;
     }
@@ -53,66 +79,242 @@ bool init_disk_device(){
 
     virtio_get_capabilities(&blk_dev, addr, &disk_device_address, &disk_device_size);
     pci_register(disk_device_address, disk_device_size);
+
+    blk_irq = pci_setup_interrupts(addr, DISK_IRQ, 1) != 0;
+
     if (!virtio_init_device(&blk_dev)) {
         kprintf("Failed disk initialization");
         return false;
     }
 
-    disk_cmd = (virtio_blk_req*)kalloc(blk_dev.memory_page, sizeof(virtio_blk_req), ALIGN_64B, MEM_PRIV_KERNEL);
-    disk_status = (uint8_t*)kalloc(blk_dev.memory_page, 64, ALIGN_64B, MEM_PRIV_KERNEL);
-    if (!disk_cmd || !disk_status) {
-        if (disk_cmd) kfree(disk_cmd, sizeof(virtio_blk_req));
-        if (disk_status) kfree(disk_status, 64);
+    blk_depth = blk_dev.queues[BLK_QUEUE].size / (BLK_MAX_SEGMENTS + 2);
+    if (blk_depth > BLK_QUEUE_DEPTH) blk_depth = BLK_QUEUE_DEPTH;
+    if (!blk_depth) blk_depth = 1;
+
+    blk_headers = (virtio_blk_req*)kalloc(blk_dev.memory_page, sizeof(virtio_blk_req) * BLK_QUEUE_DEPTH, ALIGN_64B, MEM_PRIV_KERNEL);
+    blk_status = (uint8_t*)kalloc(blk_dev.memory_page, BLK_QUEUE_DEPTH, ALIGN_64B, MEM_PRIV_KERNEL);
+    uint8_t *bounce = (uint8_t*)kalloc(blk_dev.memory_page, (size_t)BLK_BOUNCE_SIZE * blk_depth, ALIGN_64B, MEM_PRIV_KERNEL);
+    if (!blk_headers || !blk_status || !bounce) {
+        if (blk_headers) kfree(blk_headers, sizeof(virtio_blk_req) * BLK_QUEUE_DEPTH);
+        if (blk_status) kfree(blk_status, BLK_QUEUE_DEPTH);
+        if (bounce) kfree(bounce, (size_t)BLK_BOUNCE_SIZE * blk_depth);
+        blk_headers = 0;
         kprintf("failed disk DMA buffer");
         return false;
     }
+    blk_bounce = bounce;
 
+    if (blk_irq){
+        select_queue(&blk_dev, BLK_QUEUE);
+        blk_dev.common_cfg->queue_msix_vector = 0;
+        if (blk_dev.common_cfg->queue_msix_vector != 0) blk_irq = false;
+    }
+    kprintfv("[virtio-blk] queue depth %i, interrupts %i", blk_depth, blk_irq);
 
     blk_dev.common_cfg->device_status |= VIRTIO_STATUS_DRIVER_OK;
     return true;
 }
 
-void disk_write(const void *buffer, uint32_t sector, uint32_t count){
-    if (!disk_cmd || !disk_status || !count) return;
+static bool request_dma_direct(disk_request *req){
+    return ((uintptr_t)req->buffer & HIGH_VA) == HIGH_VA;
+}
+
+static void blk_complete(virtio_request *vreq){
+    blk_slot *slot = (blk_slot*)vreq->ctx;
+    uint16_t tag = (uint16_t)(slot - blk_slots);
+    bool ok = blk_status[tag] == VIRTIO_BLK_S_OK;
+
+    disk_request *req = slot->requests;
+    while (req){
+        disk_request *next = req->next;
+        req->next = 0;
+        req->ok = ok;
+        req->done = true;
+        if (req->complete) req->complete(req);
+        if (req->waiter) resume_blocked_process((process_t*)req->waiter);
+        req = next;
+    }
+    slot->requests = 0;
+    slot->busy = false;
+}
+
+//Bounced data only moves in the submitter's context, where its buffer is mapped
+static void *blk_bounce_get(){
     irq_flags_t irq = irq_save_disable();
-    
-    void* data = kalloc(blk_dev.memory_page, count * 512, ALIGN_64B, MEM_PRIV_KERNEL);
-    if (!data) {
-        irq_restore(irq);
-        return;
+    void *bounce = 0;
+    for (uint16_t i = 0; i < blk_depth; i++){
+        if (blk_bounce_used & (1u << i)) continue;
+        blk_bounce_used |= 1u << i;
+        bounce = blk_bounce + (size_t)i * BLK_BOUNCE_SIZE;
+        break;
     }
+    irq_restore(irq);
+    return bounce;
+}
+
+static void blk_bounce_put(void *bounce){
+    uint16_t i = (uint16_t)(((uint8_t*)bounce - blk_bounce) / BLK_BOUNCE_SIZE);
+    irq_flags_t irq = irq_save_disable();
+    blk_bounce_used &= ~(1u << i);
+    irq_restore(irq);
+}
+
+static int blk_free_slot(){
+    for (uint16_t i = 0; i < blk_depth; i++)
+        if (!blk_slots[i].busy) return i;
+    return -1;
+}
+
+static bool blk_can_merge(disk_request *last, disk_request *next, uint16_t segments, uint32_t sectors){
+    return next && next->write == last->write
+    && next->sector == last->sector + last->count
+    && segments < BLK_MAX_SEGMENTS
+    && sectors + next->count <= BLK_MAX_MERGE_SECTORS;
+}
+
+static void blk_dispatch(){
+    irq_flags_t irq = irq_save_disable();
+    while (pending_head){
+        int tag = blk_free_slot();
+        if (tag < 0) break;
+        blk_slot *slot = &blk_slots[tag];
+
+        virtio_buf b[BLK_MAX_SEGMENTS + 2];
+        disk_request *first = pending_head;
+        disk_request *last = first;
+        uint16_t segments = 0;
+        uint32_t sectors = 0;
+        for (disk_request *req = first; req; req = req->next){
+            if (req != first && !blk_can_merge(last, req, segments, sectors)) break;
+            b[1 + segments] = VBUF(req->bounce ? req->bounce : req->buffer, req->count * 512, req->write ? 0 : VIRTQ_DESC_F_WRITE);
+            segments++;
+            sectors += req->count;
+            last = req;
+        }
+
+        blk_headers[tag].type = first->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        blk_headers[tag].reserved = 0;
+        blk_headers[tag].sector = first->sector;
+        blk_status[tag] = 0xFF;
+        b[0] = VBUF(&blk_headers[tag], sizeof(virtio_blk_req), 0);
+        b[1 + segments] = VBUF(&blk_status[tag], 1, VIRTQ_DESC_F_WRITE);
 
-    memcpy(data, buffer, count * 512);
+        slot->busy = true;
+        slot->requests = first;
+        slot->vreq.complete = blk_complete;
+        slot->vreq.ctx = slot;
 
-    disk_cmd->type = VIRTIO_BLK_T_OUT;
-    disk_cmd->reserved = 0;
-    disk_cmd->sector = sector;
+        pending_head = last->next;
+        if (!pending_head) pending_tail = 0;
+        last->next = 0;
 
-    disk_status[0] = 0;
-    virtio_buf b[3] = {VBUF(disk_cmd, sizeof(virtio_blk_req), 0), VBUF(data, count * 512, 0), VBUF(disk_status, 1, VIRTQ_DESC_F_WRITE)};
-    virtio_send_nd(&blk_dev, b, 3);
-    kfree((void *)data,count * 512);
+        if (!virtio_submit(&blk_dev, BLK_QUEUE, b, segments + 2, &slot->vreq)){
+            last->next = pending_head;
+            pending_head = first;
+            if (!pending_tail) pending_tail = last;
+            slot->requests = 0;
+            slot->busy = false;
+            break;
+        }
+    }
     irq_restore(irq);
 }
 
-void disk_read(void *buffer, uint32_t sector, uint32_t count){
-    if (!disk_cmd || !disk_status || !count) return;
+bool disk_submit(disk_request *req){
+    if (!blk_headers || !req || !req->buffer || !req->count) return false;
+    if (req->count > BLK_MAX_MERGE_SECTORS) return false;
+    req->bounce = 0;
+    //Completions can run under any process's TTBR0, so a bounced buffer is copied
+    //here and in disk_wait rather than from the interrupt, which rules out async use
+    if (!request_dma_direct(req)){
+        if (req->complete || req->count > BLK_BOUNCE_SECTORS) return false;
+        req->bounce = blk_bounce_get();
+        if (!req->bounce) return false;
+        if (req->write) memcpy(req->bounce, req->buffer, req->count * 512);
+    }
 
     irq_flags_t irq = irq_save_disable();
-    disk_cmd->type = VIRTIO_BLK_T_IN;
-    disk_cmd->reserved = 0;
-    disk_cmd->sector = sector;
-
-    disk_status[0] = 0;
-    virtio_buf b[3] = {VBUF(disk_cmd, sizeof(virtio_blk_req), 0), VBUF(buffer, count * 512, VIRTQ_DESC_F_WRITE), VBUF(disk_status, 1, VIRTQ_DESC_F_WRITE)};
-    virtio_send_nd(&blk_dev, b, 3);
+    req->done = false;
+    req->ok = false;
+    req->waiter = 0;
+    req->next = 0;
+    if (pending_tail) pending_tail->next = req;
+    else pending_head = req;
+    pending_tail = req;
     irq_restore(irq);
+
+    if (!plug_count) blk_dispatch();
+    return true;
+}
+
+void disk_plug(){
+    plug_count++;
+}
+
+void disk_unplug(){
+    if (plug_count) plug_count--;
+    if (!plug_count) blk_dispatch();
+}
+
+void disk_handle_interrupt(){
+    virtio_reap(&blk_dev, BLK_QUEUE);
+    blk_dispatch();
+}
+
+bool disk_wait(disk_request *req){
+    if (!req) return false;
+    blk_dispatch();
+
+    if (blk_irq && scheduler_can_block()){
+        irq_flags_t irq = irq_save_disable();
+        if (!req->waiter){
+            while (!req->done && blk_dev.queues[BLK_QUEUE].in_flight){
+                req->waiter = get_current_proc();
+                block_process(get_current_proc());
+                msleep(0);
+            }
+            req->waiter = 0;
+        }
+        irq_restore(irq);
+    }
+
+    while (!req->done){
+        if (!virtio_reap(&blk_dev, BLK_QUEUE)) asm volatile ("yield");
+        blk_dispatch();
+    }
+
+    if (req->bounce){
+        if (!req->write && req->ok) memcpy(req->buffer, req->bounce, req->count * 512);
+        blk_bounce_put(req->bounce);
+        req->bounce = 0;
+    }
+    return req->ok;
+}
+
+static void disk_transfer(void *buffer, uint32_t sector, uint32_t count, bool write){
+    while (count){
+        uint32_t chunk = ((uintptr_t)buffer & HIGH_VA) == HIGH_VA ? BLK_MAX_MERGE_SECTORS : BLK_BOUNCE_SECTORS;
+        uint32_t amount = count > chunk ? chunk : count;
+        disk_request req = { .buffer = buffer, .sector = sector, .count = amount, .write = write };
+        if (!disk_submit(&req) || !disk_wait(&req)) return;
+        buffer = (uint8_t*)buffer + (amount * 512);
+        sector += amount;
+        count -= amount;
+    }
+}
+
+void disk_write(const void *buffer, uint32_t sector, uint32_t count){
+    disk_transfer((void*)buffer, sector, count, true);
+}
+
+void disk_read(void *buffer, uint32_t sector, uint32_t count){
+    disk_transfer(buffer, sector, count, false);
 }
 
 system_module disk_module = (system_module){
     .name = "virtio_blk",
     .mount = "disk",
-    .version = VERSION_NUM(0, 1, 0, 0),
+    .version = VERSION_NUM(0, 2, 0, 0),
     .init = init_disk_device,
     .fini = 0,
     .open = 0,
@@ -120,4 +322,4 @@ system_module disk_module = (system_module){
     .write = 0,
     .close = 0,
     .readdir = 0,
-};
\ No newline at end of file
+};